@@ -0,0 +1,678 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_ALBUM_ART_HPP
+#define SOUND_ALBUM_ART_HPP
+
+#include "analysis_cache.hpp"
+#include "library.hpp"
+#include "thread_config.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOUND_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <wincodec.h>
+#endif
+
+/// сторона квадратной миниатюры обложки
+constexpr int thumbnail_side = 96;
+
+/**
+ * \brief картинка в памяти: пиксели 0xAARRGGBB (BGRA в байтах), строки сверху вниз без выравнивания
+ */
+struct rgba_image {
+	int width = 0;
+	int height = 0;
+	std::vector<std::uint32_t> pixels;
+};
+
+inline std::uint32_t read_be32_(unsigned char const *p) {
+	return std::uint32_t(p[0]) << 24 | std::uint32_t(p[1]) << 16 | std::uint32_t(p[2]) << 8 | p[3];
+}
+
+inline std::uint32_t read_syncsafe32_(unsigned char const *p) {
+	return std::uint32_t(p[0] & 0x7f) << 21 | std::uint32_t(p[1] & 0x7f) << 14 | std::uint32_t(p[2] & 0x7f) << 7 |
+		   (p[3] & 0x7f);
+}
+
+/// убирает байты 0x00, вставленные после 0xFF (ID3 unsynchronisation)
+inline void unsynchronise_(std::vector<unsigned char> &data) {
+	std::size_t out = 0;
+	for (std::size_t i = 0; i < data.size(); ++i) {
+		data[out++] = data[i];
+		if (data[i] == 0xff && i + 1 < data.size() && data[i + 1] == 0) {
+			++i;
+		}
+	}
+	data.resize(out);
+}
+
+/**
+ * \brief достаёт картинку из тела кадра APIC (v2.3/v2.4) или PIC (v2.2)
+ * @return тип картинки по ID3 (3 - лицевая обложка) или -1
+ */
+inline int parse_apic_(unsigned char const *p, std::size_t size, bool v22, std::vector<char> &picture) {
+	if (size < 4) {
+		return -1;
+	}
+	unsigned encoding = p[0];
+	std::size_t i = 1;
+	if (v22) {
+		i += 3; // формат: "JPG", "PNG"
+	} else {
+		while (i < size && p[i] != 0) { // MIME в Latin-1
+			++i;
+		}
+		++i;
+	}
+	if (i >= size) {
+		return -1;
+	}
+	int type = p[i++];
+	if (encoding == 1 || encoding == 2) { // описание в UTF-16: конец - два нулевых байта на чётной позиции
+		while (i + 1 < size && (p[i] != 0 || p[i + 1] != 0)) {
+			i += 2;
+		}
+		i += 2;
+	} else {
+		while (i < size && p[i] != 0) {
+			++i;
+		}
+		++i;
+	}
+	if (i >= size) {
+		return -1;
+	}
+	picture.assign(reinterpret_cast<char const *>(p + i), reinterpret_cast<char const *>(p + size));
+	return type;
+}
+
+/**
+ * \brief ищет картинку в теле тега ID3v2
+ */
+inline bool find_id3_picture_(std::vector<unsigned char> &tag, unsigned version, unsigned flags,
+							  std::vector<char> &picture) {
+	if (version < 4 && (flags & 0x80)) {
+		unsynchronise_(tag); // в v2.2/v2.3 unsynchronisation применяется ко всему тегу
+	}
+	std::size_t pos = 0;
+	if (flags & 0x40 && version >= 3 && tag.size() >= 4) { // расширенный заголовок
+		pos = version == 3 ? 4 + read_be32_(tag.data()) : read_syncsafe32_(tag.data());
+	}
+	std::size_t const header = version == 2 ? 6 : 10;
+	int best = -1;
+	std::vector<char> found;
+	std::vector<unsigned char> body;
+	while (pos + header <= tag.size() && tag[pos] != 0) {
+		unsigned char const *h = tag.data() + pos;
+		std::size_t size = version == 2 ? (std::size_t(h[3]) << 16 | std::size_t(h[4]) << 8 | h[5])
+										: version == 3 ? read_be32_(h + 4) : read_syncsafe32_(h + 4);
+		if (size > tag.size() - pos - header) {
+			break;
+		}
+		bool is_picture = version == 2 ? std::memcmp(h, "PIC", 3) == 0 : std::memcmp(h, "APIC", 4) == 0;
+		unsigned format = version == 2 ? 0 : h[9];
+		bool packed = version == 3 ? (format & 0xc0) != 0 : version == 4 && (format & 0x0c) != 0; // сжатие, шифрование
+		if (is_picture && !packed) {
+			body.assign(h + header, h + header + size);
+			if (version == 4 && (format & 0x02)) {
+				unsynchronise_(body);
+			}
+			std::size_t skip = version == 4 && (format & 0x01) ? 4 : 0; // длина данных до unsynchronisation
+			if (body.size() > skip) {
+				int type = parse_apic_(body.data() + skip, body.size() - skip, version == 2, found);
+				if (type >= 0 && (best < 0 || (type == 3 && best != 3))) {
+					best = type;
+					picture.swap(found);
+				}
+				if (best == 3) {
+					return true;
+				}
+			}
+		}
+		pos += header + size;
+	}
+	return best >= 0;
+}
+
+/**
+ * \brief ищет блок PICTURE в метаданных FLAC, in стоит сразу за "fLaC"
+ */
+inline bool find_flac_picture_(std::ifstream &in, std::vector<char> &picture) {
+	int best = -1;
+	for (bool last = false; !last && in;) {
+		unsigned char head[4];
+		if (!in.read(reinterpret_cast<char *>(head), 4)) {
+			break;
+		}
+		last = (head[0] & 0x80) != 0;
+		std::uint32_t length = std::uint32_t(head[1]) << 16 | std::uint32_t(head[2]) << 8 | head[3];
+		if ((head[0] & 0x7f) != 6) {
+			in.seekg(length, std::ios::cur);
+			continue;
+		}
+		std::vector<unsigned char> block(length);
+		if (!in.read(reinterpret_cast<char *>(block.data()), length) || length < 32) {
+			break;
+		}
+		int type = static_cast<int>(read_be32_(block.data()));
+		std::size_t pos = 4;
+		for (int field = 0; field < 2 && pos + 4 <= block.size(); ++field) { // MIME и описание
+			pos += 4 + read_be32_(block.data() + pos);
+		}
+		pos += 16; // ширина, высота, глубина, число цветов
+		if (pos + 4 > block.size()) {
+			continue;
+		}
+		std::uint32_t size = read_be32_(block.data() + pos);
+		pos += 4;
+		if (size > block.size() - pos) {
+			continue;
+		}
+		if (best < 0 || (type == 3 && best != 3)) {
+			best = type;
+			picture.assign(reinterpret_cast<char const *>(block.data() + pos),
+						   reinterpret_cast<char const *>(block.data() + pos + size));
+		}
+	}
+	return best >= 0;
+}
+
+/**
+ * \brief достаёт встроенную обложку: кадр APIC/PIC тега ID3v2 или блок PICTURE во FLAC
+ * Из нескольких картинок берётся лицевая обложка, а если её нет - первая. Теги читаются напрямую,
+ * без FMOD: звук открывать не нужно, и чтение идёт одним проходом по началу файла.
+ * @param picture - сжатая картинка (JPEG, PNG, ...) как она лежит в теге
+ * @return false, если обложки нет или файл не читается
+ */
+inline bool read_embedded_art_(char const *path, std::vector<char> &picture) {
+	TRACE_SCOPE("read_embedded_art_");
+	std::ifstream in(path, std::ios::binary);
+	unsigned char head[10];
+	if (!in.read(reinterpret_cast<char *>(head), 4)) {
+		return false;
+	}
+	if (std::memcmp(head, "fLaC", 4) == 0) {
+		return find_flac_picture_(in, picture);
+	}
+	if (std::memcmp(head, "ID3", 3) != 0 || !in.read(reinterpret_cast<char *>(head) + 4, 6)) {
+		return false;
+	}
+	unsigned version = head[3], flags = head[5];
+	std::uint32_t size = read_syncsafe32_(head + 6);
+	if (version < 2 || version > 4 || size > (64u << 20)) {
+		return false;
+	}
+	std::vector<unsigned char> tag(size);
+	if (!in.read(reinterpret_cast<char *>(tag.data()), size)) {
+		return false;
+	}
+	if (find_id3_picture_(tag, version, flags, picture)) {
+		return true;
+	}
+	in.seekg(10 + size + ((flags & 0x10) ? 10 : 0)); // FLAC с тегом ID3 впереди
+	char magic[4];
+	return in.read(magic, 4) && std::memcmp(magic, "fLaC", 4) == 0 && find_flac_picture_(in, picture);
+}
+
+/**
+ * \brief разбирает несжатый BMP (24 и 32 бита)
+ */
+inline bool decode_bmp_(unsigned char const *p, std::size_t size, rgba_image &out) {
+	if (size < 54 || p[0] != 'B' || p[1] != 'M') {
+		return false;
+	}
+	auto le32 = [p](std::size_t at) {
+		return std::uint32_t(p[at]) | std::uint32_t(p[at + 1]) << 8 | std::uint32_t(p[at + 2]) << 16 |
+			   std::uint32_t(p[at + 3]) << 24;
+	};
+	std::uint32_t data = le32(10);
+	auto width = static_cast<std::int32_t>(le32(18)), height = static_cast<std::int32_t>(le32(22));
+	unsigned bits = p[28] | p[29] << 8, compression = le32(30);
+	bool bottom_up = height > 0;
+	height = bottom_up ? height : -height;
+	if ((bits != 24 && bits != 32) || (compression != 0 && compression != 3) || width <= 0 || height <= 0 ||
+		width > 16384 || height > 16384) {
+		return false;
+	}
+	std::size_t stride = (std::size_t(width) * bits / 8 + 3) & ~std::size_t(3);
+	if (data > size || stride * height > size - data) {
+		return false;
+	}
+	out.width = width;
+	out.height = height;
+	out.pixels.resize(std::size_t(width) * height);
+	for (int y = 0; y < height; ++y) {
+		unsigned char const *row = p + data + stride * (bottom_up ? height - 1 - y : y);
+		std::uint32_t *dst = out.pixels.data() + std::size_t(y) * width;
+		for (int x = 0; x < width; ++x) {
+			unsigned char const *px = row + x * (bits / 8);
+			dst[x] = 0xff000000u | std::uint32_t(px[2]) << 16 | std::uint32_t(px[1]) << 8 | px[0];
+		}
+	}
+	return true;
+}
+
+#ifdef _WIN32
+/// владеет COM-указателем
+template <typename T>
+struct com_ref {
+	T *p = nullptr;
+
+	~com_ref() {
+		if (p) {
+			p->Release();
+		}
+	}
+
+	T **operator&() { return &p; }
+
+	T *operator->() const { return p; }
+};
+#endif
+
+/**
+ * \brief распаковывает картинку из тега
+ * BMP разбирается здесь, остальное (JPEG, PNG, GIF) - через Windows Imaging Component. Поток должен заранее
+ * вызвать CoInitializeEx. На других системах поддерживается только BMP.
+ */
+inline bool decode_image_(void const *data, std::size_t size, rgba_image &out) {
+	TRACE_SCOPE("decode_image_");
+	if (decode_bmp_(static_cast<unsigned char const *>(data), size, out)) {
+		return true;
+	}
+#ifdef _WIN32
+	com_ref<IWICImagingFactory> factory;
+	com_ref<IWICStream> stream;
+	com_ref<IWICBitmapDecoder> decoder;
+	com_ref<IWICBitmapFrameDecode> frame;
+	com_ref<IWICFormatConverter> converter;
+	UINT width = 0, height = 0;
+	if (FAILED(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory.p))) ||
+		FAILED(factory->CreateStream(&stream)) ||
+		FAILED(stream->InitializeFromMemory(static_cast<BYTE *>(const_cast<void *>(data)), static_cast<DWORD>(size))) ||
+		FAILED(factory->CreateDecoderFromStream(stream.p, nullptr, WICDecodeMetadataCacheOnDemand, &decoder)) ||
+		FAILED(decoder->GetFrame(0, &frame)) || FAILED(factory->CreateFormatConverter(&converter)) ||
+		FAILED(converter->Initialize(frame.p, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone, nullptr, 0.0,
+									 WICBitmapPaletteTypeCustom)) ||
+		FAILED(converter->GetSize(&width, &height)) || width == 0 || height == 0 || width > 16384 || height > 16384) {
+		return false;
+	}
+	out.width = static_cast<int>(width);
+	out.height = static_cast<int>(height);
+	out.pixels.resize(std::size_t(width) * height);
+	return SUCCEEDED(converter->CopyPixels(nullptr, width * 4, static_cast<UINT>(out.pixels.size() * 4),
+										   reinterpret_cast<BYTE *>(out.pixels.data())));
+#else
+	return false;
+#endif
+}
+
+/// вклад исходных пикселей в выходной: пиксели [first, first + count), веса - подряд в общем массиве
+struct resample_axis {
+	std::vector<int> first, count;
+	std::vector<std::size_t> at;
+	std::vector<float> weights;
+
+	/// усреднение по площади: выходной пиксель покрывает src / dst исходных, крайние учитываются долей
+	resample_axis(int offset, int src, int dst) : first(dst), count(dst), at(dst) {
+		double scale = double(src) / dst;
+		for (int o = 0; o < dst; ++o) {
+			double begin = o * scale, end = (o + 1) * scale;
+			if (scale < 1) { // увеличение: берём ближайший пиксель
+				begin = std::min(double(src) - 1, std::floor((o + 0.5) * scale));
+				end = begin + 1;
+			}
+			int i0 = static_cast<int>(begin), i1 = std::min(src, static_cast<int>(std::ceil(end)));
+			first[o] = offset + i0;
+			count[o] = i1 - i0;
+			at[o] = weights.size();
+			double norm = 1 / (end - begin);
+			for (int i = i0; i < i1; ++i) {
+				double cover = std::min(end, double(i + 1)) - std::max(begin, double(i));
+				weights.push_back(static_cast<float>(cover * norm));
+			}
+		}
+	}
+};
+
+/**
+ * \brief уменьшает картинку до квадрата side x side, обрезая края по длинной стороне
+ * Усреднение по площади в два прохода: по строкам во временный буфер float (по 4 канала на пиксель),
+ * затем по столбцам. С SSE2 каналы пикселя считаются одним вектором, а второй проход идёт по 4 float подряд.
+ */
+inline void downscale_square_(rgba_image const &src, int side, rgba_image &out) {
+	TRACE_SCOPE("downscale_square_");
+	int crop = std::min(src.width, src.height);
+	resample_axis xs((src.width - crop) / 2, crop, side), ys((src.height - crop) / 2, crop, side);
+	std::size_t const row_floats = std::size_t(side) * 4;
+	std::vector<float> rows(row_floats * crop), acc(row_floats);
+	int y0 = (src.height - crop) / 2;
+
+	for (int y = 0; y < crop; ++y) { // по строкам
+		std::uint32_t const *line = src.pixels.data() + std::size_t(y0 + y) * src.width;
+		float *dst = rows.data() + row_floats * y;
+		for (int o = 0; o < side; ++o) {
+			float const *w = xs.weights.data() + xs.at[o];
+			std::uint32_t const *px = line + xs.first[o];
+#ifdef SOUND_HAVE_SSE2
+			__m128 sum = _mm_setzero_ps();
+			__m128i const zero = _mm_setzero_si128();
+			for (int i = 0; i < xs.count[o]; ++i) {
+				__m128i bytes = _mm_cvtsi32_si128(static_cast<int>(px[i]));
+				__m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(w[i])));
+			}
+			_mm_storeu_ps(dst + o * 4, sum);
+#else
+			float sum[4] = {0, 0, 0, 0};
+			for (int i = 0; i < xs.count[o]; ++i) {
+				for (int c = 0; c < 4; ++c) {
+					sum[c] += float((px[i] >> (8 * c)) & 0xff) * w[i];
+				}
+			}
+			std::memcpy(dst + o * 4, sum, sizeof(sum));
+#endif
+		}
+	}
+
+	out.width = out.height = side;
+	out.pixels.resize(std::size_t(side) * side);
+	for (int o = 0; o < side; ++o) { // по столбцам
+		std::fill(acc.begin(), acc.end(), 0.0f);
+		for (int i = 0; i < ys.count[o]; ++i) {
+			float const *line = rows.data() + row_floats * (ys.first[o] - y0 + i);
+			float w = ys.weights[ys.at[o] + i];
+			std::size_t k = 0;
+#ifdef SOUND_HAVE_SSE2
+			__m128 vw = _mm_set1_ps(w);
+			for (; k + 4 <= row_floats; k += 4) {
+				_mm_storeu_ps(&acc[k], _mm_add_ps(_mm_loadu_ps(&acc[k]), _mm_mul_ps(_mm_loadu_ps(line + k), vw)));
+			}
+#endif
+			for (; k < row_floats; ++k) {
+				acc[k] += line[k] * w;
+			}
+		}
+		std::uint32_t *dst = out.pixels.data() + std::size_t(o) * side;
+		int x = 0;
+#ifdef SOUND_HAVE_SSE2
+		for (; x + 4 <= side; x += 4) { // 16 float -> 16 байт: округление и насыщение упаковкой
+			__m128i a = _mm_cvtps_epi32(_mm_loadu_ps(&acc[x * 4])), b = _mm_cvtps_epi32(_mm_loadu_ps(&acc[x * 4 + 4]));
+			__m128i c = _mm_cvtps_epi32(_mm_loadu_ps(&acc[x * 4 + 8])), d = _mm_cvtps_epi32(_mm_loadu_ps(&acc[x * 4 + 12]));
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), packed);
+		}
+#endif
+		for (; x < side; ++x) {
+			std::uint32_t px = 0;
+			for (int c = 0; c < 4; ++c) {
+				long v = std::lround(acc[x * 4 + c]);
+				px |= std::uint32_t(std::min(255L, std::max(0L, v))) << (8 * c);
+			}
+			dst[x] = px;
+		}
+	}
+}
+
+/**
+ * \brief готовая миниатюра обложки
+ * Хранится сразу в виде BMP: paint::image открывает его из памяти без распаковки, так что UI-поток только копирует.
+ */
+struct album_thumbnail {
+	int side = 0;
+	std::vector<char> bmp;
+};
+
+/**
+ * \brief 32-битный BMP снизу вверх из квадратной картинки
+ */
+inline void encode_bmp_(rgba_image const &image, std::vector<char> &out) {
+	std::uint32_t pixels = static_cast<std::uint32_t>(image.pixels.size() * 4), header = 54;
+	out.assign(header + pixels, 0);
+	auto put32 = [&out](std::size_t at, std::uint32_t v) {
+		for (int i = 0; i < 4; ++i) {
+			out[at + i] = static_cast<char>(v >> (8 * i));
+		}
+	};
+	out[0] = 'B';
+	out[1] = 'M';
+	put32(2, header + pixels);
+	put32(10, header);
+	put32(14, 40);
+	put32(18, static_cast<std::uint32_t>(image.width));
+	put32(22, static_cast<std::uint32_t>(image.height));
+	out[26] = 1;
+	out[28] = 32;
+	put32(34, pixels);
+	for (int y = 0; y < image.height; ++y) {
+		std::memcpy(out.data() + header + std::size_t(y) * image.width * 4,
+					image.pixels.data() + std::size_t(image.height - 1 - y) * image.width, std::size_t(image.width) * 4);
+	}
+}
+
+constexpr std::uint32_t thumbnail_artifact = artifact_type_("THMB");
+
+/**
+ * \brief фоновая загрузка обложек с кэшем миниатюр на диске и в памяти
+ * Поток читает картинку из тега, хеширует её и ищет миниатюру в analysis_cache по хешу картинки: у треков
+ * одного альбома обложка одна, поэтому распаковывается и уменьшается она один раз. В памяти держатся
+ * последние миниатюры в пределах memory_limit байт. Окно только спрашивает find и ставит заявки request:
+ * новые заявки обслуживаются первыми, а слишком старые выбрасываются, так что при прокрутке длинного списка
+ * работа идёт на те строки, которые сейчас видны.
+ */
+class art_loader {
+	struct entry {
+		std::shared_ptr<album_thumbnail const> thumbnail; ///< nullptr - обложки нет
+		std::list<track_id>::iterator age;
+	};
+
+	static constexpr std::size_t max_jobs = 256;
+
+	analysis_cache *cache;
+	std::size_t memory_limit;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::pair<track_id, std::string>> jobs; ///< новые в начале
+	std::unordered_set<track_id> queued;
+	std::unordered_map<track_id, entry> memory;
+	std::list<track_id> ages; ///< в начале - недавно нужные
+	std::size_t memory_bytes = 0;
+	std::vector<track_id> loaded;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	static std::size_t cost(entry const &e) { return 64 + (e.thumbnail ? e.thumbnail->bmp.size() : 0); }
+
+	void remember(track_id id, std::shared_ptr<album_thumbnail const> thumbnail) {
+		auto it = memory.find(id);
+		if (it != memory.end()) {
+			memory_bytes -= cost(it->second);
+			ages.erase(it->second.age);
+			memory.erase(it);
+		}
+		ages.push_front(id);
+		entry &e = memory[id];
+		e = {std::move(thumbnail), ages.begin()};
+		memory_bytes += cost(e);
+		while (memory_bytes > memory_limit && ages.size() > 1) {
+			auto old = memory.find(ages.back());
+			memory_bytes -= cost(old->second);
+			memory.erase(old);
+			ages.pop_back();
+		}
+	}
+
+	std::shared_ptr<album_thumbnail const> load(char const *path) {
+		std::vector<char> picture;
+		if (!read_embedded_art_(path, picture)) {
+			return nullptr;
+		}
+		content_key key{hash64_(picture.data(), picture.size(), 0),
+						hash64_(picture.data(), picture.size(), 0x9e3779b97f4a7c15ULL)};
+		auto thumbnail = std::make_shared<album_thumbnail>();
+		if (cache && cache->get(key, thumbnail_artifact, 1, thumbnail->bmp)) {
+			thumbnail->side = thumbnail_side;
+			return thumbnail;
+		}
+		rgba_image full, small;
+		if (!decode_image_(picture.data(), picture.size(), full)) {
+			return nullptr;
+		}
+		downscale_square_(full, thumbnail_side, small);
+		encode_bmp_(small, thumbnail->bmp);
+		thumbnail->side = thumbnail_side;
+		if (cache) {
+			cache->put(key, thumbnail_artifact, 1, thumbnail->bmp.data(), thumbnail->bmp.size());
+		}
+		return thumbnail;
+	}
+
+	void run() {
+		lower_current_thread_priority_();
+#ifdef SOUND_TRACE
+		trace_thread_name_("album art");
+#endif
+#ifdef _WIN32
+		HRESULT com = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+#endif
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+			if (stopping) {
+				break;
+			}
+			auto job = std::move(jobs.front());
+			jobs.pop_front();
+			guard.unlock();
+			auto thumbnail = load(job.second.c_str());
+			guard.lock();
+			queued.erase(job.first);
+			remember(job.first, std::move(thumbnail));
+			loaded.push_back(job.first);
+		}
+		guard.unlock();
+#ifdef _WIN32
+		if (SUCCEEDED(com)) {
+			CoUninitialize();
+		}
+#endif
+	}
+
+public:
+	/**
+	 * @param cache - дисковый кэш миниатюр, nullptr - без него; должен жить дольше загрузчика
+	 * @param memory_limit - сколько байт миниатюр держать в памяти
+	 * @param threads - потоков распаковки
+	 */
+	explicit art_loader(analysis_cache *cache, std::size_t memory_limit = 24u << 20, unsigned threads = 2)
+			: cache(cache), memory_limit(memory_limit) {
+		for (unsigned i = 0; i < std::max(1u, threads); ++i) {
+			workers.emplace_back(&art_loader::run, this);
+		}
+	}
+
+	~art_loader() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	art_loader(art_loader const &) = delete;
+	art_loader &operator=(art_loader const &) = delete;
+
+	/**
+	 * \brief ставит трек в очередь, если его обложки ещё нет в памяти
+	 * @return true, если обложка уже известна (тогда её отдаст find)
+	 */
+	bool request(track_id id, std::string path) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto it = memory.find(id);
+			if (it != memory.end()) {
+				ages.splice(ages.begin(), ages, it->second.age);
+				return true;
+			}
+			if (!queued.insert(id).second) {
+				return false;
+			}
+			jobs.emplace_front(id, std::move(path));
+			if (jobs.size() > max_jobs) {
+				queued.erase(jobs.back().first);
+				jobs.pop_back();
+			}
+		}
+		wake.notify_one();
+		return false;
+	}
+
+	/**
+	 * \brief миниатюра из памяти, без обращения к диску
+	 * @return nullptr, если её нет в памяти или у трека нет обложки
+	 */
+	std::shared_ptr<album_thumbnail const> find(track_id id) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = memory.find(id);
+		return it == memory.end() ? nullptr : it->second.thumbnail;
+	}
+
+	/// забывает обложку трека, например после перезаписи файла
+	void forget(track_id id) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = memory.find(id);
+		if (it != memory.end()) {
+			memory_bytes -= cost(it->second);
+			ages.erase(it->second.age);
+			memory.erase(it);
+		}
+	}
+
+	/**
+	 * \brief треки, чьи обложки загрузились после прошлого вызова
+	 * @return false, если таких нет
+	 */
+	bool take_loaded(std::vector<track_id> &out) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (loaded.empty()) {
+			return false;
+		}
+		out.swap(loaded);
+		loaded.clear();
+		return true;
+	}
+
+	std::size_t memory_used() {
+		std::lock_guard<std::mutex> guard(lock);
+		return memory_bytes;
+	}
+};
+
+#endif //SOUND_ALBUM_ART_HPP
@@ -0,0 +1,492 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_ANALYSIS_CACHE_HPP
+#define SOUND_ANALYSIS_CACHE_HPP
+
+#include "fmod.hpp"
+#include "mapped_file.hpp"
+#include "offline_render.hpp"
+#include "spectrum.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// частота моно-сигнала, который получают анализаторы: темпу, тональности и отпечатку выше 5 кГц ничего не нужно
+constexpr int analysis_rate = 11025;
+
+/**
+ * \brief XXH64: быстрый некриптографический хеш
+ */
+inline std::uint64_t hash64_(void const *data, std::size_t n, std::uint64_t seed = 0) {
+	constexpr std::uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL,
+			p3 = 1609587929392839161ULL, p4 = 9650029242287828579ULL, p5 = 2870177450012600261ULL;
+	auto rotl = [](std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto read64 = [](unsigned char const *p) {
+		std::uint64_t v;
+		std::memcpy(&v, p, 8);
+		return v;
+	};
+	auto round = [&](std::uint64_t acc, std::uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+	auto const *p = static_cast<unsigned char const *>(data);
+	auto const *end = p + n;
+	std::uint64_t h;
+	if (n >= 32) {
+		std::uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		for (std::uint64_t v : {v1, v2, v3, v4}) {
+			h = (h ^ round(0, v)) * p1 + p4;
+		}
+	} else {
+		h = seed + p5;
+	}
+	h += n;
+	for (; p + 8 <= end; p += 8) {
+		h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+	}
+	if (p + 4 <= end) {
+		std::uint32_t v;
+		std::memcpy(&v, p, 4);
+		h = rotl(h ^ (std::uint64_t(v) * p1), 23) * p2 + p3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h = rotl(h ^ (*p * p5), 11) * p1;
+	}
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	h *= p3;
+	return h ^ (h >> 32);
+}
+
+/**
+ * \brief адрес содержимого: 128 бит хеша звуковых данных файла
+ */
+struct content_key {
+	std::uint64_t lo = 0;
+	std::uint64_t hi = 0;
+
+	bool operator==(content_key const &other) const { return lo == other.lo && hi == other.hi; }
+
+	bool empty() const { return lo == 0 && hi == 0; }
+};
+
+/**
+ * \brief границы звуковых данных файла без тегов: ID3v2 и метаданные FLAC в начале, ID3v1 и APEv2 в конце
+ * Форматы, где теги перемешаны со звуком (Ogg, MP4), берутся целиком.
+ */
+inline void audio_payload_range_(std::ifstream &in, std::uint64_t file_size, std::uint64_t &begin,
+								 std::uint64_t &end) {
+	begin = 0;
+	end = file_size;
+	unsigned char head[10];
+	while (begin + 10 <= end && in.seekg(static_cast<std::streamoff>(begin)) &&
+		   in.read(reinterpret_cast<char *>(head), 10) && std::memcmp(head, "ID3", 3) == 0) {
+		std::uint64_t size = (head[6] & 0x7f) << 21 | (head[7] & 0x7f) << 14 | (head[8] & 0x7f) << 7 | (head[9] & 0x7f);
+		begin += 10 + size + ((head[5] & 0x10) ? 10 : 0); // флаг футера
+	}
+	in.clear();
+	if (begin + 4 <= end && in.seekg(static_cast<std::streamoff>(begin)) &&
+		in.read(reinterpret_cast<char *>(head), 4) && std::memcmp(head, "fLaC", 4) == 0) {
+		begin += 4;
+		bool last = false;
+		while (!last && begin + 4 <= end && in.read(reinterpret_cast<char *>(head), 4)) {
+			last = (head[0] & 0x80) != 0;
+			begin += 4 + (std::uint64_t(head[1]) << 16 | head[2] << 8 | head[3]);
+			in.seekg(static_cast<std::streamoff>(begin));
+		}
+	}
+	in.clear();
+	if (end >= begin + 128 && in.seekg(static_cast<std::streamoff>(end - 128)) &&
+		in.read(reinterpret_cast<char *>(head), 3) && std::memcmp(head, "TAG", 3) == 0) {
+		end -= 128;
+	}
+	in.clear();
+	unsigned char footer[32];
+	if (end >= begin + 32 && in.seekg(static_cast<std::streamoff>(end - 32)) &&
+		in.read(reinterpret_cast<char *>(footer), 32) && std::memcmp(footer, "APETAGEX", 8) == 0) {
+		std::uint32_t size = footer[12] | footer[13] << 8 | footer[14] << 16 | std::uint32_t(footer[15]) << 24;
+		bool has_header = (footer[23] & 0x80) != 0;
+		std::uint64_t tag = size + (has_header ? 32 : 0);
+		end = tag <= end - begin ? end - tag : begin;
+	}
+	in.clear();
+}
+
+/**
+ * \brief хеш звуковых данных файла: переименование, перенос и правка тегов его не меняют
+ * Небольшие данные хешируются целиком, большие - по трём кускам по 64 КБ (начало, середина, конец)
+ * плюс длина: перекодирование меняет все байты, а чтение 192 КБ вместо всего файла делает хеш почти бесплатным.
+ * @return false, если файл не читается
+ */
+inline bool payload_hash_(char const *path, content_key &key) {
+	TRACE_SCOPE("payload_hash_");
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if (!in) {
+		return false;
+	}
+	auto file_size = static_cast<std::uint64_t>(in.tellg());
+	std::uint64_t begin, end;
+	audio_payload_range_(in, file_size, begin, end);
+	std::uint64_t length = end - begin;
+	std::size_t const piece = 64 * 1024;
+	std::vector<char> sample;
+	auto take = [&](std::uint64_t from, std::size_t count) {
+		std::size_t old = sample.size();
+		sample.resize(old + count);
+		in.seekg(static_cast<std::streamoff>(from));
+		in.read(sample.data() + old, static_cast<std::streamsize>(count));
+		sample.resize(old + static_cast<std::size_t>(in.gcount()));
+		in.clear();
+	};
+	if (length <= 3 * piece) {
+		take(begin, static_cast<std::size_t>(length));
+	} else {
+		take(begin, piece);
+		take(begin + length / 2 - piece / 2, piece);
+		take(end - piece, piece);
+	}
+	sample.insert(sample.end(), reinterpret_cast<char const *>(&length),
+				  reinterpret_cast<char const *>(&length) + sizeof(length));
+	key.lo = hash64_(sample.data(), sample.size(), 0);
+	key.hi = hash64_(sample.data(), sample.size(), 0x9e3779b97f4a7c15ULL);
+	return true;
+}
+
+/**
+ * \brief хранилище артефактов анализа в одном отображённом в память файле
+ * Ключ записи - адрес содержимого, тип артефакта (fourcc) и его версия. Файл - журнал записей:
+ * новая запись дописывается в конец, старая с тем же ключом помечается мёртвой. Индекс строится при открытии
+ * проходом по заголовкам. Файл растёт удвоением до max_bytes, а когда места нет - уплотняется на месте:
+ * живые записи, к которым дольше всего не обращались, выбрасываются, пока занято больше 3/4 лимита.
+ * Полезные данные проверяются хешем при чтении, так что оборванная запись - это промах, а не мусор.
+ * Потокобезопасно.
+ */
+class analysis_cache {
+	static constexpr std::uint32_t file_magic = 0x48434153;   // "SACH"
+	static constexpr std::uint32_t live_magic = 0x31434552;   // "REC1"
+	static constexpr std::uint32_t dead_magic = 0x44414544;   // "DEAD"
+	static constexpr std::uint32_t format_version = 1;
+
+	struct file_header {
+		std::uint32_t magic;
+		std::uint32_t format;
+		std::uint64_t used;  ///< конец последней записи
+		std::uint64_t clock; ///< счётчик обращений для LRU
+		std::uint64_t reserved[5];
+	};
+
+	struct record_header {
+		std::uint32_t magic;
+		std::uint32_t type;
+		std::uint32_t version;
+		std::uint32_t length;
+		std::uint64_t key_lo;
+		std::uint64_t key_hi;
+		std::uint64_t last_used;
+		std::uint64_t check; ///< hash64_ полезных данных
+	};
+
+	struct record_id {
+		content_key key;
+		std::uint32_t type;
+		std::uint32_t version;
+
+		bool operator==(record_id const &other) const {
+			return key == other.key && type == other.type && version == other.version;
+		}
+	};
+
+	struct record_id_hash {
+		std::size_t operator()(record_id const &id) const {
+			return static_cast<std::size_t>(id.key.lo ^ (std::uint64_t(id.type) << 32 | id.version));
+		}
+	};
+
+	static std::size_t padded(std::size_t n) { return (n + 7) & ~std::size_t(7); }
+
+	std::mutex lock;
+	mapped_file file;
+	std::size_t limit;
+	std::unordered_map<record_id, std::uint64_t, record_id_hash> index; ///< смещение живой записи
+	std::uint64_t hit_count = 0, miss_count = 0;
+
+	file_header &header() { return *reinterpret_cast<file_header *>(file.data()); }
+
+	record_header &record_at(std::uint64_t offset) { return *reinterpret_cast<record_header *>(file.data() + offset); }
+
+	void rebuild_index() {
+		index.clear();
+		std::uint64_t offset = sizeof(file_header), used = header().used;
+		while (offset + sizeof(record_header) <= used) {
+			record_header &r = record_at(offset);
+			std::uint64_t next = offset + sizeof(record_header) + padded(r.length);
+			if ((r.magic != live_magic && r.magic != dead_magic) || next > used) {
+				header().used = offset; // оборванный хвост после сбоя
+				break;
+			}
+			if (r.magic == live_magic) {
+				index[{{r.key_lo, r.key_hi}, r.type, r.version}] = offset;
+			}
+			offset = next;
+		}
+	}
+
+	/// освобождает место под need байт: растит файл, а на пределе - выбрасывает давно не читанное
+	bool reserve(std::size_t need) {
+		if (header().used + need <= file.size()) {
+			return true;
+		}
+		if (header().used + need > limit) {
+			compact(limit / 4 * 3 >= need ? limit / 4 * 3 - need : 0);
+			if (header().used + need > limit) {
+				return false;
+			}
+		}
+		std::size_t size = file.size();
+		while (size < header().used + need) {
+			size = std::min(limit, size * 2);
+		}
+		return size == file.size() || file.resize(size);
+	}
+
+	/// оставляет самые свежие записи общим размером до keep байт и сдвигает их к началу файла
+	void compact(std::size_t keep) {
+		TRACE_SCOPE("analysis_cache::compact");
+		std::vector<std::pair<std::uint64_t, std::uint64_t>> live; // last_used, offset
+		for (auto const &entry : index) {
+			live.emplace_back(record_at(entry.second).last_used, entry.second);
+		}
+		std::sort(live.begin(), live.end(), std::greater<>());
+		std::vector<std::uint64_t> kept;
+		std::size_t total = sizeof(file_header);
+		for (auto const &entry : live) {
+			std::size_t size = sizeof(record_header) + padded(record_at(entry.second).length);
+			if (total + size > keep) {
+				break;
+			}
+			total += size;
+			kept.push_back(entry.second);
+		}
+		std::sort(kept.begin(), kept.end()); // по возрастанию смещения: сдвиг вниз ничего не затирает
+		std::uint64_t write = sizeof(file_header);
+		for (std::uint64_t offset : kept) {
+			std::size_t size = sizeof(record_header) + padded(record_at(offset).length);
+			if (offset != write) {
+				std::memmove(file.data() + write, file.data() + offset, size);
+			}
+			write += size;
+		}
+		header().used = write;
+		rebuild_index();
+	}
+
+public:
+	/**
+	 * @param max_bytes - предел размера файла
+	 */
+	explicit analysis_cache(std::size_t max_bytes = 256u << 20) : limit(std::max<std::size_t>(max_bytes, 64 * 1024)) {}
+
+	analysis_cache(analysis_cache const &) = delete;
+	analysis_cache &operator=(analysis_cache const &) = delete;
+
+	~analysis_cache() { file.flush(); }
+
+	/**
+	 * \brief открывает или создаёт файл хранилища; испорченный или чужой файл начинается заново
+	 */
+	bool open(std::string const &path) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!file.open(path, true, std::min<std::size_t>(limit, 1u << 20))) {
+			return false;
+		}
+		file_header &h = header();
+		if (h.magic != file_magic || h.format != format_version || h.used > file.size() ||
+			h.used < sizeof(file_header)) {
+			std::memset(&h, 0, sizeof(h));
+			h.magic = file_magic;
+			h.format = format_version;
+			h.used = sizeof(file_header);
+		}
+		rebuild_index();
+		return true;
+	}
+
+	bool is_open() const { return file.is_open(); }
+
+	/**
+	 * \brief читает артефакт
+	 * @return false - промах
+	 */
+	bool get(content_key const &key, std::uint32_t type, std::uint32_t version, std::vector<char> &out) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = is_open() ? index.find({key, type, version}) : index.end();
+		if (it == index.end()) {
+			++miss_count;
+			return false;
+		}
+		record_header &r = record_at(it->second);
+		char const *payload = file.data() + it->second + sizeof(record_header);
+		if (hash64_(payload, r.length) != r.check) {
+			r.magic = dead_magic;
+			index.erase(it);
+			++miss_count;
+			return false;
+		}
+		r.last_used = ++header().clock;
+		out.assign(payload, payload + r.length);
+		++hit_count;
+		return true;
+	}
+
+	/**
+	 * \brief сохраняет артефакт, заменяя прежний с тем же ключом
+	 * @return false, если артефакт больше лимита или файл не растёт
+	 */
+	bool put(content_key const &key, std::uint32_t type, std::uint32_t version, void const *data,
+			 std::size_t size) {
+		std::lock_guard<std::mutex> guard(lock);
+		std::size_t need = sizeof(record_header) + padded(size);
+		if (!is_open() || size > 0xffffffffu || sizeof(file_header) + need > limit) {
+			return false;
+		}
+		record_id id{key, type, version};
+		auto it = index.find(id);
+		if (it != index.end()) {
+			record_at(it->second).magic = dead_magic;
+			index.erase(it);
+		}
+		if (!reserve(need)) {
+			return false;
+		}
+		std::uint64_t offset = header().used;
+		record_header &r = record_at(offset);
+		r = {live_magic, type, version, static_cast<std::uint32_t>(size), key.lo, key.hi, ++header().clock,
+			 hash64_(data, size)};
+		std::memcpy(file.data() + offset + sizeof(record_header), data, size);
+		header().used = offset + need; // запись видна только после того, как целиком легла в файл
+		index[id] = offset;
+		return true;
+	}
+
+	/// сколько байт занято записями
+	std::size_t used() {
+		std::lock_guard<std::mutex> guard(lock);
+		return is_open() ? static_cast<std::size_t>(header().used) : 0;
+	}
+
+	std::size_t entries() {
+		std::lock_guard<std::mutex> guard(lock);
+		return index.size();
+	}
+
+	std::uint64_t hits() {
+		std::lock_guard<std::mutex> guard(lock);
+		return hit_count;
+	}
+
+	std::uint64_t misses() {
+		std::lock_guard<std::mutex> guard(lock);
+		return miss_count;
+	}
+};
+
+/**
+ * \brief декодированный трек, который видят анализаторы
+ */
+struct decoded_track {
+	std::vector<float> samples; ///< interleaved, исходная частота
+	source_format format;
+	std::vector<float> mono;    ///< моно с частотой analysis_rate
+
+	/// сколько моно-сэмплов приходится на первые seconds секунд (0 - все)
+	std::size_t mono_length(double seconds) const {
+		return seconds > 0 ? std::min(mono.size(), static_cast<std::size_t>(seconds * analysis_rate)) : mono.size();
+	}
+};
+
+/**
+ * \brief анализатор, подключённый к общему проходу декодирования
+ * Версию нужно менять вместе с алгоритмом или форматом артефакта: записи старой версии просто перестают читаться.
+ */
+struct analysis_pass {
+	std::uint32_t type = 0;    ///< fourcc артефакта
+	std::uint32_t version = 1;
+	double seconds = 0;        ///< сколько секунд от начала нужно анализатору, 0 - весь файл; декодировано
+							   ///< может быть больше (для соседей), поэтому анализатор берёт decoded_track::mono_length
+	/// считает артефакт; false - трек не подошёл, артефакт не сохраняется
+	std::function<bool(decoded_track const &, std::vector<char> &)> compute;
+};
+
+/// fourcc из четырёх символов
+constexpr std::uint32_t artifact_type_(char const (&name)[5]) {
+	return std::uint32_t(std::uint8_t(name[0])) | std::uint32_t(std::uint8_t(name[1])) << 8 |
+		   std::uint32_t(std::uint8_t(name[2])) << 16 | std::uint32_t(std::uint8_t(name[3])) << 24;
+}
+
+/**
+ * \brief артефакты всех анализаторов для файла: из хранилища, а чего там нет - за одно декодирование
+ * Декодируется столько, сколько нужно самому жадному из недостающих анализаторов.
+ * @param cache - хранилище, nullptr - без него
+ * @param artifacts - артефакт каждого прохода в том же порядке; пустой, если проход не справился
+ * @param after_chunk - передаётся в decode_to_float_
+ * @return FMOD_RESULT декодирования; FMOD_OK, если всё нашлось в хранилище
+ */
+inline FMOD_RESULT run_analysis_passes_(FMOD::System *system, char const *path, analysis_cache *cache,
+										std::vector<analysis_pass> const &passes,
+										std::vector<std::vector<char>> &artifacts,
+										std::function<void()> const &after_chunk = {}) {
+	TRACE_SCOPE("run_analysis_passes_");
+	artifacts.assign(passes.size(), {});
+	content_key key;
+	bool keyed = cache && payload_hash_(path, key);
+	std::vector<std::size_t> missing;
+	double seconds = -1;
+	for (std::size_t i = 0; i < passes.size(); ++i) {
+		if (keyed && cache->get(key, passes[i].type, passes[i].version, artifacts[i])) {
+			continue;
+		}
+		missing.push_back(i);
+		if (seconds != 0) {
+			seconds = passes[i].seconds == 0 ? 0 : std::max(seconds, passes[i].seconds);
+		}
+	}
+	if (missing.empty()) {
+		return FMOD_OK;
+	}
+	decoded_track track;
+	FMOD_RESULT result = decode_to_float_(system, path, track.samples, track.format, seconds, after_chunk);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	downmix_resample_(track.samples, track.format.channels, track.format.rate, analysis_rate, track.mono);
+	for (std::size_t i : missing) {
+		if (after_chunk) {
+			after_chunk();
+		}
+		if (!passes[i].compute(track, artifacts[i])) {
+			artifacts[i].clear();
+		} else if (keyed) {
+			cache->put(key, passes[i].type, passes[i].version, artifacts[i].data(), artifacts[i].size());
+		}
+	}
+	return FMOD_OK;
+}
+
+#endif //SOUND_ANALYSIS_CACHE_HPP
@@ -0,0 +1,424 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ * Управление плеером через локальный сокет: для скриптов и демонов горячих клавиш.
+ *
+ * Протокол строковый. Запрос - строка, слова через пробел, слово с пробелами - в двойных кавычках. На каждую строку
+ * приходит ровно одна строка ответа, в том же порядке: "ok", "ok <значение>" или "error <причина>". Строки, которые
+ * пришли одним куском, - это пакет: он выполняется целиком под одним замком плеера, и ответы на него уходят одной
+ * отправкой, поэтому несколько команд стоят одного обмена.
+ * Подписки: "subscribe <тема>..." (или "*" - все темы), "unsubscribe <тема>..." (или "*"). Сразу после ответа
+ * приходят текущие значения тем, дальше - каждое изменение строкой "event <тема> <значение>"; опрашивать не нужно.
+ * "ping" отвечает "ok" без обращения к плееру.
+ */
+
+#ifndef SOUND_CONTROL_SERVER_HPP
+#define SOUND_CONTROL_SERVER_HPP
+
+#include "socket_compat.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// одна команда: слова строки, первое - имя; слова указывают в буфер соединения и живут до конца пакета
+using control_command = std::vector<std::string_view>;
+
+/**
+ * \brief делит строку на слова; слово в двойных кавычках может содержать пробелы, кавычки в нём не экранируются
+ */
+inline void split_words_(std::string_view line, control_command &out) {
+	out.clear();
+	std::size_t i = 0;
+	while (i < line.size()) {
+		while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+			++i;
+		}
+		if (i == line.size()) {
+			break;
+		}
+		if (line[i] == '"') {
+			std::size_t end = line.find('"', i + 1);
+			if (end == std::string_view::npos) {
+				end = line.size();
+			}
+			out.push_back(line.substr(i + 1, end - i - 1));
+			i = end + 1;
+		} else {
+			std::size_t end = line.find_first_of(" \t", i);
+			if (end == std::string_view::npos) {
+				end = line.size();
+			}
+			out.push_back(line.substr(i, end - i));
+			i = end;
+		}
+	}
+}
+
+/**
+ * \brief сервер управления на локальном сокете
+ * Один поток ждёт все соединения сразу (poll), читает пакеты команд, отдаёт их обработчику и пишет ответы. Он же
+ * рассылает подписчикам изменения: после каждого пакета, по wake() и раз в tick_ms снимает состояние и отправляет
+ * каждому подписчику только то, что у него изменилось. Тик нужен только темам, которые меняются без wake() (позиция
+ * трека): пока на них никто не подписан, поток спит в poll без таймаута и просыпается только от данных и wake().
+ * Сокеты соединений неблокирующие; клиент, который не читает и набрал больше max_pending байт неотправленного,
+ * отключается, а не тормозит остальных.
+ */
+class control_server {
+public:
+	/// выполняет пакет команд; ответ на команду i - в replies[i] ("ok ...", "error ..."), replies уже нужного размера
+	using batch_handler = std::function<void(std::vector<control_command> const &, std::vector<std::string> &)>;
+	/// текущее состояние: пары (тема, значение); значение - одна строка без переводов строки
+	using state_source = std::function<void(std::vector<std::pair<std::string, std::string>> &)>;
+
+	static constexpr std::size_t max_line = 4096;
+	static constexpr std::size_t max_pending = 1 << 20;
+
+private:
+	struct client {
+		socket_handle socket = no_socket;
+		std::string in, out;
+		std::map<std::string, std::string, std::less<>> topics; ///< тема -> последнее отправленное значение
+		bool everything = false;                                ///< подписан на "*": новые темы тоже его
+		bool closing = false;
+	};
+
+	std::string address;
+	batch_handler execute;
+	state_source state;
+	int tick_ms;
+	std::vector<std::string> ticking; ///< темы, которые меняются без wake(): ради них и нужен тик
+	socket_handle listener = no_socket;
+	socket_handle wake_in = no_socket, wake_out = no_socket; ///< соединение сервера с самим собой, чтобы будить poll
+	std::vector<client> clients;
+	std::mutex wake_lock;
+	std::atomic<bool> stopping{false};
+	std::atomic<std::size_t> connected{0};
+	std::thread worker;
+
+	std::vector<std::pair<std::string, std::string>> snapshot;
+	std::vector<control_command> batch;
+	std::vector<std::string> replies;
+	std::vector<std::size_t> forwarded; ///< номера команд пакета, которые ушли обработчику
+	std::vector<control_command> forward;
+	std::vector<std::string> forward_replies;
+
+	static bool wants_all(control_command const &c) { return c.size() == 2 && c[1] == "*"; }
+
+	/// кто-то подписан на тему из ticking
+	bool ticked() const {
+		for (auto const &c : clients) {
+			for (auto const &topic : ticking) {
+				if (c.everything || c.topics.find(topic) != c.topics.end()) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	/// подписка и отписка - забота сервера, а не плеера
+	bool builtin(client &c, control_command const &command, std::string &reply) {
+		if (command[0] == "ping") {
+			reply = "ok";
+		} else if (command[0] == "subscribe") {
+			if (command.size() < 2) {
+				reply = "error subscribe needs a topic";
+				return true;
+			}
+			c.everything = c.everything || wants_all(command);
+			for (std::size_t i = 1; i < command.size(); ++i) {
+				if (command[i] != "*" && c.topics.find(command[i]) == c.topics.end()) {
+					c.topics.emplace(std::string(command[i]), "\n"); // такого значения не бывает: придёт текущее
+				}
+			}
+			reply = "ok";
+		} else if (command[0] == "unsubscribe") {
+			if (wants_all(command)) {
+				c.everything = false;
+				c.topics.clear();
+			}
+			for (std::size_t i = 1; i < command.size(); ++i) {
+				auto it = c.topics.find(command[i]);
+				if (it != c.topics.end()) {
+					c.topics.erase(it);
+				}
+			}
+			reply = "ok";
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	void queue(client &c, std::string const &text) {
+		if (c.out.size() + text.size() > max_pending) {
+			c.closing = true; // не читает: отключаем
+			return;
+		}
+		c.out += text;
+	}
+
+	void flush(client &c) {
+		while (!c.out.empty() && !c.closing) {
+			long sent = send_some_(c.socket, c.out.data(), c.out.size());
+			if (sent < 0) {
+				c.closing = true;
+			} else if (sent == 0) {
+				return; // остальное уйдёт, когда сокет станет доступен для записи
+			} else {
+				c.out.erase(0, static_cast<std::size_t>(sent));
+			}
+		}
+	}
+
+	/// разбирает полные строки соединения и выполняет их одним пакетом
+	void handle(client &c) {
+		std::size_t end = c.in.rfind('\n');
+		if (end == std::string::npos) {
+			if (c.in.size() > max_line) {
+				queue(c, "error line too long\n");
+				c.closing = true;
+			}
+			return;
+		}
+		TRACE_SCOPE("control: batch");
+		std::string_view lines(c.in.data(), end + 1);
+		batch.clear();
+		std::size_t at = 0;
+		while (at < lines.size()) {
+			std::size_t next = lines.find('\n', at);
+			std::string_view line = lines.substr(at, next - at);
+			at = next + 1;
+			if (!line.empty() && line.back() == '\r') {
+				line.remove_suffix(1);
+			}
+			control_command words;
+			split_words_(line, words);
+			if (!words.empty()) {
+				batch.push_back(std::move(words));
+			}
+		}
+		replies.assign(batch.size(), std::string());
+		forward.clear();
+		forwarded.clear();
+		for (std::size_t i = 0; i < batch.size(); ++i) {
+			if (!builtin(c, batch[i], replies[i])) {
+				forward.push_back(batch[i]);
+				forwarded.push_back(i);
+			}
+		}
+		if (!forward.empty()) {
+			forward_replies.assign(forward.size(), std::string());
+			execute(forward, forward_replies);
+			for (std::size_t i = 0; i < forwarded.size(); ++i) {
+				replies[forwarded[i]] = forward_replies[i].empty() ? "ok" : std::move(forward_replies[i]);
+			}
+		}
+		std::string out;
+		for (auto const &r : replies) {
+			out += r;
+			out += '\n';
+		}
+		c.in.erase(0, end + 1);
+		queue(c, out);
+	}
+
+	/// рассылает подписчикам изменившиеся темы
+	void publish() {
+		bool anyone = false;
+		for (auto const &c : clients) {
+			anyone = anyone || c.everything || !c.topics.empty();
+		}
+		if (!anyone || !state) {
+			return;
+		}
+		snapshot.clear();
+		state(snapshot);
+		for (auto &c : clients) {
+			std::string out;
+			for (auto const &topic : snapshot) {
+				auto it = c.topics.find(topic.first);
+				if (it == c.topics.end()) {
+					if (!c.everything) {
+						continue;
+					}
+					it = c.topics.emplace(topic.first, "\n").first;
+				}
+				if (it->second != topic.second) {
+					it->second = topic.second;
+					out += "event " + topic.first + ' ' + topic.second + '\n';
+				}
+			}
+			if (!out.empty()) {
+				queue(c, out);
+			}
+		}
+	}
+
+	void run() {
+#ifdef SOUND_TRACE
+		trace_thread_name_("control");
+#endif
+		std::vector<socket_poll> fds;
+		char buffer[16384];
+		auto next_tick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tick_ms);
+		while (!stopping) {
+			fds.clear();
+			fds.push_back({listener, socket_readable, 0});
+			fds.push_back({wake_in, socket_readable, 0});
+			for (auto const &c : clients) {
+				fds.push_back({c.socket, static_cast<short>(socket_readable | (c.out.empty() ? 0 : socket_writable)), 0});
+			}
+			bool tick = ticked();
+			int wait = -1; // stop() будит через wake()
+			if (tick) {
+				wait = static_cast<int>(std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+						next_tick - std::chrono::steady_clock::now()).count()));
+			}
+			int ready = poll_sockets_(fds.data(), fds.size(), wait);
+			bool changed = false;
+			if (ready > 0) {
+				if (fds[1].revents) {
+					recv(wake_in, buffer, sizeof(buffer), 0);
+					changed = true;
+				}
+				for (std::size_t i = 0; i < clients.size(); ++i) {
+					client &c = clients[i];
+					short events = fds[i + 2].revents;
+					if (events & socket_readable) {
+						auto got = recv(c.socket, buffer, static_cast<int>(sizeof(buffer)), 0);
+						if (got <= 0) {
+							c.closing = true;
+							continue;
+						}
+						c.in.append(buffer, static_cast<std::size_t>(got));
+						handle(c);
+						changed = true;
+					} else if (events & ~socket_writable) {
+						c.closing = true; // POLLHUP, POLLERR
+					}
+				}
+				if (fds[0].revents & socket_readable) {
+					socket_handle s = accept(listener, nullptr, nullptr);
+					if (s != no_socket) {
+						set_socket_blocking_(s, false);
+						clients.emplace_back();
+						clients.back().socket = s;
+					}
+				}
+			}
+			if (tick && std::chrono::steady_clock::now() >= next_tick) {
+				changed = true;
+				next_tick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tick_ms);
+			}
+			if (changed) {
+				publish();
+			}
+			for (auto &c : clients) {
+				flush(c);
+			}
+			auto gone = std::remove_if(clients.begin(), clients.end(), [](client const &c) {
+				if (c.closing) {
+					close_socket_(c.socket);
+				}
+				return c.closing;
+			});
+			clients.erase(gone, clients.end());
+			connected = clients.size();
+		}
+		for (auto const &c : clients) {
+			close_socket_(c.socket);
+		}
+		clients.clear();
+		connected = 0;
+	}
+
+public:
+	/**
+	 * @param path - путь к сокету
+	 * @param execute - выполняет команды; вызывается из потока сервера
+	 * @param state - снимает состояние для подписчиков; вызывается из потока сервера, только если подписчики есть
+	 * @param tick_ms - как часто рассылать изменения, которые никто не сообщил через wake()
+	 * @param ticking - темы, которые так меняются; без подписчиков на них сервер не тикает
+	 */
+	control_server(std::string path, batch_handler execute, state_source state, int tick_ms = 100,
+				   std::vector<std::string> ticking = {"position"})
+			: address(std::move(path)), execute(std::move(execute)), state(std::move(state)),
+			  tick_ms(std::max(tick_ms, 1)), ticking(std::move(ticking)) {}
+
+	~control_server() { stop(); }
+
+	control_server(control_server const &) = delete;
+	control_server &operator=(control_server const &) = delete;
+
+	/**
+	 * \brief начинает слушать
+	 * @return false, если сокет занят другим плеером или не создаётся
+	 */
+	bool start() {
+		listener = listen_unix_(address);
+		if (listener == no_socket) {
+			return false;
+		}
+		wake_out = connect_unix_(address);
+		wake_in = wake_out == no_socket ? no_socket : accept(listener, nullptr, nullptr);
+		if (wake_in == no_socket) {
+			close_socket_(wake_out);
+			close_socket_(listener);
+			listener = wake_out = no_socket;
+			std::remove(address.c_str());
+			return false;
+		}
+		set_socket_blocking_(wake_out, false);
+		set_socket_blocking_(listener, false);
+		worker = std::thread(&control_server::run, this);
+		return true;
+	}
+
+	/// закрывает все соединения и убирает файл сокета
+	void stop() {
+		if (!worker.joinable()) {
+			return;
+		}
+		stopping = true;
+		wake();
+		worker.join();
+		{
+			std::lock_guard<std::mutex> guard(wake_lock);
+			close_socket_(wake_out);
+			wake_out = no_socket;
+		}
+		close_socket_(wake_in);
+		close_socket_(listener);
+		listener = wake_in = no_socket;
+		std::remove(address.c_str());
+	}
+
+	/**
+	 * \brief состояние поменялось не через сокет (кнопка в окне, конец трека): подписчики узнают сразу, а не по тику
+	 * Можно звать из любого потока, в том числе под замком плеера: сервер только будится.
+	 */
+	void wake() {
+		std::lock_guard<std::mutex> guard(wake_lock);
+		if (wake_out != no_socket) {
+			char byte = 1;
+			send_some_(wake_out, &byte, 1); // полный буфер - значит, сервер и так разбужен
+		}
+	}
+
+	std::string const &path() const { return address; }
+
+	/// сколько клиентов подключено сейчас
+	std::size_t clients_connected() const { return connected; }
+};
+
+#endif //SOUND_CONTROL_SERVER_HPP
@@ -0,0 +1,264 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_DECK_MIXER_HPP
+#define SOUND_DECK_MIXER_HPP
+
+#include "fmod.hpp"
+#include "dsp_graph.hpp"
+#include "trace.hpp"
+#include <fmod_dsp_effects.h>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// приоритеты голосов (0 - важнее всех): при нехватке реальных голосов первыми становятся виртуальными одиночные звуки
+constexpr int deck_track_priority = 0;
+constexpr int deck_one_shot_priority = 128;
+
+/**
+ * \brief дека: своя группа каналов с эффектами, высотой, громкостью и отводом на прослушку (cue)
+ * Отвод берётся со входа группы, до эффектов и громкости деки, - как pre-fader listen на пульте.
+ * Громкость деки - отдельный узел fader на выходе группы, а не громкость самой группы: громкость группы входит
+ * в слышимость голосов, и при опущенном кроссфейдере голоса деки стали бы виртуальными и пропали бы из наушников.
+ */
+class deck {
+	FMOD::System *system;
+	FMOD::ChannelGroup *channels = nullptr;
+	FMOD::DSP *level = nullptr;
+	FMOD::DSPConnection *cue_send = nullptr;
+	dsp_graph effects;
+	bool cue_on = false;
+
+public:
+	deck(FMOD::System *system, FMOD::ChannelGroup *group) : system(system), channels(group), effects(system, group) {}
+
+	deck(deck const &) = delete;
+	deck &operator=(deck const &) = delete;
+
+	FMOD::ChannelGroup *group() const { return channels; }
+
+	/**
+	 * \brief ставит узел громкости и подключает отвод деки ко входу группы прослушки
+	 * Звук идёт в прослушку, только когда включён set_cue.
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT attach(FMOD::ChannelGroup *cue) {
+		FMOD_RESULT result = system->createDSPByType(FMOD_DSP_TYPE_FADER, &level);
+		if (result == FMOD_OK) {
+			result = channels->addDSP(FMOD_CHANNELCONTROL_DSP_HEAD, level);
+		}
+		FMOD::DSP *from = nullptr, *to = nullptr;
+		if (result == FMOD_OK) {
+			result = channels->getDSP(FMOD_CHANNELCONTROL_DSP_TAIL, &from);
+		}
+		if (result == FMOD_OK) {
+			result = cue->getDSP(FMOD_CHANNELCONTROL_DSP_TAIL, &to);
+		}
+		if (result == FMOD_OK) {
+			// SEND не тянет деку второй раз: прослушка берёт уже посчитанный блок
+			result = to->addInput(from, &cue_send, FMOD_DSPCONNECTION_TYPE_SEND);
+		}
+		if (result == FMOD_OK) {
+			result = cue_send->setMix(cue_on ? 1.0f : 0.0f);
+		}
+		return result;
+	}
+
+	/**
+	 * \brief играет звук на деке
+	 * @param priority - deck_track_priority для основной дорожки, deck_one_shot_priority для сэмплов поверх неё
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT play(FMOD::Sound *sound, FMOD::Channel *&channel, int priority = deck_track_priority) {
+		TRACE_SCOPE("deck::play");
+		FMOD_RESULT result = system->playSound(sound, channels, true, &channel);
+		if (result == FMOD_OK) {
+			channel->setPriority(priority);
+			result = channel->setPaused(false);
+		}
+		return result;
+	}
+
+	/// высота и темп вместе, как регулятор pitch на вертушке; 1 - без изменений
+	FMOD_RESULT set_pitch(float pitch) { return channels->setPitch(pitch); }
+
+	/// 0..1 и выше; голоса деки остаются реальными и при нуле
+	FMOD_RESULT set_volume(float volume) {
+		float db = volume > 0.0001f ? 20.0f * std::log10(volume) : -80.0f;
+		return level ? level->setParameterFloat(FMOD_DSP_FADER_GAIN, std::fmax(db, -80.0f)) : FMOD_ERR_NOTREADY;
+	}
+
+	/// эффекты только этой деки; узлы переиспользуются так же, как у мастер-группы
+	FMOD_RESULT set_effects(effect_chain const &chain) { return effects.apply(chain); }
+
+	FMOD_RESULT set_cue(bool on) {
+		cue_on = on;
+		return cue_send ? cue_send->setMix(on ? 1.0f : 0.0f) : FMOD_OK;
+	}
+
+	bool cued() const { return cue_on; }
+
+	/**
+	 * \brief останавливает все голоса деки
+	 */
+	FMOD_RESULT stop() { return channels->stop(); }
+
+	/**
+	 * \brief освобождает эффекты и группу; каналы деки к этому моменту должны быть остановлены
+	 * @return первый ненулевой FMOD_RESULT или FMOD_OK
+	 */
+	FMOD_RESULT release() {
+		if (!channels) {
+			return FMOD_OK;
+		}
+		FMOD_RESULT first = effects.release();
+		if (level) {
+			channels->removeDSP(level);
+			FMOD_RESULT result = level->release();
+			if (first == FMOD_OK) {
+				first = result;
+			}
+			level = nullptr;
+		}
+		FMOD_RESULT result = channels->release(); // вместе с группой уходят и её соединения, в том числе отвод
+		if (first == FMOD_OK) {
+			first = result;
+		}
+		channels = nullptr;
+		cue_send = nullptr;
+		return first;
+	}
+};
+
+/**
+ * \brief несколько дек, сведённых в мастер, и шина прослушки
+ * Граф: деки -> program -> master, отводы дек -> cue -> master. Выход у системы один, поэтому прослушку
+ * слышно только в режиме split: программа сводится в левый канал, прослушка - в правый (наушники DJ).
+ * Без split шина прослушки заглушена, чтобы звук дек не удваивался.
+ * Голосов может быть больше, чем реальных каналов микшера: система создаётся с FMOD_INIT_VOL0_BECOMES_VIRTUAL,
+ * неслышные голоса не микшируются, а при нехватке реальных вытесняются голоса с меньшим приоритетом.
+ */
+class deck_mixer {
+	FMOD::System *system;
+	FMOD::ChannelGroup *master;
+	FMOD::ChannelGroup *program = nullptr;
+	FMOD::ChannelGroup *cue = nullptr;
+	std::vector<std::unique_ptr<deck>> decks;
+	bool split = false;
+
+public:
+	deck_mixer(FMOD::System *system, FMOD::ChannelGroup *master) : system(system), master(master) {}
+
+	deck_mixer(deck_mixer const &) = delete;
+	deck_mixer &operator=(deck_mixer const &) = delete;
+
+	/**
+	 * \brief создаёт шины и count дек
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT create(int count) {
+		TRACE_SCOPE("deck_mixer::create");
+		FMOD_RESULT result = system->createChannelGroup("program", &program);
+		if (result == FMOD_OK) {
+			result = master->addGroup(program);
+		}
+		if (result == FMOD_OK) {
+			result = system->createChannelGroup("cue", &cue);
+		}
+		if (result == FMOD_OK) {
+			result = master->addGroup(cue);
+		}
+		if (result == FMOD_OK) {
+			result = set_split_cue(split);
+		}
+		for (int i = 0; i < count && result == FMOD_OK; ++i) {
+			FMOD::ChannelGroup *group = nullptr;
+			result = system->createChannelGroup(("deck " + std::to_string(i + 1)).c_str(), &group);
+			if (result == FMOD_OK) {
+				result = program->addGroup(group);
+			}
+			if (result == FMOD_OK) {
+				decks.emplace_back(new deck(system, group));
+				result = decks.back()->attach(cue);
+			}
+		}
+		return result;
+	}
+
+	std::size_t size() const { return decks.size(); }
+
+	deck &at(std::size_t i) { return *decks[i]; }
+
+	/**
+	 * \brief кроссфейдер между декой 0 и декой 1 с равной мощностью
+	 * @param position - 0 - только дека 0, 1 - только дека 1
+	 */
+	FMOD_RESULT crossfade(float position) {
+		if (decks.size() < 2) {
+			return FMOD_ERR_INVALID_PARAM;
+		}
+		float angle = std::fmin(std::fmax(position, 0.0f), 1.0f) * 1.5707963f;
+		FMOD_RESULT result = decks[0]->set_volume(std::cos(angle));
+		FMOD_RESULT other = decks[1]->set_volume(std::sin(angle));
+		return result != FMOD_OK ? result : other;
+	}
+
+	/**
+	 * \brief программа в левый канал, прослушка в правый; выключено - программа как обычно, прослушка заглушена
+	 */
+	FMOD_RESULT set_split_cue(bool on) {
+		split = on;
+		float to_left[4] = {0.5f, 0.5f, 0.0f, 0.0f}; // [выход][вход], стерео сводится в моно
+		float to_right[4] = {0.0f, 0.0f, 0.5f, 0.5f};
+		FMOD_RESULT result = program->setMixMatrix(on ? to_left : nullptr, 2, 2);
+		if (result == FMOD_OK) {
+			result = cue->setMixMatrix(on ? to_right : nullptr, 2, 2);
+		}
+		if (result == FMOD_OK) {
+			result = cue->setMute(!on);
+		}
+		return result;
+	}
+
+	bool split_cue() const { return split; }
+
+	/**
+	 * \brief сколько голосов играет всего и сколько из них действительно микшируется
+	 */
+	void voices(int &all, int &real) const {
+		all = real = 0;
+		system->getChannelsPlaying(&all, &real);
+	}
+
+	/**
+	 * \brief останавливает и освобождает деки и шины
+	 * @return первый ненулевой FMOD_RESULT или FMOD_OK
+	 */
+	FMOD_RESULT release() {
+		FMOD_RESULT first = FMOD_OK;
+		for (auto &d : decks) {
+			d->stop();
+			FMOD_RESULT result = d->release();
+			if (first == FMOD_OK) {
+				first = result;
+			}
+		}
+		decks.clear();
+		for (FMOD::ChannelGroup **bus : {&cue, &program}) {
+			if (*bus) {
+				FMOD_RESULT result = (*bus)->release();
+				if (first == FMOD_OK) {
+					first = result;
+				}
+				*bus = nullptr;
+			}
+		}
+		return first;
+	}
+};
+
+#endif //SOUND_DECK_MIXER_HPP
@@ -0,0 +1,257 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_DSP_GRAPH_HPP
+#define SOUND_DSP_GRAPH_HPP
+
+#include "fmod.hpp"
+#include <fmod_dsp_effects.h>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief описание одного эффекта в цепочке
+ */
+struct effect_desc {
+	FMOD_DSP_TYPE type = FMOD_DSP_TYPE_UNKNOWN;
+	bool enabled = false;
+	std::vector<std::pair<int, float>> params; ///< (индекс параметра, значение); не указанные остаются по умолчанию
+
+	effect_desc() = default;
+
+	/// {FMOD_DSP_TYPE_ECHO} - выключенный эхо без параметров
+	effect_desc(FMOD_DSP_TYPE type, bool enabled = false, std::vector<std::pair<int, float>> params = {})
+			: type(type), enabled(enabled), params(std::move(params)) {}
+};
+
+/**
+ * \brief цепочка эффектов в порядке прохождения сигнала: первый эффект ближе всего к источнику
+ */
+using effect_chain = std::vector<effect_desc>;
+
+/**
+ * \brief задаёт значение параметра эффекта в описании (добавляет, если его ещё не было)
+ */
+inline void set_effect_param_(effect_desc &effect, int index, float value) {
+	for (auto &p : effect.params) {
+		if (p.first == index) {
+			p.second = value;
+			return;
+		}
+	}
+	effect.params.emplace_back(index, value);
+}
+
+/**
+ * \brief менеджер графа DSP одной группы каналов
+ * Хранит применённую цепочку и по новому описанию делает только разницу, всё под одним System::lockDSP,
+ * так что смена пресета - это одно обновление графа. Выключенные эффекты в графе не стоят вообще
+ * и микшеру ничего не стоят; убранные узлы складываются в пул и переиспользуются.
+ * Эффекты ставятся между фейдером группы и её головой, отводы в голове (индекс 0) остаются на месте.
+ */
+class dsp_graph {
+	FMOD::System *system;
+	FMOD::ChannelGroup *group;
+	effect_chain applied;
+	std::vector<FMOD::DSP *> units; ///< узел каждого эффекта цепочки или nullptr, если эффект выключен
+	std::vector<std::pair<FMOD_DSP_TYPE, FMOD::DSP *>> pool;
+	unsigned updates = 0;
+
+	/// узел из пула приходит с параметрами прошлого эффекта, поэтому они возвращаются к значениям по умолчанию
+	FMOD_RESULT acquire(FMOD_DSP_TYPE type, FMOD::DSP *&dsp) {
+		for (auto it = pool.begin(); it != pool.end(); ++it) {
+			if (it->first == type) {
+				dsp = it->second;
+				pool.erase(it);
+				FMOD_RESULT first = dsp->reset(); // reset чистит только внутреннее состояние (хвост эха и т.п.)
+				int count = 0;
+				keep_first_error(first, dsp->getNumParameters(&count));
+				for (int index = 0; index < count; ++index) {
+					keep_first_error(first, restore_default(dsp, index));
+				}
+				return first;
+			}
+		}
+		return system->createDSPByType(type, &dsp);
+	}
+
+	/// ставит параметр index значением по умолчанию из getParameterInfo; параметры-данные не трогаются
+	static FMOD_RESULT restore_default(FMOD::DSP *dsp, int index) {
+		FMOD_DSP_PARAMETER_DESC *info = nullptr;
+		FMOD_RESULT result = dsp->getParameterInfo(index, &info);
+		if (result != FMOD_OK || !info) {
+			return result;
+		}
+		switch (info->type) {
+			case FMOD_DSP_PARAMETER_TYPE_FLOAT:
+				return dsp->setParameterFloat(index, info->floatdesc.defaultval);
+			case FMOD_DSP_PARAMETER_TYPE_INT:
+				return dsp->setParameterInt(index, info->intdesc.defaultval);
+			case FMOD_DSP_PARAMETER_TYPE_BOOL:
+				return dsp->setParameterBool(index, info->booldesc.defaultval != 0);
+			default:
+				return FMOD_OK;
+		}
+	}
+
+	static bool has_param(effect_desc const &effect, int index) {
+		for (auto const &p : effect.params) {
+			if (p.first == index) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// индекс в группе, куда встанет эффект slot, чтобы сохранить порядок цепочки
+	int insert_index(std::size_t slot) {
+		int index = -1;
+		for (std::size_t j = slot + 1; j < units.size(); ++j) {
+			if (units[j] && group->getDSPIndex(units[j], &index) == FMOD_OK) {
+				return index + 1; // сразу со стороны источника от следующего эффекта
+			}
+		}
+		for (std::size_t j = slot; j-- > 0;) {
+			if (units[j] && group->getDSPIndex(units[j], &index) == FMOD_OK) {
+				return index; // со стороны выхода от предыдущего эффекта
+			}
+		}
+		FMOD::DSP *fader = nullptr;
+		if (group->getDSP(FMOD_CHANNELCONTROL_DSP_FADER, &fader) == FMOD_OK &&
+			group->getDSPIndex(fader, &index) == FMOD_OK) {
+			return index;
+		}
+		return 0;
+	}
+
+	static bool same_params(effect_desc const &a, effect_desc const &b) {
+		return a.params == b.params;
+	}
+
+	static void keep_first_error(FMOD_RESULT &first, FMOD_RESULT result) {
+		if (first == FMOD_OK && result != FMOD_OK) {
+			first = result;
+		}
+	}
+
+public:
+	dsp_graph(FMOD::System *system, FMOD::ChannelGroup *group) : system(system), group(group) {}
+
+	dsp_graph(dsp_graph const &) = delete;
+
+	dsp_graph &operator=(dsp_graph const &) = delete;
+
+	~dsp_graph() { release(); }
+
+	/**
+	 * \brief приводит граф к описанию desired одним обновлением
+	 * @return первый ненулевой FMOD_RESULT или FMOD_OK
+	 */
+	FMOD_RESULT apply(effect_chain const &desired) {
+		FMOD_RESULT first = system->lockDSP();
+		if (first != FMOD_OK) {
+			return first;
+		}
+
+		// сначала убираем всё лишнее: выключенные эффекты и эффекты, у которых поменялся тип
+		for (std::size_t i = 0; i < units.size(); ++i) {
+			bool keep = i < desired.size() && desired[i].enabled && desired[i].type == applied[i].type;
+			if (units[i] && !keep) {
+				keep_first_error(first, group->removeDSP(units[i]));
+				pool.emplace_back(applied[i].type, units[i]);
+				units[i] = nullptr;
+			}
+		}
+		units.resize(desired.size(), nullptr);
+		applied.resize(desired.size());
+
+		for (std::size_t i = 0; i < desired.size(); ++i) {
+			effect_desc const &want = desired[i];
+			if (!want.enabled) {
+				applied[i] = want;
+				continue;
+			}
+			bool fresh = units[i] == nullptr;
+			if (fresh) {
+				FMOD::DSP *dsp = nullptr;
+				FMOD_RESULT result = acquire(want.type, dsp);
+				keep_first_error(first, result);
+				if (result != FMOD_OK || !dsp) {
+					continue;
+				}
+				keep_first_error(first, dsp->setBypass(false));
+				keep_first_error(first, group->addDSP(insert_index(i), dsp));
+				units[i] = dsp;
+			}
+			if (fresh || !same_params(applied[i], want)) {
+				if (!fresh) {
+					for (auto const &p : applied[i].params) {
+						if (!has_param(want, p.first)) { // параметр убран из описания - значит, снова по умолчанию
+							keep_first_error(first, restore_default(units[i], p.first));
+						}
+					}
+				}
+				for (auto const &p : want.params) {
+					keep_first_error(first, units[i]->setParameterFloat(p.first, p.second));
+				}
+			}
+			applied[i] = want;
+		}
+
+		keep_first_error(first, system->unlockDSP());
+		++updates;
+		return first;
+	}
+
+	/**
+	 * \brief убирает все эффекты из графа и освобождает и их, и пул
+	 * @return первый ненулевой FMOD_RESULT или FMOD_OK
+	 */
+	FMOD_RESULT release() {
+		if (units.empty() && pool.empty()) {
+			return FMOD_OK;
+		}
+		FMOD_RESULT first = system->lockDSP();
+		for (FMOD::DSP *&dsp : units) {
+			if (dsp) {
+				keep_first_error(first, group->removeDSP(dsp));
+				keep_first_error(first, dsp->release());
+				dsp = nullptr;
+			}
+		}
+		for (auto &p : pool) {
+			keep_first_error(first, p.second->release());
+		}
+		pool.clear();
+		units.clear();
+		applied.clear();
+		keep_first_error(first, system->unlockDSP());
+		return first;
+	}
+
+	/// применённая цепочка
+	effect_chain const &chain() const { return applied; }
+
+	/// узел эффекта slot или nullptr, если эффект выключен
+	FMOD::DSP *unit(std::size_t slot) const { return slot < units.size() ? units[slot] : nullptr; }
+
+	/// сколько эффектов сейчас стоит в графе
+	std::size_t active_units() const {
+		std::size_t n = 0;
+		for (FMOD::DSP *dsp : units) {
+			n += dsp != nullptr;
+		}
+		return n;
+	}
+
+	/// сколько узлов лежит в пуле
+	std::size_t pooled_units() const { return pool.size(); }
+
+	/// сколько раз граф обновлялся
+	unsigned graph_updates() const { return updates; }
+};
+
+#endif //SOUND_DSP_GRAPH_HPP
@@ -0,0 +1,458 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_FINGERPRINT_HPP
+#define SOUND_FINGERPRINT_HPP
+
+#include "fmod.hpp"
+#include "analysis_cache.hpp"
+#include "library.hpp"
+#include "offline_render.hpp"
+#include "spectrum.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// частота, до которой понижается звук перед разбором
+constexpr int fingerprint_rate = analysis_rate;
+/// кадр БПФ, ~370 мс
+constexpr std::size_t fingerprint_frame = 4096;
+/// шаг между словами отпечатка, ~124 мс (перекрытие кадров 2/3 спасает от сдвига начала у разных кодировщиков)
+constexpr std::size_t fingerprint_hop = 1365;
+/// сколько секунд от начала трека разбирается; дубликаты узнаются и по минуте, а декодирование - самое дорогое
+constexpr double fingerprint_seconds = 60;
+
+/**
+ * \brief акустический отпечаток: одно 32-битное слово на кадр
+ * Биты 0-11 - контраст соседних классов хромы (устойчивы к эквалайзеру и битрейту),
+ * биты 12-31 - знак изменения разности энергий соседних полос 300-3000 Гц во времени (Haitsma-Kalker).
+ */
+struct audio_fingerprint {
+	std::vector<std::uint32_t> words;
+	float seconds = 0; ///< длительность разобранного фрагмента
+};
+
+/**
+ * \brief считает отпечаток из моно-сигнала с частотой fingerprint_rate
+ * Один объект на поток.
+ */
+class fingerprint_extractor {
+	static constexpr std::size_t band_count = 21;
+
+	spectrum_analyzer analyzer{fingerprint_frame, fingerprint_rate};
+	std::vector<std::size_t> edges = analyzer.log_bands(300, 3000, band_count);
+	std::vector<float> power = std::vector<float>(analyzer.bins());
+
+public:
+	audio_fingerprint compute(float const *mono, std::size_t n) {
+		TRACE_SCOPE("fingerprint");
+		audio_fingerprint print;
+		print.seconds = float(n) / fingerprint_rate;
+		float bands[band_count], previous[band_count] = {}, chroma[12];
+		for (std::size_t start = 0; start + fingerprint_frame <= n; start += fingerprint_hop) {
+			analyzer.power(mono + start, power.data());
+			analyzer.chroma(power.data(), chroma);
+			spectrum_analyzer::band_energies(power.data(), edges, bands);
+			std::uint32_t word = 0;
+			for (unsigned c = 0; c < 12; ++c) {
+				word |= std::uint32_t(chroma[c] > chroma[(c + 1) % 12]) << c;
+			}
+			for (unsigned b = 0; b + 1 < band_count; ++b) {
+				float now = bands[b] - bands[b + 1], before = previous[b] - previous[b + 1];
+				word |= std::uint32_t(now > before) << (12 + b);
+			}
+			std::copy(bands, bands + band_count, previous);
+			print.words.push_back(word);
+		}
+		return print;
+	}
+};
+
+constexpr std::uint32_t fingerprint_artifact = artifact_type_("FPRT");
+
+/**
+ * \brief отпечаток в байты для analysis_cache: длительность, затем слова
+ */
+inline void fingerprint_to_bytes_(audio_fingerprint const &print, std::vector<char> &out) {
+	out.resize(sizeof(float) + print.words.size() * sizeof(std::uint32_t));
+	std::memcpy(out.data(), &print.seconds, sizeof(float));
+	if (!print.words.empty()) {
+		std::memcpy(out.data() + sizeof(float), print.words.data(), print.words.size() * sizeof(std::uint32_t));
+	}
+}
+
+inline bool fingerprint_from_bytes_(std::vector<char> const &in, audio_fingerprint &print) {
+	if (in.size() < sizeof(float) || (in.size() - sizeof(float)) % sizeof(std::uint32_t) != 0) {
+		return false;
+	}
+	std::memcpy(&print.seconds, in.data(), sizeof(float));
+	print.words.resize((in.size() - sizeof(float)) / sizeof(std::uint32_t));
+	if (!print.words.empty()) {
+		std::memcpy(print.words.data(), in.data() + sizeof(float), print.words.size() * sizeof(std::uint32_t));
+	}
+	return true;
+}
+
+/**
+ * \brief проход общего декодирования, который считает отпечаток первых fingerprint_seconds секунд
+ * Проход держит свой fingerprint_extractor, поэтому у каждого потока должен быть свой.
+ */
+inline analysis_pass fingerprint_pass_() {
+	auto extractor = std::make_shared<fingerprint_extractor>();
+	return {fingerprint_artifact, 1, fingerprint_seconds,
+			[extractor](decoded_track const &track, std::vector<char> &out) {
+				audio_fingerprint print = extractor->compute(track.mono.data(), track.mono_length(fingerprint_seconds));
+				fingerprint_to_bytes_(print, out);
+				return !print.words.empty();
+			}};
+}
+
+inline unsigned popcount32_(std::uint32_t x) {
+	x = x - ((x >> 1) & 0x55555555u);
+	x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+	return (((x + (x >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+}
+
+/**
+ * \brief доля совпавших бит двух отпечатков, если слово b[i] совмещено со словом a[i + offset]
+ * Для разных сигналов около 0.5, для того же звука в другой кодировке - 0.8 и выше.
+ * @return 0, если перекрытие меньше min_overlap слов
+ */
+inline float fingerprint_similarity_(audio_fingerprint const &a, audio_fingerprint const &b, int offset,
+									 std::size_t min_overlap = 32) {
+	long begin_b = std::max(0L, -long(offset));
+	long end_b = std::min(long(b.words.size()), long(a.words.size()) - offset);
+	if (end_b - begin_b < long(min_overlap)) {
+		return 0;
+	}
+	unsigned long errors = 0;
+	for (long i = begin_b; i < end_b; ++i) {
+		errors += popcount32_(a.words[i + offset] ^ b.words[i]);
+	}
+	return 1.0f - float(errors) / float(32 * (end_b - begin_b));
+}
+
+/**
+ * \brief пара треков, звучащих одинаково
+ */
+struct duplicate_pair {
+	track_id a = no_track;
+	track_id b = no_track;
+	float similarity = 0;   ///< доля совпавших бит отпечатка
+	float offset_seconds = 0; ///< на сколько b начинается позже a
+};
+
+/**
+ * \brief группа одинаковых треков
+ */
+struct duplicate_group {
+	std::vector<track_id> tracks;
+	float similarity = 1; ///< самая слабая связь внутри группы
+};
+
+/**
+ * \brief индекс отпечатков для поиска дубликатов
+ * Ключ слова - 20 самых устойчивых бит (хрома и нижние полосы). В индекс попадает примерно каждый четвёртый
+ * ключ, выбранный по хешу самого ключа, поэтому у двух кодировок одной песни выбираются одни и те же кадры.
+ * Совпавшие ключи голосуют за пару (трек, сдвиг), а пары с достаточным числом голосов проверяются
+ * полным сравнением отпечатков. Индекс - CSR-массив: 4 МБ заголовков и 8 байт на ключ, без хеш-таблиц.
+ */
+class duplicate_index {
+	static constexpr unsigned key_bits = 20;
+	static constexpr std::size_t bucket_limit = 2048; ///< ключи тишины и постоянного тона не голосуют
+	static constexpr unsigned min_votes = 3;
+
+	struct posting {
+		std::uint32_t doc;
+		std::uint32_t frame;
+	};
+
+	std::vector<track_id> ids;
+	std::vector<audio_fingerprint> prints;
+	std::vector<std::uint32_t> heads; ///< постинги ключа k - [heads[k], heads[k + 1])
+	std::vector<posting> postings;
+
+	static std::uint32_t key_of(std::uint32_t word) { return word & ((1u << key_bits) - 1); }
+
+	static bool sampled(std::uint32_t key) {
+		std::uint32_t h = key * 0x9e3779b1u;
+		return key != 0 && (h >> 30) == 0;
+	}
+
+	/// кадры документа, которые попадают в индекс: выбранные ключи без повторов подряд
+	template <typename F>
+	void for_each_key(audio_fingerprint const &print, F &&f) const {
+		std::uint32_t last = ~0u;
+		for (std::size_t i = 0; i < print.words.size(); ++i) {
+			std::uint32_t key = key_of(print.words[i]);
+			if (key != last && sampled(key)) {
+				f(key, static_cast<std::uint32_t>(i));
+			}
+			last = key;
+		}
+	}
+
+	void find_for(std::uint32_t doc, float min_similarity, std::vector<std::uint64_t> &votes,
+				  std::vector<duplicate_pair> &out) const {
+		votes.clear();
+		for_each_key(prints[doc], [&](std::uint32_t key, std::uint32_t frame) {
+			std::uint32_t begin = heads[key], end = heads[key + 1];
+			if (end - begin > bucket_limit) {
+				return;
+			}
+			for (std::uint32_t p = begin; p < end; ++p) {
+				if (postings[p].doc > doc) { // каждая пара проверяется один раз
+					auto offset = static_cast<std::uint32_t>(std::int64_t(postings[p].frame) - frame + (1 << 20));
+					votes.push_back((std::uint64_t(postings[p].doc) << 32) | offset);
+				}
+			}
+		});
+		std::sort(votes.begin(), votes.end());
+		for (std::size_t i = 0; i < votes.size();) {
+			std::uint32_t other = static_cast<std::uint32_t>(votes[i] >> 32);
+			std::uint32_t best_offset = 0;
+			unsigned best = 0;
+			while (i < votes.size() && (votes[i] >> 32) == other) {
+				std::size_t j = i;
+				while (j < votes.size() && votes[j] == votes[i]) {
+					++j;
+				}
+				if (j - i > best) {
+					best = static_cast<unsigned>(j - i);
+					best_offset = static_cast<std::uint32_t>(votes[i]);
+				}
+				i = j;
+			}
+			if (best < min_votes) {
+				continue;
+			}
+			int offset = int(std::int64_t(best_offset) - (1 << 20));
+			float similarity = 0;
+			int aligned = offset;
+			for (int d = -1; d <= 1; ++d) { // голоса считаются по ключу, уточняем по полному слову
+				float s = fingerprint_similarity_(prints[other], prints[doc], offset + d);
+				if (s > similarity) {
+					similarity = s;
+					aligned = offset + d;
+				}
+			}
+			if (similarity >= min_similarity) {
+				out.push_back({ids[doc], ids[other], similarity,
+							   float(aligned) * fingerprint_hop / fingerprint_rate});
+			}
+		}
+	}
+
+public:
+	void add(track_id id, audio_fingerprint print) {
+		ids.push_back(id);
+		prints.push_back(std::move(print));
+	}
+
+	std::size_t size() const { return ids.size(); }
+
+	/**
+	 * \brief раскладывает ключи по корзинам; вызывать после всех add и до find_pairs
+	 */
+	void build() {
+		TRACE_SCOPE("duplicate_index::build");
+		heads.assign((std::size_t(1) << key_bits) + 1, 0);
+		for (auto const &print : prints) {
+			for_each_key(print, [&](std::uint32_t key, std::uint32_t) { ++heads[key + 1]; });
+		}
+		std::partial_sum(heads.begin(), heads.end(), heads.begin());
+		postings.resize(heads.back());
+		std::vector<std::uint32_t> fill(heads.begin(), heads.end() - 1);
+		for (std::uint32_t doc = 0; doc < prints.size(); ++doc) {
+			for_each_key(prints[doc], [&](std::uint32_t key, std::uint32_t frame) {
+				postings[fill[key]++] = {doc, frame};
+			});
+		}
+	}
+
+	/**
+	 * \brief все пары похожих треков
+	 * @param min_similarity - порог доли совпавших бит: 0.8 - тот же звук, 0.65 - ремастер, другая версия сведения
+	 * @param threads - 0 - по числу ядер
+	 */
+	std::vector<duplicate_pair> find_pairs(float min_similarity = 0.65f, unsigned threads = 0) const {
+		TRACE_SCOPE("duplicate_index::find_pairs");
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		std::atomic<std::uint32_t> next{0};
+		std::vector<std::vector<duplicate_pair>> found(threads);
+		auto work = [&](unsigned t) {
+			std::vector<std::uint64_t> votes;
+			for (std::uint32_t doc; (doc = next.fetch_add(1)) < prints.size();) {
+				find_for(doc, min_similarity, votes, found[t]);
+			}
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < threads; ++t) {
+			pool.emplace_back(work, t);
+		}
+		work(0);
+		for (auto &thread : pool) {
+			thread.join();
+		}
+		std::vector<duplicate_pair> pairs;
+		for (auto &part : found) {
+			pairs.insert(pairs.end(), part.begin(), part.end());
+		}
+		return pairs;
+	}
+};
+
+/**
+ * \brief собирает пары в группы (связные компоненты)
+ * @return группы по убыванию размера
+ */
+inline std::vector<duplicate_group> group_duplicates_(std::vector<duplicate_pair> const &pairs) {
+	std::unordered_map<track_id, track_id> parent;
+	std::function<track_id(track_id)> root = [&](track_id x) {
+		auto it = parent.find(x);
+		if (it == parent.end()) {
+			parent[x] = x;
+			return x;
+		}
+		if (it->second == x) {
+			return x;
+		}
+		track_id r = root(it->second);
+		parent[x] = r;
+		return r;
+	};
+	for (auto const &pair : pairs) {
+		track_id ra = root(pair.a), rb = root(pair.b);
+		if (ra != rb) {
+			parent[std::max(ra, rb)] = std::min(ra, rb);
+		}
+	}
+	std::unordered_map<track_id, duplicate_group> groups;
+	for (auto const &pair : parent) {
+		groups[root(pair.first)].tracks.push_back(pair.first);
+	}
+	for (auto const &pair : pairs) {
+		float &s = groups[root(pair.a)].similarity;
+		s = std::min(s, pair.similarity);
+	}
+	std::vector<duplicate_group> out;
+	for (auto &group : groups) {
+		std::sort(group.second.tracks.begin(), group.second.tracks.end());
+		out.push_back(std::move(group.second));
+	}
+	std::sort(out.begin(), out.end(), [](duplicate_group const &x, duplicate_group const &y) {
+		return x.tracks.size() != y.tracks.size() ? x.tracks.size() > y.tracks.size() : x.tracks < y.tracks;
+	});
+	return out;
+}
+
+/**
+ * \brief фоновый поиск дубликатов по всей библиотеке
+ * Файлы декодируются на всех ядрах, у каждого потока своя система FMOD без вывода звука (декодирование
+ * через readData, без микшера), затем строится duplicate_index. Отпечатки, уже посчитанные фоновым анализом,
+ * берутся из analysis_cache без декодирования. Прогресс и отмена - через атомарные счётчики,
+ * окно опрашивает их таймером.
+ */
+class duplicate_scan {
+	std::thread worker;
+	std::atomic<std::size_t> done{0};
+	std::atomic<std::size_t> failed{0};
+	std::atomic<bool> cancelled{false};
+	std::atomic<bool> finished{false};
+	std::size_t total = 0;
+	analysis_cache *cache;
+	std::vector<duplicate_group> groups;
+
+	void run(std::vector<std::string> paths, unsigned threads) {
+#ifdef SOUND_TRACE
+		trace_thread_name_("duplicate scan");
+#endif
+		std::vector<audio_fingerprint> prints(paths.size());
+		std::atomic<std::size_t> next{0};
+		auto work = [&] {
+			FMOD::System *system = nullptr;
+			if (create_nrt_system_(system, {}, FMOD_INIT_NORMAL, 1) != FMOD_OK) {
+				if (system) {
+					system->release();
+				}
+				return;
+			}
+			std::vector<analysis_pass> passes{fingerprint_pass_()};
+			std::vector<std::vector<char>> artifacts;
+			for (std::size_t i; !cancelled && (i = next.fetch_add(1)) < paths.size();) {
+				if (run_analysis_passes_(system, paths[i].c_str(), cache, passes, artifacts) != FMOD_OK ||
+					!fingerprint_from_bytes_(artifacts[0], prints[i])) {
+					++failed;
+				}
+				++done;
+			}
+			system->close();
+			system->release();
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 0; t < threads; ++t) {
+			pool.emplace_back(work);
+		}
+		for (auto &thread : pool) {
+			thread.join();
+		}
+		if (!cancelled) {
+			duplicate_index index;
+			for (std::size_t i = 0; i < prints.size(); ++i) {
+				index.add(static_cast<track_id>(i), std::move(prints[i]));
+			}
+			index.build();
+			groups = group_duplicates_(index.find_pairs(0.65f, threads));
+		}
+		finished = true;
+	}
+
+public:
+	/**
+	 * \brief запускает поиск
+	 * @param paths - пути треков; номер трека в результате - индекс в этом списке
+	 * @param cache - хранилище отпечатков, nullptr - считать всё заново
+	 * @param threads - 0 - по числу ядер
+	 */
+	explicit duplicate_scan(std::vector<std::string> paths, analysis_cache *cache = nullptr, unsigned threads = 0)
+			: total(paths.size()), cache(cache) {
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		worker = std::thread(&duplicate_scan::run, this, std::move(paths), threads);
+	}
+
+	~duplicate_scan() {
+		cancelled = true;
+		worker.join();
+	}
+
+	duplicate_scan(duplicate_scan const &) = delete;
+	duplicate_scan &operator=(duplicate_scan const &) = delete;
+
+	std::size_t progress() const { return done; }
+
+	std::size_t size() const { return total; }
+
+	/// файлы, которые не удалось декодировать
+	std::size_t errors() const { return failed; }
+
+	bool ready() const { return finished; }
+
+	/// результат; читать только после ready()
+	std::vector<duplicate_group> const &result() const { return groups; }
+};
+
+#endif //SOUND_FINGERPRINT_HPP
@@ -8,14 +8,24 @@
 
 #include "fmod.hpp"
 #include "common.h"
+#include "time_stretch.hpp"
+#include "trace.hpp"
 #include <exception>
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
 #include <fmod_dsp_effects.h>
 
+/// сколько ошибок FMOD прошло через ERROR_CHECK (их не бросаем, но считаем для мониторинга)
+inline std::atomic<unsigned> fmod_error_count{0};
+/// последняя ошибка FMOD
+inline std::atomic<int> fmod_last_error{FMOD_OK};
+
 void ERROR_CHECK(FMOD_RESULT const &res) {
 	if (res != FMOD_OK) {
 		//throw std::runtime_error("Fatal error, 99% that file is not found.");
+		fmod_error_count.fetch_add(1, std::memory_order_relaxed);
+		fmod_last_error.store(res, std::memory_order_relaxed);
 	}
 }
 
@@ -25,21 +35,29 @@ void ERROR_CHECK(FMOD_RESULT const &res) {
  * @param sound - указатель на созданный звук
  * @param channel - указатель на канал, в котором будет проигрываться звук
  * @param path - путь, по которому искать трек
+ * @param group - группа (дека), в которую идёт звук; nullptr - мастер-группа
+ * @param paused - канал стартует на паузе, например чтобы сначала перемотать
  * @return FMOD_RESULT
  */
-FMOD_RESULT play_sound_(FMOD::System *&system, FMOD::Sound *&sound, FMOD::Channel *&channel, char const *path) {
+FMOD_RESULT play_sound_(FMOD::System *&system, FMOD::Sound *&sound, FMOD::Channel *&channel, char const *path,
+						FMOD::ChannelGroup *group = nullptr, bool paused = false) {
+	TRACE_SCOPE("play_sound_");
 	int q = 0;
 	FMOD_RESULT result;
 	result = system->getChannelsPlaying(&q, nullptr);
 	ERROR_CHECK(result);
-	if (q > 0) {
+	if (q > 0 && channel) { // играть могут и другие деки, а канал этого трека уже остановлен
 		channel->stop();
 	}
-	result = system->createSound(path, FMOD_CREATESTREAM, 0, &sound);
+	{
+		TRACE_SCOPE("createSound");
+		result = system->createSound(path, FMOD_CREATESTREAM, 0, &sound);
+	}
 	ERROR_CHECK(result);
+	TRACE_INSTANT("stream opened");
 	result = (sound)->setMode(FMOD_LOOP_OFF);
 	ERROR_CHECK(result);
-	result = system->playSound(sound, 0, false, &channel);
+	result = system->playSound(sound, group, paused, &channel);
 	return result;
 }
 
@@ -49,6 +67,7 @@ FMOD_RESULT play_sound_(FMOD::System *&system, FMOD::Sound *&sound, FMOD::Channe
  * @return FMOD_RESULT
  */
 FMOD_RESULT increase_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigned int len_ms) {
+	TRACE_SCOPE("increase_time_");
 	FMOD_RESULT result;
 	unsigned int len, max_len;
 	result = channel->getPosition(&len, FMOD_TIMEUNIT_MS);
@@ -56,6 +75,7 @@ FMOD_RESULT increase_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigne
 	result = sound->getLength(&max_len, FMOD_TIMEUNIT_MS);
 	ERROR_CHECK(result);
 	result = channel->setPosition(std::min<unsigned>(len + len_ms, max_len), FMOD_TIMEUNIT_MS);
+	reset_time_stretch_(channel);
 	return result;
 }
 
@@ -65,6 +85,7 @@ FMOD_RESULT increase_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigne
  * @return FMOD_RESULT
  */
 FMOD_RESULT decrease_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigned int len_ms) {
+	TRACE_SCOPE("decrease_time_");
 	FMOD_RESULT result;
 	unsigned int len, max_len;
 	result = channel->getPosition(&len, FMOD_TIMEUNIT_MS);
@@ -76,6 +97,7 @@ FMOD_RESULT decrease_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigne
 	} else {
 		result = channel->setPosition(len - len_ms, FMOD_TIMEUNIT_MS);
 	}
+	reset_time_stretch_(channel);
 	return result;
 }
 
@@ -86,6 +108,7 @@ FMOD_RESULT decrease_time_(FMOD::Sound *&sound, FMOD::Channel *&channel, unsigne
  * @return FMOD_RESULT
  */
 void pause_the_sound_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("pause_the_sound_");
 	FMOD_RESULT result;
 	bool paused;
 	result = channel->getPaused(&paused);
@@ -96,6 +119,7 @@ void pause_the_sound_(FMOD::Channel *&channel) {
 
 
 void stop_the_sound_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("stop_the_sound_");
 	FMOD_RESULT result;
 	result = channel->setPaused(true);
 	//return result;
@@ -106,8 +130,10 @@ void stop_the_sound_(FMOD::Channel *&channel) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT begin_of_the_track_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("begin_of_the_track_");
 	FMOD_RESULT result;
 	result = channel->setPosition(0, FMOD_TIMEUNIT_MS);
+	reset_time_stretch_(channel);
 	return result;
 }
 
@@ -121,6 +147,7 @@ FMOD_RESULT begin_of_the_track_(FMOD::Channel *&channel) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT move_in_track_(FMOD::System *&system, FMOD::Sound *&sound, FMOD::Channel *&channel, float const &percent) {
+	TRACE_SCOPE("move_in_track_");
 	FMOD_RESULT result;
 	result = begin_of_the_track_(channel);
 	ERROR_CHECK(result);
@@ -138,6 +165,7 @@ FMOD_RESULT move_in_track_(FMOD::System *&system, FMOD::Sound *&sound, FMOD::Cha
  * @return FMOD_RESULT
  */
 FMOD_RESULT increse_volume_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("increse_volume_");
 	FMOD_RESULT result;
 	float vol = 0;
 	result = channel->getVolume(&vol);
@@ -152,6 +180,7 @@ FMOD_RESULT increse_volume_(FMOD::Channel *&channel) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT decrease_volume_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("decrease_volume_");
 	FMOD_RESULT result;
 	float vol = 0;
 	result = channel->getVolume(&vol);
@@ -166,6 +195,7 @@ FMOD_RESULT decrease_volume_(FMOD::Channel *&channel) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT mute_(FMOD::Channel *&channel) {
+	TRACE_SCOPE("mute_");
 	FMOD_RESULT result;
 	result = channel->setVolume(0);
 	return result;
@@ -178,6 +208,7 @@ FMOD_RESULT mute_(FMOD::Channel *&channel) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT change_volume_(FMOD::Channel *&channel, float dif) {
+	TRACE_SCOPE("change_volume_");
 	FMOD_RESULT result;
 	float vol = 0;
 	result = channel->getVolume(&vol);
@@ -193,6 +224,7 @@ FMOD_RESULT change_volume_(FMOD::Channel *&channel, float dif) {
  * @return FMOD_RESULT
  */
 FMOD_RESULT FMOD_change_lowpass_or_highpass_parameter_(FMOD::DSP *&dsp, float const &freq = 0) {
+	TRACE_SCOPE("FMOD_change_lowpass_or_highpass_parameter_");
 	FMOD_RESULT result;
 	result = dsp->setParameterFloat(0, freq);
 	return result;
@@ -204,6 +236,7 @@ FMOD_RESULT FMOD_change_lowpass_or_highpass_parameter_(FMOD::DSP *&dsp, float co
  * @return FMOD_RESULT
  */
 FMOD_RESULT change_dsp_bypass_(FMOD::DSP *&dsp) {
+	TRACE_SCOPE("change_dsp_bypass_");
 	FMOD_RESULT result;
 	bool bypass;
 	result = dsp->getBypass(&bypass);
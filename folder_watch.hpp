@@ -0,0 +1,605 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_FOLDER_WATCH_HPP
+#define SOUND_FOLDER_WATCH_HPP
+
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/**
+ * \brief изменение в следящей папке
+ */
+struct folder_change {
+	enum kind_t {
+		added,    ///< новый файл
+		modified, ///< файл перезаписан, анализ надо повторить
+		removed,  ///< файла больше нет
+		moved     ///< файл переименован или перенесён внутри следящих папок: from -> path
+	};
+	kind_t kind;
+	std::string path;
+	std::string from;
+};
+
+/**
+ * \brief файл похож на звуковой, который умеет открыть FMOD
+ */
+inline bool is_audio_path_(std::string_view path) {
+	static char const *const extensions[] = {".mp3", ".wav", ".ogg", ".flac", ".m4a", ".aac", ".wma", ".aif",
+											 ".aiff", ".opus", ".mod", ".xm", ".it", ".s3m", ".mid"};
+	std::size_t dot = path.find_last_of("./\\");
+	if (dot == std::string_view::npos || path[dot] != '.') {
+		return false;
+	}
+	std::string ext(path.substr(dot));
+	for (char &c : ext) {
+		c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	}
+	return std::find(std::begin(extensions), std::end(extensions), ext) != std::end(extensions);
+}
+
+/**
+ * \brief размер и время изменения файла: по ним сверка узнаёт изменения и переименования
+ */
+struct file_stamp {
+	std::int64_t mtime = 0;
+	std::uint64_t size = 0;
+
+	bool operator==(file_stamp const &other) const { return mtime == other.mtime && size == other.size; }
+
+	bool operator!=(file_stamp const &other) const { return !(*this == other); }
+};
+
+inline bool stamp_file_(std::string const &path, file_stamp &stamp) {
+	std::error_code error;
+	auto size = std::filesystem::file_size(path, error);
+	if (error) {
+		return false;
+	}
+	auto time = std::filesystem::last_write_time(path, error);
+	if (error) {
+		return false;
+	}
+	stamp = {static_cast<std::int64_t>(time.time_since_epoch().count()), static_cast<std::uint64_t>(size)};
+	return true;
+}
+
+/// снимок папок: путь звукового файла -> его штамп
+using folder_snapshot = std::unordered_map<std::string, file_stamp>;
+
+/**
+ * \brief обходит папки и собирает все звуковые файлы; недоступные подпапки пропускаются
+ */
+inline void scan_audio_files_(std::vector<std::string> const &roots, folder_snapshot &out) {
+	out.clear();
+	for (auto const &root : roots) {
+		std::error_code error;
+		std::filesystem::recursive_directory_iterator it(
+				root, std::filesystem::directory_options::skip_permission_denied, error), end;
+		for (; !error && it != end; it.increment(error)) {
+			if (!it->is_regular_file(error)) {
+				continue;
+			}
+			std::string path = it->path().string();
+			file_stamp stamp;
+			if (is_audio_path_(path) && stamp_file_(path, stamp)) {
+				out.emplace(std::move(path), stamp);
+			}
+		}
+	}
+}
+
+/**
+ * \brief сводит поток событий в пачку изменений
+ * События одного файла схлопываются: запись за записью - одно изменение, созданный и тут же удалённый файл -
+ * ничего, цепочка переименований a -> b -> c - одно переименование a -> c. Поэтому копирование тысяч файлов
+ * с многократными записями в каждый даёт библиотеке по одному added на файл.
+ */
+class change_coalescer {
+	struct pending {
+		folder_change::kind_t kind;
+		std::string from; ///< для moved
+		bool dirty = false; ///< переименованный файл ещё и перезаписан
+	};
+
+	std::map<std::string, pending> changes; ///< по текущему пути; map - чтобы пачка шла в порядке папок
+
+public:
+	void added(std::string const &path) {
+		auto it = changes.find(path);
+		if (it == changes.end()) {
+			changes[path] = {folder_change::added, {}};
+		} else if (it->second.kind == folder_change::removed) {
+			it->second = {folder_change::modified, {}}; // файл заменили новым
+		} else {
+			it->second.dirty = true;
+		}
+	}
+
+	void modified(std::string const &path) {
+		auto it = changes.find(path);
+		if (it == changes.end()) {
+			changes[path] = {folder_change::modified, {}};
+		} else if (it->second.kind == folder_change::moved) {
+			it->second.dirty = true;
+		} else if (it->second.kind == folder_change::removed) {
+			it->second = {folder_change::modified, {}};
+		}
+	}
+
+	void removed(std::string const &path) {
+		auto it = changes.find(path);
+		if (it == changes.end()) {
+			changes[path] = {folder_change::removed, {}};
+			return;
+		}
+		pending was = std::move(it->second);
+		changes.erase(it);
+		if (was.kind == folder_change::moved) {
+			removed(was.from); // библиотека знает файл под старым именем
+		} else if (was.kind == folder_change::modified) {
+			changes[path] = {folder_change::removed, {}};
+		} // added + removed - библиотеке ничего не надо
+	}
+
+	void moved(std::string const &from, std::string const &to) {
+		if (from == to) {
+			return;
+		}
+		auto it = changes.find(from);
+		pending next{folder_change::moved, from};
+		if (it != changes.end()) {
+			pending was = std::move(it->second);
+			changes.erase(it);
+			if (was.kind == folder_change::added) {
+				next = {folder_change::added, {}};
+			} else if (was.kind == folder_change::moved) {
+				next = {folder_change::moved, was.from, was.dirty};
+			} else if (was.kind == folder_change::modified) {
+				next.dirty = true;
+			}
+		}
+		if (next.kind == folder_change::moved && next.from == to) { // вернули старое имя
+			if (!next.dirty) {
+				return;
+			}
+			next = {folder_change::modified, {}};
+		}
+		auto target = changes.find(to);
+		if (target != changes.end() && target->second.kind == folder_change::removed) {
+			// файл переименовали поверх удалённого: библиотека знает трек под именем to, он и остаётся
+			if (next.kind == folder_change::moved) {
+				changes[next.from] = {folder_change::removed, {}};
+			}
+			next = {folder_change::modified, {}};
+		}
+		changes[to] = std::move(next);
+	}
+
+	bool empty() const { return changes.empty(); }
+
+	std::size_t size() const { return changes.size(); }
+
+	/**
+	 * \brief забирает накопленное; переименование с перезаписью даёт moved и следом modified
+	 */
+	void take(std::vector<folder_change> &out) {
+		for (auto &c : changes) {
+			out.push_back({c.second.kind, c.first, std::move(c.second.from)});
+			if (c.second.kind == folder_change::moved && c.second.dirty) {
+				out.push_back({folder_change::modified, c.first, {}});
+			}
+		}
+		changes.clear();
+	}
+};
+
+/**
+ * \brief сравнивает два снимка и пишет разницу в coalescer
+ * Пропавший и появившийся файлы с одинаковыми размером и временем изменения - это переименование
+ * (rename не трогает mtime), поэтому кэш анализа переживает и сверку после переполнения очереди событий.
+ * Если одинаковых штампов несколько (папку скопировали, потом перенесли), пара ищется ещё и по имени файла.
+ */
+inline void diff_snapshots_(folder_snapshot const &before, folder_snapshot const &after, change_coalescer &out) {
+	std::map<std::pair<std::int64_t, std::uint64_t>, std::vector<std::string>> vanished;
+	for (auto const &file : before) {
+		auto now = after.find(file.first);
+		if (now == after.end()) {
+			vanished[{file.second.mtime, file.second.size}].push_back(file.first);
+		} else if (now->second != file.second) {
+			out.modified(file.first);
+		}
+	}
+	auto name_of = [](std::string const &path) {
+		std::size_t slash = path.find_last_of("/\\");
+		return std::string_view(path).substr(slash == std::string::npos ? 0 : slash + 1);
+	};
+	for (auto const &file : after) {
+		if (before.count(file.first)) {
+			continue;
+		}
+		auto same = vanished.find({file.second.mtime, file.second.size});
+		if (same == vanished.end()) {
+			out.added(file.first);
+			continue;
+		}
+		auto &group = same->second;
+		auto pick = group.end();
+		if (group.size() == 1) {
+			pick = group.begin();
+		} else {
+			std::size_t matches = 0;
+			for (auto it = group.begin(); it != group.end(); ++it) {
+				if (name_of(*it) == name_of(file.first)) {
+					pick = it;
+					++matches;
+				}
+			}
+			if (matches != 1) { // два файла с одинаковыми именем и штампом - не угадываем
+				pick = group.end();
+			}
+		}
+		if (pick == group.end()) {
+			out.added(file.first);
+			continue;
+		}
+		out.moved(*pick, file.first);
+		group.erase(pick);
+		if (group.empty()) {
+			vanished.erase(same);
+		}
+	}
+	for (auto const &group : vanished) {
+		for (auto const &path : group.second) {
+			out.removed(path);
+		}
+	}
+}
+
+/**
+ * \brief следит за папками и отдаёт изменения пачками
+ * На Linux события приходят от inotify: файл считается готовым после IN_CLOSE_WRITE, пары IN_MOVED_FROM/IN_MOVED_TO
+ * склеиваются по cookie в переименование. События копятся в change_coalescer и отдаются, когда папки затихли
+ * на quiet или пачка копится дольше max_delay. При переполнении очереди inotify и при изменениях целых папок
+ * делается сверка снимков по mtime. На других системах сверка - единственный способ и идёт раз в poll_interval.
+ * Окно забирает пачки через take_changes, когда его позовёт обработчик ready из конструктора.
+ */
+class folder_watcher {
+	std::vector<std::string> roots;
+	std::chrono::milliseconds quiet, max_delay;
+	std::chrono::milliseconds poll_interval{10000};
+
+	std::mutex lock;
+	std::vector<folder_change> ready;
+	std::function<void()> on_ready;
+	std::size_t overflow_count = 0;
+	std::atomic<bool> stopping{false};
+	std::thread worker;
+
+	// дальше - только поток наблюдения
+	folder_snapshot known; ///< что библиотека знает о папках
+	change_coalescer changes;
+
+	using clock = std::chrono::steady_clock;
+
+	static bool under(std::string_view path, std::string const &root) {
+		return path.size() > root.size() && path.compare(0, root.size(), root) == 0 &&
+			   (path[root.size()] == '/' || path[root.size()] == '\\' || root.back() == '/' || root.back() == '\\');
+	}
+
+	void reconcile() {
+		TRACE_SCOPE("folder watch: reconcile");
+		folder_snapshot now;
+		scan_audio_files_(roots, now);
+		diff_snapshots_(known, now, changes);
+		known.swap(now);
+	}
+
+	void publish() {
+		if (changes.empty()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			changes.take(ready);
+		}
+		if (on_ready) {
+			on_ready();
+		}
+	}
+
+	void file_written(std::string const &path) {
+		if (!is_audio_path_(path)) {
+			return;
+		}
+		file_stamp stamp;
+		if (!stamp_file_(path, stamp)) {
+			return;
+		}
+		auto it = known.find(path);
+		if (it == known.end()) {
+			known.emplace(path, stamp);
+			changes.added(path);
+		} else if (it->second != stamp) {
+			it->second = stamp;
+			changes.modified(path);
+		}
+	}
+
+	void file_gone(std::string const &path) {
+		if (known.erase(path)) {
+			changes.removed(path);
+		}
+	}
+
+	void file_moved(std::string const &from, std::string const &to) {
+		auto it = known.find(from);
+		if (it == known.end()) {
+			file_written(to); // неизвестный или не звуковой файл получил звуковое имя
+			return;
+		}
+		file_stamp stamp = it->second;
+		known.erase(it);
+		if (!is_audio_path_(to)) {
+			changes.removed(from);
+			return;
+		}
+		stamp_file_(to, stamp);
+		known[to] = stamp;
+		changes.moved(from, to);
+	}
+
+#ifdef __linux__
+	int inotify = -1;
+	int stop_pipe[2] = {-1, -1};
+	std::unordered_map<int, std::string> dirs; ///< дескриптор наблюдения -> папка
+
+	void watch_tree(std::string const &dir) {
+		std::uint32_t const mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+								   IN_DELETE_SELF | IN_ONLYDIR;
+		int wd = inotify_add_watch(inotify, dir.c_str(), mask);
+		if (wd >= 0) {
+			dirs[wd] = dir;
+		}
+		std::error_code error;
+		std::filesystem::recursive_directory_iterator it(
+				dir, std::filesystem::directory_options::skip_permission_denied, error), end;
+		for (; !error && it != end; it.increment(error)) {
+			if (it->is_directory(error) && !it->is_symlink(error)) {
+				wd = inotify_add_watch(inotify, it->path().c_str(), mask);
+				if (wd >= 0) {
+					dirs[wd] = it->path().string();
+				}
+			}
+		}
+	}
+
+	void run_inotify() {
+		struct move_half {
+			std::string from;
+			clock::time_point at;
+		};
+		std::unordered_map<std::uint32_t, move_half> moves; ///< IN_MOVED_FROM, ждущие пару по cookie
+		auto const move_wait = std::chrono::milliseconds(100);
+		bool rescan = false;
+		clock::time_point first{}, last{};
+		alignas(inotify_event) char buffer[64 * 1024];
+
+		for (auto const &root : roots) {
+			watch_tree(root);
+		}
+		reconcile(); // файлы, появившиеся, пока программа была закрыта
+		publish();
+		while (!stopping) {
+			auto now = clock::now();
+			auto wait = std::chrono::milliseconds(-1);
+			if (!changes.empty() || rescan || !moves.empty()) {
+				auto deadline = std::min(last + quiet, first + max_delay);
+				for (auto const &m : moves) {
+					deadline = std::min(deadline, m.second.at + move_wait);
+				}
+				wait = std::max(std::chrono::milliseconds(0),
+								std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+			}
+			pollfd fds[2] = {{inotify, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+			if (poll(fds, 2, static_cast<int>(wait.count())) > 0 && (fds[0].revents & POLLIN)) {
+				ssize_t length = read(inotify, buffer, sizeof(buffer));
+				now = clock::now();
+				if (length > 0 && changes.empty() && !rescan && moves.empty()) {
+					first = now;
+				}
+				for (char *p = buffer; length > 0 && p < buffer + length;) {
+					auto const *event = reinterpret_cast<inotify_event const *>(p);
+					p += sizeof(inotify_event) + event->len;
+					last = now;
+					if (event->mask & IN_Q_OVERFLOW) {
+						rescan = true;
+						std::lock_guard<std::mutex> guard(lock);
+						++overflow_count;
+						continue;
+					}
+					if (event->mask & IN_IGNORED) {
+						dirs.erase(event->wd);
+						continue;
+					}
+					auto dir = dirs.find(event->wd);
+					if (dir == dirs.end() || event->len == 0) {
+						continue;
+					}
+					std::string path = dir->second + '/' + event->name;
+					if (event->mask & IN_ISDIR) {
+						if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+							watch_tree(path);
+						}
+						rescan = true; // файлы целой папки: сверка найдёт и новые, и переименованные
+						continue;
+					}
+					if (event->mask & IN_CLOSE_WRITE) {
+						file_written(path);
+					} else if (event->mask & IN_DELETE) {
+						file_gone(path);
+					} else if (event->mask & IN_MOVED_FROM) {
+						moves[event->cookie] = {path, now};
+					} else if (event->mask & IN_MOVED_TO) {
+						auto half = moves.find(event->cookie);
+						if (half != moves.end()) {
+							file_moved(half->second.from, path);
+							moves.erase(half);
+						} else {
+							file_written(path); // перенесли снаружи
+						}
+					}
+				}
+			}
+			now = clock::now();
+			for (auto it = moves.begin(); it != moves.end();) {
+				if (now - it->second.at >= move_wait) { // пары нет - файл унесли из следящих папок
+					file_gone(it->second.from);
+					it = moves.erase(it);
+				} else {
+					++it;
+				}
+			}
+			if ((!changes.empty() || rescan) && (now - last >= quiet || now - first >= max_delay)) {
+				if (rescan) {
+					rescan = false;
+					reconcile();
+				}
+				publish();
+			}
+		}
+	}
+#endif
+
+	void run_polling() {
+		reconcile();
+		publish();
+		while (!stopping) {
+			auto wake_at = clock::now() + poll_interval;
+			while (!stopping && clock::now() < wake_at) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+			if (!stopping) {
+				reconcile();
+				publish();
+			}
+		}
+	}
+
+	void run() {
+#ifdef SOUND_TRACE
+		trace_thread_name_("folder watch");
+#endif
+#ifdef __linux__
+		if (inotify >= 0) {
+			run_inotify();
+			return;
+		}
+#endif
+		run_polling();
+	}
+
+public:
+	/**
+	 * @param folders - папки, за которыми следить, вместе с подпапками
+	 * @param library_paths - файлы, которые уже есть в библиотеке: их не надо добавлять заново,
+	 *                        а пропавшие из них придут как removed; файлы вне folders не учитываются
+	 * @param quiet - сколько ждать тишины перед отдачей пачки
+	 * @param max_delay - дольше этого пачка не копится, даже если события идут без перерыва
+	 * @param ready - зовётся из потока наблюдения, когда пачка готова к take_changes; не должен ждать того,
+	 *                кто удаляет наблюдатель
+	 */
+	folder_watcher(std::vector<std::string> folders, std::vector<std::string> const &library_paths,
+				   std::chrono::milliseconds quiet = std::chrono::milliseconds(500),
+				   std::chrono::milliseconds max_delay = std::chrono::milliseconds(2000),
+				   std::function<void()> ready = {})
+			: roots(std::move(folders)), quiet(quiet), max_delay(max_delay), on_ready(std::move(ready)) {
+		for (auto const &path : library_paths) {
+			for (auto const &root : roots) {
+				if (under(path, root)) {
+					file_stamp stamp; // файл, которого уже нет, получит нулевой штамп и уйдёт в removed при сверке
+					stamp_file_(path, stamp);
+					known.emplace(path, stamp);
+					break;
+				}
+			}
+		}
+#ifdef __linux__
+		inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify >= 0 && pipe(stop_pipe) != 0) {
+			close(inotify);
+			inotify = -1;
+		}
+#endif
+		worker = std::thread(&folder_watcher::run, this);
+	}
+
+	~folder_watcher() {
+		stopping = true;
+#ifdef __linux__
+		if (stop_pipe[1] >= 0) {
+			char byte = 0;
+			(void) !write(stop_pipe[1], &byte, 1);
+		}
+#endif
+		worker.join();
+#ifdef __linux__
+		if (inotify >= 0) {
+			close(inotify);
+			close(stop_pipe[0]);
+			close(stop_pipe[1]);
+		}
+#endif
+	}
+
+	folder_watcher(folder_watcher const &) = delete;
+	folder_watcher &operator=(folder_watcher const &) = delete;
+
+	std::vector<std::string> const &folders() const { return roots; }
+
+	/**
+	 * \brief забирает накопленные изменения
+	 * @return false, если нового ничего нет
+	 */
+	bool take_changes(std::vector<folder_change> &out) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (ready.empty()) {
+			return false;
+		}
+		out.swap(ready);
+		ready.clear();
+		return true;
+	}
+
+	/// сколько раз переполнялась очередь inotify и пришлось сверять папки целиком
+	std::size_t overflows() {
+		std::lock_guard<std::mutex> guard(lock);
+		return overflow_count;
+	}
+};
+
+#endif //SOUND_FOLDER_WATCH_HPP
@@ -0,0 +1,255 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_GOLDEN_AUDIO_HPP
+#define SOUND_GOLDEN_AUDIO_HPP
+
+#include "fmod.hpp"
+#include "offline_render.hpp"
+#include "dsp_graph.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/**
+ * \brief сигнал в памяти: interleaved float
+ */
+struct audio_buffer {
+	std::vector<float> samples;
+	int rate = 48000;
+	int channels = 2;
+
+	double seconds() const { return channels && rate ? double(samples.size()) / channels / rate : 0; }
+};
+
+/**
+ * \brief логарифмический свип от f0 до f1 Гц, одинаковый во всех каналах
+ */
+inline audio_buffer make_sweep_(double seconds, double f0 = 20, double f1 = 20000, int rate = 48000,
+								int channels = 2) {
+	audio_buffer out{{}, rate, channels};
+	auto frames = static_cast<std::size_t>(seconds * rate);
+	double k = std::log(f1 / f0);
+	out.samples.reserve(frames * channels);
+	for (std::size_t i = 0; i < frames; ++i) {
+		double t = double(i) / rate;
+		double phase = 2 * 3.14159265358979 * f0 * seconds / k * (std::exp(t / seconds * k) - 1);
+		float v = static_cast<float>(0.5 * std::sin(phase));
+		out.samples.insert(out.samples.end(), channels, v);
+	}
+	return out;
+}
+
+/**
+ * \brief одиночные импульсы с периодом period секунд
+ */
+inline audio_buffer make_impulses_(double seconds, double period = 0.5, int rate = 48000, int channels = 2) {
+	audio_buffer out{std::vector<float>(static_cast<std::size_t>(seconds * rate) * channels), rate, channels};
+	auto step = static_cast<std::size_t>(period * rate) * channels;
+	for (std::size_t i = 0; i < out.samples.size(); i += step) {
+		for (int c = 0; c < channels; ++c) {
+			out.samples[i + c] = 0.9f;
+		}
+	}
+	return out;
+}
+
+/**
+ * \brief белый шум с фиксированным зерном, чтобы эталон не зависел от запуска
+ */
+inline audio_buffer make_noise_(double seconds, std::uint32_t seed = 12345, int rate = 48000, int channels = 2) {
+	audio_buffer out{std::vector<float>(static_cast<std::size_t>(seconds * rate) * channels), rate, channels};
+	for (float &v : out.samples) {
+		seed = seed * 1664525u + 1013904223u;
+		v = static_cast<float>((seed >> 8) / double(1u << 24) - 0.5) * 0.5f;
+	}
+	return out;
+}
+
+/**
+ * \brief создаёт звук FMOD из сигнала в памяти
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT create_sound_from_buffer_(FMOD::System *system, audio_buffer const &buffer,
+											 FMOD::Sound *&sound) {
+	FMOD_CREATESOUNDEXINFO exinfo;
+	std::memset(&exinfo, 0, sizeof(exinfo));
+	exinfo.cbsize = sizeof(exinfo);
+	exinfo.length = static_cast<unsigned int>(buffer.samples.size() * sizeof(float));
+	exinfo.numchannels = buffer.channels;
+	exinfo.defaultfrequency = buffer.rate;
+	exinfo.format = FMOD_SOUND_FORMAT_PCMFLOAT;
+	FMOD_RESULT result = system->createSound(nullptr, FMOD_OPENUSER | FMOD_CREATESAMPLE | FMOD_LOOP_OFF, &exinfo,
+											 &sound);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	void *ptr1 = nullptr, *ptr2 = nullptr;
+	unsigned int len1 = 0, len2 = 0;
+	result = sound->lock(0, exinfo.length, &ptr1, &ptr2, &len1, &len2);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	std::memcpy(ptr1, buffer.samples.data(), len1);
+	return sound->unlock(ptr1, ptr2, len1, len2);
+}
+
+/**
+ * \brief процессорное время вызывающего потока, с
+ * В отличие от настенных часов не растёт, пока поток ждёт процессор, поэтому бюджеты не зависят от соседей по машине.
+ */
+inline double thread_cpu_seconds_() {
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) {
+		return 0;
+	}
+	auto ticks = [](FILETIME const &t) { return (static_cast<unsigned long long>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+	return (ticks(kernel) + ticks(user)) * 1e-7; // FILETIME считает по 100 нс
+#else
+	timespec now{};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+/**
+ * \brief результат офлайн-рендера
+ */
+struct render_result {
+	audio_buffer audio;
+	double render_seconds = 0; ///< сколько заняло микширование по настенным часам, без создания системы и звука
+	double cpu_seconds = 0;    ///< процессорное время микширования: NRT-система микширует в update вызывающего потока
+};
+
+/**
+ * \brief проигрывает сигнал через цепочку эффектов на NRT-системе и возвращает то, что вышло из мастер-группы
+ * @param tail - сколько секунд микшировать после конца сигнала (хвосты эха)
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT render_through_chain_(audio_buffer const &input, effect_chain const &chain, render_result &out,
+										 double tail = 0.5, int rate = 48000, int channels = 2) {
+	FMOD::System *system = nullptr;
+	FMOD_RESULT result = create_nrt_system_(system, {rate, channels});
+	if (result != FMOD_OK) {
+		return result;
+	}
+	FMOD::ChannelGroup *master = nullptr;
+	system->getMasterChannelGroup(&master);
+	render_capture capture;
+	FMOD::DSP *tap = nullptr;
+	FMOD::Sound *sound = nullptr;
+	FMOD::Channel *channel = nullptr;
+	{
+		dsp_graph graph(system, master);
+		result = graph.apply(chain);
+		if (result == FMOD_OK) {
+			result = capture.attach(system, master, tap);
+		}
+		if (result == FMOD_OK) {
+			result = create_sound_from_buffer_(system, input, sound);
+		}
+		if (result == FMOD_OK) {
+			result = system->playSound(sound, master, false, &channel);
+		}
+		if (result == FMOD_OK) {
+			unsigned int block = 0;
+			system->getDSPBufferSize(&block, nullptr);
+			auto tail_blocks = static_cast<int>(tail * rate / (block ? block : 1024)) + 1;
+			auto begin = std::chrono::steady_clock::now();
+			double cpu_begin = thread_cpu_seconds_();
+			bool playing = true;
+			while (playing) {
+				system->update();
+				if (channel->isPlaying(&playing) != FMOD_OK) {
+					playing = false;
+				}
+			}
+			for (int i = 0; i < tail_blocks; ++i) {
+				system->update();
+			}
+			out.render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			out.cpu_seconds = thread_cpu_seconds_() - cpu_begin;
+			out.audio.samples = capture.data();
+			out.audio.rate = rate;
+			out.audio.channels = capture.num_channels();
+		}
+		if (tap) {
+			master->removeDSP(tap);
+			tap->release();
+		}
+		if (sound) {
+			sound->release();
+		}
+	}
+	system->close();
+	system->release();
+	return result;
+}
+
+/**
+ * \brief отношение сигнал/ошибка в дБ; более короткий сигнал дополняется тишиной
+ * @return +inf при полном совпадении
+ */
+inline double snr_db_(std::vector<float> const &reference, std::vector<float> const &actual) {
+	double signal = 0, noise = 0;
+	std::size_t n = std::max(reference.size(), actual.size());
+	for (std::size_t i = 0; i < n; ++i) {
+		double r = i < reference.size() ? reference[i] : 0.0;
+		double a = i < actual.size() ? actual[i] : 0.0;
+		signal += r * r;
+		noise += (r - a) * (r - a);
+	}
+	if (noise == 0) {
+		return std::numeric_limits<double>::infinity();
+	}
+	return 10 * std::log10((signal > 0 ? signal : 1e-30) / noise);
+}
+
+static char const golden_magic[4] = {'S', 'G', 'L', 'D'};
+
+/**
+ * \brief сохраняет эталон: "SGLD", частота, каналы, число сэмплов (uint32), затем float
+ */
+inline bool write_golden_(std::string const &path, audio_buffer const &audio) {
+	std::ofstream out(path, std::ios::binary);
+	std::uint32_t header[3] = {std::uint32_t(audio.rate), std::uint32_t(audio.channels),
+							   std::uint32_t(audio.samples.size())};
+	out.write(golden_magic, 4);
+	out.write(reinterpret_cast<char const *>(header), sizeof(header));
+	out.write(reinterpret_cast<char const *>(audio.samples.data()), audio.samples.size() * sizeof(float));
+	return bool(out);
+}
+
+/**
+ * \brief читает эталон, записанный write_golden_
+ * @return false, если файла нет или он повреждён
+ */
+inline bool read_golden_(std::string const &path, audio_buffer &audio) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[4] = {};
+	std::uint32_t header[3] = {};
+	if (!in.read(magic, 4) || std::memcmp(magic, golden_magic, 4) != 0 ||
+		!in.read(reinterpret_cast<char *>(header), sizeof(header))) {
+		return false;
+	}
+	audio.rate = static_cast<int>(header[0]);
+	audio.channels = static_cast<int>(header[1]);
+	audio.samples.resize(header[2]);
+	return bool(in.read(reinterpret_cast<char *>(audio.samples.data()), audio.samples.size() * sizeof(float)));
+}
+
+#endif //SOUND_GOLDEN_AUDIO_HPP
@@ -0,0 +1,132 @@
+#define CATCH_CONFIG_RUNNER
+
+#include "catch.hpp"
+#include "golden_audio.hpp"
+#include <cstdlib>
+#include <filesystem>
+#include <fmod.hpp>
+#include <fmod_dsp_effects.h>
+#include "common.h"
+
+/*
+ * Регрессия звука и производительности цепочки эффектов.
+ * Каждый сигнал рендерится офлайн через все 16 состояний окна эквалайзера (срез НЧ/ВЧ, эхо, флэнжер)
+ * и сравнивается с эталоном из SOUND_GOLDEN_DIR (по умолчанию golden/).
+ * SOUND_GOLDEN_RECORD=1 перезаписывает эталоны, SOUND_BUDGET_SCALE растягивает бюджеты на медленных машинах.
+ * Бюджеты проверяются всегда; если эталона сценария нет, пропускается только сравнение звука, с предупреждением.
+ * Бюджет проверяется по процессорному времени потока, а не по настенным часам: на общей машине CI поток
+ * может подолгу ждать процессор, и тест падал бы не из-за эффектов.
+ */
+
+FMOD::System *golden_system;
+
+double const golden_min_snr_db = 60;
+
+/// бюджет рендера в долях длительности сигнала: база плюс надбавка за каждый включённый эффект
+double const budget_base = 0.02;
+double const budget_per_effect = 0.01;
+
+static char const *env_or_(char const *name, char const *fallback) {
+	char const *value = std::getenv(name);
+	return value && *value ? value : fallback;
+}
+
+/// состояние окна эквалайзера: бит 0 - срез ВЧ (lowpass), 1 - срез НЧ (highpass), 2 - эхо, 3 - флэнжер
+static effect_chain equalizer_chain_(unsigned mask) {
+	effect_chain chain = {{FMOD_DSP_TYPE_LOWPASS}, {FMOD_DSP_TYPE_HIGHPASS}, {FMOD_DSP_TYPE_ECHO}, {FMOD_DSP_TYPE_FLANGE}};
+	set_effect_param_(chain[0], FMOD_DSP_LOWPASS_CUTOFF, 3400);
+	set_effect_param_(chain[1], FMOD_DSP_HIGHPASS_CUTOFF, 300);
+	for (std::size_t i = 0; i < chain.size(); ++i) {
+		chain[i].enabled = (mask >> i) & 1u;
+	}
+	return chain;
+}
+
+static std::string equalizer_name_(unsigned mask) {
+	static char const *names[] = {"lowpass", "highpass", "echo", "flange"};
+	std::string name;
+	for (unsigned i = 0; i < 4; ++i) {
+		if ((mask >> i) & 1u) {
+			name += (name.empty() ? "" : "+") + std::string(names[i]);
+		}
+	}
+	return name.empty() ? "flat" : name;
+}
+
+static void check_all_equalizer_states_(char const *signal_name, audio_buffer const &signal) {
+	std::filesystem::path dir = env_or_("SOUND_GOLDEN_DIR", "golden");
+	bool record = std::getenv("SOUND_GOLDEN_RECORD") != nullptr;
+	double budget_scale = std::atof(env_or_("SOUND_BUDGET_SCALE", "1"));
+	if (record) {
+		std::filesystem::create_directories(dir);
+	}
+
+	for (unsigned mask = 0; mask < 16; ++mask) {
+		std::string scenario = std::string(signal_name) + "_" + equalizer_name_(mask);
+		INFO("scenario " << scenario);
+		render_result rendered;
+		REQUIRE(render_through_chain_(signal, equalizer_chain_(mask), rendered) == FMOD_OK);
+
+		int effects = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			effects += (mask >> i) & 1u;
+		}
+		double budget = signal.seconds() * (budget_base + budget_per_effect * effects) * budget_scale;
+		INFO("render took " << rendered.cpu_seconds * 1000 << " ms of CPU (" << rendered.render_seconds * 1000
+							 << " ms wall), budget " << budget * 1000 << " ms");
+		CHECK(rendered.cpu_seconds <= budget);
+
+		std::string path = (dir / (scenario + ".gold")).string();
+		if (record) {
+			REQUIRE(write_golden_(path, rendered.audio));
+			continue;
+		}
+		if (!std::filesystem::exists(path)) {
+			WARN("no golden file " << path << ", SNR is not checked (record with SOUND_GOLDEN_RECORD=1)");
+			continue;
+		}
+		audio_buffer golden;
+		INFO("golden file " << path);
+		REQUIRE(read_golden_(path, golden));
+		CHECK(golden.rate == rendered.audio.rate);
+		CHECK(golden.channels == rendered.audio.channels);
+		double snr = snr_db_(golden.samples, rendered.audio.samples);
+		INFO("SNR " << snr << " dB");
+		CHECK(snr >= golden_min_snr_db);
+	}
+}
+
+TEST_CASE("golden: meow.mp3") {
+	audio_buffer meow;
+	source_format format;
+	REQUIRE(decode_to_float_(golden_system, Common_MediaPath("meow.mp3"), meow.samples, format) == FMOD_OK);
+	meow.rate = format.rate;
+	meow.channels = format.channels;
+	check_all_equalizer_states_("meow", meow);
+}
+
+TEST_CASE("golden: sweep") {
+	check_all_equalizer_states_("sweep", make_sweep_(3));
+}
+
+TEST_CASE("golden: impulses") {
+	check_all_equalizer_states_("impulses", make_impulses_(2));
+}
+
+TEST_CASE("golden: noise") {
+	check_all_equalizer_states_("noise", make_noise_(2));
+}
+
+int FMOD_Main(int argc, char **argv) {
+	void *extradriverdata = 0;
+	Common_Init(&extradriverdata);
+
+	create_nrt_system_(golden_system);
+	int result = Catch::Session().run(argc, argv);
+
+	golden_system->close();
+	golden_system->release();
+
+	Common_Close();
+	return result;
+}
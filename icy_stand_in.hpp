@@ -0,0 +1,162 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ * Локальная замена радиосервера для тестов и замеров net_stream: отдаёт поток в темпе эфира,
+ * со вставкой метаданных ICY, задержкой ответа, обрывами и рывками.
+ */
+
+#ifndef SOUND_ICY_STAND_IN_HPP
+#define SOUND_ICY_STAND_IN_HPP
+
+#include "socket_compat.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief поведение подставного сервера
+ */
+struct icy_stand_in_options {
+	std::vector<char> body;              ///< звук, повторяется по кругу
+	std::size_t bytes_per_second = 16000; ///< темп эфира (128 кбит/с)
+	std::size_t burst_bytes = 64 * 1024;  ///< сколько уже сыгранного отдать сразу при подключении, как делает Icecast
+	std::size_t metaint = 0;              ///< 0 - без метаданных
+	std::string title = "Stand-in - Test Signal";
+	int header_delay_ms = 0;              ///< задержка до ответа (медленный сервер или далёкий канал)
+	std::size_t drop_after = 0;           ///< оборвать соединение после стольких байт звука; 0 - не обрывать
+	int jitter_ms = 0;                    ///< случайная задержка отправки до стольких мс
+};
+
+/**
+ * \brief подставной Icecast на 127.0.0.1
+ * Эфир идёт независимо от слушателя: после переподключения отдаётся то, что звучит сейчас, минус burst_bytes.
+ */
+class icy_stand_in {
+	icy_stand_in_options options;
+	socket_handle listener = no_socket;
+	std::uint16_t bound_port = 0;
+	std::chrono::steady_clock::time_point on_air = std::chrono::steady_clock::now();
+	std::atomic<bool> stopping{false};
+	std::atomic<unsigned> served{0};
+	std::thread worker;
+
+	std::uint64_t live_position() const {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - on_air).count();
+		return static_cast<std::uint64_t>(seconds * options.bytes_per_second);
+	}
+
+	void serve(socket_handle client, std::mt19937 &random) {
+		char request[2048];
+		std::string head;
+		while (head.find("\r\n\r\n") == std::string::npos && !stopping) {
+			long got = receive_some_(client, request, sizeof(request), 100);
+			if (got == 0) {
+				return;
+			}
+			if (got > 0) {
+				head.append(request, static_cast<std::size_t>(got));
+			}
+		}
+		bool wants_meta = head.find("Icy-MetaData: 1") != std::string::npos && options.metaint > 0;
+		if (options.header_delay_ms > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(options.header_delay_ms));
+		}
+		std::string reply = "ICY 200 OK\r\nicy-name:Stand-in Radio\r\ncontent-type:audio/mpeg\r\n";
+		if (wants_meta) {
+			reply += "icy-metaint:" + std::to_string(options.metaint) + "\r\n";
+		}
+		reply += "\r\n";
+		if (!send_all_(client, reply.data(), reply.size())) {
+			return;
+		}
+		std::uint64_t live = live_position();
+		std::uint64_t position = live > options.burst_bytes ? live - options.burst_bytes : 0;
+		std::size_t sent = 0, until_meta = options.metaint;
+		std::uniform_int_distribution<int> jitter(0, std::max(options.jitter_ms, 0));
+		std::string chunk;
+		while (!stopping) {
+			std::uint64_t target = live_position();
+			if (options.drop_after > 0) {
+				target = std::min<std::uint64_t>(target, position + (options.drop_after - sent));
+			}
+			chunk.clear();
+			while (position < target) {
+				std::size_t take = static_cast<std::size_t>(target - position);
+				if (wants_meta) {
+					take = std::min(take, until_meta);
+				}
+				for (std::size_t i = 0; i < take; ++i) {
+					chunk.push_back(options.body[(position + i) % options.body.size()]);
+				}
+				position += take;
+				sent += take;
+				if (wants_meta && (until_meta -= take) == 0) {
+					std::string meta = "StreamTitle='" + options.title + "';";
+					meta.resize((meta.size() + 15) / 16 * 16, '\0');
+					chunk.push_back(static_cast<char>(meta.size() / 16));
+					chunk += meta;
+					until_meta = options.metaint;
+				}
+			}
+			if (!chunk.empty() && !send_all_(client, chunk.data(), chunk.size())) {
+				return;
+			}
+			if (options.drop_after > 0 && sent >= options.drop_after) {
+				return; // обрыв посреди эфира
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20 + jitter(random)));
+		}
+	}
+
+	void run() {
+		std::mt19937 random(7);
+		while (!stopping) {
+			if (!wait_socket_(listener, 50)) {
+				continue;
+			}
+			socket_handle client = accept(listener, nullptr, nullptr);
+			if (client == no_socket) {
+				continue;
+			}
+			++served;
+			serve(client, random);
+			close_socket_(client);
+		}
+	}
+
+public:
+	explicit icy_stand_in(icy_stand_in_options opts) : options(std::move(opts)) {
+		if (options.body.empty()) {
+			options.body.assign(1, '\0');
+		}
+		listener = listen_local_(bound_port);
+		if (listener != no_socket) {
+			worker = std::thread(&icy_stand_in::run, this);
+		}
+	}
+
+	~icy_stand_in() {
+		stopping = true;
+		if (worker.joinable()) {
+			worker.join();
+		}
+		close_socket_(listener);
+	}
+
+	icy_stand_in(icy_stand_in const &) = delete;
+	icy_stand_in &operator=(icy_stand_in const &) = delete;
+
+	bool ready() const { return listener != no_socket; }
+
+	std::string url() const { return "http://127.0.0.1:" + std::to_string(bound_port) + "/stream"; }
+
+	/// сколько соединений обслужено
+	unsigned connections() const { return served; }
+};
+
+#endif //SOUND_ICY_STAND_IN_HPP
@@ -0,0 +1,227 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_LATENCY_PROFILE_HPP
+#define SOUND_LATENCY_PROFILE_HPP
+
+#include "fmod.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+/**
+ * \brief профили задержки вывода
+ */
+enum class latency_profile {
+	low,         ///< маленький буфер, быстрая реакция на кнопки, больше пробуждений микшера
+	balanced,    ///< значения FMOD по умолчанию
+	power_saving ///< большой буфер, микшер просыпается редко
+};
+
+/**
+ * \brief параметры, которые задаёт профиль до System::init
+ */
+struct latency_settings {
+	unsigned int buffer_length; ///< длина одного DSP-буфера в сэмплах
+	int num_buffers;            ///< количество буферов в кольце вывода
+	int sample_rate;            ///< частота программного микшера
+};
+
+inline latency_settings latency_settings_for_(latency_profile profile) {
+	switch (profile) {
+		case latency_profile::low:
+			return {256, 2, 48000};
+		case latency_profile::power_saving:
+			return {2048, 4, 48000};
+		case latency_profile::balanced:
+		default:
+			return {1024, 4, 48000};
+	}
+}
+
+/**
+ * \brief разбирает имя профиля: low, balanced, power_saving
+ */
+inline bool parse_latency_profile_(char const *str, latency_profile &profile) {
+	if (std::strcmp(str, "low") == 0) {
+		profile = latency_profile::low;
+	} else if (std::strcmp(str, "balanced") == 0) {
+		profile = latency_profile::balanced;
+	} else if (std::strcmp(str, "power_saving") == 0) {
+		profile = latency_profile::power_saving;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * \brief задаёт размер DSP-буфера и формат микшера; вызывать до System::init
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT apply_latency_profile_(FMOD::System *system, latency_profile profile) {
+	latency_settings settings = latency_settings_for_(profile);
+	FMOD_RESULT result = system->setDSPBufferSize(settings.buffer_length, settings.num_buffers);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	return system->setSoftwareFormat(settings.sample_rate, FMOD_SPEAKERMODE_DEFAULT, 0);
+}
+
+/**
+ * \brief распределение измеренных задержек, мс
+ */
+struct latency_report {
+	std::size_t count = 0;
+	double p50 = 0;
+	double p99 = 0;
+	double max = 0;
+};
+
+/**
+ * \brief замер задержки от команды в интерфейсе до изменения сигнала на выходе микшера
+ * Интерфейс вызывает mark() в момент нажатия, DSP-отвод в голове мастер-группы следит за RMS блоков
+ * и фиксирует время, когда громкость заметно изменилась (звук пропал или появился). К измеренному
+ * времени добавляется задержка кольца вывода, т.к. блок прозвучит только после его проигрывания.
+ * Отметка, за которой так и не последовало слышимое изменение, сбрасывается через stale_ms,
+ * иначе ей приписалось бы первое же изменение не от команды (конец трека, тишина в записи).
+ * Микшер пишет результаты без блокировок, читать их можно из любого потока.
+ */
+class latency_probe {
+	static constexpr std::size_t capacity = 4096;
+	static constexpr float silence = 1e-4f;
+
+	std::atomic<long long> marked_ns{0}; ///< 0 - замер не идёт
+	std::atomic<float> baseline{0};
+	std::atomic<float> last_rms{0};
+	std::atomic<std::size_t> count{0};
+	std::atomic<double> samples_ms[capacity] = {};
+	double output_ms = 0;
+	long long stale_ns;
+
+	static long long now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static FMOD_RESULT F_CALLBACK read_callback(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer,
+												unsigned int length, int inchannels, int *outchannels) {
+		void *userdata = nullptr;
+		static_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(&userdata);
+		std::memcpy(outbuffer, inbuffer, sizeof(float) * length * inchannels);
+		*outchannels = inchannels;
+		if (userdata) {
+			static_cast<latency_probe *>(userdata)->on_block(inbuffer, length * inchannels);
+		}
+		return FMOD_OK;
+	}
+
+	void on_block(float const *data, unsigned int n) {
+		double sum = 0;
+		for (unsigned int i = 0; i < n; ++i) {
+			sum += data[i] * data[i];
+		}
+		float rms = n ? static_cast<float>(std::sqrt(sum / n)) : 0.f;
+		last_rms.store(rms, std::memory_order_relaxed);
+
+		long long mark = marked_ns.load(std::memory_order_acquire);
+		if (mark == 0) {
+			return;
+		}
+		long long now = now_ns();
+		if (now - mark > stale_ns) {
+			marked_ns.compare_exchange_strong(mark, 0, std::memory_order_acq_rel); // новая отметка не трогается
+			return;
+		}
+		float base = baseline.load(std::memory_order_relaxed);
+		bool changed = base > silence ? rms < base * 0.1f : rms > silence;
+		if (!changed) {
+			return;
+		}
+		if (!marked_ns.compare_exchange_strong(mark, 0, std::memory_order_acq_rel)) {
+			return; // пока шёл блок, интерфейс поставил новую отметку: она ждёт своего изменения
+		}
+		std::size_t i = count.load(std::memory_order_relaxed);
+		samples_ms[i % capacity].store((now - mark) / 1e6 + output_ms, std::memory_order_relaxed);
+		count.store(i + 1, std::memory_order_release);
+	}
+
+public:
+	/**
+	 * @param stale_ms - через сколько отметка без слышимого изменения перестаёт ждать
+	 */
+	explicit latency_probe(int stale_ms = 1000) : stale_ns(stale_ms * 1000000LL) {}
+
+	/**
+	 * \brief создаёт DSP-отвод и ставит его в голову группы (после всех эффектов)
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT attach(FMOD::System *system, FMOD::ChannelGroup *group, FMOD::DSP *&dsp) {
+		FMOD_DSP_DESCRIPTION desc;
+		std::memset(&desc, 0, sizeof(desc));
+		std::strncpy(desc.name, "latency probe", sizeof(desc.name) - 1);
+		desc.version = 0x00010000;
+		desc.numinputbuffers = 1;
+		desc.numoutputbuffers = 1;
+		desc.read = read_callback;
+
+		int rate = 0;
+		unsigned int buffer_length = 0;
+		int num_buffers = 0;
+		system->getSoftwareFormat(&rate, nullptr, nullptr);
+		system->getDSPBufferSize(&buffer_length, &num_buffers);
+		output_ms = rate > 0 ? 1000.0 * buffer_length * num_buffers / rate : 0;
+
+		FMOD_RESULT result = system->createDSP(&desc, &dsp);
+		if (result != FMOD_OK) {
+			return result;
+		}
+		dsp->setUserData(this);
+		return group->addDSP(0, dsp);
+	}
+
+	/**
+	 * \brief отмечает момент команды; вызывать непосредственно перед изменением громкости/паузой
+	 */
+	void mark() {
+		baseline.store(last_rms.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		marked_ns.store(now_ns(), std::memory_order_release);
+	}
+
+	/// идёт ли сейчас замер
+	bool pending() const {
+		long long mark = marked_ns.load(std::memory_order_acquire);
+		return mark != 0 && now_ns() - mark <= stale_ns;
+	}
+
+	/// текущий RMS на выходе
+	float rms() const { return last_rms.load(std::memory_order_relaxed); }
+
+	/**
+	 * \brief p50/p99 по последним (до 4096) замерам
+	 */
+	latency_report report() const {
+		latency_report r;
+		std::size_t n = std::min(count.load(std::memory_order_acquire), capacity);
+		if (n == 0) {
+			return r;
+		}
+		std::vector<double> v(n);
+		for (std::size_t i = 0; i < n; ++i) {
+			v[i] = samples_ms[i].load(std::memory_order_relaxed);
+		}
+		std::sort(v.begin(), v.end());
+		r.count = n;
+		r.p50 = v[(n - 1) * 50 / 100];
+		r.p99 = v[(n - 1) * 99 / 100];
+		r.max = v.back();
+		return r;
+	}
+};
+
+#endif //SOUND_LATENCY_PROFILE_HPP
@@ -0,0 +1,279 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_LIBRARY_HPP
+#define SOUND_LIBRARY_HPP
+
+#include "fmod.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// номер трека в библиотеке; номера идут подряд с нуля
+using track_id = std::uint32_t;
+
+constexpr track_id no_track = ~track_id(0);
+
+/**
+ * \brief темп, сетка долей и тональность трека
+ */
+struct track_analysis {
+	float bpm = 0;            ///< 0 - трек ещё не разобран или ритма нет
+	float first_beat = 0;     ///< секунда первой доли; доли идут через 60 / bpm
+	int key = -1;             ///< тоника 0..11 (0 = C), -1 - не определена
+	bool minor = false;
+	float key_confidence = 0; ///< разница корреляций лучшей и второй тональности, 0..1
+
+	bool analyzed() const { return bpm > 0 || key >= 0; }
+};
+
+/// кадров CUE в секунде: позиции в CUE - это mm:ss:ff
+constexpr std::uint32_t cue_frames_per_second = 75;
+
+/**
+ * \brief часть файла, которая считается отдельным треком (трек CUE на образе альбома)
+ * Границы - в кадрах CUE, а не в миллисекундах: кадр 1/75 с - это целое число сэмплов при 44100 и 48000,
+ * поэтому в сэмплы граница переводится без округления. end == 0 - до конца файла.
+ */
+struct track_range {
+	std::uint32_t start = 0;
+	std::uint32_t end = 0;
+
+	bool whole() const { return start == 0 && end == 0; }
+
+	/// граница в сэмплах при частоте rate
+	static std::uint32_t to_pcm(std::uint32_t frames, float rate) {
+		return static_cast<std::uint32_t>(std::uint64_t(frames) * std::uint64_t(rate) / cue_frames_per_second);
+	}
+
+	static std::uint32_t to_ms(std::uint32_t frames) {
+		return static_cast<std::uint32_t>(std::uint64_t(frames) * 1000 / cue_frames_per_second);
+	}
+
+	/**
+	 * \brief длина трека
+	 * @param file_ms - длина всего файла
+	 */
+	std::uint32_t length_ms(std::uint32_t file_ms) const {
+		std::uint32_t last = end ? std::min(to_ms(end), file_ms) : file_ms;
+		return last > to_ms(start) ? last - to_ms(start) : 0;
+	}
+
+	/**
+	 * \brief позиция в файле для позиции в треке; за конец трека не выходит
+	 */
+	std::uint32_t seek_ms(std::uint32_t track_ms, std::uint32_t file_ms) const {
+		return to_ms(start) + std::min(track_ms, length_ms(file_ms));
+	}
+
+	/**
+	 * \brief позиция в треке для позиции в файле; до начала трека - 0
+	 */
+	std::uint32_t track_ms(std::uint32_t file_ms_position, std::uint32_t file_ms) const {
+		return std::min(file_ms_position > to_ms(start) ? file_ms_position - to_ms(start) : 0u, length_ms(file_ms));
+	}
+};
+
+/**
+ * \brief библиотека треков: все пути лежат в одном буфере, трек - это номер
+ * Плейлисты, очередь и история хранят только номера, поэтому миллион треков - это 4 МБ на список,
+ * а не миллион строк. Номер трека не меняется никогда: переименованный файл остаётся тем же треком,
+ * а удалённый с диска - помечается missing, чтобы номера в плейлистах и списке не поехали.
+ */
+class track_library {
+	std::vector<char> text;
+	std::vector<std::pair<std::uint32_t, std::uint32_t>> spans; ///< путь трека id - [first, second) в text
+	std::vector<track_analysis> analyses;
+	std::vector<bool> gone;
+	std::unordered_map<track_id, track_range> ranges; ///< только у треков-частей файла, их мало
+	std::unordered_multimap<std::size_t, track_id> by_path; ///< хэш пути -> номер; строки не дублируются
+
+	static std::size_t path_hash(std::string_view path) { return std::hash<std::string_view>()(path); }
+
+	void place(track_id id, std::string_view path) {
+		spans[id] = {static_cast<std::uint32_t>(text.size()), static_cast<std::uint32_t>(text.size() + path.size())};
+		text.insert(text.end(), path.begin(), path.end());
+		by_path.emplace(path_hash(path), id);
+	}
+
+public:
+	/**
+	 * \brief добавляет трек
+	 * @return номер нового трека
+	 */
+	track_id add(std::string_view path) {
+		auto id = static_cast<track_id>(spans.size());
+		spans.emplace_back();
+		analyses.emplace_back();
+		gone.push_back(false);
+		place(id, path);
+		return id;
+	}
+
+	/**
+	 * \brief добавляет трек, который занимает только часть файла; у одного файла таких треков может быть много,
+	 * find вернёт первый
+	 * @return номер нового трека
+	 */
+	track_id add(std::string_view path, track_range range) {
+		track_id id = add(path);
+		if (!range.whole()) {
+			ranges.emplace(id, range);
+		}
+		return id;
+	}
+
+	/// часть файла, которую играет трек; у обычного трека - whole()
+	track_range range(track_id id) const {
+		auto it = ranges.find(id);
+		return it == ranges.end() ? track_range() : it->second;
+	}
+
+	/// путь к треку; действителен до следующего add или rename
+	std::string_view path(track_id id) const {
+		return {text.data() + spans[id].first, spans[id].second - spans[id].first};
+	}
+
+	/**
+	 * \brief трек с таким путём
+	 * @return no_track, если такого нет
+	 */
+	track_id find(std::string_view path) const {
+		auto range = by_path.equal_range(path_hash(path));
+		for (auto it = range.first; it != range.second; ++it) {
+			if (this->path(it->second) == path) {
+				return it->second;
+			}
+		}
+		return no_track;
+	}
+
+	/**
+	 * \brief файл трека переехал; номер, анализ и место в плейлистах остаются
+	 */
+	void rename(track_id id, std::string_view path) {
+		auto range = by_path.equal_range(path_hash(this->path(id)));
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == id) {
+				by_path.erase(it);
+				break;
+			}
+		}
+		place(id, path); // старый путь остаётся мусором в text: переименования редки
+	}
+
+	/// файл трека пропал с диска (true) или снова появился (false)
+	void set_missing(track_id id, bool missing) { gone[id] = missing; }
+
+	bool missing(track_id id) const { return gone[id]; }
+
+	std::size_t size() const { return spans.size(); }
+
+	/**
+	 * \brief место под ещё tracks треков и bytes байт путей: импорт большого списка не перекладывает всё
+	 * по многу раз, пока растёт
+	 */
+	void reserve(std::size_t tracks, std::size_t bytes) {
+		spans.reserve(spans.size() + tracks);
+		analyses.reserve(analyses.size() + tracks);
+		gone.reserve(gone.size() + tracks);
+		by_path.reserve(by_path.size() + tracks);
+		text.reserve(text.size() + bytes);
+	}
+
+	track_analysis const &analysis(track_id id) const { return analyses[id]; }
+
+	void set_analysis(track_id id, track_analysis const &result) { analyses[id] = result; }
+
+	void clear() {
+		text.clear();
+		spans.clear();
+		analyses.clear();
+		gone.clear();
+		ranges.clear();
+		by_path.clear();
+	}
+};
+
+/**
+ * \brief теги трека, по которым работает поиск
+ */
+struct track_tags {
+	std::string title;
+	std::string artist;
+	std::string album;
+};
+
+/**
+ * \brief переводит строковый тег FMOD в UTF-8
+ */
+inline std::string tag_to_utf8_(FMOD_TAG const &tag) {
+	auto const *bytes = static_cast<unsigned char const *>(tag.data);
+	if (tag.datatype == FMOD_TAGDATATYPE_STRING || tag.datatype == FMOD_TAGDATATYPE_STRING_UTF8) {
+		std::string out(reinterpret_cast<char const *>(bytes), tag.datalen);
+		return out.substr(0, out.find('\0'));
+	}
+	if (tag.datatype != FMOD_TAGDATATYPE_STRING_UTF16 && tag.datatype != FMOD_TAGDATATYPE_STRING_UTF16BE) {
+		return {};
+	}
+	bool big_endian = tag.datatype == FMOD_TAGDATATYPE_STRING_UTF16BE;
+	std::string out;
+	for (unsigned int i = 0; i + 1 < tag.datalen; i += 2) {
+		unsigned c = big_endian ? (bytes[i] << 8) | bytes[i + 1] : bytes[i] | (bytes[i + 1] << 8);
+		if (c == 0) {
+			break;
+		}
+		if (c == 0xfeff) {
+			continue; // BOM
+		}
+		if (c < 0x80) {
+			out += static_cast<char>(c);
+		} else if (c < 0x800) {
+			out += static_cast<char>(0xc0 | (c >> 6));
+			out += static_cast<char>(0x80 | (c & 0x3f));
+		} else { // суррогатные пары в тегах почти не встречаются, символы вне BMP станут мусором, но не сломают строку
+			out += static_cast<char>(0xe0 | (c >> 12));
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+			out += static_cast<char>(0x80 | (c & 0x3f));
+		}
+	}
+	return out;
+}
+
+/**
+ * \brief читает название, исполнителя и альбом (ID3v1/v2, Vorbis, ASF) без декодирования звука
+ * @param system - система, в которой открывается файл
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT read_track_tags_(FMOD::System *system, char const *path, track_tags &tags) {
+	FMOD::Sound *sound = nullptr;
+	FMOD_RESULT result = system->createSound(path, FMOD_OPENONLY, 0, &sound);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	auto first_tag = [sound](std::initializer_list<char const *> names) {
+		for (char const *name : names) {
+			FMOD_TAG tag;
+			if (sound->getTag(name, 0, &tag) == FMOD_OK) {
+				std::string value = tag_to_utf8_(tag);
+				if (!value.empty()) {
+					return value;
+				}
+			}
+		}
+		return std::string();
+	};
+	tags.title = first_tag({"TIT2", "TITLE", "Title", "TT2"});
+	tags.artist = first_tag({"TPE1", "ARTIST", "Author", "TP1"});
+	tags.album = first_tag({"TALB", "ALBUM", "WM/AlbumTitle", "TAL"});
+	return sound->release();
+}
+
+#endif //SOUND_LIBRARY_HPP
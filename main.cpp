@@ -2,15 +2,50 @@
  * \file
  * \author Lukashov Sergey, Belousov Dmitry, Kosmachev Alexey
  */
+#include "net_stream.hpp" // winsock2.h раньше windows.h из common.h
+#include "control_server.hpp"
 #include "fmod.hpp"
 #include "common.h"
 #include <exception>
 #include <algorithm>
 #include <fmod_dsp_effects.h>
 #include <string>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 #include "fmod_functions.hpp"
+#include "thread_config.hpp"
+#include "latency_profile.hpp"
+#include "passthrough.hpp"
+#include "dsp_graph.hpp"
+#include "time_stretch.hpp"
+#include "perf_monitor.hpp"
+#include "trace.hpp"
+#include "library.hpp"
+#include "playlist.hpp"
+#include "search_index.hpp"
+#include "analysis_cache.hpp"
+#include "fingerprint.hpp"
+#include "music_analysis.hpp"
+#include "folder_watch.hpp"
+#include "album_art.hpp"
+#include "deck_mixer.hpp"
+#include "zones.hpp"
+#include "playback_events.hpp"
+#include "startup.hpp"
+#include "playlist_import.hpp"
+#include "similarity.hpp"
+#include "scrub_cache.hpp"
 
 #include "nana/gui/detail/general_events.hpp"
+#include <nana/gui/detail/internal_scope_guard.hpp>
 #include <nana/gui.hpp>
 #include <nana/gui/widgets/button.hpp>
 #include <nana/paint/image.hpp>
@@ -29,6 +64,8 @@
 #include <nana/gui/widgets/label.hpp>
 #include <nana/gui/widgets/spinbox.hpp>
 #include <nana/gui/widgets/textbox.hpp>
+#include <nana/gui/widgets/combox.hpp>
+#include <nana/gui/widgets/picture.hpp>
 
 
 FMOD::System *system1;
@@ -36,10 +73,97 @@ FMOD::ChannelControl *chanel_control1 = 0;
 FMOD::Sound *sound1;
 FMOD::ChannelGroup *mastergroup = 0;
 FMOD::Channel *channel1 = 0;
-FMOD::DSP *highpass_dsp = 0;
-FMOD::DSP *lowpass_dsp = 0;
-FMOD::DSP *echo_dsp = 0;
-FMOD::DSP *flange_dsp = 0;
+FMOD::DSP *probe_dsp = 0;
+FMOD::DSP *stretch_dsp = 0;
+float speed1 = 1.0f; ///< скорость воспроизведения без изменения тона
+
+/// эффекты мастер-группы в порядке прохождения сигнала
+enum {
+	fx_lowpass, fx_highpass, fx_echo, fx_flange
+};
+effect_chain chain1 = {{FMOD_DSP_TYPE_LOWPASS}, {FMOD_DSP_TYPE_HIGHPASS}, {FMOD_DSP_TYPE_ECHO}, {FMOD_DSP_TYPE_FLANGE}};
+std::unique_ptr<dsp_graph> effects1;
+latency_probe latency1;
+void *extradriverdata1 = 0;
+latency_profile profile1 = latency_profile::balanced;
+bool passthrough1 = false;
+source_format format1; ///< формат, с которым открыт микшер; rate == 0 - формат из профиля
+std::string track1; ///< путь к играющему треку, нужен для перезапуска системы
+track_range range1; ///< часть файла track1, которую играет трек; у трека CUE - не весь файл
+std::unique_ptr<perf_monitor> perf1;
+bool profiling1 = false; ///< FMOD_INIT_PROFILE_ENABLE: без него FMOD не считает стоимость отдельных DSP
+std::chrono::milliseconds perf_interval1{250};
+bool perf_overlay1 = false; ///< оверлей производительности открыт: поток замеров нужен и без --perf
+std::string perf_export1; ///< файл выгрузки замеров, пустая строка - без выгрузки
+std::string trace_file1 = "sound_trace.json"; ///< куда сохранять трассу по запросу и при падении
+track_library library1;
+playlist playlist1; ///< треки добавляются в library1 и playlist1 вместе, поэтому номер трека = его место в списке
+FMOD::System *tags_system1 = 0; ///< отдельная система без вывода для чтения тегов в потоке поиска
+std::unique_ptr<search_worker> search1;
+std::string cache_file1 = "sound_analysis.cache"; ///< общее хранилище результатов анализа, пустая строка - без него
+std::size_t cache_limit1 = 256u << 20;
+std::unique_ptr<analysis_cache> cache1;
+std::unique_ptr<art_loader> art1; ///< обложки; миниатюры лежат в cache1
+std::atomic<bool> playback_stressed1{false}; ///< perf1 поднимает его, когда воспроизведению не хватает ресурсов
+std::unique_ptr<library_analyzer> analyzer1; ///< темп и тональность в фоне, результаты уходят в library1
+std::unique_ptr<duplicate_scan> duplicates1; ///< идущий поиск дубликатов
+std::vector<track_id> duplicate_ids1; ///< номер файла в duplicates1 -> трек library1
+std::vector<std::string> watch_folders1; ///< папки, новые файлы из которых сами попадают в библиотеку
+std::unique_ptr<folder_watcher> watcher1;
+net_stream_options net_options1;
+std::unique_ptr<net_stream> net1; ///< интернет-радио; его звук - stream_sound1, а не sound1
+FMOD::Sound *stream_sound1 = nullptr; ///< открывается с FMOD_NONBLOCKING, играет, когда автомат плеера увидит READY
+int deck_count1 = 2; ///< дека 0 - основной плеер (channel1, плейлист), остальные - для сведения поверх него
+int real_voices1 = 64;  ///< сколько голосов реально микшируется
+int max_voices1 = 1024; ///< сколько голосов может играть всего; тихие и наименее важные становятся виртуальными
+bool split_cue1 = false;
+std::vector<bool> deck_cue1; ///< какие деки слушаются в наушниках; переживает перезапуск системы
+std::unique_ptr<deck_mixer> decks1;
+std::vector<FMOD::Sound *> deck_sounds1; ///< треки дек 1..n; у деки 0 это sound1
+std::vector<zone_options> zone_options1; ///< комнаты из --zone, у каждой своя система и свой выход
+std::vector<std::unique_ptr<zone>> zones1;
+/// замок плеера: channel1, sound1, next1, pending1, радио, позиция в playlist1 и сама система (её пересоздаёт restart_audio_)
+std::recursive_mutex player_lock1;
+std::unique_ptr<playback_machine> player1; ///< замечает конец трека и открытие звука; автопереход идёт из его потока
+startup_phases startup1; ///< отметки от запуска процесса; --startup-times печатает их
+bool startup_report1 = false;
+std::string session_file1 = "sound_session.bin"; ///< снимок сессии, пустая строка - без него
+std::shared_future<void> background_ready1; ///< система, теги и кэш анализа, которые поднимаются в фоне, готовы
+similarity_index similar1; ///< похожие треки; векторы кладёт analyzer1, пути узлов из файла связывает adopt
+std::string similar_file1 = "sound_similar.bin"; ///< файл индекса похожести, пустая строка - не хранить
+std::size_t similar_loaded1 = 0; ///< сколько узлов прочитано из файла: если новых нет, файл не переписывается
+bool endless1 = false; ///< бесконечное радио: когда очередь пуста, в неё встаёт трек, похожий на текущий
+std::deque<track_id> radio_recent1; ///< что радио уже ставило, чтобы не ходить по кругу из двух похожих
+scrub_cache_options scrub_options1; ///< окно кэша перемотки; оба окна нулевые - кэш выключен
+std::unique_ptr<scrub_stream> scrub1; ///< кэш перемотки трека основной деки; когда он есть, sound1 - его стрим
+scrub_counters scrub_stats1; ///< перемотки по всем трекам: доля попаданий в кэш и задержка
+std::string control_file1 = "sound_control.sock"; ///< сокет управления, пустая строка - без него
+int control_tick1 = 100; ///< как часто подписчики получают позицию, мс
+std::unique_ptr<control_server> control1;
+/// что окну пора посмотреть: биты для window_pump1
+enum window_news : unsigned {
+	window_control = 1u << 0, ///< команда из сокета поменяла плеер
+	window_watch = 1u << 1,   ///< наблюдение за папками отдало пачку
+};
+std::mutex window_follow_lock1;
+std::function<void(unsigned)> window_follow1; ///< окно показывает window_news; под window_follow_lock1
+/// отдаёт window_news окну из потоков сокета и наблюдения за папками; живёт дольше их обоих
+std::unique_ptr<event_pump> window_pump1;
+
+/// трек и позиция из снимка сессии: к ним плеер вернётся при первом play, а не при запуске
+struct resume_point {
+	track_id id = no_track;
+	unsigned position = 0;
+} resume1;
+
+/// следующий трек, открытый заранее с FMOD_NONBLOCKING
+struct preopened_track {
+	track_id id = no_track;
+	FMOD::Sound *sound = nullptr;
+} next1;
+
+/// трек плейлиста, отданный player1 ещё не открытым: его отпускает только on_sound_opened_ или drop_pending_
+preopened_track pending1;
 
 
 /**
@@ -52,6 +176,1038 @@ FMOD::DSP *flange_dsp = 0;
 using namespace nana;
 
 
+/**
+ * \brief отпускает заранее открытый трек
+ */
+void drop_preopened_() {
+	if (next1.sound) {
+		next1.sound->release();
+	}
+	next1 = {};
+}
+
+/**
+ * \brief отменяет ожидание трека, отданного player1 ещё не открытым, и отпускает его
+ */
+void drop_pending_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (!pending1.sound) {
+		return;
+	}
+	if (player1 && player1->awaiting() == pending1.sound) {
+		player1->open(nullptr); // поток плеера больше не спрашивает у него getOpenState
+	}
+	pending1.sound->release();
+	pending1 = {};
+}
+
+/**
+ * \brief сообщает автомату плеера, что channel1 заменён; вызывать после каждой замены канала
+ */
+void follow_channel_() {
+	if (control1) {
+		control1->wake(); // подписчики узнают о новом треке сразу
+	}
+	if (!player1) {
+		return;
+	}
+	float rate = 0;
+	unsigned int end = 0;
+	if (range1.end && sound1 && sound1->getDefaults(&rate, nullptr) == FMOD_OK) {
+		end = track_range::to_pcm(range1.end, rate);
+	}
+	player1->play(channel1, end);
+}
+
+/**
+ * \brief останавливает и отпускает интернет-радио
+ * Сначала net_stream::stop: иначе release ждал бы чтения, которое ждёт сеть.
+ */
+void drop_stream_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (!net1) {
+		return;
+	}
+	net1->stop();
+	if (stream_sound1) {
+		FMOD::Sound *current = nullptr;
+		if (channel1 && channel1->getCurrentSound(&current) == FMOD_OK && current == stream_sound1) {
+			channel1->stop();
+			channel1 = 0;
+			follow_channel_();
+		}
+		if (player1 && player1->awaiting() == stream_sound1) {
+			player1->open(nullptr); // поток плеера больше не спрашивает у стрима getOpenState
+		}
+		if (perf1) {
+			perf1->watch(sound1); // и поток замеров тоже
+		}
+		stream_sound1->release();
+	}
+	stream_sound1 = nullptr;
+	net1.reset();
+}
+
+/**
+ * \brief группа основной деки: туда играют треки плейлиста и радио
+ */
+FMOD::ChannelGroup *main_deck_() {
+	return decks1 && decks1->size() > 0 ? decks1->at(0).group() : nullptr;
+}
+
+/**
+ * \brief останавливает дополнительную деку и отпускает её трек
+ * @param index - 1..deck_count1-1
+ */
+void stop_deck_(std::size_t index) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (index >= deck_sounds1.size() || !deck_sounds1[index]) {
+		return;
+	}
+	decks1->at(index).stop();
+	deck_sounds1[index]->release();
+	deck_sounds1[index] = nullptr;
+}
+
+/**
+ * \brief ставит трек на дополнительную деку; играет вместе с основной, громкость и прослушка у деки свои
+ * @param index - 1..deck_count1-1
+ * @return FMOD_RESULT
+ */
+FMOD_RESULT play_on_deck_(std::size_t index, std::string const &path) {
+	TRACE_SCOPE("play_on_deck_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (!decks1 || index == 0 || index >= decks1->size()) {
+		return FMOD_ERR_INVALID_PARAM;
+	}
+	stop_deck_(index);
+	deck_sounds1.resize(decks1->size(), nullptr);
+	FMOD::Sound *sound = nullptr;
+	FMOD_RESULT result = system1->createSound(path.c_str(), FMOD_CREATESTREAM | FMOD_LOOP_OFF, 0, &sound);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	deck_sounds1[index] = sound;
+	FMOD::Channel *channel = nullptr;
+	return decks1->at(index).play(sound, channel);
+}
+
+/**
+ * \brief создаёт систему, мастер-группу, эффекты и открывает трек по умолчанию
+ * @param format - формат микшера для режима passthrough, rate == 0 - формат берётся из профиля задержки
+ * @return FMOD_RESULT
+ */
+FMOD_RESULT open_audio_(source_format const &format = {}) {
+	TRACE_SCOPE("open_audio_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	FMOD_RESULT result;
+	unsigned int version;
+	result = FMOD::System_Create(&system1);
+	ERRCHECK(result);
+	result = system1->getVersion(&version);
+	if (version < FMOD_VERSION) {
+		Common_Fatal("FMOD lib version %08x doesn't match header version %08x", version, FMOD_VERSION);
+	}
+	result = apply_latency_profile_(system1, profile1);
+	ERRCHECK(result);
+	if (format.rate > 0) {
+		result = apply_passthrough_format_(system1, format);
+		ERRCHECK(result);
+	}
+	format1 = format;
+	result = system1->setSoftwareChannels(real_voices1);
+	ERRCHECK(result);
+	FMOD_INITFLAGS flags = FMOD_INIT_NORMAL | FMOD_INIT_VOL0_BECOMES_VIRTUAL;
+	if (profiling1) {
+		flags |= FMOD_INIT_PROFILE_ENABLE | FMOD_INIT_PROFILE_METER_ALL;
+	}
+	result = system1->init(max_voices1, flags, extradriverdata1);
+	ERRCHECK(result);
+	result = system1->getMasterChannelGroup(&mastergroup);
+
+	result = system1->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM, 0, &sound1);
+	result = sound1->setMode(FMOD_LOOP_OFF);
+
+	ERRCHECK(result);
+	effects1.reset(new dsp_graph(system1, mastergroup));
+	result = effects1->apply(chain1);
+	ERRCHECK(result);
+	decks1.reset(new deck_mixer(system1, mastergroup)); // деки сводятся до эффектов мастера
+	result = decks1->create(deck_count1);
+	ERRCHECK(result);
+	result = decks1->set_split_cue(split_cue1);
+	ERRCHECK(result);
+	deck_cue1.resize(decks1->size(), false);
+	for (std::size_t i = 0; i < decks1->size(); ++i) {
+		decks1->at(i).set_cue(deck_cue1[i]);
+	}
+	result = create_time_stretch_dsp_(system1, stretch_dsp);
+	ERRCHECK(result);
+	result = latency1.attach(system1, mastergroup, probe_dsp);
+	ERRCHECK(result);
+	perf1.reset(new perf_monitor(system1, mastergroup));
+	perf1->watch(sound1);
+	perf1->report_stress(&playback_stressed1);
+	if (profiling1 || perf_overlay1) {
+		perf1->start(perf_interval1, perf_export1); // иначе поток замеров не будит процесс каждые 250 мс
+	}
+	if (player1) {
+		player1->attach(system1);
+	}
+	return result;
+}
+
+/**
+ * \brief запускает поток замеров, когда он нужен, и останавливает, когда перестал быть нужен
+ * Полные замеры - для --perf, --perf-export и открытого оверлея. Пока анализатору есть что разбирать, идёт хотя бы
+ * дешёвый сбор признаков нагрузки раз в полсекунды: без него playback_stressed1 не поднимается и анализ не уступает
+ * воспроизведению. Когда не нужно ни то ни другое, поток не будит процесс вовсе.
+ */
+void update_perf_monitor_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (!perf1) {
+		return;
+	}
+	if (profiling1 || perf_overlay1) {
+		if (!perf1->active() || perf1->stress_only_active()) {
+			perf1->start(perf_interval1, perf_export1);
+		}
+	} else if (analyzer1 && analyzer1->pending() > 0) {
+		if (!perf1->stress_only_active()) {
+			perf1->start_stress_only(std::chrono::milliseconds(500));
+		}
+	} else if (perf1->active()) {
+		perf1->stop();
+	}
+}
+
+/**
+ * \brief освобождает всё, что создал open_audio_
+ */
+void close_audio_() {
+	TRACE_SCOPE("close_audio_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	FMOD_RESULT result;
+	if (player1) {
+		player1->attach(nullptr); // поток плеера больше не зовёт update у закрываемой системы
+	}
+	perf1.reset(); // поток замеров останавливается раньше, чем освобождаются стрим и DSP
+	drop_preopened_();
+	drop_pending_();
+	drop_stream_();
+	result = mastergroup->removeDSP(probe_dsp);
+	ERRCHECK(result);
+	result = probe_dsp->release();
+	ERRCHECK(result);
+	probe_dsp = 0;
+	if (channel1 && find_time_stretch_(channel1) == stretch_dsp) {
+		channel1->removeDSP(stretch_dsp);
+	}
+	result = stretch_dsp->release();
+	ERRCHECK(result);
+	stretch_dsp = 0;
+	result = effects1->release(); // все эффекты одним обновлением графа
+	ERRCHECK(result);
+	effects1.reset();
+	for (std::size_t i = 1; i < deck_sounds1.size(); ++i) {
+		stop_deck_(i);
+	}
+	result = decks1->release();
+	ERRCHECK(result);
+	decks1.reset();
+
+	if (scrub1) {
+		scrub1.reset(); // sound1 принадлежит ему
+		sound1 = 0;
+	}
+	if (sound1) {
+		result = sound1->release(); //shut down
+	}
+	result = system1->close();
+	result = system1->release();
+	channel1 = 0;
+	sound1 = 0;
+	mastergroup = 0;
+}
+
+/**
+ * \brief применяет speed1 к текущему каналу; вызывать после каждого play_sound_, т.к. канал новый
+ */
+void apply_speed_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (channel1 && (speed1 != 1.0f || find_time_stretch_(channel1))) {
+		set_playback_speed_(channel1, stretch_dsp, speed1);
+	}
+}
+
+/**
+ * \brief начинает слушать интернет-радио; звук пойдёт, когда автомат плеера увидит, что стрим открыт
+ * Обрывы связи net_stream переживает сам, не трогая ни Sound, ни канал.
+ * @param url - http://...
+ * @return FMOD_RESULT
+ */
+FMOD_RESULT play_stream_(std::string const &url) {
+	TRACE_SCOPE("play_stream_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	drop_pending_();
+	drop_stream_();
+	if (channel1) {
+		channel1->stop();
+	}
+	track1 = url;
+	range1 = {};
+	net1.reset(new net_stream(url, net_options1));
+	FMOD_RESULT result = open_net_stream_(system1, *net1, stream_sound1, FMOD_NONBLOCKING);
+	if (result != FMOD_OK) {
+		drop_stream_();
+	} else if (player1) {
+		player1->open(stream_sound1);
+	}
+	return result;
+}
+
+/**
+ * \brief следит за радио; название песни берётся под тем же замком, потому что радио может отпустить и поток сокета
+ * @param news - новый заголовок окна: "станция - песня" или "Stream lost: ..."; пустая строка - ничего нового
+ * @return false, если радио нет: его выключили, оно не открылось или сервер пропал насовсем - тогда оно уже отпущено
+ */
+bool poll_stream_(std::string &news) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	news.clear();
+	if (!net1) {
+		return false;
+	}
+	FMOD_OPENSTATE state = FMOD_OPENSTATE_ERROR;
+	stream_sound1->getOpenState(&state, nullptr, nullptr, nullptr);
+	if (state == FMOD_OPENSTATE_ERROR || (net1->dead() && net1->buffered() == 0)) {
+		news = "Stream lost: " + track1;
+		drop_stream_();
+		return false;
+	}
+	std::string song;
+	if (net1->take_title(song)) {
+		std::string station = net1->station_name();
+		news = station.empty() ? song : station + " - " + song;
+	}
+	return true;
+}
+
+/**
+ * \brief включён ли кэш перемотки
+ */
+bool scrub_enabled_() {
+	return scrub_options1.back_seconds > 0 || scrub_options1.ahead_seconds > 0;
+}
+
+/**
+ * \brief открывает трек основной деки в sound1 и включает его в channel1
+ * С кэшем перемотки звук идёт из кольца декодированного PCM (scrub1); если кэш выключен или файл не читается в PCM,
+ * трек играет обычным стримом.
+ * @param opened - уже открытый звук этого трека или nullptr: с кэшем - декодер FMOD_OPENONLY, без него - стрим
+ * @param paused - канал стартует на паузе
+ */
+void open_main_track_(std::string const &path, FMOD::Sound *opened, bool paused) {
+	TRACE_SCOPE("open_main_track_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	// прошлый трек отпускается, когда perf1 уже следит за новым звуком; звук кэша принадлежит самому кэшу
+	FMOD::Sound *previous_sound = scrub1 ? nullptr : sound1;
+	std::unique_ptr<scrub_stream> previous = std::move(scrub1);
+	if (channel1) {
+		channel1->stop();
+	}
+	if (scrub_enabled_()) {
+		if (opened) {
+			scrub1.reset(new scrub_stream);
+			if (scrub1->open(system1, opened, scrub_options1, &scrub_stats1) != FMOD_OK) {
+				scrub1.reset(); // декодер отпущен вместе с ним, файл откроется обычным стримом
+			}
+			opened = nullptr;
+		} else {
+			open_scrub_stream_(system1, path.c_str(), scrub1, scrub_options1, &scrub_stats1);
+		}
+	}
+	if (scrub1) {
+		sound1 = scrub1->sound();
+		system1->playSound(sound1, main_deck_(), paused, &channel1);
+	} else if (opened) {
+		sound1 = opened;
+		sound1->setMode(FMOD_LOOP_OFF);
+		system1->playSound(sound1, main_deck_(), paused, &channel1);
+	} else {
+		play_sound_(system1, sound1, channel1, path.c_str(), main_deck_(), paused);
+	}
+	perf1->watch(sound1);
+	if (previous_sound && previous_sound != sound1) {
+		previous_sound->release(); // иначе каждый автопереход оставлял бы открытый стрим и файл
+	}
+}
+
+/**
+ * \brief пересоздаёт систему с новым форматом микшера, сохраняя эффекты и позицию трека
+ * System::setSoftwareFormat работает только до init, поэтому без перезапуска формат не поменять.
+ * @param format - формат микшера, rate == 0 - формат из профиля задержки
+ */
+void restart_audio_(source_format const &format) {
+	TRACE_SCOPE("restart_audio_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	bool playing = false, paused = false;
+	unsigned int position = 0;
+	if (channel1 && channel1->isPlaying(&playing) == FMOD_OK && playing) {
+		channel1->getPosition(&position, FMOD_TIMEUNIT_MS);
+		channel1->getPaused(&paused);
+	}
+	std::string radio = net1 ? net1->url() : std::string();
+
+	close_audio_();
+	open_audio_(format); // эффекты восстанавливаются из chain1
+	if (!radio.empty()) {
+		play_stream_(radio); // эфир не перематывается - просто подключаемся заново
+	} else if (playing && !track1.empty()) {
+		open_main_track_(track1, nullptr, false);
+		channel1->setPosition(position, FMOD_TIMEUNIT_MS);
+		apply_speed_();
+		channel1->setPaused(paused);
+		follow_channel_();
+		if (passthrough1) {
+			passthrough_channel_(channel1);
+		}
+	}
+}
+
+/**
+ * \brief включает/выключает passthrough: подстраивает формат микшера под трек
+ * Выключенных эффектов в графе нет и так (см. dsp_graph), поэтому трогать граф не нужно.
+ * @param enable - новое состояние режима
+ */
+void set_passthrough_(bool enable) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	passthrough1 = enable;
+	FMOD::Sound *current = sound1;
+	if (channel1) {
+		channel1->getCurrentSound(&current);
+	}
+	source_format format;
+	if (enable && get_source_format_(current, format) == FMOD_OK) {
+		if (!mixer_matches_source_(system1, format)) {
+			restart_audio_(format);
+		} else if (channel1) {
+			passthrough_channel_(channel1);
+		}
+	} else if (!enable && format1.rate > 0) {
+		restart_audio_({});
+	}
+}
+
+/**
+ * \brief переключает эффект; выключенный эффект убирается из графа совсем
+ * @param slot - номер эффекта в chain1
+ */
+void toggle_effect_(int slot) {
+	TRACE_SCOPE("toggle_effect_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	chain1[slot].enabled = !chain1[slot].enabled;
+	effects1->apply(chain1);
+}
+
+/**
+ * \brief готовые наборы эффектов для окна эквалайзера
+ */
+struct effect_preset {
+	char const *name;
+	effect_chain chain;
+};
+
+std::vector<effect_preset> make_effect_presets_() {
+	effect_chain flat = {{FMOD_DSP_TYPE_LOWPASS}, {FMOD_DSP_TYPE_HIGHPASS}, {FMOD_DSP_TYPE_ECHO}, {FMOD_DSP_TYPE_FLANGE}};
+	effect_chain telephone = flat;
+	telephone[fx_highpass].enabled = true;
+	set_effect_param_(telephone[fx_highpass], FMOD_DSP_HIGHPASS_CUTOFF, 300);
+	telephone[fx_lowpass].enabled = true;
+	set_effect_param_(telephone[fx_lowpass], FMOD_DSP_LOWPASS_CUTOFF, 3400);
+	effect_chain hall = flat;
+	hall[fx_echo].enabled = true;
+	set_effect_param_(hall[fx_echo], FMOD_DSP_ECHO_DELAY, 300);
+	set_effect_param_(hall[fx_echo], FMOD_DSP_ECHO_FEEDBACK, 40);
+	effect_chain jet = flat;
+	jet[fx_flange].enabled = true;
+	jet[fx_highpass].enabled = true;
+	set_effect_param_(jet[fx_highpass], FMOD_DSP_HIGHPASS_CUTOFF, 150);
+	return {{"Flat", flat}, {"Telephone", telephone}, {"Hall", hall}, {"Jet", jet}};
+}
+
+/**
+ * \brief сообщает окну новости из чужого потока; не ждёт ни окна, ни замков
+ * @param news - биты window_news
+ */
+void post_window_(unsigned news) {
+	if (window_pump1) {
+		window_pump1->post(news);
+	}
+}
+
+/**
+ * \brief перезапускает наблюдение за watch_folders1 с текущим содержимым библиотеки
+ * Файлы, которые уже есть в библиотеке, не придут как новые, а пропавшие, пока наблюдения не было, придут как removed.
+ * Готовую пачку окно забирает, когда наблюдатель его позовёт, а не опросом.
+ */
+void restart_watcher_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1); // окно забирает пачки под ним
+	watcher1.reset();
+	if (watch_folders1.empty()) {
+		return;
+	}
+	std::vector<std::string> known;
+	known.reserve(library1.size());
+	for (std::size_t i = 0; i < library1.size(); ++i) {
+		if (!library1.missing(static_cast<track_id>(i))) {
+			known.emplace_back(library1.path(static_cast<track_id>(i)));
+		}
+	}
+	watcher1.reset(new folder_watcher(watch_folders1, known, std::chrono::milliseconds(500),
+									  std::chrono::milliseconds(2000), [] { post_window_(window_watch); }));
+}
+
+/**
+ * \brief включает трек из списка; в режиме passthrough при другой частоте трека микшер перезапускается
+ * @param path - путь к треку
+ * @param opened - уже открытый стрим этого трека или nullptr
+ * @param range - часть файла, которую играет трек; канал стартует на паузе, чтобы не было слышно начала файла
+ */
+void play_track_(std::string const &path, FMOD::Sound *opened = nullptr, track_range range = {}) {
+	TRACE_SCOPE("play_track_");
+	drop_pending_();
+	drop_stream_();
+	resume1 = {};
+	track1 = path;
+	range1 = range;
+	open_main_track_(path, opened, !range.whole());
+	float rate = 0;
+	if (!range.whole() && channel1 && sound1 && sound1->getDefaults(&rate, nullptr) == FMOD_OK) {
+		channel1->setPosition(track_range::to_pcm(range.start, rate), FMOD_TIMEUNIT_PCM);
+		channel1->setPaused(false);
+	}
+	apply_speed_();
+	follow_channel_();
+	if (!passthrough1 || !channel1) {
+		return;
+	}
+	source_format format;
+	if (get_source_format_(sound1, format) == FMOD_OK && !mixer_matches_source_(system1, format)) {
+		restart_audio_(format);
+	} else {
+		passthrough_channel_(channel1);
+	}
+}
+
+/**
+ * \brief перематывает играющий трек; позиция - от начала трека, у трека CUE она переводится в позицию в файле
+ * и не выходит за его часть
+ * @param track_ms - позиция от начала трека
+ */
+void seek_track_(unsigned int track_ms) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	FMOD::Sound *sound = nullptr;
+	unsigned int length = 0;
+	if (!channel1 || net1 || channel1->getCurrentSound(&sound) != FMOD_OK || sound != sound1 ||
+		sound1->getLength(&length, FMOD_TIMEUNIT_MS) != FMOD_OK) {
+		return; // радио не перематывается
+	}
+	channel1->setPosition(range1.seek_ms(track_ms, length), FMOD_TIMEUNIT_MS);
+	reset_time_stretch_(channel1);
+}
+
+/**
+ * \brief ставит в очередь треки, похожие на seed
+ * @param count - сколько поставить
+ * @param skip_recent - не брать то, что радио ставило недавно
+ * @return сколько поставлено; 0 - трек ещё не разобран или похожих нет
+ */
+std::size_t enqueue_similar_(track_id seed, std::size_t count, bool skip_recent) {
+	TRACE_SCOPE("enqueue_similar_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	std::vector<std::pair<float, track_id>> found;
+	if (seed == no_track || !similar1.nearest(seed, count + (skip_recent ? radio_recent1.size() : 0), found)) {
+		return 0;
+	}
+	std::size_t queued = 0;
+	for (auto const &f : found) {
+		if (queued == count) {
+			break;
+		}
+		if (library1.missing(f.second) || (skip_recent && std::find(radio_recent1.begin(), radio_recent1.end(),
+																   f.second) != radio_recent1.end())) {
+			continue;
+		}
+		playlist1.enqueue(f.second);
+		radio_recent1.push_back(f.second);
+		if (radio_recent1.size() > 100) {
+			radio_recent1.pop_front();
+		}
+		++queued;
+	}
+	return queued;
+}
+
+/**
+ * \brief бесконечное радио: если очередь пуста, ставит в неё трек, похожий на текущий
+ * Вызывается при каждой смене трека, поэтому следующий известен заранее и preopen_next_ успевает его открыть.
+ */
+void feed_radio_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (endless1 && playlist1.queued() == 0 && !net1) {
+		enqueue_similar_(playlist1.current(), 1, true);
+	}
+}
+
+/**
+ * \brief открывает следующий трек плейлиста в фоне, чтобы "далее" не ждало диска
+ * Вызывать после каждого изменения плейлиста или текущего трека; если следующий не поменялся, ничего не делает.
+ */
+void preopen_next_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	track_id id = playlist1.peek_next();
+	if (id == next1.id) {
+		return;
+	}
+	drop_preopened_();
+	if (id == no_track) {
+		return;
+	}
+	TRACE_SCOPE("preopen_next_");
+	std::string path(library1.path(id));
+	// с кэшем перемотки заранее открывается декодер: кэш и стрим поверх него создаются мгновенно
+	FMOD_MODE mode = scrub_enabled_() ? FMOD_OPENONLY : FMOD_CREATESTREAM;
+	if (system1->createSound(path.c_str(), mode | FMOD_NONBLOCKING, 0, &next1.sound) == FMOD_OK) {
+		next1.id = id;
+	} else {
+		next1.sound = nullptr;
+	}
+}
+
+/**
+ * \brief включает трек плейлиста, по возможности из заранее открытого стрима
+ * @param id - номер трека в library1, no_track - ничего не делать
+ */
+void play_track_id_(track_id id) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (id == no_track) {
+		return;
+	}
+	FMOD::Sound *opened = nullptr;
+	FMOD_OPENSTATE state = FMOD_OPENSTATE_ERROR;
+	if (id == next1.id && next1.sound->getOpenState(&state, nullptr, nullptr, nullptr) == FMOD_OK) {
+		if (state == FMOD_OPENSTATE_READY) {
+			opened = next1.sound;
+			next1 = {}; // стрим переходит в sound1
+		} else if (state != FMOD_OPENSTATE_ERROR && player1) {
+			// ещё открывается: дождаться его дешевле, чем открывать тот же файл второй раз и ждать диска в UI
+			drop_pending_();
+			drop_stream_();
+			if (channel1) {
+				channel1->stop();
+				channel1 = 0;
+			}
+			track1 = std::string(library1.path(id));
+			range1 = library1.range(id);
+			pending1 = next1; // теперь звук принадлежит ожиданию плеера, preopen_next_ его не тронет
+			next1 = {};
+			player1->open(pending1.sound);
+			return;
+		}
+	}
+	play_track_(std::string(library1.path(id)), opened, library1.range(id));
+	feed_radio_();
+	preopen_next_();
+}
+
+/**
+ * \brief звук, открытый с FMOD_NONBLOCKING, готов: радио начинает играть, трек плейлиста включается
+ * Вызывается автоматом плеера из его потока под player_lock1.
+ * @param ok - false, если звук не открылся
+ */
+void on_sound_opened_(FMOD::Sound *sound, bool ok) {
+	if (sound == stream_sound1) {
+		if (ok) { // неоткрывшееся радио отпустит poll_stream_
+			system1->playSound(stream_sound1, main_deck_(), false, &channel1);
+			perf1->watch(stream_sound1);
+			apply_speed_();
+			follow_channel_();
+		}
+	} else if (sound && sound == pending1.sound) {
+		preopened_track opened = pending1;
+		pending1 = {};
+		if (!ok) {
+			opened.sound->release();
+			opened.sound = nullptr; // откроем обычным путём, ошибка будет видна как раньше
+		}
+		play_track_(std::string(library1.path(opened.id)), opened.sound, library1.range(opened.id));
+		feed_radio_();
+		preopen_next_();
+	}
+}
+
+/**
+ * \brief канал плеера доиграл сам: следующий трек по правилам повтора, после последнего - тишина
+ * Вызывается автоматом плеера из его потока под player_lock1, в том числе при свёрнутом окне.
+ */
+void on_track_end_() {
+	if (net1) {
+		return; // эфир сам не кончается, пропавший сервер замечает poll_stream_
+	}
+	play_track_id_(playlist1.next(true));
+}
+
+/**
+ * \brief пауза и снятие с паузы; после конца списка кнопка играет последний трек заново
+ */
+void toggle_pause_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	if (player1 && player1->state() == playback_state::stopped) {
+		resume_point resume = resume1;
+		play_track_id_(playlist1.current());
+		if (resume.id != no_track && resume.id == playlist1.current() && channel1) {
+			channel1->setPosition(resume.position, FMOD_TIMEUNIT_MS); // трек из прошлой сессии - с того же места
+		}
+		return;
+	}
+	if (!channel1) {
+		return;
+	}
+	pause_the_sound_(channel1);
+	bool paused = false;
+	channel1->getPaused(&paused);
+	if (player1) {
+		player1->pause(paused);
+	}
+	if (control1) {
+		control1->wake();
+	}
+}
+
+/**
+ * \brief восстанавливает список, очередь, текущий трек, скорость и эффекты из снимка
+ * Ничего не открывается: треки только заносятся в библиотеку и плейлист, теги и анализ окно закажет, когда
+ * поднимется фоновый запуск, а к позиции плеер вернётся при первом play. Звать до open_audio_: эффекты
+ * из chain1 он поставит сам.
+ */
+void restore_session_(session_snapshot const &s) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	std::vector<track_id> ids;
+	ids.reserve(s.tracks.size());
+	for (std::size_t i = 0; i < s.tracks.size(); ++i) {
+		ids.push_back(library1.add(s.tracks[i], i < s.ranges.size() ? s.ranges[i] : track_range()));
+		playlist1.add(ids.back());
+	}
+	playlist1.set_shuffle(s.shuffle);
+	playlist1.set_repeat(static_cast<repeat_mode>(std::min<int>(s.repeat, static_cast<int>(repeat_mode::one))));
+	if (s.current >= 0 && static_cast<std::size_t>(s.current) < ids.size()) {
+		playlist1.jump(static_cast<std::size_t>(s.current));
+		resume1 = {ids[s.current], s.position_ms};
+	}
+	for (std::uint32_t index : s.queue) { // после jump: очередь идёт после текущего трека
+		if (index < ids.size()) {
+			playlist1.enqueue(ids[index]);
+		}
+	}
+	if (s.speed > 0.1f && s.speed < 10.0f) {
+		speed1 = s.speed;
+	}
+	bool same_slots = s.effects.size() == chain1.size();
+	for (std::size_t i = 0; same_slots && i < chain1.size(); ++i) {
+		same_slots = s.effects[i].type == chain1[i].type;
+	}
+	if (same_slots) { // набор эффектов другой версии не трогаем
+		chain1 = s.effects;
+	}
+}
+
+/**
+ * \brief снимок того, что играет сейчас; пропавшие файлы в него не попадают
+ */
+session_snapshot take_session_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	session_snapshot s;
+	std::vector<std::int32_t> index(library1.size(), -1);
+	for (std::size_t i = 0; i < playlist1.size(); ++i) {
+		track_id id = playlist1[i];
+		if (!library1.missing(id)) {
+			index[id] = static_cast<std::int32_t>(s.tracks.size());
+			s.tracks.emplace_back(library1.path(id));
+			s.ranges.push_back(library1.range(id));
+		}
+	}
+	for (track_id id : playlist1.queued_tracks()) {
+		if (index[id] >= 0) {
+			s.queue.push_back(static_cast<std::uint32_t>(index[id]));
+		}
+	}
+	track_id current = playlist1.current();
+	if (current != no_track && index[current] >= 0) {
+		s.current = index[current];
+		FMOD::Sound *sound = nullptr;
+		if (resume1.id == current) {
+			s.position_ms = resume1.position; // так и не включали
+		} else if (channel1 && !net1 && channel1->getCurrentSound(&sound) == FMOD_OK && sound == sound1) {
+			channel1->getPosition(&s.position_ms, FMOD_TIMEUNIT_MS);
+		}
+	}
+	s.speed = speed1;
+	s.repeat = static_cast<std::uint8_t>(playlist1.repeat_state());
+	s.shuffle = playlist1.shuffle();
+	s.effects = chain1;
+	return s;
+}
+
+/**
+ * \brief поднимает звук, систему тегов и кэш анализа, пока строится окно
+ * Замок плеера берётся раньше, чем FMOD_Main пойдёт дальше (locked): всё, что трогает плеер из окна, дождётся
+ * конца open_audio_, а не увидит полусозданную систему. Остальное окну не нужно, пока не готово ready.
+ */
+void start_background_(std::promise<void> &locked, std::promise<void> &ready) {
+	trace_thread_name_("startup");
+	std::unique_lock<std::recursive_mutex> hold(player_lock1);
+	locked.set_value();
+	FMOD_RESULT result = open_audio_();
+	ERRCHECK(result);
+	if (passthrough1) {
+		set_passthrough_(true);
+	}
+	hold.unlock();
+	startup1.mark("audio");
+	result = FMOD::System_Create(&tags_system1);
+	ERRCHECK(result);
+	result = tags_system1->setOutput(FMOD_OUTPUTTYPE_NOSOUND);
+	ERRCHECK(result);
+	result = tags_system1->init(1, FMOD_INIT_NORMAL, 0);
+	ERRCHECK(result);
+	startup1.mark("tags system");
+	if (cache1 && !cache1->open(cache_file1)) { // закрытый кэш просто промахивается
+		std::cout << "Cannot open analysis cache " << cache_file1 << std::endl;
+	}
+	startup1.mark("analysis cache");
+	if (!similar_file1.empty() && similar1.load(similar_file1)) {
+		hold.lock(); // библиотеку пишет и окно
+		for (std::size_t i = 0; i < library1.size(); ++i) {
+			similar1.adopt(library1.path(static_cast<track_id>(i)), static_cast<track_id>(i));
+		}
+		similar_loaded1 = similar1.size();
+		hold.unlock();
+	}
+	startup1.mark("similarity index");
+	ready.set_value();
+}
+
+/**
+ * \brief "стоп": канал остаётся на месте и встаёт на паузу, как и раньше
+ */
+void stop_player_() {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	drop_pending_(); // ждущий открытия трек после стопа не заиграет
+	if (!channel1) {
+		return;
+	}
+	stop_the_sound_(channel1);
+	if (player1) {
+		player1->pause(true);
+	}
+	if (control1) {
+		control1->wake();
+	}
+}
+
+/// имена эффектов chain1 для сокета управления, по номерам слотов
+char const *const effect_names1[] = {"lowpass", "highpass", "echo", "flange"};
+
+/**
+ * \brief место в играющем треке; у трека CUE - от начала трека и его длина, у радио длины нет (0)
+ * @param position - мс от начала трека, 0 - ничего не играет
+ * @param length - длина трека в мс
+ */
+void track_position_(unsigned &position, unsigned &length) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	position = length = 0;
+	FMOD::Sound *sound = nullptr;
+	if (channel1 && channel1->getCurrentSound(&sound) == FMOD_OK && sound) {
+		channel1->getPosition(&position, FMOD_TIMEUNIT_MS);
+		if (sound->getLength(&length, FMOD_TIMEUNIT_MS) != FMOD_OK || length == 0xFFFFFFFF) {
+			length = 0; // у радио длины нет
+		} else if (sound == sound1) {
+			position = range1.track_ms(position, length);
+			length = range1.length_ms(length);
+		}
+	}
+}
+
+/**
+ * \brief состояние плеера для подписчиков сокета управления
+ * Темы: state, track, position и length (мс от начала трека), volume, queue (сколько треков в очереди), effects.
+ */
+void control_state_(std::vector<std::pair<std::string, std::string>> &state) {
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	static char const *states[] = {"stopped", "opening", "playing", "paused"};
+	state.emplace_back("state", player1 ? states[static_cast<int>(player1->state())] : "stopped");
+	state.emplace_back("track", track1);
+	unsigned position = 0, length = 0;
+	track_position_(position, length);
+	state.emplace_back("position", std::to_string(position));
+	state.emplace_back("length", std::to_string(length));
+	float volume = 1.0f;
+	if (channel1) {
+		channel1->getVolume(&volume);
+	}
+	char number[32];
+	std::snprintf(number, sizeof(number), "%.3f", volume);
+	state.emplace_back("volume", number);
+	state.emplace_back("queue", std::to_string(playlist1.queued()));
+	std::string effects;
+	for (std::size_t i = 0; i < chain1.size(); ++i) {
+		effects += std::string(i ? " " : "") + effect_names1[i] + (chain1[i].enabled ? "=on" : "=off");
+		for (auto const &p : chain1[i].params) {
+			std::snprintf(number, sizeof(number), ",%d:%g", p.first, p.second);
+			effects += number;
+		}
+	}
+	state.emplace_back("effects", effects);
+}
+
+/**
+ * \brief выполняет пакет команд из сокета управления под одним замком плеера
+ * play [номер в списке], pause, toggle, stop, next, prev, seek <мс | +мс | -мс>, volume <0..1 | +d | -d>,
+ * queue <номер в списке>, effect <имя | слот> on|off, param <имя | слот> <индекс> <значение>, get <тема>.
+ * Вызывается из потока сервера; окну о переменах сообщает control_batch_.
+ * @return true, если плеер поменялся
+ */
+bool control_commands_(std::vector<control_command> const &commands, std::vector<std::string> &replies) {
+	TRACE_SCOPE("control_commands_");
+	std::lock_guard<std::recursive_mutex> hold(player_lock1);
+	auto number = [](std::string_view word, double &out) {
+		std::string text(word);
+		char *end = nullptr;
+		out = std::strtod(text.c_str(), &end);
+		return !text.empty() && end == text.c_str() + text.size();
+	};
+	auto within = [](double x, double low, double high) { return x >= low && x <= high; }; // nan - нет
+
+	auto slot_of = [](std::string_view word) {
+		for (std::size_t i = 0; i < chain1.size(); ++i) {
+			if (word == effect_names1[i] || word == std::to_string(i)) {
+				return static_cast<int>(i);
+			}
+		}
+		return -1;
+	};
+	bool changed = false;
+	for (std::size_t i = 0; i < commands.size(); ++i) {
+		control_command const &c = commands[i];
+		std::string &reply = replies[i];
+		std::string_view name = c[0];
+		double value = 0;
+		if (name == "play") {
+			if (c.size() > 1) {
+				if (!number(c[1], value) || !(value >= 0 && value < playlist1.size())) {
+					reply = "error no such song";
+					continue;
+				}
+				play_track_id_(playlist1.jump(static_cast<std::size_t>(value)));
+			} else if (!player1 || player1->state() != playback_state::playing) {
+				toggle_pause_();
+			}
+		} else if (name == "pause") {
+			if (player1 && player1->state() == playback_state::playing) {
+				toggle_pause_();
+			}
+		} else if (name == "toggle") {
+			toggle_pause_();
+		} else if (name == "stop") {
+			stop_player_();
+		} else if (name == "next" || name == "prev") {
+			play_track_id_(name == "next" ? playlist1.next() : playlist1.previous());
+		} else if (name == "seek") {
+			if (c.size() != 2 || !number(c[1], value)) {
+				reply = "error seek needs milliseconds";
+				continue;
+			}
+			if (c[1][0] == '+' || c[1][0] == '-') { // от текущего места
+				unsigned position = 0, length = 0;
+				track_position_(position, length);
+				value += position;
+			}
+			// "seek 1e30" и nan приводятся к unsigned только в его пределах
+			value = std::min(std::max(0.0, value), static_cast<double>(std::numeric_limits<unsigned>::max()));
+			seek_track_(static_cast<unsigned>(value));
+		} else if (name == "volume") {
+			float current = 0;
+			if (c.size() != 2 || !number(c[1], value)) {
+				reply = "error volume needs 0..1";
+				continue;
+			}
+			if (passthrough1) {
+				reply = "error passthrough plays at full volume"; // см. passthrough_channel_
+				continue;
+			}
+			if (!channel1 || channel1->getVolume(&current) != FMOD_OK) {
+				reply = "error nothing plays";
+				continue;
+			}
+			// громкость канала, как у кнопок окна; change_volume_ держит её в 0..1
+			value = c[1][0] == '+' || c[1][0] == '-' ? value : value - current;
+			change_volume_(channel1, static_cast<float>(std::min(1.0, std::max(-1.0, value))));
+		} else if (name == "queue") {
+			if (c.size() != 2 || !number(c[1], value) || !(value >= 0 && value < playlist1.size())) {
+				reply = "error no such song";
+				continue;
+			}
+			playlist1.enqueue(playlist1[static_cast<std::size_t>(value)]);
+			preopen_next_();
+		} else if (name == "effect" || name == "param") {
+			int slot = c.size() > 1 ? slot_of(c[1]) : -1;
+			double index = 0;
+			if (slot < 0 || (name == "effect" && (c.size() != 3 || (c[2] != "on" && c[2] != "off"))) ||
+				(name == "param" && (c.size() != 4 || !number(c[2], index) || !number(c[3], value) ||
+									 !within(index, 0, std::numeric_limits<int>::max()) ||
+									 !within(value, -std::numeric_limits<float>::max(), std::numeric_limits<float>::max())))) {
+				reply = name == "effect" ? "error effect <name> on|off" : "error param <name> <index> <value>";
+				continue;
+			}
+			if (name == "effect") {
+				chain1[slot].enabled = c[2] == "on";
+			} else {
+				set_effect_param_(chain1[slot], static_cast<int>(index), static_cast<float>(value));
+			}
+			if (effects1) {
+				effects1->apply(chain1);
+			}
+		} else if (name == "get") {
+			std::vector<std::pair<std::string, std::string>> state;
+			control_state_(state);
+			reply = "error no such topic";
+			for (auto const &t : state) {
+				if (c.size() == 2 && c[1] == t.first) {
+					reply = "ok " + t.second;
+				}
+			}
+			continue;
+		} else {
+			reply = "error unknown command " + std::string(name);
+			continue;
+		}
+		changed = true;
+	}
+	return changed;
+}
+
+/**
+ * \brief выполняет пакет команд из сокета управления и сразу показывает перемены в окне, без опроса по таймеру
+ * Окно узнаёт о переменах через window_pump1: поток сервера не ждёт замка окна.
+ */
+void control_batch_(std::vector<control_command> const &commands, std::vector<std::string> &replies) {
+	if (!control_commands_(commands, replies)) {
+		return;
+	}
+	post_window_(window_control);
+}
+
+
 /**
 	void equalizer() - function that shows the equalizer's menu with all icluded settings
 	----
@@ -109,25 +1265,19 @@ void equalizer() {
 
 	//----------------------------------------------------------------------------------------------------------
 	button echo_btn{equa};
-	bool bypass2 = true;
-	echo_dsp->getBypass(&bypass2);
-	echo_btn.caption(bypass2 ? "Off" : "On");
+	echo_btn.caption(chain1[fx_echo].enabled ? "On" : "Off");
 	echo_btn.enable_pushed(false);
 
 	///taking actions when the button is clicked (changing its status + enable action)
 	echo_btn.events().click([&] {
 		echo_btn.enabled(false); //disable button while taking actions
 		if (echo_btn.pushed()) { //if already pushed..
-			change_dsp_bypass_(echo_dsp);
-			bool bypass = true;
-			echo_dsp->getBypass(&bypass);
-			echo_btn.caption(bypass ? "Off" : "On");
+			toggle_effect_(fx_echo);
+			echo_btn.caption(chain1[fx_echo].enabled ? "On" : "Off");
 			echo_btn.enable_pushed(false);
 		} else {
-			change_dsp_bypass_(echo_dsp);
-			bool bypass = true;
-			echo_dsp->getBypass(&bypass);
-			echo_btn.caption(bypass ? "Off" : "On");
+			toggle_effect_(fx_echo);
+			echo_btn.caption(chain1[fx_echo].enabled ? "On" : "Off");
 			echo_btn.enable_pushed(true);
 			/*
 				... /some code/ ...
@@ -139,32 +1289,61 @@ void equalizer() {
 	//creating flange button
 	button flange_btn{equa};
 
-	bool bypass1 = true;
-	flange_dsp->getBypass(&bypass1);
-	flange_btn.caption(bypass1 ? "Off" : "On");
+	flange_btn.caption(chain1[fx_flange].enabled ? "On" : "Off");
 	flange_btn.enable_pushed(false);
 
 	//taking actions when the button is clicked (changing its status + enable action)
 	flange_btn.events().click([&] {
 		flange_btn.enabled(false); //disable button while taking actions
 		if (flange_btn.pushed()) { //if already pushed..
-			change_dsp_bypass_(flange_dsp);
-			bool bypass = true;
-			flange_dsp->getBypass(&bypass);
-			flange_btn.caption(bypass ? "Off" : "On");
+			toggle_effect_(fx_flange);
+			flange_btn.caption(chain1[fx_flange].enabled ? "On" : "Off");
 			flange_btn.enable_pushed(false);
 
 		} else {
-			change_dsp_bypass_(flange_dsp);
-			bool bypass = true;
-			flange_dsp->getBypass(&bypass);
-			flange_btn.caption(bypass ? "Off" : "On");
+			toggle_effect_(fx_flange);
+			flange_btn.caption(chain1[fx_flange].enabled ? "On" : "Off");
 			flange_btn.enable_pushed(true);
 		}
 		flange_btn.enabled(true); //enable button again
 	});
 
 
+	//message to make user understand where the passthrough button is
+	label passthrough_label{equa, "Passthrough:"};
+	passthrough_label.text_align(align::right, align_v::center);
+
+	//creating passthrough button: mixer runs at the track's own format, no resampling
+	button passthrough_btn{equa};
+	passthrough_btn.caption(passthrough1 ? "On" : "Off");
+	passthrough_btn.events().click([&] {
+		passthrough_btn.enabled(false); //disable button while taking actions
+		set_passthrough_(!passthrough1);
+		passthrough_btn.caption(passthrough1 ? "On" : "Off");
+		passthrough_btn.enabled(true); //enable button again
+	});
+
+
+	//message to make user understand where the presets are
+	label preset_label{equa, "Preset:"};
+	preset_label.text_align(align::right, align_v::center);
+
+	//creating a list of presets, choosing one costs a single DSP graph update
+	static const std::vector<effect_preset> presets = make_effect_presets_();
+	combox preset_box{equa};
+	for (auto const &preset : presets) {
+		preset_box.push_back(preset.name);
+	}
+	preset_box.events().selected([&](const arg_combox &) {
+		TRACE_SCOPE("ui: preset selected");
+		std::lock_guard<std::recursive_mutex> hold(player_lock1);
+		chain1 = presets[preset_box.option()].chain;
+		effects1->apply(chain1);
+		echo_btn.caption(chain1[fx_echo].enabled ? "On" : "Off");
+		flange_btn.caption(chain1[fx_flange].enabled ? "On" : "Off");
+	});
+
+
 	/*
 	----Creating frequency cut fields----
 	*/
@@ -201,8 +1380,11 @@ void equalizer() {
 		low_freq_button.enabled(false); //disable button while taking actions
 		float low_cut = low_frequencies_spin.to_int(); //accepting the given value
 
-		FMOD_change_lowpass_or_highpass_parameter_(highpass_dsp, low_cut);
-		change_dsp_bypass_(highpass_dsp);
+		{
+			std::lock_guard<std::recursive_mutex> hold(player_lock1); //the control socket changes chain1 too
+			set_effect_param_(chain1[fx_highpass], FMOD_DSP_HIGHPASS_CUTOFF, low_cut);
+			toggle_effect_(fx_highpass);
+		}
 
 		low_freq_button.enabled(true); //enable button again
 	});
@@ -226,8 +1408,11 @@ void equalizer() {
 	high_freq_button.events().click([&] {
 		high_freq_button.enabled(false); //disable button while taking actions
 		float high_cut = high_frequencies_spin.to_int(); //accepting the given value
-		FMOD_change_lowpass_or_highpass_parameter_(lowpass_dsp, high_cut);
-		change_dsp_bypass_(lowpass_dsp);
+		{
+			std::lock_guard<std::recursive_mutex> hold(player_lock1); //the control socket changes chain1 too
+			set_effect_param_(chain1[fx_lowpass], FMOD_DSP_LOWPASS_CUTOFF, high_cut);
+			toggle_effect_(fx_lowpass);
+		}
 
 		high_freq_button.enabled(true); //enable button again
 	});
@@ -269,7 +1454,7 @@ void equalizer() {
 
 	//placing all the elements (reserve place)
 	place plc{equa};
-	plc.div("vert <weight=35 margin=5 <arrange=[40,40] gap=10 echo><arrange=[40,40] gap=10 flange>>" // echo/flange buttons
+	plc.div("vert <weight=35 margin=5 <arrange=[40,40] gap=10 echo><arrange=[40,40] gap=10 flange><arrange=[80,40] gap=10 passthrough><arrange=[50,variable] gap=10 preset>>" // echo/flange buttons
 
 			"<weight=25 margin=[5, 20] arrange=[variable] freq_announce>" // frequency cut announce
 
@@ -292,6 +1477,12 @@ void equalizer() {
 	//flange button
 	plc["flange"] << flange_label << flange_btn;
 
+	//passthrough button
+	plc["passthrough"] << passthrough_label << passthrough_btn;
+
+	//presets
+	plc["preset"] << preset_label << preset_box;
+
 	//frequency cut announce
 	plc["freq_announce"] << frequency_announce_label;
 
@@ -321,6 +1512,43 @@ void equalizer() {
 }
 
 
+/**
+	void duplicates_report() - function that shows the groups of tracks that sound the same
+	----
+	every group is a category of the listbox, the weakest match of the group is in its title
+	clicking a track plays it, so the copies can be compared by ear before deleting
+*/
+void duplicates_report(std::vector<duplicate_group> const &groups, std::size_t errors) {
+	form report(API::make_center(600, 400));
+	report.caption("Duplicates: " + std::to_string(groups.size()) + " groups" +
+				   (errors ? ", " + std::to_string(errors) + " files not decoded" : ""));
+
+	listbox tracks{report};
+	tracks.append_header("Track", 520);
+	for (std::size_t g = 0; g < groups.size(); ++g) {
+		auto category = tracks.append("Group " + std::to_string(g + 1) + ", match " +
+									  std::to_string(static_cast<int>(groups[g].similarity * 100)) + "%");
+		for (track_id id : groups[g].tracks) {
+			category.append(std::string(library1.path(id)));
+			category.back().value(std::size_t(id));
+		}
+	}
+	tracks.events().selected([](const arg_listbox &arg) {
+		if (arg.item.selected()) {
+			play_track_id_(playlist1.jump(arg.item.value<std::size_t>()));
+		}
+	});
+
+	place plc{report};
+	plc.div("<tracks margin=5>");
+	plc["tracks"] << tracks;
+	plc.collocate();
+
+	report.show();
+	nana::exec();
+}
+
+
 /** класс для более удобного оформления элементов окна, которые собраны в группы(такие как кнопки и кнопки с
 				  * прогресс-баром), либо описаны самостоятельными
 				  * в public описываются параметры поля окна, его подпространства, в private - функции без
@@ -330,10 +1558,11 @@ void equalizer() {
 					*/
 class fm : public form {
 	place plc{*this};
-	timer tmr;
+	timer tmr;                //follows the player: takes its events and moves the slider, runs only while something plays
 	group mn{*this, "", true},
 			bttns{mn, ""},        //field for control buttons
 			submn{mn, ""};        //field for equalizer, buttons for changing volume level
+	picture art_pic{mn};      //cover of the playing song
 	button b_pl{bttns, ("")}, //play-pause
 			b_s{bttns, ("")},     //stop
 			b_n{bttns, ("")},     //next
@@ -342,9 +1571,28 @@ class fm : public form {
 			b_vmin{submn, ("")},
 			b_eq{submn, ("")},
 			b_vmax{submn, ("")};
+	textbox search_box{*this};
+	timer search_tmr;         //collects search results while the search box is not empty
+	unsigned search_gen = 0;  //the newest query the listbox should show
 	listbox lbx{*this};
 	menubar mnbr{*this};
 	slider sldr{submn}; //progress prg{submn};
+	label perf_lbl{*this}; //performance overlay, hidden by default
+	timer perf_tmr;        //refreshes the overlay only while it is shown
+	timer dup_tmr;         //shows the duplicate scan progress in the caption
+	timer analysis_tmr;    //moves tempo and key results from the background analyzer into the library
+	timer art_tmr;         //puts loaded covers into the visible rows and the cover picture
+	timer net_tmr;         //starts the radio once it is open and shows the song from the ICY metadata
+	timer startup_tmr;     //waits for the background start, then hands the restored songs to tags and analysis
+	std::unordered_set<track_id> art_rows; //rows of the listbox whose cover is already decided
+	std::size_t art_first = ~std::size_t(0); //first visible row when the rows were last checked
+	track_id art_track = no_track;           //song whose cover the picture shows
+	bool art_waiting = false;                //some visible row still waits for its cover
+	int art_quiet = 0;                       //ticks in a row with nothing new for the covers
+	std::vector<timer *> asleep;             //timers stopped while the window is minimized
+	std::vector<timer *> idle;               //background timers stopped while nothing plays
+	bool playing_seen = false;               //the player played or opened when the window last looked
+	bool watch_waiting = false;              //a batch from the watch folders came while the window was minimized
 
 public:
 	fm()
@@ -353,25 +1601,56 @@ public:
 	{
 		nana::API::track_window_size(*this, {400, 600}, false);
 		nana::API::track_window_size(*this, {400, 600}, true);
-		plc.div("vert <menubar weight=28><main weight=30%><listbox>");
+		plc.div("vert <menubar weight=28><main weight=30%><search weight=26 margin=[2,5]><listbox><perf weight=60 margin=[0,5]>");
 		plc["menubar"] << mnbr;
+		plc["search"] << search_box;
+		plc["perf"] << perf_lbl;
+		plc.field_display("perf", false);
 		plc["main"] << mn;
-		mn.div("<vert all min=260 gap=10 margin=10>"); //weight=50% gap=5 margin=10><weight=30%
+		mn.div("<art weight=104 margin=[10,0,10,10]><vert all min=260 gap=10 margin=10>"); //weight=50% gap=5 margin=10><weight=30%
+		mn["art"] << art_pic;
 		mn["all"] << bttns << submn;
 		plc.field("listbox") << lbx;
 
-		lbx.append_header("Songs' Headers", 400);
+		lbx.append_header("Songs' Headers", 280);
+		lbx.append_header("BPM", 55);
+		lbx.append_header("Key", 55);
 		lbx.events().selected(
 				[&](const arg_listbox &arg) { /////////////////////////////////////////////////////////////////
-					static auto ptrr = arg;
-					auto t = arg.item.text(0);
-					play_sound_(system1, sound1, channel1, t.c_str());
+					if (!arg.item.selected()) {
+						return;
+					}
+					TRACE_SCOPE("ui: track selected");
+					{
+						std::lock_guard<std::recursive_mutex> hold(player_lock1);
+						play_track_id_(playlist1.jump(arg.item.value<std::size_t>()));
+					}
+					m_follow_playback();
 				});
 
 		m_init_buttons();
 		// m_init_listbox();
 		m_make_menus();
 		m_init_submain();
+		m_init_perf();
+		m_init_search();
+		m_init_duplicates();
+		m_init_analysis();
+		m_init_art();
+		m_init_stream();
+		m_init_news();
+		m_init_playback();
+		m_init_startup();
+		this->events().focus([this](const arg_focus &arg) { //restored from the taskbar
+			if (arg.getting && (!asleep.empty() || watch_waiting)) {
+				m_wake();
+			}
+		});
+		this->events().resized([this] {
+			if ((!asleep.empty() || watch_waiting) && !API::is_window_zoomed(*this, false)) {
+				m_wake();
+			}
+		});
 
 		this->events().unload(
 				[this](const arg_unload &ei) { // yes/no messagebox that opens when you try to exit the programme
@@ -387,6 +1666,11 @@ public:
 	   * option, what leads to a problem"*/
 	};
 
+	~fm() {
+		std::lock_guard<std::mutex> hold(window_follow_lock1); //the pump thread outlives the window
+		window_follow1 = nullptr;
+	}
+
 private:
 	/**function that helps find the files with mp3 extension in the directory
 	 *  of computer and return its path  */
@@ -404,24 +1688,49 @@ private:
 	void m_init_buttons() {
 		bttns.div("buttons gap=15 margin=[5,10]"); //grid=[3,3] collapse(2,2,3,2)
 		bttns["buttons"] << b_s << b_pr << b_pl << b_n << b_rpl;
-		msgbox mb{*this, "Msgbox"};
-		mb.icon(mb.icon_information) << "Button Clicked";
 		b_pl.events().click([&](const nana::arg_click &eventinfo) {
-			pause_the_sound_(channel1);
+			TRACE_SCOPE("ui: play/pause");
+			latency1.mark();
+			toggle_pause_();
+			m_follow_playback();
 		});
 		b_s.events().click([&](const nana::arg_click &eventinfo) {
-			stop_the_sound_(channel1);
+			TRACE_SCOPE("ui: stop");
+			stop_player_();
+			m_follow_playback();
 		});
 		//b_s.events().click(_stop_the_sound_(channel1));
-		b_n.events().click(mb);
-		b_pr.events().click(mb);
-		b_rpl.events().click(mb);
+		b_n.events().click([&] {
+			TRACE_SCOPE("ui: next");
+			{
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				play_track_id_(playlist1.next());
+			}
+			m_follow_playback();
+		});
+		b_pr.events().click([&] {
+			TRACE_SCOPE("ui: previous");
+			{
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				play_track_id_(playlist1.previous());
+			}
+			m_follow_playback();
+		});
+		b_rpl.events().click([&] { //off -> all -> one -> off
+			static const repeat_mode cycle[] = {repeat_mode::all, repeat_mode::one, repeat_mode::off};
+			{
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				playlist1.set_repeat(cycle[static_cast<int>(playlist1.repeat_state())]);
+				preopen_next_();
+			}
+			m_show_repeat();
+		});
 
 		b_pl.tooltip("Play/Pause");
 		b_s.tooltip("Stop");
 		b_n.tooltip("Next");
 		b_pr.tooltip("Previous");
-		b_rpl.tooltip("Set the Replay");
+		m_show_repeat();
 
 		b_pl.enable_pushed(true);
 		b_s.enable_pushed(true);
@@ -444,20 +1753,784 @@ private:
 	}
 
 
+	/** function that shows the current repeat mode in the replay button's tooltip */
+	void m_show_repeat() {
+		static char const *names[] = {"Replay: Off", "Replay: All", "Replay: One"};
+		b_rpl.tooltip(names[static_cast<int>(playlist1.repeat_state())]);
+	}
+
+
 	/** function that creates 2 categories in menu bar - adding a file and getting the information about the app
 	 *   the format of added file is path of the file*/
 	void m_make_menus() {
 		mnbr.push_back("&ADD");
 		mnbr.at(0).append("Add A File", [this](menu::item_proxy &ip) {
 			auto fs = m_pick_file(true);
-			if (!fs.empty())
-				lbx.at(0).append(fs); //надо чтобы он выводил на лбх не сам файл, а его имя...
+			if (!fs.empty()) {
+				m_add_track(fs.string());
+				preopen_next_();
+			}
+		});
+		mnbr.at(0).append("Import Playlist", [this](menu::item_proxy &) { //songs of a CUE sheet are parts of one file
+			filebox fbox(*this, true);
+			fbox.add_filter("Playlists", "*.m3u;*.m3u8;*.pls;*.xspf;*.cue");
+			fbox.add_filter("All Files", "*.*");
+			auto files = fbox.show();
+			if (!files.empty()) {
+				m_import_playlist(files.front().string());
+			}
 		});
+		mnbr.at(0).append("Open Stream URL", [this](menu::item_proxy &) { //Icecast/SHOUTcast radio, http only
+			inputbox::text url("URL", "http://");
+			inputbox box(*this, "The radio keeps playing through short network drops", "Open Stream URL");
+			if (box.show_modal(url) && is_stream_url_(url.value())) {
+				if (play_stream_(url.value()) == FMOD_OK) {
+					caption("Connecting to " + url.value());
+					net_tmr.start();
+					m_follow_playback();
+				} else {
+					caption("Cannot open " + url.value());
+				}
+			}
+		});
+		mnbr.at(0).append("Watch A Folder", [this](menu::item_proxy &) { //files already in the folder come in the first batch
+			folderbox fbox(*this);
+			auto folders = fbox.show();
+			if (folders.empty()) {
+				return;
+			}
+			std::string folder = folders.front().string();
+			if (std::find(watch_folders1.begin(), watch_folders1.end(), folder) == watch_folders1.end()) {
+				watch_folders1.push_back(folder);
+				restart_watcher_();
+			}
+		});
+		mnbr.push_back("&SPEED");
+		for (float speed : {0.5f, 0.75f, 1.0f, 1.25f, 1.5f, 2.0f, 3.0f}) {
+			mnbr.at(1).append(std::to_string(speed).substr(0, 4) + "x", [speed](menu::item_proxy &) {
+				TRACE_SCOPE("ui: speed");
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				speed1 = speed;
+				apply_speed_();
+			});
+		}
+		mnbr.push_back("&PLAYLIST");
+		mnbr.at(2).append("Shuffle", [](menu::item_proxy &ip) {
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			playlist1.set_shuffle(!playlist1.shuffle());
+			ip.checked(playlist1.shuffle());
+			preopen_next_();
+		}).check_style(menu::checks::highlight);
+		mnbr.at(2).append("Play Next", [this](menu::item_proxy &) { //selected songs go to the play queue
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			for (auto const &index : lbx.selected()) {
+				playlist1.enqueue(playlist1[lbx.at(index).value<std::size_t>()]);
+			}
+			preopen_next_();
+		});
+		mnbr.at(2).append("Play Similar", [this](menu::item_proxy &) { //songs that sound like the selected one go to the play queue
+			auto selected = lbx.selected();
+			if (selected.empty()) {
+				return;
+			}
+			track_id id = playlist1[lbx.at(selected.front()).value<std::size_t>()];
+			std::size_t queued = enqueue_similar_(id, 10, false);
+			caption(queued ? "Queued " + std::to_string(queued) + " similar songs"
+						   : "Not analyzed yet: " + std::string(library1.path(id)));
+			preopen_next_();
+		});
+		mnbr.at(2).append("Endless Radio", [](menu::item_proxy &ip) { //when the queue runs out, a song like the current one joins it
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			endless1 = !endless1;
+			ip.checked(endless1);
+			feed_radio_();
+			preopen_next_();
+		}).check_style(menu::checks::highlight);
+		mnbr.at(2).append("Find Duplicates", [this](menu::item_proxy &) {
+			if (duplicates1 && !duplicates1->ready()) {
+				return; //already running, the caption shows the progress
+			}
+			//only whole files that are still there, each file once: the songs of a CUE sheet share one file
+			std::vector<std::string> paths;
+			std::unordered_set<std::string> seen;
+			duplicate_ids1.clear();
+			for (std::size_t i = 0; i < library1.size(); ++i) {
+				track_id id = static_cast<track_id>(i);
+				if (library1.range(id).whole() && !library1.missing(id) &&
+					seen.emplace(library1.path(id)).second) {
+					paths.emplace_back(library1.path(id));
+					duplicate_ids1.push_back(id);
+				}
+			}
+			duplicates1.reset(new duplicate_scan(std::move(paths), cache1.get()));
+			dup_tmr.start();
+		});
+		m_make_deck_menu(mnbr.push_back("&DECKS"));
+		if (!zones1.empty()) {
+			m_make_zone_menu(mnbr.push_back("&ZONES"));
+		}
+		std::size_t info = zones1.empty() ? 4 : 5;
 		mnbr.push_back("I&NFO");
-		mnbr.at(1).append("About Us", [this](menu::item_proxy &) {
+		mnbr.at(info).append("About Us", [this](menu::item_proxy &) {
 			msgbox mb{*this, "Msgbox"};
 			mb.icon(mb.icon_information) << "Something About Us";
 		});
+		mnbr.at(info).append("Latency", [this](menu::item_proxy &) {
+			latency_report r = latency1.report();
+			msgbox mb{*this, "Latency"};
+			mb.icon(mb.icon_information) << "Play/Pause to audible change, " << r.count << " samples\n"
+										 << "p50: " << r.p50 << " ms\np99: " << r.p99 << " ms";
+		});
+		mnbr.at(info).append("Seek Cache", [this](menu::item_proxy &) {
+			scrub_report r = scrub_stats1.report();
+			msgbox mb{*this, "Seek Cache"};
+			mb.icon(mb.icon_information) << r.seeks << " seeks, " << r.hits << " without a decoder reset ("
+										 << static_cast<int>(r.hit_rate * 100 + 0.5) << "%)\n"
+										 << "seek to audio p50: " << r.latency.p50 << " ms\np99: " << r.latency.p99
+										 << " ms\nmax: " << r.latency.max << " ms";
+		});
+		mnbr.at(info).append("Performance Overlay", [this](menu::item_proxy &ip) {
+			bool show = !plc.field_display("perf");
+			ip.checked(show);
+			plc.field_display("perf", show);
+			plc.collocate();
+			perf_overlay1 = show;
+			update_perf_monitor_();
+			if (show) {
+				perf_lbl.caption(perf1->overlay_text());
+				perf_tmr.start();
+			} else {
+				perf_tmr.stop();
+			}
+		}).check_style(menu::checks::highlight);
+		mnbr.at(info).append("Tracing", [](menu::item_proxy &ip) {
+			set_trace_enabled_(!trace_enabled_());
+			ip.checked(trace_enabled_());
+		}).check_style(menu::checks::highlight).checked(trace_enabled_());
+		mnbr.at(info).append("Save Trace", [this](menu::item_proxy &) {
+			msgbox mb{*this, "Trace"};
+			if (dump_trace_(trace_file1.c_str())) {
+				mb.icon(mb.icon_information) << "Saved to " << trace_file1 << "\nOpen it in chrome://tracing";
+			} else {
+				mb.icon(mb.icon_error) << "Cannot write " << trace_file1;
+			}
+			mb();
+		});
+	}
+
+	/** function that fills the DECKS menu: the first deck is the playlist player, the other decks
+	 *  play the selected song on top of it; the crossfader works between the first two decks */
+	void m_make_deck_menu(menu &decks) {
+		for (std::size_t d = 1; d < static_cast<std::size_t>(deck_count1); ++d) {
+			std::string name = "Deck " + std::to_string(d + 1);
+			decks.append("Load Selected On " + name, [this, d](menu::item_proxy &) {
+				auto selected = lbx.selected();
+				if (!selected.empty()) {
+					track_id id = playlist1[lbx.at(selected.front()).value<std::size_t>()];
+					play_on_deck_(d, std::string(library1.path(id)));
+				}
+			});
+			decks.append("Stop " + name, [d](menu::item_proxy &) { stop_deck_(d); });
+			for (float pitch : {0.92f, 0.98f, 1.0f, 1.02f, 1.08f}) {
+				int percent = static_cast<int>(std::lround((pitch - 1.0f) * 100));
+				decks.append(name + " Pitch " + (percent > 0 ? "+" : "") + std::to_string(percent) + "%",
+							 [d, pitch](menu::item_proxy &) {
+								 std::lock_guard<std::recursive_mutex> hold(player_lock1); //decks are rebuilt with the system
+								 decks1->at(d).set_pitch(pitch);
+							 });
+			}
+			decks.append_splitter();
+		}
+		for (std::size_t d = 0; d < static_cast<std::size_t>(deck_count1); ++d) {
+			decks.append("Cue Deck " + std::to_string(d + 1), [d](menu::item_proxy &ip) {
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				deck_cue1[d] = !deck_cue1[d];
+				decks1->at(d).set_cue(deck_cue1[d]);
+				ip.checked(deck_cue1[d]);
+			}).check_style(menu::checks::highlight);
+		}
+		decks.append("Split Cue (program left, cue right)", [](menu::item_proxy &ip) {
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			split_cue1 = !split_cue1;
+			decks1->set_split_cue(split_cue1);
+			ip.checked(split_cue1);
+		}).check_style(menu::checks::highlight);
+		if (deck_count1 >= 2) {
+			decks.append_splitter();
+			for (int step = 0; step <= 4; ++step) {
+				static char const *names[] = {"Deck 1", "3/4 Deck 1", "Center", "3/4 Deck 2", "Deck 2"};
+				decks.append(std::string("Crossfader: ") + names[step],
+							 [step](menu::item_proxy &) {
+								 std::lock_guard<std::recursive_mutex> hold(player_lock1);
+								 decks1->crossfade(step / 4.0f);
+							 });
+			}
+		}
+	}
+
+	/** function that returns the files of the selected songs */
+	std::vector<std::string> m_selected_paths() {
+		std::vector<std::string> paths;
+		for (auto const &index : lbx.selected()) {
+			paths.emplace_back(library1.path(playlist1[lbx.at(index).value<std::size_t>()]));
+		}
+		return paths;
+	}
+
+	/** function that fills the ZONES menu: every room can get its own queue,
+	 *  or all rooms play the selected song together, kept in step by the drift correction */
+	void m_make_zone_menu(menu &zones) {
+		zones.append("Play Selected In All Zones", [this](menu::item_proxy &) {
+			std::vector<std::string> paths = m_selected_paths();
+			std::vector<zone *> rooms;
+			for (auto &z : zones1) {
+				rooms.push_back(z.get());
+			}
+			if (!paths.empty()) {
+				play_synced_(rooms, paths.front());
+			}
+		});
+		zones.append_splitter();
+		for (auto &z : zones1) {
+			zone *room = z.get();
+			zones.append("Queue Selected In " + room->name(), [this, room](menu::item_proxy &) {
+				for (std::string &path : m_selected_paths()) {
+					room->enqueue(std::move(path));
+				}
+			});
+		}
+	}
+
+	/** function that adds a song to the listbox; the item keeps its place in the playlist,
+	 *  so a filtered listbox still plays the right track */
+	void m_append_track(track_id id) {
+		lbx.at(0).append(std::string(library1.path(id))); //надо чтобы он выводил на лбх не сам файл, а его имя...
+		lbx.at(0).back().value(std::size_t(id));
+		m_show_path(lbx.at(0).back(), id);
+		m_show_analysis(lbx.at(0).back(), id);
+	}
+
+	/** function that adds a new file to the library, the playlist, the search index and the analysis queue */
+	void m_add_track(std::string const &path) {
+		track_id id;
+		{
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			id = library1.add(path);
+			playlist1.add(id);
+		}
+		similar1.adopt(path, id);
+		search1->add(id, path);
+		analyzer1->add(id, path);
+		analysis_tmr.start();
+		m_wake_art();
+		if (search_box.text().empty()) {
+			m_append_track(id);
+		}
+	}
+
+	/** function that brings an M3U, PLS or XSPF playlist or a CUE sheet into the library and the playlist;
+	 *  the file is parsed straight from its mapping and the listbox is drawn once at the end. Songs of a CUE
+	 *  sheet skip the analysis: it would measure the whole album, not the song */
+	void m_import_playlist(std::string const &path) {
+		TRACE_SCOPE("ui: import playlist");
+		std::size_t first = 0, count = 0;
+		{
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			first = library1.size();
+			count = import_playlist_(
+					path,
+					[](std::string const &file, playlist_entry const &entry) {
+						playlist1.add(library1.add(file, entry.range));
+					},
+					[](std::size_t entries, std::size_t bytes) { library1.reserve(entries, bytes); });
+		}
+		if (count == 0) {
+			caption("Cannot import " + path);
+			return;
+		}
+		lbx.auto_draw(false);
+		for (std::size_t i = first; i < library1.size(); ++i) {
+			auto id = static_cast<track_id>(i);
+			std::string file(library1.path(id));
+			search1->add(id, file);
+			if (library1.range(id).whole()) {
+				similar1.adopt(file, id);
+				analyzer1->add(id, file);
+			}
+			if (search_box.text().empty()) {
+				m_append_track(id);
+			}
+		}
+		lbx.auto_draw(true);
+		analysis_tmr.start();
+		m_wake_art();
+		caption(std::to_string(count) + " songs from " + path);
+		preopen_next_();
+	}
+
+	/** function that writes the path of a song into its first column; files gone from the disk keep their row,
+	 *  a song of a CUE sheet shows where it starts in its file */
+	void m_show_path(listbox::item_proxy item, track_id id) {
+		std::string path(library1.path(id));
+		track_range range = library1.range(id);
+		if (!range.whole()) {
+			unsigned start = track_range::to_ms(range.start) / 1000;
+			char at[32];
+			std::snprintf(at, sizeof(at), " @ %u:%02u", start / 60, start % 60);
+			path += at;
+		}
+		item.text(0, library1.missing(id) ? "[missing] " + path : path);
+	}
+
+	/** function that writes the tempo and key of a song into its BPM and Key columns */
+	void m_show_analysis(listbox::item_proxy item, track_id id) {
+		track_analysis const &a = library1.analysis(id);
+		char bpm[16] = "";
+		if (a.bpm > 0) {
+			std::snprintf(bpm, sizeof(bpm), "%.1f", a.bpm);
+		}
+		item.text(1, bpm);
+		item.text(2, key_name_(a.key, a.minor));
+	}
+
+	/** function that refills the listbox with the given songs */
+	template <typename Ids>
+	void m_show_tracks(Ids const &ids) {
+		lbx.auto_draw(false);
+		lbx.clear(0);
+		art_rows.clear();
+		art_first = ~std::size_t(0);
+		for (track_id id : ids) {
+			m_append_track(id);
+		}
+		lbx.auto_draw(true);
+	}
+
+	/** function that prepares the search box: the query runs on the search thread,
+	 *  stale queries are cancelled there and the timer only picks up the newest results */
+	void m_init_search() {
+		search_box.multi_lines(false);
+		search_box.tip_string("Search: title, artist, album, path");
+		search_box.events().text_changed([this] {
+			std::string text = search_box.text();
+			if (text.empty()) {
+				search_tmr.stop();
+				search_gen = search1->search({});
+				std::vector<track_id> all(library1.size());
+				for (std::size_t i = 0; i < all.size(); ++i) {
+					all[i] = static_cast<track_id>(i);
+				}
+				m_show_tracks(all);
+				return;
+			}
+			search_gen = search1->search(text);
+			search_tmr.start();
+		});
+		search_tmr.interval(std::chrono::milliseconds{15});
+		search_tmr.elapse([this] {
+			std::vector<search_hit> hits;
+			unsigned gen = 0;
+			if (!search1->take_results(hits, gen) || gen < search_gen) {
+				return;
+			}
+			search_gen = gen; //re-runs after indexing come with a newer number
+			std::vector<track_id> ids;
+			for (auto const &hit : hits) {
+				ids.push_back(hit.id);
+			}
+			m_show_tracks(ids);
+		});
+	}
+
+	/** function that prepares the performance overlay: mixer/stream load, stream buffer, DSP costs
+	 *  the numbers are sampled by perf_monitor in the background, the timer only redraws the label */
+	void m_init_perf() {
+		perf_lbl.typeface(paint::font{"Consolas", 8});
+		perf_tmr.interval(std::chrono::milliseconds{500});
+		perf_tmr.elapse([this] {
+			if (m_sleep_if_minimized()) {
+				return;
+			}
+			if (perf1) {
+				perf_lbl.caption(perf1->overlay_text());
+			}
+		});
+	}
+
+	/** function that prepares the duplicate scan: the files are fingerprinted on all cores in the background,
+	 *  the timer shows the progress and opens the report when the scan is over */
+	void m_init_duplicates() {
+		dup_tmr.interval(std::chrono::milliseconds{500});
+		dup_tmr.elapse([this] {
+			if (m_sleep_if_minimized()) {
+				return;
+			}
+			if (!duplicates1) {
+				dup_tmr.stop();
+				return;
+			}
+			if (!duplicates1->ready()) {
+				caption("Fingerprinting " + std::to_string(duplicates1->progress()) + "/" +
+						std::to_string(duplicates1->size()));
+				return;
+			}
+			dup_tmr.stop();
+			caption("");
+			std::vector<duplicate_group> groups = duplicates1->result();
+			for (duplicate_group &group : groups) {
+				for (track_id &id : group.tracks) {
+					id = duplicate_ids1[id];
+				}
+			}
+			duplicates_report(groups, duplicates1->errors());
+		});
+	}
+
+	/** function that collects the background analysis: the library keeps the results,
+	 *  the listbox is updated in place while it shows the whole library (row == track id);
+	 *  the timer runs only while the analyzer has work, adding a track starts it again */
+	void m_init_analysis() {
+		analysis_tmr.interval(std::chrono::milliseconds{1000});
+		analysis_tmr.elapse([this] {
+			if (m_sleep_if_minimized()) {
+				return;
+			}
+			std::vector<std::pair<track_id, track_analysis>> results;
+			bool idle = !analyzer1 || analyzer1->pending() == 0; //asked first: a finished track has its result posted
+			update_perf_monitor_(); //the analyzer yields to playback only while the stress sampler runs
+			if (!analyzer1 || !analyzer1->take_results(results)) {
+				if (idle) {
+					analysis_tmr.stop();
+				}
+				return;
+			}
+			bool whole_library = search_box.text().empty();
+			std::lock_guard<std::recursive_mutex> hold(player_lock1); //the playback thread reads the library
+			for (auto const &r : results) {
+				library1.set_analysis(r.first, r.second);
+				if (whole_library && r.first < lbx.at(0).size()) {
+					m_show_analysis(lbx.at(0).at(r.first), r.first);
+				}
+			}
+		});
+	}
+
+	/** function that follows the radio: it starts playing as soon as the prefetch buffer is filled,
+	 *  the caption shows the station and the song; the timer runs only while a radio is on */
+	void m_init_stream() {
+		net_tmr.interval(std::chrono::milliseconds{200});
+		net_tmr.elapse([this] {
+			if (m_sleep_if_minimized()) {
+				return;
+			}
+			std::string news; //a song picked from the list has already switched the radio off, then there is none
+			if (!poll_stream_(news)) {
+				net_tmr.stop();
+			}
+			if (!news.empty()) {
+				caption(news);
+			}
+		});
+	}
+
+	/** function that shows in the window what other threads report through window_pump1: the commands from
+	 *  the control socket and the batches from the watch folders. The pump calls it on its own thread, so nothing
+	 *  polls and the reporting threads never wait for the window; it runs under nana's own lock like every
+	 *  handler of the window */
+	void m_init_news() {
+		std::lock_guard<std::mutex> hold(window_follow_lock1);
+		window_follow1 = [this](unsigned news) {
+			internal_scope_guard lock;
+			if (news & window_control) {
+				m_follow_playback();
+			}
+			if (news & window_watch) {
+				m_take_watch();
+			}
+		};
+	}
+
+	/** function that applies the batches from the watch folders; a bulk copy arrives as a few large batches,
+	 *  so the listbox is redrawn once per batch and not once per file. A minimized window leaves them
+	 *  in the watcher until m_wake */
+	void m_take_watch() {
+		watch_waiting = API::is_window_zoomed(*this, false);
+		if (watch_waiting) {
+			return;
+		}
+		std::vector<folder_change> changes;
+		std::lock_guard<std::recursive_mutex> hold(player_lock1); //restart_watcher_ replaces the watcher under it
+		if (watcher1 && watcher1->take_changes(changes)) {
+			m_apply_changes(changes);
+		}
+	}
+
+	/** function that shows album covers: the rows on screen and the playing song ask the loader,
+	 *  the covers are decoded and downscaled on its threads, the UI thread only puts ready thumbnails in place;
+	 *  the timer stops after a second with nothing to do, scrolling and new songs start it again */
+	void m_init_art() {
+		art_tmr.interval(std::chrono::milliseconds{100});
+		art_tmr.elapse([this] {
+			if (m_sleep_if_minimized()) {
+				return;
+			}
+			std::vector<track_id> loaded;
+			bool fresh = art1->take_loaded(loaded);
+			track_id playing;
+			{
+				std::lock_guard<std::recursive_mutex> hold(player_lock1);
+				playing = playlist1.current();
+			}
+			if (playing != art_track && playing != no_track &&
+				art1->request(playing, std::string(library1.path(playing)))) { //true once the cover is known
+				paint::image cover;
+				if (auto thumbnail = art1->find(playing)) {
+					cover.open(thumbnail->bmp.data(), thumbnail->bmp.size());
+				}
+				art_pic.load(cover);
+				art_track = playing;
+			}
+			std::size_t first = lbx.first_visible().item, rows = lbx.at(0).size();
+			if (!fresh && first == art_first) {
+				if ((!art_waiting || !playing_seen) && (playing == art_track || playing == no_track) &&
+					++art_quiet >= 10) { //on pause a cover that never comes doesn't keep the timer going
+					art_tmr.stop();
+				}
+				return;
+			}
+			art_quiet = 0;
+			art_first = first;
+			art_waiting = false;
+			for (std::size_t i = first; i < std::min(rows, first + 48); ++i) { //a screenful with some reserve
+				auto item = lbx.at(0).at(i);
+				auto id = static_cast<track_id>(item.value<std::size_t>());
+				if (art_rows.count(id)) {
+					continue;
+				}
+				if (!art1->request(id, std::string(library1.path(id)))) {
+					art_waiting = true; //comes back through take_loaded
+					continue;
+				}
+				art_rows.insert(id);
+				if (auto thumbnail = art1->find(id)) {
+					paint::image icon;
+					icon.open(thumbnail->bmp.data(), thumbnail->bmp.size());
+					item.icon(icon);
+				}
+			}
+		});
+		lbx.events().mouse_wheel([this] { m_wake_art(); });
+		lbx.events().key_press([this] { m_wake_art(); });
+		lbx.events().mouse_move([this] { m_wake_art(); }); //after dragging the scrollbar
+		art_tmr.start();
+	}
+
+	/** function that shows the songs of the last session right away; their tags, analysis and the watch
+	 *  folders wait for the background start (FMOD, tags system, analysis cache), the timer only checks it */
+	void m_init_startup() {
+		lbx.auto_draw(false);
+		for (std::size_t i = 0; i < library1.size(); ++i) {
+			m_append_track(static_cast<track_id>(i));
+		}
+		lbx.auto_draw(true);
+		startup_tmr.interval(std::chrono::milliseconds{20});
+		startup_tmr.elapse([this] {
+			if (background_ready1.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				return;
+			}
+			startup_tmr.stop();
+			for (std::size_t i = 0; i < library1.size(); ++i) {
+				auto id = static_cast<track_id>(i);
+				std::string path(library1.path(id));
+				search1->add(id, path);
+				if (library1.range(id).whole()) {
+					analyzer1->add(id, path);
+				}
+			}
+			if (library1.size() > 0) {
+				analysis_tmr.start();
+			}
+			restart_watcher_();
+			preopen_next_();
+			startup1.mark("background ready");
+			if (startup_report1) {
+				double interactive = startup1.at("interactive");
+				std::cout << startup1.report() << "time to interactive: " << interactive << " ms"
+						  << (interactive > interactive_budget_ms ? " - over budget" : "") << std::endl;
+			}
+		});
+		startup_tmr.start();
+	}
+
+	/** function that starts the cover timer again after it went quiet; scrolling starts it on pause too */
+	void m_wake_art() {
+		art_quiet = 0;
+		if (!art_tmr.started() && asleep.empty()) {
+			art_tmr.start();
+		}
+	}
+
+	/** function that follows the player: the end of a song, the next song and the opened radio come from
+	 *  the playback thread through a coalescing queue, so the timer only moves the slider and runs only
+	 *  while something plays; paused, stopped or minimized, the window has no timers running */
+	void m_init_playback() {
+		tmr.interval(std::chrono::milliseconds{250});
+		tmr.elapse([this] {
+			if (!m_sleep_if_minimized()) {
+				m_poll_playback();
+			}
+		});
+	}
+
+	/** function that takes the player events, moves the slider and stops the timer when nothing plays */
+	void m_poll_playback() {
+		unsigned events = player1->events().take();
+		playback_state state = player1->state();
+		unsigned position = 0, length = 0;
+		std::string track;
+		{
+			std::lock_guard<std::recursive_mutex> hold(player_lock1);
+			track = track1;
+			track_position_(position, length); //a song of a CUE sheet counts from its own start
+		}
+		if (events & playback_open_failed) {
+			caption("Cannot open " + track);
+		}
+		if (events & (playback_ended | playback_state_changed)) {
+			m_wake_art(); //the cover of the next song
+		}
+		sldr.maximum(std::max(length / 1000, 1u));
+		sldr.value(length > 0 ? position / 1000 : 0);
+		bool playing = state == playback_state::playing || state == playback_state::opening;
+		if (!playing) {
+			tmr.stop();
+		}
+		if (playing != playing_seen) {
+			playing_seen = playing;
+			if (playing) {
+				m_wake_idle();
+			} else {
+				m_sleep_if_idle(art_tmr);
+			}
+		}
+	}
+
+	/** function that starts following the player after the user has played, paused or switched something */
+	void m_follow_playback() {
+		playback_state state = player1->state();
+		if ((state == playback_state::playing || state == playback_state::opening) && asleep.empty()) {
+			tmr.start();
+		}
+		m_poll_playback();
+	}
+
+	/** function that stops every running timer while the window is minimized, the timers check it
+	 *  when they fire; m_wake starts them again. Returns true if the window is minimized */
+	bool m_sleep_if_minimized() {
+		if (!API::is_window_zoomed(*this, false)) {
+			return false;
+		}
+		for (timer *t : {&tmr, &search_tmr, &perf_tmr, &dup_tmr, &analysis_tmr, &art_tmr, &net_tmr,
+						 &startup_tmr}) {
+			if (t->started()) {
+				t->stop();
+				asleep.push_back(t);
+			}
+		}
+		return true;
+	}
+
+	/** function that stops a background timer while nothing plays, so a paused or stopped player leaves
+	 *  the window without wakeups; m_wake_idle starts it again. Returns true if nothing plays */
+	bool m_sleep_if_idle(timer &t) {
+		if (playing_seen) {
+			return false;
+		}
+		if (t.started()) {
+			t.stop();
+		}
+		if (std::find(idle.begin(), idle.end(), &t) == idle.end()) {
+			idle.push_back(&t);
+		}
+		return true;
+	}
+
+	/** function that starts the background timers stopped by m_sleep_if_idle once the player plays again;
+	 *  a minimized window keeps them for m_wake */
+	void m_wake_idle() {
+		for (timer *t : idle) {
+			if (asleep.empty()) {
+				t->start();
+			} else {
+				asleep.push_back(t);
+			}
+		}
+		idle.clear();
+	}
+
+	/** function that starts the timers stopped by m_sleep_if_minimized and takes the watch folder batches that
+	 *  came meanwhile; the song may have changed too */
+	void m_wake() {
+		for (timer *t : asleep) {
+			if (t != &tmr) {
+				t->start();
+			}
+		}
+		asleep.clear();
+		m_take_watch();
+		m_follow_playback();
+	}
+
+	/** function that applies a batch of changes: a renamed file keeps its track id, so its analysis and
+	 *  its place in the playlist survive; a removed file stays in the list as missing so the ids don't shift */
+	void m_apply_changes(std::vector<folder_change> const &changes) {
+		TRACE_SCOPE("ui: watch folder batch");
+		std::lock_guard<std::recursive_mutex> hold(player_lock1); //the playback thread reads the paths
+		bool whole_library = search_box.text().empty();
+		lbx.auto_draw(false);
+		for (auto const &change : changes) {
+			track_id id = library1.find(change.kind == folder_change::moved ? change.from : change.path);
+			if (id == no_track) {
+				if (change.kind != folder_change::removed) {
+					m_add_track(change.path);
+				}
+				continue;
+			}
+			switch (change.kind) {
+			case folder_change::moved: {
+				track_id target = library1.find(change.path);
+				if (target == no_track) {
+					library1.rename(id, change.path);
+					search1->add(id, change.path);
+					break;
+				}
+				library1.set_missing(id, true); //renamed over a known file: that one stays and gets re-analyzed
+				if (whole_library && id < lbx.at(0).size()) {
+					m_show_path(lbx.at(0).at(id), id);
+				}
+				id = target;
+			}
+			// fall through
+			case folder_change::added:
+			case folder_change::modified:
+				art1->forget(id);
+				art_rows.erase(id);
+				library1.set_missing(id, false);
+				search1->add(id, change.path);
+				analyzer1->add(id, change.path);
+				break;
+			case folder_change::removed:
+				library1.set_missing(id, true);
+				break;
+			}
+			if (whole_library && id < lbx.at(0).size()) {
+				m_show_path(lbx.at(0).at(id), id);
+			}
+		}
+		lbx.auto_draw(true);
+		preopen_next_();
+		analysis_tmr.start();
+		m_wake_art();
 	}
 
 	void m_init_submain() {
@@ -472,6 +2545,10 @@ private:
 		b_vmin.events().click(mb);
 		b_vmax.events().click(mb);
 		b_eq.events().click([&]() { equalizer(); });
+		sldr.events().mouse_up([this] { //seconds from the start of the song, a CUE song counts from its own start
+			seek_track_(sldr.value() * 1000);
+			m_poll_playback();
+		});
 
 		b_vmin.tooltip("Minimize the Volume");
 		b_vmax.tooltip("Maximize the Volume");
@@ -489,15 +2566,6 @@ private:
 		//bground2.image(paint::image("../media/vmax.bmp"), true, {});
 		//bground3.image(paint::image("../media/eq.bmp"), true, {});
 
-		tmr.elapse([this](const nana::arg_elapse &a) {
-			if (sldr.value() == sldr.maximum()) {
-				sldr.value(0);
-				tmr.reset();
-			}
-			sldr.move_step(true);
-			tmr.start();
-			//  prg.inc();
-		});
 		//prg.events().click((int x, int y){
 		//  prg.
 		//});
@@ -521,65 +2589,235 @@ private:
 
 int FMOD_Main(int argc, char **argv) {
 	FMOD_RESULT result;
-	unsigned int version;
-	void *extradriverdata = 0;
-
-	Common_Init(&extradriverdata);
-	result = FMOD::System_Create(&system1);
-	result = system1->getVersion(&version);
-	if (version < FMOD_VERSION) {
-		Common_Fatal("FMOD lib version %08x doesn't match header version %08x", version, FMOD_VERSION);
+	thread_config threads;
+	unsigned load_threads = 0;
+	float load_duty = 0.9f;
+	double load_seconds = 30;
+	unsigned latency_runs = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (std::strncmp(argv[i], "--load-test=", 12) == 0) {
+			// --load-test=<потоки нагрузки>[,<доля занятости>[,<секунды>]]
+			std::sscanf(argv[i] + 12, "%u,%f,%lf", &load_threads, &load_duty, &load_seconds);
+		} else if (std::strncmp(argv[i], "--latency=", 10) == 0) {
+			if (!parse_latency_profile_(argv[i] + 10, profile1)) {
+				std::cout << "Unknown latency profile " << argv[i] + 10 << std::endl;
+			}
+		} else if (std::strncmp(argv[i], "--latency-test=", 15) == 0) {
+			latency_runs = std::strtoul(argv[i] + 15, nullptr, 10);
+		} else if (std::strcmp(argv[i], "--passthrough") == 0) {
+			passthrough1 = true;
+		} else if (std::strcmp(argv[i], "--perf") == 0) {
+			profiling1 = true;
+		} else if (std::strncmp(argv[i], "--perf-export=", 14) == 0) {
+			profiling1 = true;
+			perf_export1 = argv[i] + 14;
+		} else if (std::strncmp(argv[i], "--perf-interval=", 16) == 0) {
+			perf_interval1 = std::chrono::milliseconds(std::max(10ul, std::strtoul(argv[i] + 16, nullptr, 10)));
+		} else if (std::strcmp(argv[i], "--trace") == 0) {
+			set_trace_enabled_(true);
+		} else if (std::strncmp(argv[i], "--trace-file=", 13) == 0) {
+			trace_file1 = argv[i] + 13;
+		} else if (std::strncmp(argv[i], "--watch=", 8) == 0) {
+			watch_folders1.emplace_back(argv[i] + 8); // можно повторять
+		} else if (std::strncmp(argv[i], "--decks=", 8) == 0) {
+			deck_count1 = std::max(1, std::atoi(argv[i] + 8));
+		} else if (std::strncmp(argv[i], "--voices=", 9) == 0) {
+			// --voices=<реальных>[,<всего>]
+			std::sscanf(argv[i] + 9, "%d,%d", &real_voices1, &max_voices1);
+			max_voices1 = std::max(max_voices1, real_voices1);
+		} else if (std::strncmp(argv[i], "--zone=", 7) == 0) {
+			// --zone=<имя>[:driver<N> | :wav:<файл>]; можно повторять
+			zone_options zone;
+			std::string value = argv[i] + 7;
+			std::size_t colon = value.find(':');
+			zone.name = value.substr(0, colon);
+			std::string output = colon == std::string::npos ? std::string() : value.substr(colon + 1);
+			if (output.compare(0, 6, "driver") == 0) {
+				zone.driver = std::atoi(output.c_str() + 6);
+			} else if (output.compare(0, 4, "wav:") == 0) {
+				zone.output = FMOD_OUTPUTTYPE_WAVWRITER;
+				zone.wav_file = output.substr(4);
+			}
+			zone_options1.push_back(zone);
+		} else if (std::strncmp(argv[i], "--stream-buffer=", 16) == 0) {
+			// --stream-buffer=<КБ впрок>[,<КБ до начала звука>]
+			unsigned buffer_kb = 0, start_kb = 0;
+			if (std::sscanf(argv[i] + 16, "%u,%u", &buffer_kb, &start_kb) >= 1 && buffer_kb > 0) {
+				net_options1.buffer_bytes = std::size_t(buffer_kb) << 10;
+			}
+			if (start_kb > 0) {
+				net_options1.start_bytes = std::size_t(start_kb) << 10;
+			}
+		} else if (std::strncmp(argv[i], "--analysis-cache=", 17) == 0) {
+			// --analysis-cache=<файл>[,<мегабайты>]; пустое имя отключает хранилище
+			std::string value = argv[i] + 17;
+			std::size_t comma = value.find(',');
+			if (comma != std::string::npos) {
+				cache_limit1 = std::size_t(std::strtoul(value.c_str() + comma + 1, nullptr, 10)) << 20;
+				value.resize(comma);
+			}
+			cache_file1 = value;
+		} else if (std::strncmp(argv[i], "--similar-index=", 16) == 0) {
+			similar_file1 = argv[i] + 16; // пустое имя - индекс похожести строится заново при каждом запуске
+		} else if (std::strncmp(argv[i], "--scrub-cache=", 14) == 0) {
+			// --scrub-cache=<секунд назад>[,<секунд впрок>]; 0 - без кэша перемотки
+			double back = 0, ahead = -1;
+			std::sscanf(argv[i] + 14, "%lf,%lf", &back, &ahead);
+			scrub_options1.back_seconds = std::max(0.0, back);
+			scrub_options1.ahead_seconds = ahead < 0 ? scrub_options1.back_seconds : ahead;
+		} else if (std::strncmp(argv[i], "--control=", 10) == 0) {
+			// --control=<путь к сокету>[,<мс между рассылками позиции>]; пустой путь - без сокета управления
+			std::string value = argv[i] + 10;
+			std::size_t comma = value.find(',');
+			if (comma != std::string::npos) {
+				control_tick1 = std::max(10, std::atoi(value.c_str() + comma + 1));
+				value.resize(comma);
+			}
+			control_file1 = value;
+		} else if (std::strncmp(argv[i], "--session=", 10) == 0) {
+			session_file1 = argv[i] + 10; // пустое имя - не помнить сессию
+		} else if (std::strcmp(argv[i], "--startup-times") == 0) {
+			startup_report1 = true;
+		} else if (!parse_thread_option_(argv[i], threads)) {
+			std::cout << "Unknown option " << argv[i] << std::endl;
+		}
 	}
-	result = system1->init(32, FMOD_INIT_NORMAL, extradriverdata);
-	ERRCHECK(result);
-	result = system1->getMasterChannelGroup(&mastergroup);
-
-	result = system1->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM, 0, &sound1);
-	result = sound1->setMode(FMOD_LOOP_OFF);
-
-	ERRCHECK(result);
-	system1->createDSPByType(FMOD_DSP_TYPE_LOWPASS, &lowpass_dsp);
-	system1->createDSPByType(FMOD_DSP_TYPE_HIGHPASS, &highpass_dsp);
-	system1->createDSPByType(FMOD_DSP_TYPE_ECHO, &echo_dsp);
-	system1->createDSPByType(FMOD_DSP_TYPE_FLANGE, &flange_dsp);
-
-	mastergroup->addDSP(0, lowpass_dsp);
-	mastergroup->addDSP(0, highpass_dsp);
-	mastergroup->addDSP(0, echo_dsp);
-	mastergroup->addDSP(0, flange_dsp);
-	lowpass_dsp->setBypass(true);
-	highpass_dsp->setBypass(true);
-	echo_dsp->setBypass(true);
-	flange_dsp->setBypass(true);
-	try {
-		fm wdw1;
-		wdw1.show();
-		exec();
-	}
-	catch (std::exception &e) {
-		std::cout << "Something went wrong";
-	}
-	result = mastergroup->removeDSP(lowpass_dsp);
-	ERRCHECK(result);
-	result = mastergroup->removeDSP(highpass_dsp);
-	ERRCHECK(result);
-	result = mastergroup->removeDSP(echo_dsp);
-	ERRCHECK(result);
-	result = mastergroup->removeDSP(flange_dsp);
-	ERRCHECK(result);
 
-	result = lowpass_dsp->release();
-	ERRCHECK(result);
-	result = highpass_dsp->release();
-	ERRCHECK(result);
-	result = echo_dsp->release();
-	ERRCHECK(result);
-	result = flange_dsp->release();
+#ifdef SOUND_TRACE
+	trace_thread_name_("ui");
+	install_trace_crash_handler_(trace_file1);
+#endif
+	Common_Init(&extradriverdata1);
+	result = apply_thread_config_(threads);
 	ERRCHECK(result);
+	startup1.mark("platform");
+	session_snapshot session;
+	if (!session_file1.empty() && load_session_(session_file1, session)) {
+		restore_session_(session);
+	}
+	startup1.mark("session");
+	// окно строится, пока в фоне поднимаются FMOD, DSP, теги и кэш; кэш создаётся сразу, а открывается там
+	if (!cache_file1.empty()) {
+		cache1.reset(new analysis_cache(cache_limit1));
+	}
+	player1.reset(new playback_machine(player_lock1, on_sound_opened_, on_track_end_));
+	std::promise<void> locked, ready;
+	background_ready1 = ready.get_future().share();
+	std::thread background([&locked, &ready] { start_background_(locked, ready); });
+	locked.get_future().wait();
+	search1.reset(new search_worker([](std::string const &path) {
+		background_ready1.wait(); // система тегов поднимается в фоне
+		track_tags tags;
+		read_track_tags_(tags_system1, path.c_str(), tags);
+		return tags;
+	}));
+	analyzer1.reset(new library_analyzer(playback_stressed1, cache1.get(), &similar1));
+	art1.reset(new art_loader(cache1.get()));
+	window_pump1.reset(new event_pump([](unsigned news) {
+		std::lock_guard<std::mutex> hold(window_follow_lock1);
+		if (window_follow1) {
+			window_follow1(news);
+		}
+	}));
+	if (!control_file1.empty()) {
+		control1.reset(new control_server(control_file1, control_batch_, control_state_, control_tick1));
+		if (!control1->start()) {
+			std::cout << "Cannot open control socket " << control_file1 << std::endl;
+			control1.reset();
+		}
+	}
+	startup1.mark("workers");
+	for (zone_options const &options : zone_options1) {
+		std::unique_ptr<zone> room(new zone(options));
+		if (room->open() != FMOD_OK) {
+			std::cout << "Cannot open zone " << options.name << std::endl;
+			continue;
+		}
+		room->run();
+		zones1.push_back(std::move(room));
+	}
 
-	result = sound1->release(); //shut down
-	result = system1->close();
-	result = system1->release();
+	if (latency_runs > 0 || load_threads > 0) {
+		background.join(); // замерам нужен звук сразу
+	}
+	if (latency_runs > 0) {
+		// переключаем mute и ждём, пока изменение дойдёт до DSP-отвода
+		result = system1->playSound(sound1, 0, false, &channel1);
+		ERRCHECK(result);
+		channel1->setMode(FMOD_LOOP_NORMAL);
+		Common_Sleep(500);
+		for (unsigned i = 0; i < latency_runs; ++i) {
+			Common_Sleep(150 + std::rand() % 250);
+			bool muted = false;
+			channel1->getMute(&muted);
+			latency1.mark();
+			channel1->setMute(!muted);
+			for (int wait = 0; wait < 200 && latency1.pending(); ++wait) {
+				system1->update();
+				Common_Sleep(5);
+			}
+		}
+		latency_report r = latency1.report();
+		std::cout << "latency samples: " << r.count << ", p50: " << r.p50 << " ms, p99: " << r.p99
+				  << " ms, max: " << r.max << " ms" << std::endl;
+	} else if (load_threads > 0) {
+		// замер срывов под синтетической нагрузкой вместо запуска окна
+		cpu_load_generator load;
+		result = system1->playSound(sound1, 0, false, &channel1);
+		ERRCHECK(result);
+		result = sound1->setMode(FMOD_LOOP_NORMAL);
+		result = channel1->setMode(FMOD_LOOP_NORMAL);
+		load.start(load_threads, load_duty);
+		perf1->start(perf_interval1, perf_export1); // для сводки ниже
+		underrun_stats stats = measure_underruns_(system1, sound1, mastergroup, load_seconds);
+		load.stop();
+		std::cout << "load threads: " << load_threads << ", duty: " << load_duty << ", seconds: " << stats.seconds
+				  << ", stream starves: " << stats.stream_starves << ", mixer stalls: " << stats.mixer_stalls
+				  << std::endl;
+		std::cout << perf1->overlay_text() << std::endl;
+	} else {
+		try {
+			fm wdw1;
+			wdw1.show();
+			startup1.mark("interactive");
+			exec();
+		}
+		catch (std::exception &e) {
+			std::cout << "Something went wrong";
+		}
+		background.join();
+		if (!session_file1.empty() && !save_session_(session_file1, take_session_())) {
+			std::cout << "Cannot save session " << session_file1 << std::endl;
+		}
+	}
+	if (control1) {
+		control1->stop(); // без замка плеера: поток сервера может ждать его в control_batch_
+		std::lock_guard<std::recursive_mutex> hold(player_lock1);
+		control1.reset();
+	}
+	{
+		std::lock_guard<std::recursive_mutex> hold(player_lock1);
+		player1->attach(nullptr); // снимает обратный вызов с канала: автомат уходит раньше системы
+	}
+	player1.reset();
+	watcher1.reset();
+	window_pump1.reset(); // после всех, кто в него пишет
+	zones1.clear();
+	duplicates1.reset(); // отменяет разбор: потоки доделывают текущий файл и выходят
+	analyzer1.reset();
+	if (!similar_file1.empty() && similar1.size() != similar_loaded1 &&
+		!similar1.save(similar_file1, [](track_id id) { return library1.path(id); })) {
+		std::cout << "Cannot save similarity index " << similar_file1 << std::endl;
+	}
+	art1.reset();
+	cache1.reset(); // после всех, кто в него пишет
+	search1.reset();
+	tags_system1->release();
+	close_audio_();
+	if (trace_enabled_()) {
+		dump_trace_(trace_file1.c_str());
+	}
 	Common_Close();
 
 
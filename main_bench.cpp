@@ -0,0 +1,542 @@
+#define CATCH_CONFIG_RUNNER
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#define CATCH_CONFIG_DEFAULT_REPORTER "xml" // результаты сравниваются между сборками, поэтому по умолчанию xml
+
+#include "catch.hpp"
+#include "net_stream.hpp"
+#include "icy_stand_in.hpp"
+#include "fmod_functions.hpp"
+#include "offline_render.hpp"
+#include "dsp_graph.hpp"
+#include "time_stretch.hpp"
+#include "fingerprint.hpp"
+#include "deck_mixer.hpp"
+#include "startup.hpp"
+#include "playlist_import.hpp"
+#include "similarity.hpp"
+#include "scrub_cache.hpp"
+#include "control_server.hpp"
+#include "playlist.hpp"
+#include "search_index.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fmod.hpp>
+#include "common.h"
+
+/*
+ * Все замеры идут на системе FMOD_OUTPUTTYPE_NOSOUND_NRT: звуковая карта не нужна,
+ * а микшер делает ровно один блок на каждый System::update в потоке замера.
+ */
+FMOD::System *bench_system;
+FMOD::ChannelGroup *bench_master;
+
+TEST_CASE("createSound latency") {
+	char const *path = Common_MediaPath("meow.mp3");
+	for (auto mode : {FMOD_CREATESTREAM, FMOD_CREATESAMPLE}) {
+		BENCHMARK_ADVANCED(mode == FMOD_CREATESTREAM ? "createSound stream" : "createSound sample")(
+				Catch::Benchmark::Chronometer meter) {
+			std::vector<FMOD::Sound *> sounds(meter.runs());
+			meter.measure([&](int i) { return bench_system->createSound(path, mode, 0, &sounds[i]); });
+			for (FMOD::Sound *s : sounds) {
+				s->release();
+			}
+		};
+	}
+}
+
+TEST_CASE("play_sound_ time to first sample") {
+	render_capture capture;
+	FMOD::DSP *tap = nullptr;
+	REQUIRE(capture.attach(bench_system, bench_master, tap) == FMOD_OK);
+	FMOD::Channel *ch = nullptr;
+	char const *path = Common_MediaPath("meow.mp3");
+
+	// время вызова плюс микширование блоков, пока на выходе не появится ненулевой сэмпл
+	BENCHMARK_ADVANCED("play_sound_ to first sample")(Catch::Benchmark::Chronometer meter) {
+		std::vector<FMOD::Sound *> sounds(meter.runs());
+		meter.measure([&](int i) {
+			capture.clear();
+			play_sound_(bench_system, sounds[i], ch, path);
+			for (int blocks = 0; blocks < 100; ++blocks) {
+				bench_system->update();
+				auto const &out = capture.data();
+				if (std::any_of(out.begin(), out.end(), [](float v) { return v != 0.0f; })) {
+					return blocks;
+				}
+			}
+			return -1;
+		});
+		ch->stop();
+		for (FMOD::Sound *s : sounds) {
+			s->release();
+		}
+	};
+
+	bench_master->removeDSP(tap);
+	tap->release();
+}
+
+TEST_CASE("seek latency") {
+	FMOD::Sound *track = nullptr;
+	FMOD::Channel *ch = nullptr;
+	REQUIRE(bench_system->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM | FMOD_LOOP_NORMAL, 0,
+									  &track) == FMOD_OK);
+	REQUIRE(bench_system->playSound(track, 0, false, &ch) == FMOD_OK);
+	bench_system->update();
+
+	// стрим перечитывается с новой позиции в следующем update, поэтому он входит в замер
+	BENCHMARK_ADVANCED("move_in_track_")(Catch::Benchmark::Chronometer meter) {
+		meter.measure([&](int i) {
+			FMOD_RESULT result = move_in_track_(bench_system, track, ch, (i % 10) / 10.0f);
+			bench_system->update();
+			return result;
+		});
+	};
+	BENCHMARK_ADVANCED("increase_time_ 5 s")(Catch::Benchmark::Chronometer meter) {
+		begin_of_the_track_(ch);
+		meter.measure([&] {
+			FMOD_RESULT result = increase_time_(track, ch, 5000);
+			bench_system->update();
+			return result;
+		});
+	};
+
+	// скраб назад на 0-3 с от точки 20 с: обычный стрим декодирует заново от точки синхронизации, кэш отдаёт из памяти
+	BENCHMARK_ADVANCED("scrub back within 3 s, plain stream")(Catch::Benchmark::Chronometer meter) {
+		meter.measure([&](int i) {
+			FMOD_RESULT result = ch->setPosition(20000 - (i % 4) * 1000, FMOD_TIMEUNIT_MS);
+			bench_system->update();
+			return result;
+		});
+	};
+	ch->stop();
+	track->release();
+
+	scrub_counters counters;
+	std::unique_ptr<scrub_stream> scrub;
+	REQUIRE(open_scrub_stream_(bench_system, Common_MediaPath("meow.mp3"), scrub, {}, &counters) == FMOD_OK);
+	REQUIRE(bench_system->playSound(scrub->sound(), 0, false, &ch) == FMOD_OK);
+	ch->setPosition(20000, FMOD_TIMEUNIT_MS);
+	bench_system->update();
+	Common_Sleep(200); // поток кэша набирает окно
+	BENCHMARK_ADVANCED("scrub back within 3 s, scrub cache")(Catch::Benchmark::Chronometer meter) {
+		meter.measure([&](int i) {
+			FMOD_RESULT result = ch->setPosition(20000 - (i % 4) * 1000, FMOD_TIMEUNIT_MS);
+			bench_system->update();
+			return result;
+		});
+	};
+	ch->stop();
+	scrub_report report = counters.report();
+	WARN("scrub cache: " << report.seeks << " seeks, hit rate " << report.hit_rate << ", seek to audio p50 "
+						 << report.latency.p50 << " ms, p99 " << report.latency.p99 << " ms");
+	scrub.reset();
+}
+
+TEST_CASE("mixer block cost per DSP") {
+	FMOD::Sound *track = nullptr;
+	FMOD::Channel *ch = nullptr;
+	// сэмпл, а не стрим: декодирование не должно попадать в стоимость блока
+	REQUIRE(bench_system->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESAMPLE | FMOD_LOOP_NORMAL, 0,
+									  &track) == FMOD_OK);
+	REQUIRE(bench_system->playSound(track, 0, false, &ch) == FMOD_OK);
+
+	BENCHMARK("mix block: no effects") {
+		return bench_system->update();
+	};
+
+	static const struct {
+		char const *name;
+		FMOD_DSP_TYPE type;
+	} effects[] = {
+			{"lowpass",  FMOD_DSP_TYPE_LOWPASS},
+			{"highpass", FMOD_DSP_TYPE_HIGHPASS},
+			{"echo",     FMOD_DSP_TYPE_ECHO},
+			{"flange",   FMOD_DSP_TYPE_FLANGE},
+	};
+	dsp_graph graph(bench_system, bench_master);
+	for (auto const &e : effects) {
+		effect_desc only{e.type, true, {}};
+		REQUIRE(graph.apply({only}) == FMOD_OK);
+		BENCHMARK(std::string("mix block: ") + e.name) {
+			return bench_system->update();
+		};
+	}
+	graph.release();
+
+	FMOD::DSP *stretch = nullptr;
+	REQUIRE(create_time_stretch_dsp_(bench_system, stretch) == FMOD_OK);
+	REQUIRE(set_playback_speed_(ch, stretch, 1.25f) == FMOD_OK);
+	BENCHMARK("mix block: time stretch 1.25x") {
+		return bench_system->update();
+	};
+
+	ch->stop();
+	stretch->release();
+	track->release();
+}
+
+TEST_CASE("time stretch block cost") {
+	for (float speed : {0.5f, 1.25f, 2.0f, 3.0f}) {
+		wsola_stretcher stretcher;
+		stretcher.configure(2, 48000, 1024);
+		stretcher.set_speed(speed);
+		std::vector<float> block(1024 * 2);
+		for (std::size_t i = 0; i < block.size(); ++i) {
+			block[i] = std::sin(i * 0.01f) * 0.3f + std::sin(i * 0.137f) * 0.2f;
+		}
+		// блок 1024 кадров стерео 48 кГц - это 21.3 мс реального времени
+		BENCHMARK("wsola 1024 frames at " + std::to_string(speed).substr(0, 4) + "x") {
+			stretcher.process(block.data(), block.data(), 1024);
+			return block[0];
+		};
+	}
+}
+
+TEST_CASE("fingerprint and duplicate search cost") {
+	std::vector<float> decoded(static_cast<std::size_t>(fingerprint_seconds * 44100) * 2), mono;
+	for (std::size_t i = 0; i < decoded.size(); ++i) {
+		decoded[i] = std::sin(i * 0.01f) * 0.3f + std::sin(i * 0.00137f * (i % 5000)) * 0.2f;
+	}
+	fingerprint_extractor extractor;
+	// всё, что идёт после декодирования одного трека
+	BENCHMARK("fingerprint 60 s of 44.1 kHz stereo") {
+		downmix_resample_(decoded, 2, 44100, fingerprint_rate, mono);
+		return extractor.compute(mono.data(), mono.size()).words.size();
+	};
+
+	// 10000 отпечатков по минуте: слова меняются медленно, как у настоящей музыки
+	std::mt19937 rng(7);
+	duplicate_index index;
+	for (track_id id = 0; id < 10000; ++id) {
+		audio_fingerprint print;
+		std::uint32_t word = rng();
+		for (int i = 0; i < 484; ++i) {
+			word ^= rng() & rng() & rng();
+			print.words.push_back(word);
+		}
+		index.add(id, std::move(print));
+	}
+	BENCHMARK("duplicate index over 10000 tracks") {
+		index.build();
+		return index.find_pairs().size();
+	};
+}
+
+TEST_CASE("net stream time to first audio and underruns") {
+	std::ifstream mp3(Common_MediaPath("meow.mp3"), std::ios::binary);
+	icy_stand_in_options server;
+	server.body.assign(std::istreambuf_iterator<char>(mp3), std::istreambuf_iterator<char>());
+	server.metaint = 8192;
+	server.header_delay_ms = 30; // задержка канала до сервера
+	icy_stand_in radio(server);
+	REQUIRE(radio.ready());
+	render_capture capture;
+	FMOD::DSP *tap = nullptr;
+	REQUIRE(capture.attach(bench_system, bench_master, tap) == FMOD_OK);
+	FMOD::Channel *ch = nullptr;
+
+	// от создания потока до первого ненулевого сэмпла на выходе микшера
+	BENCHMARK_ADVANCED("net stream to first sample, 30 ms server delay")(Catch::Benchmark::Chronometer meter) {
+		std::vector<std::unique_ptr<net_stream>> streams(meter.runs());
+		std::vector<FMOD::Sound *> sounds(meter.runs());
+		meter.measure([&](int i) {
+			capture.clear();
+			streams[i] = std::make_unique<net_stream>(radio.url());
+			if (open_net_stream_(bench_system, *streams[i], sounds[i]) != FMOD_OK ||
+				bench_system->playSound(sounds[i], 0, false, &ch) != FMOD_OK) {
+				return -1;
+			}
+			for (int blocks = 0; blocks < 100; ++blocks) {
+				bench_system->update();
+				auto const &out = capture.data();
+				if (std::any_of(out.begin(), out.end(), [](float v) { return v != 0.0f; })) {
+					return blocks;
+				}
+			}
+			return -1;
+		});
+		ch->stop();
+		for (int i = 0; i < meter.runs(); ++i) {
+			streams[i]->stop();
+			if (sounds[i]) {
+				sounds[i]->release();
+			}
+		}
+	};
+	bench_master->removeDSP(tap);
+	tap->release();
+
+	// 20 с эфира в реальном темпе: обрыв каждые 3 с и рывки сети до 40 мс
+	icy_stand_in_options flaky = server;
+	flaky.drop_after = 3 * flaky.bytes_per_second;
+	flaky.jitter_ms = 40;
+	icy_stand_in flaky_radio(flaky);
+	net_stream stream(flaky_radio.url());
+	FMOD::Sound *live = nullptr;
+	REQUIRE(open_net_stream_(bench_system, stream, live) == FMOD_OK);
+	REQUIRE(bench_system->playSound(live, 0, false, &ch) == FMOD_OK);
+	unsigned int block = 0;
+	int blocks = 0, rate = 0, starving_blocks = 0;
+	bench_system->getDSPBufferSize(&block, &blocks);
+	bench_system->getSoftwareFormat(&rate, nullptr, nullptr);
+	auto block_time = std::chrono::microseconds(1000000LL * block / rate);
+	auto next = std::chrono::steady_clock::now();
+	auto end = next + std::chrono::seconds(20);
+	while (next < end) {
+		bench_system->update();
+		bool starving = false;
+		live->getOpenState(nullptr, nullptr, &starving, nullptr);
+		starving_blocks += starving;
+		next += block_time;
+		std::this_thread::sleep_until(next);
+	}
+	net_stream_stats stats = stream.stats();
+	WARN("first audio " << stats.first_read_ms << " ms, reconnects " << stats.reconnects << ", underruns "
+						<< stats.underruns * 3 << " per minute, starving " << starving_blocks << " blocks");
+	ch->stop();
+	stream.stop();
+	live->release();
+}
+
+TEST_CASE("mixer cost by decks and voices") {
+	// своя система: bench_system создана без виртуальных голосов и всего с 32 каналами
+	FMOD::System *nrt = nullptr;
+	REQUIRE(FMOD::System_Create(&nrt) == FMOD_OK);
+	REQUIRE(nrt->setOutput(FMOD_OUTPUTTYPE_NOSOUND_NRT) == FMOD_OK);
+	REQUIRE(nrt->setSoftwareChannels(64) == FMOD_OK);
+	REQUIRE(nrt->init(4096, FMOD_INIT_VOL0_BECOMES_VIRTUAL, nullptr) == FMOD_OK);
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	FMOD::Sound *meow = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESAMPLE | FMOD_LOOP_NORMAL, 0, &meow) == FMOD_OK);
+	effect_chain eq = {{FMOD_DSP_TYPE_LOWPASS, true}, {FMOD_DSP_TYPE_HIGHPASS, true}};
+
+	for (int count : {1, 2, 4, 8, 16}) {
+		for (int per_deck : {1, 8, 64}) {
+			deck_mixer decks(nrt, master);
+			REQUIRE(decks.create(count) == FMOD_OK);
+			for (int d = 0; d < count; ++d) {
+				decks.at(d).set_effects(eq);
+				FMOD::Channel *ch = nullptr;
+				for (int v = 0; v < per_deck; ++v) {
+					decks.at(d).play(meow, ch, v == 0 ? deck_track_priority : deck_one_shot_priority);
+				}
+			}
+			nrt->update();
+			int all = 0, real = 0;
+			decks.voices(all, real);
+			BENCHMARK("mix block: " + std::to_string(count) + " decks x " + std::to_string(per_deck) + " voices, " +
+					  std::to_string(real) + "/" + std::to_string(all) + " real") {
+				return nrt->update();
+			};
+			if (count >= 4 && per_deck == 64) {
+				// всё, кроме двух дек, приглушено: лишние голоса виртуальные и почти ничего не стоят
+				for (int d = 2; d < count; ++d) {
+					decks.at(d).group()->setVolume(0.0f);
+				}
+				nrt->update();
+				decks.voices(all, real);
+				BENCHMARK("mix block: " + std::to_string(count) + " decks x 64 voices, 2 audible, " +
+						  std::to_string(real) + "/" + std::to_string(all) + " real") {
+					return nrt->update();
+				};
+			}
+			decks.release();
+			nrt->update();
+		}
+	}
+	meow->release();
+	nrt->close();
+	nrt->release();
+}
+
+TEST_CASE("cold start phases") {
+	// что стоит на пути к окну (снимок сессии) и что уходит в фон (создание системы с настоящим выводом)
+	std::string file = (std::filesystem::temp_directory_path() / "sound_bench_session.bin").string();
+	session_snapshot session;
+	for (int i = 0; i < 10000; ++i) {
+		session.tracks.push_back("C:\\Music\\Artist " + std::to_string(i / 12) + "\\" + std::to_string(i) + ".mp3");
+	}
+	session.current = 5000;
+	REQUIRE(save_session_(file, session));
+	BENCHMARK("load session, 10000 tracks") {
+		session_snapshot loaded;
+		load_session_(file, loaded);
+		return loaded.tracks.size();
+	};
+	BENCHMARK("FMOD system create and init") {
+		FMOD::System *system = nullptr;
+		FMOD::System_Create(&system);
+		system->init(64, FMOD_INIT_NORMAL, nullptr);
+		system->close();
+		return system->release();
+	};
+	std::filesystem::remove(file);
+}
+
+TEST_CASE("playlist import, 1M-line M3U") {
+	// разбор из отображения отдельно от того, что стоит занести миллион треков в библиотеку и список
+	std::string file = (std::filesystem::temp_directory_path() / "sound_bench_import.m3u").string();
+	{
+		std::ofstream out(file, std::ios::binary | std::ios::trunc);
+		out << "#EXTM3U\n";
+		for (int i = 0; i < 500000; ++i) {
+			out << "#EXTINF:215,Artist " << i / 12 << " - Song " << i << "\nArtist " << i / 12 << "/" << i << ".mp3\n";
+		}
+	}
+	BENCHMARK("parse only") {
+		std::size_t bytes = 0;
+		import_playlist_(file, [&bytes](std::string const &path, playlist_entry const &) { bytes += path.size(); });
+		return bytes;
+	};
+	BENCHMARK("parse into library and playlist") {
+		track_library library;
+		playlist list;
+		return import_playlist_(
+				file, [&](std::string const &path, playlist_entry const &entry) { list.add(library.add(path, entry.range)); },
+				[&library](std::size_t entries, std::size_t bytes) { library.reserve(entries, bytes); });
+	};
+	std::filesystem::remove(file);
+}
+
+TEST_CASE("similar tracks over 500000 vectors") {
+	// сборка графа на полмиллиона - около полутора минут, она не меряется; меряются запрос и вставка в готовый
+	std::mt19937 random(3);
+	std::normal_distribution<float> gauss(0, 1);
+	std::size_t const count = 500000, clusters = 2000;
+	std::vector<float> centers(clusters * similarity_dims), point(similarity_dims);
+	for (float &x : centers) {
+		x = 2 * gauss(random);
+	}
+	auto next = [&]() {
+		std::size_t cluster = random() % clusters;
+		for (std::size_t d = 0; d < similarity_dims; ++d) {
+			point[d] = centers[cluster * similarity_dims + d] + gauss(random);
+		}
+		return point.data();
+	};
+	similarity_index index;
+	for (std::size_t i = 0; i < count; ++i) {
+		index.insert(static_cast<track_id>(i), next());
+	}
+	std::vector<std::pair<float, track_id>> found;
+	track_id query = 0;
+	BENCHMARK("10 nearest, ef 64") {
+		index.nearest(query, 10, found);
+		query = (query + 7919) % count;
+		return found.size();
+	};
+	track_id added = static_cast<track_id>(count);
+	BENCHMARK("insert one more track") {
+		return index.insert(added++, next());
+	};
+}
+
+TEST_CASE("search over 500000 tracks") {
+	// слова из слогов: у библиотеки много похожих, но разных названий, как у настоящей
+	static char const *syllables[] = {"ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "da", "be", "go", "ze", "ly", "po",
+									  "ti", "mar", "son", "del", "ver", "tan"};
+	std::mt19937 random(5);
+	auto word = [&](int parts) {
+		std::string w;
+		for (int i = 0; i < parts; ++i) {
+			w += syllables[random() % 20];
+		}
+		return w;
+	};
+	std::vector<std::string> artists(5000), albums(40000);
+	for (std::string &a : artists) {
+		a = word(3) + " " + word(2);
+	}
+	for (std::string &a : albums) {
+		a = word(2) + " " + word(3);
+	}
+	search_index index;
+	for (std::size_t i = 0; i < 500000; ++i) {
+		track_tags tags{word(3) + " " + word(2), artists[i % artists.size()], albums[i % albums.size()]};
+		index.set(static_cast<track_id>(i), tags, "C:/Music/" + tags.artist + "/" + tags.title + ".mp3");
+	}
+	std::string const known = artists[42], typo = known.substr(0, 3) + known.substr(4);
+	BENCHMARK("prefix, 3 letters") {
+		return index.query(known.substr(0, 3), 50).size();
+	};
+	BENCHMARK("prefix, two words") {
+		return index.query(known.substr(0, known.find(' ') + 3), 50).size();
+	};
+	BENCHMARK("fuzzy, one letter missing") {
+		return index.query(typo, 50).size();
+	};
+}
+
+TEST_CASE("control socket round trip") {
+	// команда за командой против пакета: пакет идёт одной отправкой и выполняется под одним замком
+	std::string path = (std::filesystem::temp_directory_path() / "sound_bench_control.sock").string();
+	std::mutex lock;
+	float volume = 1.0f;
+	control_server server(path, [&](std::vector<control_command> const &commands, std::vector<std::string> &) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (control_command const &c : commands) {
+			if (c.size() == 2) {
+				volume = std::stof(std::string(c[1]));
+			}
+		}
+	}, nullptr);
+	REQUIRE(server.start());
+	socket_handle s = connect_unix_(path);
+	REQUIRE(s != no_socket);
+	auto round_trip = [&](std::string const &text, std::size_t replies) {
+		send_all_(s, text.data(), text.size());
+		char buffer[512];
+		std::size_t lines = 0;
+		while (lines < replies) {
+			long got = receive_some_(s, buffer, sizeof(buffer), 2000);
+			if (got <= 0) {
+				break;
+			}
+			lines += static_cast<std::size_t>(std::count(buffer, buffer + got, '\n'));
+		}
+		return lines;
+	};
+	BENCHMARK("1 command") {
+		return round_trip("volume 0.5\n", 1);
+	};
+	std::string batch;
+	for (int i = 0; i < 8; ++i) {
+		batch += "volume 0." + std::to_string(i + 1) + "\n";
+	}
+	BENCHMARK("batch of 8") {
+		return round_trip(batch, 8);
+	};
+	BENCHMARK("8 commands one by one") {
+		std::size_t lines = 0;
+		for (int i = 0; i < 8; ++i) {
+			lines += round_trip("volume 0." + std::to_string(i + 1) + "\n", 1);
+		}
+		return lines;
+	};
+	close_socket_(s);
+	server.stop();
+}
+
+int FMOD_Main(int argc, char **argv) {
+	void *extradriverdata = 0;
+	Common_Init(&extradriverdata);
+
+	create_nrt_system_(bench_system);
+	bench_system->getMasterChannelGroup(&bench_master);
+	int result = Catch::Session().run(argc, argv);
+
+	bench_system->close();
+	bench_system->release();
+
+	Common_Close();
+	return result;
+}
@@ -2,7 +2,38 @@
 #define CATCH_CONFIG_RUNNER
 
 #include "catch.hpp"
+#include "net_stream.hpp"
+#include "icy_stand_in.hpp"
 #include "fmod_functions.hpp"
+#include "thread_config.hpp"
+#include "latency_profile.hpp"
+#include "offline_render.hpp"
+#include "dsp_graph.hpp"
+#include "time_stretch.hpp"
+#include "perf_monitor.hpp"
+#include "trace.hpp"
+#include "playlist.hpp"
+#include "search_index.hpp"
+#include "analysis_cache.hpp"
+#include "fingerprint.hpp"
+#include "music_analysis.hpp"
+#include "folder_watch.hpp"
+#include "album_art.hpp"
+#include "deck_mixer.hpp"
+#include "zones.hpp"
+#include "playback_events.hpp"
+#include "startup.hpp"
+#include "playlist_import.hpp"
+#include "similarity.hpp"
+#include "scrub_cache.hpp"
+#include "control_server.hpp"
+#include <random>
+#include <set>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
 #include <fmod.hpp>
 #include "common.h"
 #include <stdexcept>
@@ -28,6 +59,1566 @@ TEST_CASE("go to begin of the track") {
 	REQUIRE(b);
 }
 
+TEST_CASE("parse thread options") {
+	thread_config config;
+	REQUIRE(parse_thread_option_("--mixer-cores=1,3", config));
+	REQUIRE(config.mixer.affinity == (FMOD_THREAD_AFFINITY_CORE_1 | (1 << 3)));
+	REQUIRE(parse_thread_option_("--stream-priority=very_high", config));
+	REQUIRE(config.stream.priority == FMOD_THREAD_PRIORITY_VERY_HIGH);
+	REQUIRE(parse_thread_option_("--file-stack=96k", config));
+	REQUIRE(config.file.stack_size == 96 * 1024);
+	REQUIRE_FALSE(parse_thread_option_("--mixer-cores=", config));
+	REQUIRE_FALSE(parse_thread_option_("--geometry-cores=1", config));
+	REQUIRE_FALSE(parse_thread_option_("--nonblocking-priority=fast", config));
+	REQUIRE_FALSE(parse_thread_option_("--mixer-cores=1,", config));
+	REQUIRE(parse_thread_option_("--stream-stack=2m", config));
+	REQUIRE(config.stream.stack_size == 2 * 1024 * 1024);
+	REQUIRE_FALSE(parse_thread_option_("--stream-stack=99999999999999999999", config));
+	REQUIRE_FALSE(parse_thread_option_("--stream-stack=18014398509481984k", config));
+	REQUIRE_FALSE(parse_thread_option_("--stream-stack=-1", config));
+	REQUIRE(config.stream.stack_size == 2 * 1024 * 1024); // неудачный разбор ничего не меняет
+}
+TEST_CASE("passthrough keeps samples bit-exact") {
+	std::vector<float> reference;
+	source_format format;
+	REQUIRE(decode_to_float_(system2, Common_MediaPath("meow.mp3"), reference, format) == FMOD_OK);
+
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt, format) == FMOD_OK);
+	REQUIRE(mixer_matches_source_(nrt, format));
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	// тот же граф, что строит open_audio_: выключенные эффекты мастера, деки с узлом fader и шиной cue, отвод задержки
+	effect_chain chain = {{FMOD_DSP_TYPE_LOWPASS}, {FMOD_DSP_TYPE_HIGHPASS}, {FMOD_DSP_TYPE_ECHO}, {FMOD_DSP_TYPE_FLANGE}};
+	dsp_graph effects(nrt, master);
+	REQUIRE(effects.apply(chain) == FMOD_OK);
+	deck_mixer decks(nrt, master);
+	REQUIRE(decks.create(2) == FMOD_OK);
+	latency_probe probe;
+	FMOD::DSP *probe_dsp = nullptr;
+	REQUIRE(probe.attach(nrt, master, probe_dsp) == FMOD_OK);
+	render_capture capture;
+	FMOD::DSP *tap = nullptr;
+	REQUIRE(capture.attach(nrt, master, tap) == FMOD_OK);
+
+	FMOD::Sound *track = nullptr;
+	FMOD::Channel *ch = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM | FMOD_LOOP_OFF, 0, &track) == FMOD_OK);
+	REQUIRE(nrt->playSound(track, decks.at(0).group(), true, &ch) == FMOD_OK);
+	passthrough_channel_(ch);
+	ch->setPaused(false);
+	bool playing = true;
+	for (int blocks = 0; playing && blocks < 100000; ++blocks) {
+		nrt->update();
+		if (ch->isPlaying(&playing) != FMOD_OK) {
+			playing = false;
+		}
+	}
+
+	// микшер начинает с границы блока, поэтому выравниваем по первому ненулевому сэмплу
+	auto first_sound = [&format](std::vector<float> const &v) {
+		std::size_t i = 0;
+		while (i < v.size() && v[i] == 0.0f) {
+			++i;
+		}
+		return i - i % format.channels;
+	};
+	std::vector<float> const &rendered = capture.data();
+	std::size_t ref_begin = first_sound(reference);
+	std::size_t out_begin = first_sound(rendered);
+	REQUIRE(capture.num_channels() == format.channels);
+	REQUIRE(rendered.size() - out_begin >= reference.size() - ref_begin);
+	std::size_t mismatches = 0;
+	for (std::size_t i = 0; ref_begin + i < reference.size(); ++i) {
+		if (reference[ref_begin + i] != rendered[out_begin + i]) {
+			++mismatches;
+		}
+	}
+	REQUIRE(mismatches == 0);
+
+	track->release();
+	master->removeDSP(tap);
+	tap->release();
+	master->removeDSP(probe_dsp);
+	probe_dsp->release();
+	decks.release();
+	effects.release();
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("dsp graph applies only enabled effects and reuses units") {
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	int base_dsps = 0;
+	master->getNumDSPs(&base_dsps);
+	{
+		dsp_graph graph(nrt, master);
+		effect_chain chain = {{FMOD_DSP_TYPE_LOWPASS}, {FMOD_DSP_TYPE_HIGHPASS}, {FMOD_DSP_TYPE_ECHO}};
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.active_units() == 0);
+
+		chain[0].enabled = chain[2].enabled = true;
+		set_effect_param_(chain[0], FMOD_DSP_LOWPASS_CUTOFF, 1000);
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.active_units() == 2);
+		int num_dsps = 0;
+		master->getNumDSPs(&num_dsps);
+		REQUIRE(num_dsps == base_dsps + 2);
+		int lowpass_index = 0, echo_index = 0;
+		master->getDSPIndex(graph.unit(0), &lowpass_index);
+		master->getDSPIndex(graph.unit(2), &echo_index);
+		REQUIRE(lowpass_index > echo_index); // lowpass ближе к источнику
+
+		chain[1].enabled = true; // встаёт между ними
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		int highpass_index = 0;
+		master->getDSPIndex(graph.unit(0), &lowpass_index);
+		master->getDSPIndex(graph.unit(1), &highpass_index);
+		master->getDSPIndex(graph.unit(2), &echo_index);
+		REQUIRE(lowpass_index > highpass_index);
+		REQUIRE(highpass_index > echo_index);
+
+		FMOD::DSP *echo = graph.unit(2);
+		chain[2].enabled = false;
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.unit(2) == nullptr);
+		REQUIRE(graph.pooled_units() == 1);
+		chain[2].enabled = true;
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.unit(2) == echo);
+		REQUIRE(graph.pooled_units() == 0);
+		REQUIRE(graph.graph_updates() == 5);
+	}
+	int num_dsps = 0;
+	master->getNumDSPs(&num_dsps);
+	REQUIRE(num_dsps == base_dsps);
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("dsp graph puts unlisted parameters back to their defaults") {
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	{
+		dsp_graph graph(nrt, master);
+		effect_chain chain = {{FMOD_DSP_TYPE_HIGHPASS}};
+		chain[0].enabled = true;
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		FMOD::DSP *highpass = graph.unit(0);
+		float default_cutoff = 0, cutoff = 0;
+		highpass->getParameterFloat(FMOD_DSP_HIGHPASS_CUTOFF, &default_cutoff, nullptr, 0);
+		REQUIRE(default_cutoff != 300);
+
+		set_effect_param_(chain[0], FMOD_DSP_HIGHPASS_CUTOFF, 300); // пресет Telephone
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		highpass->getParameterFloat(FMOD_DSP_HIGHPASS_CUTOFF, &cutoff, nullptr, 0);
+		REQUIRE(cutoff == 300);
+		chain[0].params.clear(); // тот же узел, параметр убран из описания
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.unit(0) == highpass);
+		highpass->getParameterFloat(FMOD_DSP_HIGHPASS_CUTOFF, &cutoff, nullptr, 0);
+		REQUIRE(cutoff == default_cutoff);
+
+		set_effect_param_(chain[0], FMOD_DSP_HIGHPASS_CUTOFF, 300);
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		chain[0].enabled = false; // узел уходит в пул с частотой 300
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		chain[0] = {FMOD_DSP_TYPE_HIGHPASS, true};
+		REQUIRE(graph.apply(chain) == FMOD_OK);
+		REQUIRE(graph.unit(0) == highpass);
+		highpass->getParameterFloat(FMOD_DSP_HIGHPASS_CUTOFF, &cutoff, nullptr, 0);
+		REQUIRE(cutoff == default_cutoff);
+	}
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("latency probe catches the sound stopping and starting and forgets stale marks") {
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	latency_probe probe(50);
+	FMOD::DSP *tap = nullptr, *tone = nullptr;
+	REQUIRE(probe.attach(nrt, master, tap) == FMOD_OK);
+	REQUIRE(nrt->createDSPByType(FMOD_DSP_TYPE_OSCILLATOR, &tone) == FMOD_OK);
+	FMOD::Channel *ch = nullptr;
+	REQUIRE(nrt->playDSP(tone, master, false, &ch) == FMOD_OK);
+	auto blocks = [nrt](int n) {
+		for (int i = 0; i < n; ++i) {
+			nrt->update();
+		}
+	};
+	blocks(4);
+	REQUIRE(probe.rms() > 0.1f);
+
+	probe.mark();
+	blocks(4); // громкость та же: замер ждёт
+	REQUIRE(probe.pending());
+	REQUIRE(probe.report().count == 0);
+	ch->setMute(true);
+	blocks(4);
+	REQUIRE_FALSE(probe.pending());
+	REQUIRE(probe.report().count == 1);
+	REQUIRE(probe.rms() < 1e-4f);
+
+	probe.mark();
+	ch->setMute(false);
+	blocks(4);
+	REQUIRE(probe.report().count == 2);
+
+	probe.mark(); // команда без слышимого следствия
+	std::this_thread::sleep_for(std::chrono::milliseconds(80));
+	REQUIRE_FALSE(probe.pending());
+	blocks(1);
+	ch->setMute(true);
+	blocks(4);
+	REQUIRE(probe.report().count == 2); // тишина не приписана просроченной отметке
+
+	ch->stop();
+	master->removeDSP(tap);
+	tap->release();
+	tone->release();
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("time stretch keeps the pitch") {
+	for (float speed : {0.5f, 1.5f, 3.0f}) {
+		wsola_stretcher stretcher;
+		stretcher.configure(2, 48000, 512);
+		stretcher.set_speed(speed);
+		std::vector<float> block(512 * 2);
+		double phase = 0;
+		int crossings = 0;
+		float previous = 0;
+		unsigned counted = 0;
+		for (int b = 0; b < 400; ++b) {
+			for (unsigned i = 0; i < 512; ++i) {
+				// канал играет в speed раз быстрее: 440 Гц звучит как 440 * speed
+				block[2 * i] = block[2 * i + 1] = 0.5f * std::sin(phase);
+				phase += 2 * 3.14159265358979 * 440 * speed / 48000;
+			}
+			stretcher.process(block.data(), block.data(), 512);
+			for (unsigned i = 0; b > 10 && i < 512; ++i, ++counted) {
+				crossings += previous < 0 && block[2 * i] >= 0;
+				previous = block[2 * i];
+			}
+		}
+		double frequency = crossings / (counted / 48000.0);
+		REQUIRE(std::abs(frequency - 440) < 2);
+	}
+}
+
+TEST_CASE("time stretch resets only at the start of a block") {
+	wsola_stretcher stretcher;
+	stretcher.configure(1, 48000, 512);
+	stretcher.set_speed(1.5f);
+	std::vector<float> block(512);
+	auto loud = [&] {
+		std::fill(block.begin(), block.end(), 0.5f);
+		stretcher.process(block.data(), block.data(), 512);
+		return std::any_of(block.begin(), block.end(), [](float v) { return v != 0; });
+	};
+	bool sounding = false;
+	for (int b = 0; b < 20 && !sounding; ++b) {
+		sounding = loud();
+	}
+	REQUIRE(sounding);
+	stretcher.request_reset();
+	REQUIRE_FALSE(loud()); // история очищена: WSOLA снова копит запас
+}
+
+TEST_CASE("rolling histogram forgets old values") {
+	rolling_histogram hist(4, 0, 100, 10);
+	for (float v : {95.f, 95.f, 95.f, 95.f}) {
+		hist.add(v);
+	}
+	REQUIRE(hist.percentile(0.5f) == Approx(100));
+	for (float v : {5.f, 5.f, 5.f}) {
+		hist.add(v);
+	}
+	REQUIRE(hist.percentile(0.5f) == Approx(10));
+	REQUIRE(hist.percentile(1.0f) == Approx(100));
+	REQUIRE(hist.mean() == Approx(27.5f));
+	REQUIRE(hist.counts()[0] == 3);
+	REQUIRE(hist.counts()[9] == 1);
+}
+
+TEST_CASE("trace records scopes only while enabled") {
+	set_trace_enabled_(false);
+	{
+		trace_scope scope("trace test: disabled");
+	}
+	set_trace_enabled_(true);
+	{
+		trace_scope scope("trace test: enabled");
+	}
+	trace_instant_("trace test: instant");
+	set_trace_enabled_(false);
+	REQUIRE(dump_trace_("trace_test.json"));
+	std::stringstream text;
+	text << std::ifstream("trace_test.json").rdbuf();
+	REQUIRE(text.str().find("\"trace test: enabled\",\"ph\":\"X\"") != std::string::npos);
+	REQUIRE(text.str().find("\"trace test: instant\",\"ph\":\"i\"") != std::string::npos);
+	REQUIRE(text.str().find("trace test: disabled") == std::string::npos);
+	std::remove("trace_test.json");
+
+	auto rings = [] {
+		std::lock_guard<std::mutex> guard(trace_registry_().lock);
+		return trace_registry_().rings.size();
+	};
+	std::size_t before = rings();
+	std::thread([] {
+		trace_thread_name_("trace test: idle");
+		TRACE_SCOPE("trace test: idle scope");
+	}).join();
+	REQUIRE(rings() == before); // без записи кольцо не нужно
+	set_trace_enabled_(true);
+	for (int i = 0; i < 5; ++i) { // потоки по одному на трек: кольцо переходит от завершившегося к следующему
+		std::thread([] {
+			trace_thread_name_("trace test: worker");
+			trace_instant_("trace test: work");
+		}).join();
+	}
+	set_trace_enabled_(false);
+	REQUIRE(rings() <= before + 1);
+}
+
+TEST_CASE("lazy permutation is a bijection") {
+	for (std::uint64_t n : {1, 2, 3, 17, 1000, 4097}) {
+		lazy_permutation order;
+		order.reset(n, 42 + n);
+		std::set<std::uint64_t> seen;
+		for (std::uint64_t i = 0; i < n; ++i) {
+			std::uint64_t v = order(i);
+			REQUIRE(v < n);
+			REQUIRE(order.inverse(v) == i);
+			seen.insert(v);
+		}
+		REQUIRE(seen.size() == n);
+	}
+}
+
+TEST_CASE("playlist shuffle, queue, history and repeat") {
+	playlist list(7);
+	for (track_id id = 0; id < 10; ++id) {
+		list.add(id);
+	}
+	list.set_shuffle(true);
+	list.set_repeat(repeat_mode::all);
+	std::set<track_id> round;
+	for (int i = 0; i < 30; ++i) {
+		track_id expected = list.peek_next();
+		track_id id = list.next();
+		REQUIRE(id == expected);
+		if (i < 10) {
+			round.insert(id);
+		}
+	}
+	REQUIRE(round.size() == 10);
+
+	track_id before = list.current();
+	list.next();
+	REQUIRE(list.previous() == before);
+
+	list.enqueue(5);
+	REQUIRE(list.peek_next() == 5);
+	REQUIRE(list.next() == 5);
+	list.set_repeat(repeat_mode::one);
+	REQUIRE(list.next(true) == 5);
+
+	playlist plain(1);
+	for (track_id id = 0; id < 3; ++id) {
+		plain.add(id);
+	}
+	REQUIRE(plain.jump(1) == 1);
+	REQUIRE(plain.next() == 2);
+	REQUIRE(plain.next() == no_track);
+}
+
+TEST_CASE("playlist keeps the shuffle round when a track is added mid-round") {
+	playlist list(11);
+	for (track_id id = 0; id < 10; ++id) {
+		list.add(id);
+	}
+	list.set_shuffle(true);
+	std::vector<track_id> played;
+	for (int i = 0; i < 4; ++i) {
+		played.push_back(list.next());
+	}
+	list.add(10);
+	std::vector<track_id> rest;
+	for (track_id id = list.next(); id != no_track; id = list.next()) {
+		rest.push_back(id);
+	}
+	REQUIRE(rest.size() == 7);
+	REQUIRE(rest.back() == 10);
+	std::set<track_id> all(played.begin(), played.end());
+	all.insert(rest.begin(), rest.end());
+	REQUIRE(all.size() == 11);
+
+	for (std::size_t i = rest.size() - 1; i-- > 0;) {
+		REQUIRE(list.previous() == rest[i]);
+	}
+	for (std::size_t i = played.size(); i-- > 0;) {
+		REQUIRE(list.previous() == played[i]);
+	}
+	REQUIRE(list.next() == played[1]);
+}
+
+TEST_CASE("search index finds prefixes, substrings and typos") {
+	search_index index;
+	index.set(0, {}, "C:/Music/Beatles/Yesterday.mp3");
+	index.set(1, {"Группа крови", "Кино", ""}, "C:/Music/kino.mp3");
+	index.set(2, {}, "C:/Music/Other/Tomorrow.mp3");
+
+	auto top = [&index](char const *request) {
+		auto hits = index.query(request, 10);
+		return hits.empty() ? no_track : hits[0].id;
+	};
+	REQUIRE(top("yes") == 0);
+	REQUIRE(top("TERDAY") == 0);
+	REQUIRE(top("beatles yesterday") == 0);
+	REQUIRE(top("ГРУППА") == 1);
+	REQUIRE(top("beatels") == 0); // опечатка
+	REQUIRE(top("xyz") == no_track);
+	REQUIRE(index.query("ye", 10).size() == 1); // короткие слова - только с начала слова
+
+	index.set(2, {"Tomorrow Never Knows", "The Beatles", "Revolver"}, "C:/Music/Other/Tomorrow.mp3");
+	REQUIRE(index.query("beatles", 10).size() == 2);
+}
+
+/// мелодия из случайных нот с обертонами, mono; shift сдвигает начало на shift сэмплов
+static std::vector<float> make_melody_(unsigned seed, int rate, double seconds, int shift = 0, float noise = 0) {
+	std::mt19937 rng(seed);
+	std::vector<std::pair<double, double>> notes; // начало, частота
+	for (double t = 0; t < seconds + 1; t += 0.1 + (rng() % 400) / 1000.0) {
+		notes.push_back({t, 440 * std::pow(2, (int(rng() % 40) - 29) / 12.0)});
+	}
+	std::vector<float> out(static_cast<std::size_t>(seconds * rate));
+	std::size_t note = 0;
+	for (std::size_t i = 0; i < out.size(); ++i) {
+		double t = double(i + shift) / rate;
+		while (note + 1 < notes.size() && notes[note + 1].first <= t) {
+			++note;
+		}
+		double v = 0;
+		for (int h = 1; h <= 4; ++h) {
+			v += std::sin(2 * 3.14159265358979 * notes[note].second * h * t) / h;
+		}
+		out[i] = static_cast<float>(0.2 * v) + noise * static_cast<float>(int(rng() % 2001) - 1000) / 1000;
+	}
+	return out;
+}
+
+TEST_CASE("stale search is dropped and only the latest result is delivered") {
+	search_index index;
+	for (track_id id = 0; id < 10000; ++id) {
+		index.set(id, {}, "C:/Music/song " + std::to_string(id) + ".mp3");
+	}
+	std::atomic<unsigned> latest{2};
+	REQUIRE(index.query("song", 10, {&latest, 1}).empty()); // запрос устарел ещё до начала
+	REQUIRE(index.query("song", 10, {&latest, 2}).size() == 10);
+
+	std::mutex lock;
+	std::condition_variable entered;
+	bool reading = false;
+	std::mutex gate; // держит поток поиска в чтении тегов, пока тест задаёт запросы
+	std::unique_lock<std::mutex> hold_gate(gate);
+	search_worker worker([&](std::string const &path) {
+		if (path == "gate.mp3") {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				reading = true;
+			}
+			entered.notify_all();
+			std::lock_guard<std::mutex> pass(gate);
+		}
+		return track_tags{};
+	});
+	worker.add(0, "alpha.mp3");
+	worker.add(1, "beta.mp3");
+	worker.add(2, "gate.mp3");
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		REQUIRE(entered.wait_for(guard, std::chrono::seconds(5), [&] { return reading; }));
+	}
+	unsigned first = worker.search("alpha");
+	unsigned second = worker.search("beta");
+	REQUIRE(second > first);
+	hold_gate.unlock();
+
+	std::vector<search_hit> hits;
+	unsigned generation = 0;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!worker.take_results(hits, generation) && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	REQUIRE(generation >= second);
+	REQUIRE(hits.size() == 1);
+	REQUIRE(hits[0].id == 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	REQUIRE_FALSE(worker.take_results(hits, generation)); // "alpha" так и не выполнился
+}
+
+TEST_CASE("fingerprint finds the same melody in another encoding") {
+	fingerprint_extractor extractor;
+	auto print = [&extractor](std::vector<float> const &signal, int rate) {
+		std::vector<float> mono;
+		downmix_resample_(signal, 1, rate, fingerprint_rate, mono);
+		return extractor.compute(mono.data(), mono.size());
+	};
+	audio_fingerprint original = print(make_melody_(1, 44100, 20), 44100);
+	audio_fingerprint copy = print(make_melody_(1, 48000, 20, 700, 0.02f), 48000); // другая частота, сдвиг и шум
+	audio_fingerprint other = print(make_melody_(2, 44100, 20), 44100);
+	REQUIRE(fingerprint_similarity_(original, copy, 0) > 0.75f);
+	REQUIRE(fingerprint_similarity_(original, other, 0) < 0.6f);
+
+	duplicate_index index;
+	index.add(0, original);
+	index.add(1, other);
+	index.add(2, copy);
+	index.build();
+	auto groups = group_duplicates_(index.find_pairs());
+	REQUIRE(groups.size() == 1);
+	REQUIRE(groups[0].tracks == std::vector<track_id>{0, 2});
+}
+
+TEST_CASE("music analyzer finds tempo, beat grid and key") {
+	int const rate = 44100;
+	double const bpm = 128, offset = 0.3, beat = 60 / bpm;
+	int const a_minor[] = {57, 60, 64}; // A3 C4 E4
+	std::mt19937 rng(3);
+	std::vector<float> signal(30 * rate), mono;
+	for (std::size_t i = 0; i < signal.size(); ++i) {
+		double t = double(i) / rate, v = 0;
+		if (t >= offset) { // бочка на каждую долю
+			double phase = std::fmod(t - offset, beat);
+			v += 0.6 * std::exp(-phase * 40) * std::sin(2 * 3.14159265358979 * 60 * phase) +
+				 0.2 * std::exp(-phase * 80) * (int(rng() % 2001) - 1000) / 1000.0;
+		}
+		for (int note : a_minor) {
+			v += 0.05 * std::sin(2 * 3.14159265358979 * 440 * std::pow(2, (note - 69) / 12.0) * t);
+		}
+		signal[i] = static_cast<float>(v);
+	}
+	downmix_resample_(signal, 1, rate, analysis_rate, mono);
+	music_analyzer analyzer;
+	track_analysis result = analyzer.analyze(mono.data(), mono.size());
+	REQUIRE(std::abs(result.bpm - bpm) < 0.5);
+	REQUIRE(std::abs(result.first_beat - offset) < 0.02);
+	REQUIRE(key_name_(result.key, result.minor) == "Am");
+	REQUIRE(camelot_key_(result.key, result.minor) == "8A");
+}
+
+TEST_CASE("analysis cache keys by payload and keeps recent artifacts") {
+	auto dir = std::filesystem::temp_directory_path();
+	std::string payload(300 * 1024, 0);
+	std::mt19937 rng(5);
+	for (char &c : payload) {
+		c = static_cast<char>(rng());
+	}
+	auto write = [](std::filesystem::path const &path, std::string const &bytes) {
+		std::ofstream(path, std::ios::binary) << bytes;
+	};
+	std::string id3v2("ID3\x04\x00\x00\x00\x00\x00\x0a", 10);
+	std::string id3v1 = "TAG" + std::string(125, 'x');
+	write(dir / "sound_plain.bin", payload);
+	write(dir / "sound_tagged.bin", id3v2 + std::string(10, 't') + payload + id3v1);
+	payload[150 * 1024] ^= 1;
+	write(dir / "sound_changed.bin", payload);
+	content_key plain, tagged, changed;
+	REQUIRE(payload_hash_((dir / "sound_plain.bin").string().c_str(), plain));
+	REQUIRE(payload_hash_((dir / "sound_tagged.bin").string().c_str(), tagged));
+	REQUIRE(payload_hash_((dir / "sound_changed.bin").string().c_str(), changed));
+	REQUIRE(plain == tagged);
+	REQUIRE(!(plain == changed));
+
+	std::string file = (dir / "sound_test.cache").string();
+	std::filesystem::remove(file);
+	std::vector<char> out, artifact(8000, 'a');
+	{
+		analysis_cache cache(64 * 1024);
+		REQUIRE(cache.open(file));
+		REQUIRE(cache.put(plain, artifact_type_("TEST"), 1, artifact.data(), artifact.size()));
+		REQUIRE(cache.get(plain, artifact_type_("TEST"), 1, out));
+		REQUIRE(out == artifact);
+		REQUIRE(!cache.get(plain, artifact_type_("TEST"), 2, out)); // другая версия анализатора - промах
+	}
+	analysis_cache cache(64 * 1024);
+	REQUIRE(cache.open(file));
+	REQUIRE(cache.get(plain, artifact_type_("TEST"), 1, out));
+	for (std::uint64_t i = 1; i <= 20; ++i) {
+		REQUIRE(cache.put({i, i}, artifact_type_("TEST"), 1, artifact.data(), artifact.size()));
+		REQUIRE(cache.get(plain, artifact_type_("TEST"), 1, out)); // часто нужная запись переживает сжатие
+	}
+	REQUIRE(cache.used() <= 64 * 1024);
+	REQUIRE(cache.entries() < 21);
+	REQUIRE(cache.get({20, 20}, artifact_type_("TEST"), 1, out));
+	REQUIRE(!cache.get({1, 1}, artifact_type_("TEST"), 1, out));
+}
+
+TEST_CASE("watch folder changes coalesce and renames keep the track") {
+	change_coalescer events;
+	for (int i = 0; i < 3; ++i) {
+		events.added("music/new.mp3"); // копирование пишет файл кусками
+	}
+	events.added("music/temp.mp3");
+	events.removed("music/temp.mp3");
+	events.moved("music/a.mp3", "music/b.mp3");
+	events.moved("music/b.mp3", "music/c.mp3");
+	events.removed("music/gone.mp3");
+	std::vector<folder_change> batch;
+	events.take(batch);
+	REQUIRE(batch.size() == 3);
+	REQUIRE((batch[0].kind == folder_change::moved && batch[0].from == "music/a.mp3" && batch[0].path == "music/c.mp3"));
+	REQUIRE((batch[1].kind == folder_change::removed && batch[1].path == "music/gone.mp3"));
+	REQUIRE((batch[2].kind == folder_change::added && batch[2].path == "music/new.mp3"));
+
+	folder_snapshot before{{"music/x/one.mp3", {10, 100}}, {"music/x/two.mp3", {10, 100}}, {"music/old.mp3", {20, 5}}},
+			after{{"music/y/one.mp3", {10, 100}}, {"music/y/two.mp3", {10, 100}}, {"music/old.mp3", {30, 5}}};
+	diff_snapshots_(before, after, events); // папку перенесли, пока очередь событий была переполнена
+	batch.clear();
+	events.take(batch);
+	REQUIRE(batch.size() == 3);
+	REQUIRE(batch[0].kind == folder_change::modified);
+	REQUIRE((batch[1].kind == folder_change::moved && batch[1].from == "music/x/one.mp3"));
+	REQUIRE((batch[2].kind == folder_change::moved && batch[2].from == "music/x/two.mp3"));
+
+	track_library library;
+	track_id id = library.add("music/x/one.mp3");
+	library.add("music/other.mp3");
+	library.set_analysis(id, {128, 0.5f, 9, true, 0.4f});
+	library.rename(id, "music/y/one.mp3");
+	REQUIRE(library.find("music/x/one.mp3") == no_track);
+	REQUIRE(library.find("music/y/one.mp3") == id);
+	REQUIRE(library.path(id) == "music/y/one.mp3");
+	REQUIRE(library.analysis(id).bpm == 128);
+	REQUIRE(!is_audio_path_("music/cover.jpg"));
+	REQUIRE(is_audio_path_("music/Track.FLAC"));
+}
+
+TEST_CASE("watch folder calls back with a ready batch and the event pump hands it over on its own thread") {
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "sound_test_watch";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	std::ofstream(dir / "new.mp3") << "x"; // придёт первой сверкой, без ожидания событий
+	std::mutex lock;
+	std::condition_variable done;
+	unsigned seen = 0, deliveries = 0;
+	std::thread::id deliverer;
+	std::mutex gate; // держит обработчик, пока тест постит
+	std::unique_lock<std::mutex> hold_gate(gate);
+	event_pump pump([&](unsigned events) {
+		std::lock_guard<std::mutex> pass(gate);
+		std::lock_guard<std::mutex> guard(lock);
+		seen |= events;
+		++deliveries;
+		deliverer = std::this_thread::get_id();
+		done.notify_all();
+	});
+	pump.post(1);
+	pump.post(4); // обработчик стоит, а post не ждёт его
+	{
+		folder_watcher watcher({dir.string()}, {}, std::chrono::milliseconds(20), std::chrono::milliseconds(100),
+							   [&] { pump.post(2); });
+		hold_gate.unlock();
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			REQUIRE(done.wait_for(guard, std::chrono::seconds(5), [&] { return seen == 7; }));
+		}
+		REQUIRE(deliverer != std::this_thread::get_id());
+		REQUIRE(deliveries <= 3); // биты сливаются, пока обработчик занят
+		std::vector<folder_change> batch;
+		REQUIRE(watcher.take_changes(batch));
+		REQUIRE(batch.size() == 1);
+		REQUIRE((batch[0].kind == folder_change::added && batch[0].path == (dir / "new.mp3").string()));
+	}
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("album art comes out of ID3 and FLAC tags as a cached thumbnail") {
+	rgba_image cover; // 200 x 100: левая половина красная, правая синяя
+	cover.width = 200;
+	cover.height = 100;
+	for (int y = 0; y < 100; ++y) {
+		for (int x = 0; x < 200; ++x) {
+			cover.pixels.push_back(x < 100 ? 0xffff0000u : 0xff0000ffu);
+		}
+	}
+	std::vector<char> bmp;
+	encode_bmp_(cover, bmp);
+	auto be32 = [](std::uint32_t v) {
+		return std::string{char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+	};
+	std::string apic = std::string("\0image/bmp\0\x03" "cover\0", 18) + std::string(bmp.begin(), bmp.end());
+	std::string frame = "APIC" + be32(static_cast<std::uint32_t>(apic.size())) + std::string(2, '\0') + apic;
+	std::uint32_t n = static_cast<std::uint32_t>(frame.size());
+	std::string id3 = std::string("ID3\x03\0\0", 6) + char(n >> 21 & 0x7f) + char(n >> 14 & 0x7f) + char(n >> 7 & 0x7f) +
+					  char(n & 0x7f) + frame + std::string(1000, '\x55');
+	std::string picture_block = be32(3) + be32(9) + "image/bmp" + be32(0) + std::string(16, '\0') +
+								be32(static_cast<std::uint32_t>(bmp.size())) + std::string(bmp.begin(), bmp.end());
+	std::uint32_t m = static_cast<std::uint32_t>(picture_block.size());
+	std::string flac = "fLaC" + std::string("\0\0\0\x22", 4) + std::string(34, '\0') + char('\x86') + char(m >> 16) +
+					   char(m >> 8) + char(m) + picture_block;
+	auto dir = std::filesystem::temp_directory_path();
+	std::ofstream(dir / "sound_art.mp3", std::ios::binary) << id3;
+	std::ofstream(dir / "sound_art.flac", std::ios::binary) << flac;
+
+	std::vector<char> from_id3, from_flac;
+	REQUIRE(read_embedded_art_((dir / "sound_art.mp3").string().c_str(), from_id3));
+	REQUIRE(read_embedded_art_((dir / "sound_art.flac").string().c_str(), from_flac));
+	REQUIRE(from_id3 == bmp);
+	REQUIRE(from_flac == bmp);
+
+	rgba_image decoded, thumb;
+	REQUIRE(decode_image_(from_id3.data(), from_id3.size(), decoded));
+	downscale_square_(decoded, thumbnail_side, thumb); // квадрат из середины: красная и синяя половины
+	REQUIRE(thumb.width == thumbnail_side);
+	REQUIRE(thumb.pixels[40 * thumbnail_side + 10] == 0xffff0000u);
+	REQUIRE(thumb.pixels[40 * thumbnail_side + 90] == 0xff0000ffu);
+
+	std::string file = (dir / "sound_art.cache").string();
+	std::filesystem::remove(file);
+	analysis_cache cache;
+	REQUIRE(cache.open(file));
+	art_loader loader(&cache, 1 << 20, 1);
+	REQUIRE(!loader.request(0, (dir / "sound_art.mp3").string()));
+	std::vector<track_id> loaded;
+	for (int wait = 0; wait < 500 && !loader.take_loaded(loaded); ++wait) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(loaded == std::vector<track_id>{0});
+	REQUIRE(loader.find(0));
+	REQUIRE(loader.find(0)->bmp.size() == 54 + thumbnail_side * thumbnail_side * 4);
+	loader.request(1, (dir / "sound_art.flac").string()); // та же обложка - из кэша, без распаковки
+	for (int wait = 0; wait < 500 && !loader.take_loaded(loaded); ++wait) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(cache.hits() == 1);
+	REQUIRE(loader.find(1)->bmp == loader.find(0)->bmp);
+}
+
+TEST_CASE("net stream strips ICY metadata and reconnects without losing the sound") {
+	icy_demuxer icy;
+	icy.reset(4);
+	std::string wire = std::string("abcd\x02StreamTitle='A - B';\0\0\0\0\0\0\0\0\0\0\0\0efgh\0ijkl", 46);
+	std::vector<char> audio;
+	for (char c : wire) { // по байту - метаданные режутся в любом месте
+		icy.feed(&c, 1, audio);
+	}
+	std::string title;
+	REQUIRE(std::string(audio.begin(), audio.end()) == "abcdefghijkl");
+	REQUIRE(icy.take_title(title));
+	REQUIRE(title == "A - B");
+	REQUIRE(!icy.take_title(title));
+
+	icy_stand_in_options server;
+	for (int i = 0; i < 251; ++i) {
+		server.body.push_back(static_cast<char>(i));
+	}
+	server.bytes_per_second = 200000;
+	server.burst_bytes = 16000;
+	server.metaint = 1000;
+	server.drop_after = 60000;
+	server.jitter_ms = 10;
+	icy_stand_in radio(server);
+	REQUIRE(radio.ready());
+	net_stream_options options;
+	options.start_bytes = 8000;
+	net_stream stream(radio.url(), options);
+	std::vector<char> got(200000);
+	std::size_t total = 0;
+	while (total < got.size()) {
+		std::size_t n = stream.read(got.data() + total, got.size() - total);
+		REQUIRE(n > 0);
+		total += n;
+	}
+	std::size_t breaks = 0; // звук идёт подряд, стыки - только на переподключениях
+	for (std::size_t i = 1; i < got.size(); ++i) {
+		if (static_cast<unsigned char>(got[i]) != (static_cast<unsigned char>(got[i - 1]) + 1) % 251) {
+			++breaks;
+		}
+	}
+	net_stream_stats stats = stream.stats();
+	REQUIRE(stats.reconnects >= 2);
+	REQUIRE(breaks <= stats.reconnects);
+	REQUIRE(stream.take_title(title));
+	REQUIRE(title == server.title);
+	REQUIRE(stream.station_name() == "Stand-in Radio");
+	REQUIRE(stats.first_byte_ms >= 0);
+
+	std::ifstream mp3(Common_MediaPath("meow.mp3"), std::ios::binary);
+	icy_stand_in_options meow;
+	meow.body.assign(std::istreambuf_iterator<char>(mp3), std::istreambuf_iterator<char>());
+	meow.metaint = 8192;
+	icy_stand_in meow_radio(meow);
+	net_stream meow_stream(meow_radio.url(), options);
+	FMOD::Sound *live = nullptr;
+	REQUIRE(open_net_stream_(system2, meow_stream, live) == FMOD_OK);
+	FMOD_SOUND_TYPE type;
+	live->getFormat(&type, nullptr, nullptr, nullptr);
+	REQUIRE(type == FMOD_SOUND_TYPE_MPEG);
+	meow_stream.stop();
+	live->release();
+}
+TEST_CASE("decks mix through their own groups and quiet voices go virtual") {
+	FMOD::System *nrt = nullptr;
+	REQUIRE(FMOD::System_Create(&nrt) == FMOD_OK);
+	REQUIRE(nrt->setOutput(FMOD_OUTPUTTYPE_NOSOUND_NRT) == FMOD_OK);
+	REQUIRE(nrt->setSoftwareChannels(8) == FMOD_OK);
+	REQUIRE(nrt->init(256, FMOD_INIT_VOL0_BECOMES_VIRTUAL, nullptr) == FMOD_OK);
+	FMOD::ChannelGroup *master = nullptr;
+	nrt->getMasterChannelGroup(&master);
+	FMOD::Sound *meow = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESAMPLE | FMOD_LOOP_NORMAL, 0, &meow) == FMOD_OK);
+	{
+		deck_mixer decks(nrt, master);
+		REQUIRE(decks.create(2) == FMOD_OK);
+		FMOD::Channel *track = nullptr, *shot = nullptr;
+		REQUIRE(decks.at(0).play(meow, track) == FMOD_OK);
+		for (int i = 0; i < 40; ++i) { // больше, чем реальных голосов
+			REQUIRE(decks.at(1).play(meow, shot, deck_one_shot_priority) == FMOD_OK);
+		}
+		nrt->update();
+		int all = 0, real = 0;
+		decks.voices(all, real);
+		REQUIRE(all == 41);
+		REQUIRE(real <= 8);
+		bool is_virtual = true;
+		track->isVirtual(&is_virtual);
+		REQUIRE(!is_virtual); // дорожка деки важнее сэмплов
+
+		REQUIRE(decks.at(1).group()->setVolume(0.0f) == FMOD_OK); // неслышную деку не микшируем вовсе
+		nrt->update();
+		decks.voices(all, real);
+		REQUIRE(real == 1);
+
+		REQUIRE(decks.at(1).stop() == FMOD_OK);
+		REQUIRE(decks.crossfade(1.0f) == FMOD_OK); // кроссфейдер не делает голоса виртуальными: их слышно в cue
+		nrt->update();
+		decks.voices(all, real);
+		REQUIRE(real == 1);
+
+		REQUIRE(decks.at(0).set_pitch(1.5f) == FMOD_OK);
+		float pitch = 0;
+		decks.at(0).group()->getPitch(&pitch);
+		REQUIRE(pitch == Approx(1.5f));
+
+		render_capture capture; // split: программа слева, прослушка справа
+		FMOD::DSP *tap = nullptr;
+		REQUIRE(capture.attach(nrt, master, tap) == FMOD_OK);
+		REQUIRE(decks.set_split_cue(true) == FMOD_OK);
+		REQUIRE(decks.at(0).set_cue(true) == FMOD_OK);
+		for (int i = 0; i < 20; ++i) {
+			nrt->update();
+		}
+		float left = 0, right = 0;
+		std::vector<float> const &out = capture.data();
+		for (std::size_t i = 0; i + 1 < out.size(); i += capture.num_channels()) {
+			left = std::max(left, std::fabs(out[i]));
+			right = std::max(right, std::fabs(out[i + 1]));
+		}
+		REQUIRE(left < 0.001f); // дека 0 убрана кроссфейдером
+		REQUIRE(right > 0.01f); // но слышна в наушниках
+		master->removeDSP(tap);
+		tap->release();
+		REQUIRE(decks.release() == FMOD_OK);
+	}
+	meow->release();
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("zones stay sample-aligned over an hour of offline rendering") {
+	// у каждой зоны свой кварц: выход делает rate * (1 + skew) кадров в секунду общих часов
+	struct simulated_output {
+		int rate;
+		double skew;
+		std::unique_ptr<zone> player;
+		unsigned int block = 1024;
+		double frames = 0;    ///< сколько кадров выход уже отдал
+		double last = 0;      ///< когда закончился последний блок, по общим часам
+		unsigned int pcm = 0; ///< позиция содержимого после него
+		double next_end() const { return (frames + block) / (rate * (1 + skew)); }
+	};
+	std::vector<simulated_output> outputs(3);
+	outputs[0].rate = 48000;
+	outputs[0].skew = 0;
+	outputs[1].rate = 44100;
+	outputs[1].skew = 80e-6;
+	outputs[2].rate = 48000;
+	outputs[2].skew = -120e-6;
+	int const source_rate = 44100;
+	double const start = 0.3, hour = 3600;
+	FMOD_CREATESOUNDEXINFO info;
+	std::memset(&info, 0, sizeof(info));
+	info.cbsize = sizeof(info);
+	info.numchannels = 1;
+	info.defaultfrequency = source_rate;
+	info.format = FMOD_SOUND_FORMAT_PCM16;
+	info.length = static_cast<unsigned int>((hour + 60) * source_rate * 2);
+	info.decodebuffersize = 4096;
+	info.pcmreadcallback = [](FMOD_SOUND *, void *data, unsigned int bytes) {
+		std::memset(data, 0, bytes); // содержимое неважно, сверяются позиции
+		return FMOD_OK;
+	};
+	for (std::size_t i = 0; i < outputs.size(); ++i) {
+		zone_options options;
+		options.name = "zone " + std::to_string(i);
+		options.output = FMOD_OUTPUTTYPE_NOSOUND_NRT;
+		options.rate = outputs[i].rate;
+		outputs[i].player.reset(new zone(options));
+		REQUIRE(outputs[i].player->open() == FMOD_OK);
+		outputs[i].player->fmod_system()->getDSPBufferSize(&outputs[i].block, nullptr);
+		FMOD::Sound *stream = nullptr;
+		REQUIRE(outputs[i].player->fmod_system()->createSound(nullptr, FMOD_OPENUSER | FMOD_CREATESTREAM, &info,
+															  &stream) == FMOD_OK);
+		REQUIRE(outputs[i].player->play_synced(stream, start, 0) == FMOD_OK);
+	}
+
+	double now = 0, worst = 0;
+	while (now < hour) {
+		simulated_output *next = &outputs[0]; // блоки идут в том порядке, в каком их отдали бы выходы
+		for (auto &o : outputs) {
+			if (o.next_end() < next->next_end()) {
+				next = &o;
+			}
+		}
+		now = next->next_end();
+		next->player->step(now);
+		next->frames += next->block;
+		next->last = now;
+		next->pcm = next->player->position();
+		if (now < 60) {
+			continue; // первую минуту корректор набирает окно
+		}
+		double lo = 1e300, hi = -1e300;
+		for (auto const &o : outputs) {
+			double at_now = o.pcm + (now - o.last) * source_rate; // позиция зоны на текущий момент
+			lo = std::min(lo, at_now);
+			hi = std::max(hi, at_now);
+		}
+		worst = std::max(worst, hi - lo);
+	}
+	INFO("worst spread between zones " << worst << " frames");
+	REQUIRE(worst <= 2.0);
+	for (auto &o : outputs) {
+		REQUIRE(o.player->corrector()->skew_ppm() == Approx(o.skew * 1e6).margin(1.0));
+		REQUIRE(std::fabs(o.pcm + (now - o.last) * source_rate - (now - start) * source_rate) <= 2.0);
+		o.player->close();
+	}
+}
+TEST_CASE("playback machine follows the end of a track and sleeps while nothing plays") {
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::Sound *meow = nullptr, *missing = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM | FMOD_NONBLOCKING | FMOD_LOOP_OFF, 0,
+							 &meow) == FMOD_OK);
+	std::recursive_mutex player;
+	FMOD::Channel *playing = nullptr;
+	int plays = 0, ends = 0, failures = 0;
+	std::unique_ptr<playback_machine> machine;
+	auto play_meow = [&] {
+		nrt->playSound(meow, nullptr, false, &playing);
+		++plays;
+		machine->play(playing);
+	};
+	machine.reset(new playback_machine(player, [&](FMOD::Sound *, bool ok) {
+		if (ok) {
+			play_meow();
+		} else {
+			++failures;
+		}
+	}, [&] {
+		if (++ends < 3) {
+			play_meow(); // автопереход из потока плеера
+		}
+	}, std::chrono::milliseconds(1)));
+	auto wait_until = [&](std::function<bool()> done) {
+		for (int i = 0; i < 4000; ++i) {
+			{
+				std::lock_guard<std::recursive_mutex> hold(player);
+				if (done()) {
+					return true;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		return false;
+	};
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		machine->attach(nrt);
+		machine->open(meow);
+		REQUIRE(machine->state() == playback_state::opening);
+	}
+	REQUIRE(wait_until([&] { return ends == 3; }));
+	REQUIRE(plays == 3);
+	REQUIRE(machine->state() == playback_state::stopped);
+	unsigned events = machine->events().take();
+	REQUIRE((events & playback_ended) != 0);
+	REQUIRE((events & playback_state_changed) != 0);
+	REQUIRE((events & playback_open_failed) == 0);
+	std::uint64_t posts = 0, takes = 0;
+	machine->events().counts(posts, takes);
+	REQUIRE(takes == 1); // три трека с концами и переходами слились в одно пробуждение UI
+	REQUIRE(posts >= 6);
+
+	std::uint64_t updates = machine->update_count(); // остановлен - update не зовётся
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	REQUIRE(machine->update_count() == updates);
+
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		play_meow();
+		playing->setPaused(true);
+		machine->pause(true);
+		REQUIRE(machine->state() == playback_state::paused);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	updates = machine->update_count();
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	REQUIRE(machine->update_count() == updates); // на паузе тоже
+
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		FMOD::Channel *replaced = playing;
+		play_meow(); // замена канала - не конец трека
+		replaced->stop();
+		playing->setPaused(false);
+		machine->pause(false);
+	}
+	REQUIRE(wait_until([&] { return machine->state() == playback_state::stopped; }));
+	REQUIRE(ends == 4);
+
+	REQUIRE(nrt->createSound("no such file.mp3", FMOD_CREATESTREAM | FMOD_NONBLOCKING, 0, &missing) == FMOD_OK);
+	machine->events().take();
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		machine->open(missing);
+	}
+	REQUIRE(wait_until([&] { return failures == 1; }));
+	REQUIRE((machine->events().take() & playback_open_failed) != 0);
+	REQUIRE(machine->state() == playback_state::stopped);
+	REQUIRE(plays == 5);
+
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		machine->attach(nullptr);
+	}
+	machine.reset();
+	missing->release();
+	meow->release();
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("session snapshot round-trips and a damaged file is not half-read") {
+	std::string file = (std::filesystem::temp_directory_path() / "sound_test_session.bin").string();
+	session_snapshot saved;
+	saved.tracks = {"C:\\music\\a.mp3", "/home/user/Музыка/b.flac", ""};
+	saved.ranges = {{}, {13687, 31500}, {}};
+	saved.queue = {2, 0};
+	saved.current = 1;
+	saved.position_ms = 83500;
+	saved.speed = 1.25f;
+	saved.repeat = static_cast<std::uint8_t>(repeat_mode::one);
+	saved.shuffle = true;
+	saved.effects = {{FMOD_DSP_TYPE_LOWPASS, true, {{FMOD_DSP_LOWPASS_CUTOFF, 3400.0f}}}, {FMOD_DSP_TYPE_ECHO}};
+	REQUIRE(save_session_(file, saved));
+
+	session_snapshot loaded;
+	REQUIRE(load_session_(file, loaded));
+	REQUIRE(loaded.tracks == saved.tracks);
+	REQUIRE(loaded.ranges.size() == 3);
+	REQUIRE(loaded.ranges[0].whole());
+	REQUIRE(loaded.ranges[1].start == 13687);
+	REQUIRE(loaded.ranges[1].end == 31500);
+	REQUIRE(loaded.queue == saved.queue);
+	REQUIRE(loaded.current == 1);
+	REQUIRE(loaded.position_ms == 83500);
+	REQUIRE(loaded.speed == 1.25f);
+	REQUIRE(loaded.repeat == saved.repeat);
+	REQUIRE(loaded.shuffle);
+	REQUIRE(loaded.effects.size() == 2);
+	REQUIRE(loaded.effects[0].enabled);
+	REQUIRE(loaded.effects[0].params == saved.effects[0].params);
+	REQUIRE(loaded.effects[1].type == FMOD_DSP_TYPE_ECHO);
+
+	std::string bytes;
+	{
+		std::ifstream in(file, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	bytes[20] ^= 1;
+	std::ofstream(file, std::ios::binary | std::ios::trunc) << bytes;
+	session_snapshot untouched;
+	untouched.current = 7;
+	REQUIRE(!load_session_(file, untouched));
+	REQUIRE(untouched.current == 7);
+	REQUIRE(untouched.tracks.empty());
+	std::ofstream(file, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() / 2);
+	REQUIRE(!load_session_(file, untouched));
+	bytes.replace(8, 4, 4, '\xff'); // заголовок обещает 4 ГБ тела
+	std::ofstream(file, std::ios::binary | std::ios::trunc) << bytes;
+	REQUIRE(!load_session_(file, untouched));
+	std::filesystem::remove(file);
+	REQUIRE(!load_session_(file, untouched));
+
+	startup_phases phases;
+	phases.mark("window");
+	std::thread([&phases] { phases.mark("audio"); }).join();
+	REQUIRE(phases.at("window") >= 0);
+	REQUIRE(phases.at("audio") >= phases.at("window"));
+	REQUIRE(phases.at("never") < 0);
+	std::string report = phases.report();
+	REQUIRE(report.find("window") < report.find("audio"));
+}
+
+TEST_CASE("playlists and CUE sheets import from the mapped file and a CUE song plays only its part") {
+	auto dir = std::filesystem::temp_directory_path() / "sound_test_import";
+	std::filesystem::create_directories(dir);
+	std::string folder = dir.string() + "/";
+	std::vector<std::string> paths, titles;
+	std::vector<track_range> ranges;
+	auto import = [&](char const *name, std::string const &text) {
+		std::ofstream(dir / name, std::ios::binary | std::ios::trunc) << text;
+		paths.clear();
+		titles.clear();
+		ranges.clear();
+		return import_playlist_((dir / name).string(), [&](std::string const &path, playlist_entry const &entry) {
+			paths.push_back(path);
+			titles.emplace_back(entry.title); // строки записи живут только во время вызова
+			ranges.push_back(entry.range);
+		});
+	};
+
+	REQUIRE(import("a.m3u8", "\xEF\xBB\xBF#EXTM3U\r\n#EXTINF:215,Artist - Song\r\nsub/a.mp3\r\n\r\n"
+							 "C:\\music\\b.mp3\r\nhttp://radio.example/stream\r\n") == 3);
+	REQUIRE(paths == std::vector<std::string>{folder + "sub/a.mp3", "C:\\music\\b.mp3", "http://radio.example/stream"});
+	REQUIRE(titles == std::vector<std::string>{"Artist - Song", "", ""});
+
+	REQUIRE(import("b.pls", "[playlist]\nTitle1=First\nFile1=a.mp3\nFile2=/abs/b.mp3\nTitle2=Second\nNumberOfEntries=2\n") == 2);
+	REQUIRE(paths == std::vector<std::string>{folder + "a.mp3", "/abs/b.mp3"});
+	REQUIRE(titles == std::vector<std::string>{"First", "Second"});
+
+	REQUIRE(import("c.xspf", "<?xml version=\"1.0\"?><playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\"><trackList>"
+							 "<track><title>R &amp; B</title><location>file:///music/a%20b.mp3</location></track>"
+							 "<track><location>rel/R&amp;B.mp3</location></track></trackList></playlist>") == 2);
+	REQUIRE(paths == std::vector<std::string>{"/music/a b.mp3", folder + "rel/R&B.mp3"});
+	REQUIRE(titles[0] == "R &amp; B");
+
+	REQUIRE(import("d.cue", "PERFORMER \"Band\"\nTITLE \"Album\"\nFILE \"album.flac\" WAVE\n"
+							"  TRACK 01 AUDIO\n    TITLE \"One\"\n    INDEX 01 00:00:00\n"
+							"  TRACK 02 AUDIO\n    TITLE \"Two\"\n    INDEX 00 03:00:00\n    INDEX 01 03:02:37\n"
+							"  TRACK 03 AUDIO\n    INDEX 01 07:00:00\n"
+							"FILE \"second.wav\" WAVE\n  TRACK 04 AUDIO\n    INDEX 01 00:00:00\n") == 4);
+	REQUIRE(paths == std::vector<std::string>{folder + "album.flac", folder + "album.flac", folder + "album.flac",
+											  folder + "second.wav"});
+	REQUIRE(titles == std::vector<std::string>{"One", "Two", "", ""});
+	std::uint32_t two = (3 * 60 + 2) * cue_frames_per_second + 37;
+	REQUIRE(ranges[0].start == 0);
+	REQUIRE(ranges[0].end == two); // пауза INDEX 00 остаётся в конце первого трека
+	REQUIRE(ranges[1].start == two);
+	REQUIRE(ranges[1].end == 7 * 60 * cue_frames_per_second);
+	REQUIRE(ranges[2].end == 0); // последний трек файла - до конца
+	REQUIRE(ranges[3].whole());
+	REQUIRE(track_range::to_pcm(two, 44100) == two * 588u); // кадр - ровно 588 сэмплов
+	REQUIRE(track_range::to_ms(two) == 182493);
+	REQUIRE(ranges[1].length_ms(600000) == 420000 - 182493);
+	REQUIRE(ranges[2].length_ms(600000) == 180000);
+	REQUIRE(ranges[1].seek_ms(1000, 600000) == 183493);
+	REQUIRE(ranges[1].seek_ms(999999, 600000) == 420000); // за конец трека не перематывается
+	REQUIRE(ranges[1].track_ms(100, 600000) == 0);
+
+	REQUIRE(import("e.txt", "not a playlist") == 0);
+	REQUIRE(import_playlist_((dir / "none.m3u").string(), [](std::string const &, playlist_entry const &) {}) == 0);
+	std::filesystem::remove_all(dir);
+
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::Sound *meow = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_CREATESTREAM | FMOD_LOOP_OFF, 0, &meow) == FMOD_OK);
+	unsigned int samples = 0;
+	REQUIRE(meow->getLength(&samples, FMOD_TIMEUNIT_PCM) == FMOD_OK);
+	std::recursive_mutex player;
+	std::atomic<int> ends{0};
+	playback_machine machine(player, [](FMOD::Sound *, bool) {}, [&] { ++ends; }, std::chrono::milliseconds(1));
+	auto play = [&](unsigned int end) {
+		std::uint64_t before = machine.update_count();
+		{
+			std::lock_guard<std::recursive_mutex> hold(player);
+			machine.attach(nrt);
+			FMOD::Channel *channel = nullptr;
+			nrt->playSound(meow, nullptr, false, &channel);
+			machine.play(channel, end);
+		}
+		int seen = ends;
+		for (int i = 0; i < 4000 && ends == seen; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		REQUIRE(ends == seen + 1);
+		return machine.update_count() - before;
+	};
+	std::uint64_t whole = play(0);
+	std::uint64_t part = play(samples / 4);
+	REQUIRE(part < whole / 2); // в NRT звук идёт по блоку за update: четверть файла - четверть вызовов
+	{
+		std::lock_guard<std::recursive_mutex> hold(player);
+		machine.attach(nullptr);
+	}
+	meow->release();
+	nrt->close();
+	nrt->release();
+}
+TEST_CASE("similar tracks come from the timbre, tempo and key, and the index survives a restart") {
+	std::mt19937 random(7);
+	std::normal_distribution<float> gauss(0, 1);
+	auto tone = [&](double hz, float noise) {
+		std::vector<float> mono(analysis_rate * 20);
+		for (std::size_t i = 0; i < mono.size(); ++i) {
+			mono[i] = 0.3f * static_cast<float>(std::sin(2 * 3.14159265358979323846 * hz * i / analysis_rate)) +
+					  noise * gauss(random);
+		}
+		return mono;
+	};
+	timbre_extractor extractor;
+	track_timbre low, near, hiss, silent;
+	auto a = tone(220, 0.01f), b = tone(233, 0.01f), c = tone(220, 0.3f);
+	REQUIRE(extractor.compute(a.data(), a.size(), low));
+	REQUIRE(extractor.compute(b.data(), b.size(), near));
+	REQUIRE(extractor.compute(c.data(), c.size(), hiss));
+	std::vector<float> quiet(analysis_rate * 20, 0.0f);
+	REQUIRE(!extractor.compute(quiet.data(), quiet.size(), silent));
+	track_analysis slow, fast;
+	slow.bpm = 90;
+	slow.key = 9; // A минор и C мажор - одна точка на круге
+	slow.minor = true;
+	fast.bpm = 174;
+	fast.key = 0;
+	float va[similarity_dims], vb[similarity_dims], vc[similarity_dims], vd[similarity_dims];
+	similarity_vector_(low, slow, va);
+	similarity_vector_(near, slow, vb);
+	similarity_vector_(hiss, slow, vc);
+	similarity_vector_(low, fast, vd);
+	REQUIRE(l2_squared_(va, vb, similarity_dims) < l2_squared_(va, vc, similarity_dims));
+	REQUIRE(l2_squared_(va, vb, similarity_dims) < l2_squared_(va, vd, similarity_dims));
+	REQUIRE(va[29] == Approx(vd[29]));
+	REQUIRE(va[30] == Approx(vd[30]).margin(1e-6));
+
+	// граф против полного перебора на скоплениях, как у жанров
+	std::size_t const count = 4000, clusters = 40;
+	std::vector<float> centers(clusters * similarity_dims), points(count * similarity_dims);
+	for (float &x : centers) {
+		x = 2 * gauss(random);
+	}
+	similarity_index index;
+	for (std::size_t i = 0; i < count; ++i) {
+		std::size_t cluster = random() % clusters;
+		for (std::size_t d = 0; d < similarity_dims; ++d) {
+			points[i * similarity_dims + d] = centers[cluster * similarity_dims + d] + gauss(random);
+		}
+		REQUIRE(index.insert(static_cast<track_id>(i), &points[i * similarity_dims]));
+	}
+	REQUIRE(!index.insert(0, &points[0]));
+	std::size_t hits = 0, total = 0;
+	std::vector<std::pair<float, track_id>> found;
+	for (track_id q = 0; q < 100; ++q) {
+		REQUIRE(index.nearest(q, 10, found));
+		REQUIRE(found.size() == 10);
+		std::vector<std::pair<float, track_id>> exact;
+		for (std::size_t i = 0; i < count; ++i) {
+			if (i != q) {
+				exact.emplace_back(l2_squared_(&points[q * similarity_dims], &points[i * similarity_dims], similarity_dims),
+								   static_cast<track_id>(i));
+			}
+		}
+		std::partial_sort(exact.begin(), exact.begin() + 10, exact.end());
+		for (auto const &f : found) {
+			REQUIRE(f.second != q);
+			for (std::size_t j = 0; j < 10; ++j) {
+				hits += exact[j].second == f.second;
+			}
+		}
+		total += 10;
+	}
+	REQUIRE(double(hits) / total > 0.95);
+
+	std::string file = (std::filesystem::temp_directory_path() / "sound_test_similar.bin").string();
+	auto name = [](track_id id) { return "track " + std::to_string(id); };
+	std::string buffer;
+	REQUIRE(index.save(file, [&](track_id id) {
+		buffer = name(id);
+		return std::string_view(buffer);
+	}));
+	similarity_index restored;
+	REQUIRE(restored.load(file));
+	REQUIRE(restored.size() == count);
+	REQUIRE(restored.orphan_count() == count);
+	REQUIRE(!restored.nearest(1000 + 5, 10, found)); // пока пути не связаны с библиотекой, треков нет
+	for (track_id i = 0; i < count; i += 2) { // номера в новом запуске другие; половина треков ещё не в библиотеке
+		REQUIRE(restored.adopt(name(i), 1000 + i));
+	}
+	REQUIRE(!restored.adopt("not in the file", 1));
+	std::vector<std::pair<float, track_id>> again;
+	REQUIRE(index.nearest(4, 63, found)); // тот же перебор ef = 64, что и ниже
+	REQUIRE(restored.nearest(1000 + 4, 10, again));
+	std::vector<track_id> even;
+	for (auto const &f : found) {
+		if (f.second % 2 == 0 && even.size() < again.size()) {
+			even.push_back(1000 + f.second);
+		}
+	}
+	for (std::size_t i = 0; i < again.size(); ++i) {
+		REQUIRE(again[i].second == even[i]); // сироты пропускаются, порядок тот же
+	}
+	float fresh[similarity_dims];
+	std::copy(&points[4 * similarity_dims], &points[5 * similarity_dims], fresh);
+	fresh[0] += 0.01f;
+	REQUIRE(restored.insert(9999, fresh)); // индекс растёт и после загрузки
+	REQUIRE(restored.nearest(1000 + 4, 1, again));
+	REQUIRE(again[0].second == 9999);
+
+	std::string bytes;
+	{
+		std::ifstream in(file, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	bytes[bytes.size() / 2] ^= 1;
+	std::ofstream(file, std::ios::binary | std::ios::trunc) << bytes;
+	REQUIRE(!restored.load(file));
+	REQUIRE(restored.size() == count + 1);
+	std::filesystem::remove(file);
+}
+
+TEST_CASE("scrub cache serves seeks inside its window without touching the decoder") {
+	// кадр - его собственный номер, так видно, откуда пришёл каждый прочитанный кадр
+	std::uint32_t const rate = 1000, total = 60 * rate;
+	std::atomic<std::uint32_t> position{0};
+	std::atomic<unsigned> restarts{0};
+	auto decode = [&](char *out, std::size_t bytes) {
+		std::uint32_t frames = std::min<std::uint32_t>(static_cast<std::uint32_t>(bytes / 4), total - position);
+		for (std::uint32_t i = 0; i < frames; ++i) {
+			std::uint32_t v = position + i;
+			std::memcpy(out + 4 * i, &v, 4);
+		}
+		position += frames;
+		return std::size_t(frames) * 4;
+	};
+	auto restart = [&](std::uint64_t frame) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5)); // сжатый файл ищет точку синхронизации
+		position = static_cast<std::uint32_t>(frame);
+		++restarts;
+		return true;
+	};
+	scrub_counters counters;
+	scrub_cache_options options;
+	options.back_seconds = 5;
+	options.ahead_seconds = 5;
+	options.chunk_frames = 256;
+	pcm_scrub_cache cache(decode, restart, 4, rate, total, options, &counters);
+	auto expect = [&cache](std::uint32_t from, std::uint32_t frames) {
+		std::vector<std::uint32_t> got(frames);
+		std::size_t bytes = cache.read(reinterpret_cast<char *>(got.data()), frames * 4);
+		for (std::uint32_t i = 0; i < bytes / 4; ++i) {
+			REQUIRE(got[i] == from + i);
+		}
+		return bytes / 4;
+	};
+
+	REQUIRE(expect(0, 8 * rate) == 8 * rate);
+	REQUIRE(cache.seek(4 * rate)); // назад, в окне
+	REQUIRE(expect(4 * rate, 500) == 500);
+	REQUIRE(cache.seek(3 * rate + 1)); // ещё назад, всё ещё в окне
+	REQUIRE(expect(3 * rate + 1, rate) == rate);
+	REQUIRE(cache.seek(12 * rate)); // вперёд за окно, но не дальше ahead: декодер просто идёт дальше
+	REQUIRE(expect(12 * rate, rate) == rate);
+	REQUIRE(restarts == 0);
+	std::uint64_t from = 0, to = 0;
+	cache.window(from, to);
+	REQUIRE(to - from <= std::uint64_t(10 * rate + 256));
+
+	REQUIRE(!cache.seek(40 * rate)); // далеко: декодер сбрасывается, окно начинается заново
+	REQUIRE(expect(40 * rate, rate) == rate);
+	REQUIRE(restarts == 1);
+	REQUIRE(!cache.seek(rate)); // вытесненное тоже промах
+	REQUIRE(expect(rate, 100) == 100);
+	REQUIRE(restarts == 2);
+
+	REQUIRE(!cache.seek(total - 300));
+	REQUIRE(expect(total - 300, 1000) == 300); // конец файла - короткое чтение, дальше стрим играет тишину
+	REQUIRE(cache.read(nullptr, 0) == 0);
+
+	scrub_report report = counters.report();
+	REQUIRE(report.seeks == 6);
+	REQUIRE(report.hits == 3);
+	REQUIRE(report.hit_rate == Approx(0.5));
+	REQUIRE(report.latency.count == 6);
+	REQUIRE(report.latency.p50 <= report.latency.p99);
+	REQUIRE(report.latency.max >= 5); // промах ждал перемотки декодера
+}
+
+TEST_CASE("control socket runs batches, pushes state and reports its latency") {
+	std::string path = (std::filesystem::temp_directory_path() / "sound_test_control.sock").string();
+	FMOD::System *nrt = nullptr;
+	REQUIRE(create_nrt_system_(nrt) == FMOD_OK);
+	FMOD::Sound *meow = nullptr;
+	REQUIRE(nrt->createSound(Common_MediaPath("meow.mp3"), FMOD_DEFAULT, 0, &meow) == FMOD_OK);
+	FMOD::Channel *channel = nullptr;
+	REQUIRE(nrt->playSound(meow, nullptr, true, &channel) == FMOD_OK);
+	std::mutex lock; // замок "плеера"
+	auto volume = [&] {
+		float v = 0;
+		channel->getVolume(&v);
+		return v;
+	};
+	std::atomic<long long> applied_ns{0};
+	auto now_ns = [] {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	};
+	unsigned batches = 0;
+	control_server server(path, [&](std::vector<control_command> const &commands, std::vector<std::string> &replies) {
+		std::lock_guard<std::mutex> guard(lock);
+		++batches;
+		for (std::size_t i = 0; i < commands.size(); ++i) {
+			if (commands[i][0] == "volume" && commands[i].size() == 2) {
+				// как control_commands_: громкость канала через change_volume_
+				float value = std::stof(std::string(commands[i][1]));
+				change_volume_(channel, value - volume());
+				applied_ns = now_ns();
+			} else if (commands[i][0] == "echo") {
+				replies[i] = "ok";
+				for (std::size_t j = 1; j < commands[i].size(); ++j) {
+					replies[i] += ' ' + std::string(commands[i][j]);
+				}
+			} else {
+				replies[i] = "error unknown command";
+			}
+		}
+	}, [&](std::vector<std::pair<std::string, std::string>> &state) {
+		std::lock_guard<std::mutex> guard(lock);
+		state.emplace_back("volume", std::to_string(volume()));
+		state.emplace_back("track", "meow.mp3");
+	}, 10000); // тик длиннее теста: всё, что приходит, пришло по изменению, а не по таймеру
+	REQUIRE(server.start());
+	control_server second(path, nullptr, nullptr);
+	REQUIRE(!second.start()); // сокет живого плеера не отнимается
+
+	socket_handle s = connect_unix_(path);
+	REQUIRE(s != no_socket);
+	std::string pending;
+	auto line = [&]() {
+		char buffer[4096];
+		std::size_t end;
+		while ((end = pending.find('\n')) == std::string::npos) {
+			long got = receive_some_(s, buffer, sizeof(buffer), 2000);
+			if (got <= 0) {
+				return std::string("<nothing>");
+			}
+			pending.append(buffer, static_cast<std::size_t>(got));
+		}
+		std::string out = pending.substr(0, end);
+		pending.erase(0, end + 1);
+		return out;
+	};
+	auto send = [&](std::string const &text) { REQUIRE(send_all_(s, text.data(), text.size())); };
+
+	send("ping\necho \"two words\" x\r\nvolume 0.25\n\nfrobnicate\n");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "ok two words x");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "error unknown command");
+	REQUIRE(batches == 1); // одна отправка - один пакет под одним замком
+	REQUIRE(volume() == 0.25f);
+
+	send("subscribe volume\n");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "event volume " + std::to_string(0.25f));
+	send("volume 0.5\n");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "event volume " + std::to_string(0.5f));
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		channel->setVolume(0.75f); // кнопка в окне
+	}
+	server.wake();
+	REQUIRE(line() == "event volume " + std::to_string(0.75f));
+	send("subscribe *\n");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "event track meow.mp3");
+	send("unsubscribe *\nvolume 0.1\nping\n");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "ok");
+	REQUIRE(line() == "ok"); // и никаких event после отписки
+	REQUIRE(pending.empty());
+
+	// от отправки до того, как команда применена, и до ответа
+	std::vector<double> effect_ms, reply_ms;
+	for (int i = 0; i < 2000; ++i) {
+		long long start = now_ns();
+		send(i % 2 ? "volume 0.5\n" : "volume 0.6\n");
+		REQUIRE(line() == "ok");
+		long long done = now_ns();
+		effect_ms.push_back((applied_ns - start) / 1e6);
+		reply_ms.push_back((done - start) / 1e6);
+	}
+	std::sort(effect_ms.begin(), effect_ms.end());
+	std::sort(reply_ms.begin(), reply_ms.end());
+	WARN("command to effect p50 " << effect_ms[1000] << " ms, p99 " << effect_ms[1980] << " ms; round trip p50 "
+								  << reply_ms[1000] << " ms, p99 " << reply_ms[1980] << " ms");
+	// требование - меньше 1 мс от команды до канала; p99 с запасом на планировщик, SOUND_BUDGET_SCALE растягивает оба
+	char const *scale_env = std::getenv("SOUND_BUDGET_SCALE");
+	double scale = scale_env && *scale_env ? std::atof(scale_env) : 1;
+	CHECK(effect_ms[1000] <= 1.0 * scale);
+	CHECK(effect_ms[1980] <= 5.0 * scale);
+
+	close_socket_(s);
+	server.stop();
+	REQUIRE(!std::filesystem::exists(path));
+	channel->stop();
+	meow->release();
+	nrt->close();
+	nrt->release();
+}
+
+TEST_CASE("control socket ticks only while someone follows the position") {
+	std::string path = (std::filesystem::temp_directory_path() / "sound_test_control_tick.sock").string();
+	std::atomic<unsigned> snapshots{0};
+	control_server server(path, nullptr, [&](std::vector<std::pair<std::string, std::string>> &state) {
+		state.emplace_back("position", std::to_string(++snapshots)); // позиция меняется при каждом взгляде
+		state.emplace_back("volume", "1.0");
+	}, 5);
+	REQUIRE(server.start());
+	socket_handle s = connect_unix_(path);
+	REQUIRE(s != no_socket);
+	char buffer[4096];
+	auto wait_for = [&](std::string const &text) {
+		std::string got;
+		while (got.find(text) == std::string::npos) {
+			long n = receive_some_(s, buffer, sizeof(buffer), 2000);
+			if (n <= 0) {
+				return false;
+			}
+			got.append(buffer, static_cast<std::size_t>(n));
+		}
+		return true;
+	};
+	std::string subscribe = "subscribe volume\n";
+	REQUIRE(send_all_(s, subscribe.data(), subscribe.size()));
+	REQUIRE(wait_for("event volume 1.0\n"));
+	unsigned before = snapshots;
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	REQUIRE(snapshots == before); // подписчик громкости не будит сервер по тику
+
+	subscribe = "subscribe position\n";
+	REQUIRE(send_all_(s, subscribe.data(), subscribe.size()));
+	REQUIRE(wait_for("event position " + std::to_string(before + 3) + "\n")); // несколько тиков подряд
+
+	close_socket_(s);
+	server.stop();
+}
 
 int FMOD_Main(int argc, char **argv) {
 	void *extradriverdata = 0;
@@ -0,0 +1,190 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_MAPPED_FILE_HPP
+#define SOUND_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * \brief файл, отображённый в память
+ * Только для чтения - для разбора больших файлов без копирования, на запись - для хранилищ,
+ * которые растут через resize. После resize старые указатели на data() недействительны.
+ */
+class mapped_file {
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+	char *base = nullptr;
+	std::size_t length = 0;
+	bool writable = false;
+
+	void unmap() {
+#ifdef _WIN32
+		if (base) {
+			UnmapViewOfFile(base);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		mapping = nullptr;
+#else
+		if (base) {
+			munmap(base, length);
+		}
+#endif
+		base = nullptr;
+	}
+
+	bool map() {
+		if (length == 0) {
+			return true; // пустой файл отобразить нельзя, data() == nullptr
+		}
+#ifdef _WIN32
+		mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) {
+			return false;
+		}
+		base = static_cast<char *>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length));
+		return base != nullptr;
+#else
+		void *p = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		base = p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+		return base != nullptr;
+#endif
+	}
+
+	bool set_file_size(std::size_t size) {
+#ifdef _WIN32
+		LARGE_INTEGER pos;
+		pos.QuadPart = static_cast<LONGLONG>(size);
+		return SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+#else
+		return ftruncate(fd, static_cast<off_t>(size)) == 0;
+#endif
+	}
+
+public:
+	mapped_file() = default;
+
+	mapped_file(mapped_file const &) = delete;
+	mapped_file &operator=(mapped_file const &) = delete;
+
+	~mapped_file() { close(); }
+
+	/**
+	 * \brief открывает и отображает файл
+	 * @param write - на запись; файл создаётся, если его нет
+	 * @param min_size - для записи: файл дополняется нулями до этого размера
+	 * @return false, если файл не открылся или не отобразился
+	 */
+	bool open(std::string const &path, bool write = false, std::size_t min_size = 0) {
+		close();
+		writable = write;
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, nullptr,
+						   write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		length = static_cast<std::size_t>(size.QuadPart);
+#else
+		fd = ::open(path.c_str(), write ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		fstat(fd, &st);
+		length = static_cast<std::size_t>(st.st_size);
+#endif
+		if (write && length < min_size) {
+			if (!set_file_size(min_size)) {
+				close();
+				return false;
+			}
+			length = min_size;
+		}
+		if (!map()) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * \brief меняет размер файла, открытого на запись, и отображает его заново
+	 */
+	bool resize(std::size_t size) {
+		if (!writable || !is_open()) {
+			return false;
+		}
+		unmap();
+		if (!set_file_size(size)) {
+			length = 0;
+			return false;
+		}
+		length = size;
+		return map();
+	}
+
+	/// сбрасывает изменённые страницы на диск
+	void flush() {
+		if (!base || !writable) {
+			return;
+		}
+#ifdef _WIN32
+		FlushViewOfFile(base, length);
+#else
+		msync(base, length, MS_ASYNC);
+#endif
+	}
+
+	void close() {
+		unmap();
+#ifdef _WIN32
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (fd >= 0) {
+			::close(fd);
+		}
+		fd = -1;
+#endif
+		length = 0;
+	}
+
+	bool is_open() const {
+#ifdef _WIN32
+		return file != INVALID_HANDLE_VALUE;
+#else
+		return fd >= 0;
+#endif
+	}
+
+	char *data() { return base; }
+
+	char const *data() const { return base; }
+
+	std::size_t size() const { return length; }
+};
+
+#endif //SOUND_MAPPED_FILE_HPP
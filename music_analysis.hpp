@@ -0,0 +1,423 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_MUSIC_ANALYSIS_HPP
+#define SOUND_MUSIC_ANALYSIS_HPP
+
+#include "fmod.hpp"
+#include "analysis_cache.hpp"
+#include "fingerprint.hpp"
+#include "library.hpp"
+#include "offline_render.hpp"
+#include "similarity.hpp"
+#include "spectrum.hpp"
+#include "thread_config.hpp"
+#include "time_stretch.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// кадр и шаг функции атак: шаг 11.6 мс даёт сетку долей точнее 1 BPM
+constexpr std::size_t onset_frame = 1024;
+constexpr std::size_t onset_hop = 128;
+/// кадр хромы: 2.7 Гц на бин, чтобы различить полутона в басу
+constexpr std::size_t key_frame = 4096;
+/// сколько секунд от начала трека разбирается
+constexpr double analysis_seconds = 180;
+
+/**
+ * \brief спектральный поток: сумма положительных приращений спектра (SSE, если доступно)
+ */
+inline float spectral_flux_(float const *now, float const *before, std::size_t n) {
+	std::size_t i = 0;
+	float sum = 0;
+#ifdef SOUND_HAVE_SSE
+	__m128 acc = _mm_setzero_ps(), zero = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm_add_ps(acc, _mm_max_ps(zero, _mm_sub_ps(_mm_loadu_ps(now + i), _mm_loadu_ps(before + i))));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, acc);
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; i < n; ++i) {
+		sum += std::max(0.0f, now[i] - before[i]);
+	}
+	return sum;
+}
+
+/**
+ * \brief название тональности: "C", "F#m"
+ */
+inline std::string key_name_(int key, bool minor) {
+	static char const *names[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+	if (key < 0 || key > 11) {
+		return {};
+	}
+	return std::string(names[key]) + (minor ? "m" : "");
+}
+
+/**
+ * \brief тональность по кругу Camelot, которым пользуются диджеи: соседние номера сводятся без диссонанса
+ */
+inline std::string camelot_key_(int key, bool minor) {
+	if (key < 0 || key > 11) {
+		return {};
+	}
+	int major = minor ? (key + 3) % 12 : key; // параллельный мажор
+	return std::to_string((major * 7 + 7) % 12 + 1) + (minor ? "A" : "B");
+}
+
+/**
+ * \brief темп, сетка долей и тональность моно-сигнала с частотой analysis_rate
+ * Темп - автокорреляция функции атак с гребёнкой по кратным периодам и мягким предпочтением 120 BPM
+ * против ошибок на октаву, затем уточнение периода и фазы свёрткой функции атак по периоду.
+ * Тональность - средняя нормированная хрома против профилей Крумхансла-Кесслер для 24 тональностей.
+ * Один объект на поток: буферы переиспользуются между треками.
+ */
+class music_analyzer {
+	spectrum_analyzer onset{onset_frame, analysis_rate};
+	spectrum_analyzer tonal{key_frame, analysis_rate};
+	std::vector<float> power, current, previous, odf, smooth, correlation;
+
+	void compute_onsets(float const *mono, std::size_t n) {
+		odf.clear();
+		std::fill(previous.begin(), previous.end(), 0.0f);
+		for (std::size_t start = 0; start + onset_frame <= n; start += onset_hop) {
+			onset.power(mono + start, power.data());
+			for (std::size_t k = 0; k < current.size(); ++k) {
+				current[k] = std::log1p(std::sqrt(power[k])); // сжатие: тихие атаки весят почти как громкие
+			}
+			odf.push_back(spectral_flux_(current.data(), previous.data(), current.size()));
+			std::swap(current, previous);
+		}
+		// вычитаем локальное среднее за ~0.5 с: остаются атаки, а не громкость
+		std::size_t half = 22;
+		smooth.assign(odf.size(), 0.0f);
+		double sum = 0;
+		std::size_t lo = 0, hi = 0;
+		for (std::size_t t = 0; t < odf.size(); ++t) {
+			for (; hi < std::min(odf.size(), t + half + 1); ++hi) {
+				sum += odf[hi];
+			}
+			for (; lo + half < t; ++lo) {
+				sum -= odf[lo];
+			}
+			smooth[t] = std::max(0.0f, odf[t] - float(sum / double(hi - lo)));
+		}
+		odf.swap(smooth);
+	}
+
+	/// сумма функции атак в каждой из bins фаз периода period кадров
+	void fold(double period, std::vector<float> &bins) const {
+		std::fill(bins.begin(), bins.end(), 0.0f);
+		for (std::size_t t = 0; t < odf.size(); ++t) {
+			double phase = std::fmod(double(t), period) / period;
+			bins[std::min(bins.size() - 1, static_cast<std::size_t>(phase * bins.size()))] += odf[t];
+		}
+	}
+
+	void estimate_tempo(track_analysis &out) {
+		double odf_rate = double(analysis_rate) / onset_hop;
+		auto lag_min = static_cast<std::size_t>(odf_rate * 60 / 200);
+		auto lag_max = static_cast<std::size_t>(odf_rate * 60 / 60) + 1;
+		if (odf.size() < 4 * lag_max) {
+			return; // меньше четырёх долей самого медленного темпа
+		}
+		correlation.assign(2 * lag_max + 2, 0.0f);
+		for (std::size_t lag = 0; lag < correlation.size(); ++lag) {
+			correlation[lag] = dot_product_(odf.data(), odf.data() + lag, odf.size() - lag) / float(odf.size() - lag);
+		}
+		if (correlation[0] <= 0) {
+			return;
+		}
+		auto score = [&](std::size_t lag) {
+			double bpm = odf_rate * 60 / lag;
+			double prior = std::exp(-0.5 * std::pow(std::log2(bpm / 120) / 0.9, 2));
+			return (correlation[lag] + 0.5 * correlation[2 * lag]) * prior;
+		};
+		std::size_t best = lag_min;
+		for (std::size_t lag = lag_min; lag <= lag_max; ++lag) {
+			if (score(lag) > score(best)) {
+				best = lag;
+			}
+		}
+		if (correlation[best] < 0.05f * correlation[0]) {
+			return; // периодичности нет: речь, эмбиент
+		}
+		double lag = best;
+		if (best > lag_min && best < lag_max) { // парабола через три точки
+			double a = score(best - 1), b = score(best), c = score(best + 1), d = a - 2 * b + c;
+			if (d < 0) {
+				lag += 0.5 * (a - c) / d;
+			}
+		}
+		// уточнение: период, при котором атаки сильнее всего собираются в одной фазе
+		std::vector<float> bins(32);
+		double best_bpm = odf_rate * 60 / lag, best_peak = -1, best_phase = 0;
+		double center = best_bpm;
+		for (double bpm = center - 1; bpm <= center + 1; bpm += 0.02) {
+			double period = odf_rate * 60 / bpm;
+			fold(period, bins);
+			auto peak = std::max_element(bins.begin(), bins.end());
+			if (*peak > best_peak) {
+				best_peak = *peak;
+				best_bpm = bpm;
+				best_phase = (double(peak - bins.begin()) + 0.5) / bins.size() * period;
+			}
+		}
+		// фаза: по кадру на корзину и парабола через пик
+		double period = odf_rate * 60 / best_bpm;
+		bins.assign(static_cast<std::size_t>(period), 0.0f);
+		fold(period, bins);
+		std::size_t peak = static_cast<std::size_t>(std::max_element(bins.begin(), bins.end()) - bins.begin());
+		double a = bins[(peak + bins.size() - 1) % bins.size()], b = bins[peak], c = bins[(peak + 1) % bins.size()];
+		double shift = a - 2 * b + c < 0 ? 0.5 * (a - c) / (a - 2 * b + c) : 0;
+		best_phase = (double(peak) + 0.5 + shift) / bins.size() * period;
+		out.bpm = static_cast<float>(std::round(best_bpm * 100) / 100);
+		// поток растёт быстрее всего, когда атака на 3/4 окна: там круче всего склон окна Ханна
+		double first = (best_phase * onset_hop + onset_frame * 0.75) / analysis_rate;
+		double beat = 60 / best_bpm;
+		out.first_beat = static_cast<float>(std::fmod(first, beat));
+	}
+
+	void estimate_key(float const *mono, std::size_t n, track_analysis &out) {
+		static double const major[12] = {6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88};
+		static double const minor[12] = {6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17};
+		std::vector<float> key_power(tonal.bins());
+		double total[12] = {};
+		float chroma[12];
+		for (std::size_t start = 0; start + key_frame <= n; start += key_frame) {
+			tonal.power(mono + start, key_power.data());
+			tonal.chroma(key_power.data(), chroma);
+			float sum = 0;
+			for (float c : chroma) {
+				sum += c;
+			}
+			if (sum < 1e-3f) {
+				continue; // тишина
+			}
+			for (int c = 0; c < 12; ++c) {
+				total[c] += chroma[c] / sum; // каждый кадр весит одинаково, громкий припев не перевешивает
+			}
+		}
+		auto pearson = [&total](double const *profile, int tonic) {
+			double mx = 0, my = 0;
+			for (int i = 0; i < 12; ++i) {
+				mx += total[(tonic + i) % 12];
+				my += profile[i];
+			}
+			mx /= 12;
+			my /= 12;
+			double sxy = 0, sxx = 0, syy = 0;
+			for (int i = 0; i < 12; ++i) {
+				double x = total[(tonic + i) % 12] - mx, y = profile[i] - my;
+				sxy += x * y;
+				sxx += x * x;
+				syy += y * y;
+			}
+			return sxx > 0 ? sxy / std::sqrt(sxx * syy) : 0.0;
+		};
+		double best = -2, second = -2;
+		for (int tonic = 0; tonic < 12; ++tonic) {
+			for (int mode = 0; mode < 2; ++mode) {
+				double r = pearson(mode ? minor : major, tonic);
+				if (r > best) {
+					second = best;
+					best = r;
+					out.key = tonic;
+					out.minor = mode == 1;
+				} else if (r > second) {
+					second = r;
+				}
+			}
+		}
+		if (best <= 0) {
+			out.key = -1;
+			return;
+		}
+		out.key_confidence = static_cast<float>(std::min(1.0, best - second));
+	}
+
+public:
+	music_analyzer() : power(onset.bins()), current(onset.bins()), previous(onset.bins()) {}
+
+	/// функция атак последнего разобранного сигнала, analysis_rate / onset_hop отсчётов в секунду
+	std::vector<float> const &onset_envelope() const { return odf; }
+
+	track_analysis analyze(float const *mono, std::size_t n) {
+		TRACE_SCOPE("music_analyzer::analyze");
+		track_analysis out;
+		compute_onsets(mono, n);
+		estimate_tempo(out);
+		estimate_key(mono, n, out);
+		return out;
+	}
+};
+
+constexpr std::uint32_t tempo_key_artifact = artifact_type_("TMPK");
+
+/**
+ * \brief проход общего декодирования, который считает темп, сетку долей и тональность; артефакт - track_analysis
+ */
+inline analysis_pass tempo_key_pass_() {
+	static_assert(std::is_trivially_copyable<track_analysis>::value, "track_analysis is stored as raw bytes");
+	auto analyzer = std::make_shared<music_analyzer>();
+	return {tempo_key_artifact, 1, analysis_seconds, [analyzer](decoded_track const &track, std::vector<char> &out) {
+		track_analysis result = analyzer->analyze(track.mono.data(), track.mono_length(analysis_seconds));
+		out.resize(sizeof(result));
+		std::memcpy(out.data(), &result, sizeof(result));
+		return true;
+	}};
+}
+
+/**
+ * \brief фоновый анализ библиотеки: темп, сетка долей и тональность
+ * Потоки работают с пониженным приоритетом и на половине ядер, у каждого своя система FMOD без вывода.
+ * Пока флаг stressed поднят (perf_monitor::report_stress), потоки стоят между блоками декодирования,
+ * так что микшер system1 никогда не делит процессор с анализом в тяжёлый момент.
+ * За то же декодирование считается и отпечаток, так что поиск дубликатов потом берёт его из analysis_cache.
+ * Тембр считается тем же проходом и вместе с темпом и тональностью сразу уходит в индекс похожести, если он есть.
+ * Результаты забирает окно через take_results и пишет в track_library.
+ */
+class library_analyzer {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::pair<track_id, std::string>> jobs;
+	std::vector<std::pair<track_id, track_analysis>> results;
+	std::vector<std::thread> workers;
+	std::atomic<bool> const &stressed;
+	analysis_cache *cache;
+	similarity_index *similar;
+	std::atomic<bool> stopping{false};
+	std::atomic<std::size_t> in_work{0};
+
+	void wait_while_stressed() {
+		while (stressed.load(std::memory_order_relaxed) && !stopping) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+	}
+
+	void run() {
+		lower_current_thread_priority_();
+#ifdef SOUND_TRACE
+		trace_thread_name_("library analyzer");
+#endif
+		FMOD::System *system = nullptr;
+		if (create_nrt_system_(system, {}, FMOD_INIT_NORMAL, 1) != FMOD_OK) {
+			if (system) {
+				system->release();
+			}
+			return;
+		}
+		std::vector<analysis_pass> passes{tempo_key_pass_(), fingerprint_pass_(), timbre_pass_(analysis_seconds)};
+		std::vector<std::vector<char>> artifacts;
+		while (true) {
+			std::pair<track_id, std::string> job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+				if (stopping) {
+					break;
+				}
+				job = std::move(jobs.front());
+				jobs.pop_front();
+				++in_work;
+			}
+			track_analysis result;
+			if (run_analysis_passes_(system, job.second.c_str(), cache, passes, artifacts,
+									 [this] { wait_while_stressed(); }) == FMOD_OK &&
+				artifacts[0].size() == sizeof(result)) {
+				std::memcpy(&result, artifacts[0].data(), sizeof(result));
+				if (similar && artifacts[2].size() == sizeof(track_timbre)) {
+					track_timbre timbre;
+					std::memcpy(&timbre, artifacts[2].data(), sizeof(timbre));
+					float vector[similarity_dims];
+					similarity_vector_(timbre, result, vector);
+					similar->insert(job.first, vector); // трек, который уже в индексе, не меняется
+				}
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			results.emplace_back(job.first, result);
+			--in_work;
+		}
+		system->close();
+		system->release();
+	}
+
+public:
+	/**
+	 * @param stressed - флаг нагрузки на воспроизведение, должен жить дольше анализатора
+	 * @param cache - хранилище артефактов, nullptr - без него; должно жить дольше анализатора
+	 * @param similar - индекс похожести, nullptr - без него; должен жить дольше анализатора
+	 * @param threads - 0 - половина ядер
+	 */
+	explicit library_analyzer(std::atomic<bool> const &stressed, analysis_cache *cache = nullptr,
+							  similarity_index *similar = nullptr, unsigned threads = 0)
+			: stressed(stressed), cache(cache), similar(similar) {
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+		}
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back(&library_analyzer::run, this);
+		}
+	}
+
+	~library_analyzer() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	library_analyzer(library_analyzer const &) = delete;
+	library_analyzer &operator=(library_analyzer const &) = delete;
+
+	/// ставит трек в очередь анализа
+	void add(track_id id, std::string path) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.emplace_back(id, std::move(path));
+		}
+		wake.notify_one();
+	}
+
+	/**
+	 * \brief забирает готовые результаты; трек, который не удалось декодировать, приходит с пустым track_analysis
+	 * @return false, если нового ничего нет
+	 */
+	bool take_results(std::vector<std::pair<track_id, track_analysis>> &out) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (results.empty()) {
+			return false;
+		}
+		out.swap(results);
+		results.clear();
+		return true;
+	}
+
+	/// сколько треков ещё не разобрано
+	std::size_t pending() {
+		std::lock_guard<std::mutex> guard(lock);
+		return jobs.size() + in_work;
+	}
+};
+
+#endif //SOUND_MUSIC_ANALYSIS_HPP
@@ -0,0 +1,528 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_NET_STREAM_HPP
+#define SOUND_NET_STREAM_HPP
+
+#include "socket_compat.hpp"
+#include "fmod.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief путь - это адрес интернет-радио, а не файл
+ */
+inline bool is_stream_url_(std::string_view path) {
+	return path.compare(0, 7, "http://") == 0 || path.compare(0, 8, "https://") == 0;
+}
+
+/**
+ * \brief разбирает http://host[:port]/path; https не поддерживается
+ */
+inline bool parse_http_url_(std::string_view url, std::string &host, std::uint16_t &port, std::string &path) {
+	if (url.compare(0, 7, "http://") != 0) {
+		return false;
+	}
+	url.remove_prefix(7);
+	std::size_t slash = url.find('/');
+	std::string_view authority = url.substr(0, slash);
+	path = slash == std::string_view::npos ? "/" : std::string(url.substr(slash));
+	std::size_t colon = authority.rfind(':');
+	port = 80;
+	if (colon != std::string_view::npos && authority.find(']', colon) == std::string_view::npos) {
+		port = static_cast<std::uint16_t>(std::strtoul(std::string(authority.substr(colon + 1)).c_str(), nullptr, 10));
+		authority = authority.substr(0, colon);
+	}
+	if (authority.size() > 2 && authority.front() == '[' && authority.back() == ']') { // [::1]
+		authority = authority.substr(1, authority.size() - 2);
+	}
+	host = std::string(authority);
+	return !host.empty() && port != 0;
+}
+
+/**
+ * \brief название из блока метаданных ICY: StreamTitle='Artist - Title';
+ */
+inline std::string parse_stream_title_(std::string_view meta) {
+	std::size_t begin = meta.find("StreamTitle='");
+	if (begin == std::string_view::npos) {
+		return {};
+	}
+	begin += 13;
+	std::size_t end = meta.find("';", begin);
+	if (end == std::string_view::npos) {
+		end = meta.rfind('\'');
+	}
+	return std::string(meta.substr(begin, end == std::string_view::npos || end < begin ? 0 : end - begin));
+}
+
+/**
+ * \brief отделяет метаданные ICY от звука
+ * Сервер вставляет после каждых metaint байт звука байт длины (в 16-байтных блоках) и сами метаданные.
+ */
+class icy_demuxer {
+	std::size_t metaint = 0;
+	std::size_t audio_left = 0; ///< звука до следующего блока метаданных
+	std::size_t meta_left = 0;
+	bool want_length = false;
+	std::string meta;
+	std::string title;
+	bool title_fresh = false;
+
+public:
+	/// metaint - из заголовка icy-metaint, 0 - метаданных в потоке нет
+	void reset(std::size_t interval) {
+		metaint = interval;
+		audio_left = interval;
+		meta_left = 0;
+		want_length = false;
+		meta.clear();
+	}
+
+	/**
+	 * \brief разбирает очередной кусок ответа
+	 * @param audio - сюда дописывается звук
+	 */
+	void feed(char const *data, std::size_t size, std::vector<char> &audio) {
+		if (metaint == 0) {
+			audio.insert(audio.end(), data, data + size);
+			return;
+		}
+		while (size > 0) {
+			if (want_length) {
+				meta_left = static_cast<unsigned char>(*data) * std::size_t(16);
+				want_length = false;
+				++data;
+				--size;
+				meta.clear();
+				if (meta_left == 0) {
+					audio_left = metaint;
+				}
+			} else if (meta_left > 0) {
+				std::size_t take = std::min(meta_left, size);
+				meta.append(data, take);
+				data += take;
+				size -= take;
+				meta_left -= take;
+				if (meta_left == 0) {
+					std::string parsed = parse_stream_title_(meta);
+					if (!parsed.empty() && parsed != title) {
+						title = parsed;
+						title_fresh = true;
+					}
+					audio_left = metaint;
+				}
+			} else {
+				std::size_t take = std::min(audio_left, size);
+				audio.insert(audio.end(), data, data + take);
+				data += take;
+				size -= take;
+				audio_left -= take;
+				if (audio_left == 0) {
+					want_length = true;
+				}
+			}
+		}
+	}
+
+	/**
+	 * \brief новое название, если оно сменилось после прошлого вызова
+	 */
+	bool take_title(std::string &out) {
+		if (!title_fresh) {
+			return false;
+		}
+		out = title;
+		title_fresh = false;
+		return true;
+	}
+};
+
+/**
+ * \brief настройки сетевого потока
+ */
+struct net_stream_options {
+	std::size_t buffer_bytes = 256 * 1024; ///< сколько звука держать впрок
+	std::size_t start_bytes = 24 * 1024;   ///< сколько набрать перед первым чтением и после опустошения буфера
+	std::size_t history_bytes = 64 * 1024; ///< сколько прочитанного хранить для перемоток назад при разборе формата
+	int connect_timeout_ms = 3000;
+	int read_timeout_ms = 5000;  ///< тишина в сокете дольше этого - обрыв
+	unsigned max_retries = 8;    ///< переподключений подряд без единого байта, потом поток считается мёртвым
+};
+
+/**
+ * \brief счётчики сетевого потока
+ */
+struct net_stream_stats {
+	double first_byte_ms = -1;  ///< от создания до первого байта звука
+	double first_read_ms = -1;  ///< от создания до первого чтения декодером, то есть с учётом набора start_bytes
+	unsigned connects = 0;
+	unsigned reconnects = 0;    ///< переподключения после обрыва
+	unsigned underruns = 0;     ///< декодеру пришлось ждать данных уже после начала воспроизведения
+	std::uint64_t bytes = 0;    ///< звука принято
+};
+
+/**
+ * \brief HTTP/Icecast-поток с буфером впрок и быстрым переподключением
+ * Поток соединяется, просит метаданные ICY (Icy-MetaData: 1), отделяет их от звука и складывает звук в кольцевой
+ * буфер. Декодер FMOD читает из буфера через файловые колбэки (open_net_stream_), поэтому обрыв соединения для FMOD -
+ * это просто медленное чтение: поток переподключается (первая попытка сразу, дальше с нарастающей паузой),
+ * и воспроизведение продолжается тем же звуком и каналом, без пересоздания Sound. Звук, пропущенный за время
+ * обрыва, теряется, как у любого прямого эфира; MP3 и AAC ADTS декодер синхронизирует по следующему кадру.
+ */
+class net_stream {
+	std::string address;
+	net_stream_options options;
+	std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+
+	std::mutex lock;
+	std::condition_variable wake_reader, wake_writer;
+	std::vector<char> ring;
+	std::uint64_t written = 0;  ///< позиция конца принятого звука от начала потока
+	std::uint64_t position = 0; ///< позиция чтения декодера
+	bool started = false;       ///< набрано start_bytes, декодер читает
+	bool failed = false;        ///< переподключения исчерпаны
+	bool stopping = false;
+	std::string title, station, content_type;
+	bool title_fresh = false;
+	net_stream_stats counters;
+	std::thread worker;
+
+	double since_created_ms() const {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - created).count();
+	}
+
+	void push(std::vector<char> const &audio) {
+		std::unique_lock<std::mutex> guard(lock);
+		std::size_t done = 0;
+		while (done < audio.size() && !stopping) {
+			wake_writer.wait(guard, [this] { return stopping || written - position < options.buffer_bytes; });
+			std::size_t room = static_cast<std::size_t>(options.buffer_bytes - (written - position));
+			std::size_t take = std::min(room, audio.size() - done);
+			for (std::size_t i = 0; i < take; ++i) {
+				ring[(written + i) % ring.size()] = audio[done + i];
+			}
+			if (counters.first_byte_ms < 0 && take > 0) {
+				counters.first_byte_ms = since_created_ms();
+			}
+			written += take;
+			counters.bytes += take;
+			done += take;
+			if (!started && written - position >= options.start_bytes) {
+				started = true;
+			}
+			wake_reader.notify_all();
+		}
+	}
+
+	/// соединение и заголовки ответа; redirects - сколько ещё можно пройти по Location
+	socket_handle open_connection(std::string url, std::size_t &metaint, std::string &rest) {
+		for (int redirects = 0; redirects < 5; ++redirects) {
+			std::string host, path;
+			std::uint16_t port;
+			if (!parse_http_url_(url, host, port, path)) {
+				return no_socket;
+			}
+			socket_handle s = connect_tcp_(host, port, options.connect_timeout_ms);
+			if (s == no_socket) {
+				return no_socket;
+			}
+			std::string request = "GET " + path + " HTTP/1.0\r\nHost: " + host + "\r\nUser-Agent: sound/1.0\r\n"
+								  "Icy-MetaData: 1\r\nAccept: */*\r\nConnection: close\r\n\r\n";
+			std::string head;
+			char buffer[4096];
+			std::size_t end = std::string::npos;
+			if (send_all_(s, request.data(), request.size())) {
+				while ((end = head.find("\r\n\r\n")) == std::string::npos && head.size() < 16384) {
+					long got = receive_some_(s, buffer, sizeof(buffer), options.read_timeout_ms);
+					if (got <= 0) {
+						break;
+					}
+					head.append(buffer, static_cast<std::size_t>(got));
+				}
+			}
+			if (end == std::string::npos) {
+				close_socket_(s);
+				return no_socket;
+			}
+			rest = head.substr(end + 4);
+			head.resize(end + 2);
+			std::string lower = head;
+			for (char &c : lower) {
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			}
+			auto header = [&](char const *name) {
+				std::size_t at = lower.find(std::string("\r\n") + name + ':');
+				if (at == std::string::npos) {
+					return std::string();
+				}
+				at += std::strlen(name) + 3;
+				std::size_t line_end = head.find("\r\n", at);
+				std::string value = head.substr(at, line_end - at);
+				value.erase(0, value.find_first_not_of(' '));
+				return value;
+			};
+			std::size_t space = head.find(' ');
+			int status = space == std::string::npos ? 0 : std::atoi(head.c_str() + space + 1); // HTTP/1.x 200 или ICY 200
+			if (status >= 300 && status < 400 && !header("location").empty()) {
+				close_socket_(s);
+				url = header("location");
+				continue;
+			}
+			if (status != 200) {
+				close_socket_(s);
+				return no_socket;
+			}
+			metaint = std::strtoul(header("icy-metaint").c_str(), nullptr, 10);
+			std::lock_guard<std::mutex> guard(lock);
+			if (station.empty()) {
+				station = header("icy-name");
+				content_type = header("content-type");
+			}
+			return s;
+		}
+		return no_socket;
+	}
+
+	void run() {
+#ifdef SOUND_TRACE
+		trace_thread_name_("net stream");
+#endif
+		icy_demuxer icy;
+		std::vector<char> audio;
+		char buffer[16384];
+		unsigned failures = 0;
+		while (true) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping) {
+					return;
+				}
+			}
+			std::size_t metaint = 0;
+			std::string rest;
+			socket_handle s;
+			{
+				TRACE_SCOPE("net stream: connect");
+				s = open_connection(address, metaint, rest);
+			}
+			bool got_audio = false;
+			if (s != no_socket) {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (++counters.connects > 1) {
+						++counters.reconnects;
+					}
+				}
+				icy.reset(metaint);
+				audio.clear();
+				icy.feed(rest.data(), rest.size(), audio);
+				auto heard = std::chrono::steady_clock::now();
+				while (true) {
+					if (!audio.empty()) {
+						got_audio = true;
+						push(audio);
+						audio.clear();
+					}
+					std::string fresh;
+					if (icy.take_title(fresh)) {
+						std::lock_guard<std::mutex> guard(lock);
+						title = fresh;
+						title_fresh = true;
+					}
+					{
+						std::lock_guard<std::mutex> guard(lock);
+						if (stopping) {
+							break;
+						}
+					}
+					// короткие ожидания, чтобы stop() не ждал read_timeout
+					long got = receive_some_(s, buffer, sizeof(buffer), std::min(options.read_timeout_ms, 250));
+					if (got == -1) {
+						if (std::chrono::steady_clock::now() - heard < std::chrono::milliseconds(options.read_timeout_ms)) {
+							continue;
+						}
+						break; // сервер замолчал: соединение считается оборванным
+					}
+					if (got == 0) {
+						break;
+					}
+					heard = std::chrono::steady_clock::now();
+					icy.feed(buffer, static_cast<std::size_t>(got), audio);
+				}
+				close_socket_(s);
+			}
+			failures = got_audio ? 0 : failures + 1;
+			std::unique_lock<std::mutex> guard(lock);
+			if (failures > options.max_retries) {
+				failed = true;
+				wake_reader.notify_all();
+				return;
+			}
+			// первая попытка - сразу: буфер ещё играет, и каждая миллисекунда паузы съедает запас
+			auto pause = std::chrono::milliseconds(failures <= 1 ? 0 : std::min(2000, 50 << std::min(failures, 6u)));
+			wake_writer.wait_for(guard, pause, [this] { return stopping; });
+		}
+	}
+
+public:
+	explicit net_stream(std::string url, net_stream_options opts = {}) : address(std::move(url)), options(opts) {
+		options.start_bytes = std::min(options.start_bytes, options.buffer_bytes);
+		ring.resize(options.buffer_bytes + options.history_bytes);
+		worker = std::thread(&net_stream::run, this);
+	}
+
+	~net_stream() {
+		stop();
+		worker.join();
+	}
+
+	net_stream(net_stream const &) = delete;
+	net_stream &operator=(net_stream const &) = delete;
+
+	/// будит все ожидания: чтение вернёт конец потока; вызывать перед Sound::release
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake_reader.notify_all();
+		wake_writer.notify_all();
+	}
+
+	std::string const &url() const { return address; }
+
+	/**
+	 * \brief читает звук; ждёт, пока в буфере что-то есть (после опустошения - пока снова не наберётся start_bytes)
+	 * @return число прочитанных байт; 0 - поток остановлен или мёртв
+	 */
+	std::size_t read(char *out, std::size_t size) {
+		std::unique_lock<std::mutex> guard(lock);
+		if (started && written == position) {
+			started = false; // декодер догнал сеть: набираем запас заново, чтобы не заикаться на каждом пакете
+			++counters.underruns;
+		}
+		wake_reader.wait(guard, [this] { return stopping || failed || (started && written > position); });
+		if (stopping || (failed && written == position)) {
+			return 0;
+		}
+		if (counters.first_read_ms < 0) {
+			counters.first_read_ms = since_created_ms();
+		}
+		std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(size, written - position));
+		for (std::size_t i = 0; i < take; ++i) {
+			out[i] = ring[(position + i) % ring.size()];
+		}
+		position += take;
+		wake_writer.notify_all();
+		return take;
+	}
+
+	/**
+	 * \brief перемотка внутри того, что ещё лежит в буфере (декодер возвращается к началу при разборе формата)
+	 */
+	bool seek(std::uint64_t to) {
+		std::lock_guard<std::mutex> guard(lock);
+		std::uint64_t oldest = written > ring.size() ? written - ring.size() : 0;
+		if (to < oldest || to > written) {
+			return false;
+		}
+		position = to;
+		wake_writer.notify_all();
+		return true;
+	}
+
+	/**
+	 * \brief название из метаданных ICY, если оно сменилось после прошлого вызова
+	 */
+	bool take_title(std::string &out) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!title_fresh) {
+			return false;
+		}
+		out = title;
+		title_fresh = false;
+		return true;
+	}
+
+	/// icy-name из ответа сервера
+	std::string station_name() {
+		std::lock_guard<std::mutex> guard(lock);
+		return station;
+	}
+
+	/// сколько звука лежит в буфере впрок, байт
+	std::size_t buffered() {
+		std::lock_guard<std::mutex> guard(lock);
+		return static_cast<std::size_t>(written - position);
+	}
+
+	bool dead() {
+		std::lock_guard<std::mutex> guard(lock);
+		return failed;
+	}
+
+	net_stream_stats stats() {
+		std::lock_guard<std::mutex> guard(lock);
+		return counters;
+	}
+};
+
+inline FMOD_RESULT F_CALLBACK net_file_open_(char const *, unsigned int *filesize, void **handle, void *userdata) {
+	*filesize = 0xffffffffu; // длина эфира неизвестна
+	*handle = userdata;
+	return FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK net_file_close_(void *, void *) {
+	return FMOD_OK; // net_stream принадлежит вызывающему
+}
+
+inline FMOD_RESULT F_CALLBACK net_file_read_(void *handle, void *buffer, unsigned int sizebytes,
+											 unsigned int *bytesread, void *) {
+	*bytesread = static_cast<unsigned int>(static_cast<net_stream *>(handle)->read(static_cast<char *>(buffer),
+																				   sizebytes));
+	return *bytesread == 0 ? FMOD_ERR_FILE_EOF : FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK net_file_seek_(void *handle, unsigned int pos, void *) {
+	return static_cast<net_stream *>(handle)->seek(pos) ? FMOD_OK : FMOD_ERR_FILE_COULDNOTSEEK;
+}
+
+/**
+ * \brief открывает net_stream как стрим FMOD через файловые колбэки
+ * Своя буферизация FMOD почти не нужна - запас держит net_stream, поэтому буфер чтения FMOD маленький,
+ * и первый звук появляется, как только набралось start_bytes. Теги не ищутся: для этого FMOD перематывал бы в конец.
+ * @param stream - должен жить дольше sound; перед sound->release() вызвать stream.stop()
+ * @param mode - дополнительные флаги, например FMOD_NONBLOCKING
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT open_net_stream_(FMOD::System *system, net_stream &stream, FMOD::Sound *&sound, FMOD_MODE mode = 0) {
+	TRACE_SCOPE("open_net_stream_");
+	FMOD_CREATESOUNDEXINFO info;
+	std::memset(&info, 0, sizeof(info));
+	info.cbsize = sizeof(info);
+	info.fileuseropen = net_file_open_;
+	info.fileuserclose = net_file_close_;
+	info.fileuserread = net_file_read_;
+	info.fileuserseek = net_file_seek_;
+	info.fileuserdata = &stream;
+	info.filebuffersize = 8 * 1024;
+	return system->createSound(stream.url().c_str(), FMOD_CREATESTREAM | FMOD_IGNORETAGS | FMOD_LOOP_OFF | mode, &info,
+							   &sound);
+}
+
+#endif //SOUND_NET_STREAM_HPP
@@ -0,0 +1,178 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_OFFLINE_RENDER_HPP
+#define SOUND_OFFLINE_RENDER_HPP
+
+#include "fmod.hpp"
+#include "passthrough.hpp"
+#include "trace.hpp"
+#include <cstring>
+#include <functional>
+#include <vector>
+
+/**
+ * \brief DSP-отвод, который копирует всё, что через него проходит
+ * Предназначен для режима FMOD_OUTPUTTYPE_NOSOUND_NRT: там микширование идёт внутри System::update
+ * в вызывающем потоке, поэтому данные можно читать без синхронизации между вызовами update.
+ */
+class render_capture {
+	std::vector<float> samples;
+	int channels = 0;
+
+	static FMOD_RESULT F_CALLBACK read_callback(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer,
+												unsigned int length, int inchannels, int *outchannels) {
+		void *userdata = nullptr;
+		static_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(&userdata);
+		std::memcpy(outbuffer, inbuffer, sizeof(float) * length * inchannels);
+		*outchannels = inchannels;
+		if (userdata) {
+			auto *self = static_cast<render_capture *>(userdata);
+			self->channels = inchannels;
+			self->samples.insert(self->samples.end(), inbuffer, inbuffer + length * inchannels);
+		}
+		return FMOD_OK;
+	}
+
+public:
+	/**
+	 * \brief создаёт отвод и ставит его в голову группы
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT attach(FMOD::System *system, FMOD::ChannelGroup *group, FMOD::DSP *&dsp) {
+		FMOD_DSP_DESCRIPTION desc;
+		std::memset(&desc, 0, sizeof(desc));
+		std::strncpy(desc.name, "render capture", sizeof(desc.name) - 1);
+		desc.version = 0x00010000;
+		desc.numinputbuffers = 1;
+		desc.numoutputbuffers = 1;
+		desc.read = read_callback;
+		FMOD_RESULT result = system->createDSP(&desc, &dsp);
+		if (result != FMOD_OK) {
+			return result;
+		}
+		dsp->setUserData(this);
+		return group->addDSP(0, dsp);
+	}
+
+	std::vector<float> const &data() const { return samples; }
+
+	int num_channels() const { return channels; }
+
+	void clear() { samples.clear(); }
+};
+
+/**
+ * \brief создаёт систему без вывода звука, которая микширует по одному блоку на каждый System::update
+ * @param format - формат микшера; rate == 0 - формат FMOD по умолчанию
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT create_nrt_system_(FMOD::System *&system, source_format const &format = {},
+									  FMOD_INITFLAGS flags = FMOD_INIT_NORMAL, int max_channels = 32) {
+	FMOD_RESULT result = FMOD::System_Create(&system);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	result = system->setOutput(FMOD_OUTPUTTYPE_NOSOUND_NRT);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	if (format.rate > 0) {
+		result = apply_passthrough_format_(system, format);
+		if (result != FMOD_OK) {
+			return result;
+		}
+	}
+	return system->init(max_channels, flags, nullptr);
+}
+
+/**
+ * \brief переводит декодированные данные в float так же, как это делает микшер FMOD
+ */
+inline void pcm_to_float_(void const *data, unsigned int bytes, FMOD_SOUND_FORMAT format, std::vector<float> &out) {
+	switch (format) {
+		case FMOD_SOUND_FORMAT_PCM8: {
+			auto const *p = static_cast<signed char const *>(data);
+			for (unsigned int i = 0; i < bytes; ++i) {
+				out.push_back(p[i] / 128.0f);
+			}
+			break;
+		}
+		case FMOD_SOUND_FORMAT_PCM16: {
+			auto const *p = static_cast<short const *>(data);
+			for (unsigned int i = 0; i < bytes / 2; ++i) {
+				out.push_back(p[i] / 32768.0f);
+			}
+			break;
+		}
+		case FMOD_SOUND_FORMAT_PCM24: {
+			auto const *p = static_cast<unsigned char const *>(data);
+			for (unsigned int i = 0; i + 2 < bytes; i += 3) {
+				int v = (p[i] << 8) | (p[i + 1] << 16) | (p[i + 2] << 24);
+				out.push_back((v >> 8) / 8388608.0f);
+			}
+			break;
+		}
+		case FMOD_SOUND_FORMAT_PCM32: {
+			auto const *p = static_cast<int const *>(data);
+			for (unsigned int i = 0; i < bytes / 4; ++i) {
+				out.push_back(static_cast<float>(p[i] / 2147483648.0));
+			}
+			break;
+		}
+		case FMOD_SOUND_FORMAT_PCMFLOAT: {
+			auto const *p = static_cast<float const *>(data);
+			out.insert(out.end(), p, p + bytes / 4);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/**
+ * \brief декодирует файл целиком в interleaved float без участия микшера
+ * @param path - путь к файлу
+ * @param out - сюда пишутся сэмплы
+ * @param format - частота и количество каналов файла
+ * @param max_seconds - сколько секунд от начала декодировать, 0 - до конца файла
+ * @param after_chunk - вызывается после каждого прочитанного блока; фоновый анализ ждёт в нём,
+ * пока воспроизведению не хватает процессора
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT decode_to_float_(FMOD::System *system, char const *path, std::vector<float> &out,
+									source_format &format, double max_seconds = 0,
+									std::function<void()> const &after_chunk = {}) {
+	TRACE_SCOPE("decode_to_float_");
+	FMOD::Sound *sound = nullptr;
+	FMOD_RESULT result = system->createSound(path, FMOD_OPENONLY | FMOD_ACCURATETIME, 0, &sound);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	FMOD_SOUND_FORMAT pcm_format = FMOD_SOUND_FORMAT_NONE;
+	result = get_source_format_(sound, format);
+	if (result == FMOD_OK) {
+		result = sound->getFormat(nullptr, &pcm_format, nullptr, nullptr);
+	}
+	std::size_t limit = max_seconds > 0 ? static_cast<std::size_t>(max_seconds * format.rate) * format.channels
+										: ~std::size_t(0);
+	std::vector<char> chunk(64 * 1024);
+	while (result == FMOD_OK && out.size() < limit) {
+		unsigned int read = 0;
+		result = sound->readData(chunk.data(), static_cast<unsigned int>(chunk.size()), &read);
+		pcm_to_float_(chunk.data(), read, pcm_format, out);
+		if (after_chunk) {
+			after_chunk();
+		}
+	}
+	if (out.size() > limit) {
+		out.resize(limit);
+	}
+	sound->release();
+	TRACE_INSTANT("decode finished");
+	return result == FMOD_ERR_FILE_EOF ? FMOD_OK : result;
+}
+
+#endif //SOUND_OFFLINE_RENDER_HPP
@@ -0,0 +1,100 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_PASSTHROUGH_HPP
+#define SOUND_PASSTHROUGH_HPP
+
+#include "fmod.hpp"
+
+/**
+ * \brief частота и количество каналов исходного трека
+ */
+struct source_format {
+	int rate = 0;
+	int channels = 0;
+};
+
+/**
+ * \brief узнаёт формат трека
+ * @param sound - открытый трек
+ * @param format - сюда пишется результат
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT get_source_format_(FMOD::Sound *sound, source_format &format) {
+	float frequency = 0;
+	FMOD_RESULT result = sound->getDefaults(&frequency, nullptr);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	result = sound->getFormat(nullptr, nullptr, &format.channels, nullptr);
+	format.rate = static_cast<int>(frequency);
+	return result;
+}
+
+/**
+ * \brief раскладка микшера, при которой каналы трека проходят без панорамирования
+ * @return FMOD_SPEAKERMODE_DEFAULT, если у такого числа каналов своей раскладки нет
+ */
+inline FMOD_SPEAKERMODE passthrough_speaker_mode_(int channels) {
+	switch (channels) {
+		case 1:
+			return FMOD_SPEAKERMODE_MONO;
+		case 2:
+			return FMOD_SPEAKERMODE_STEREO;
+		case 4:
+			return FMOD_SPEAKERMODE_QUAD;
+		case 5:
+			return FMOD_SPEAKERMODE_SURROUND;
+		case 6:
+			return FMOD_SPEAKERMODE_5POINT1;
+		case 8:
+			return FMOD_SPEAKERMODE_7POINT1;
+		case 12:
+			return FMOD_SPEAKERMODE_7POINT1POINT4;
+		default:
+			return FMOD_SPEAKERMODE_DEFAULT;
+	}
+}
+
+/**
+ * \brief совпадает ли формат микшера с форматом трека (тогда ни ресемплинга, ни пересведения каналов)
+ * getSoftwareFormat отдаёт раскладку, которую система выбрала на самом деле, а не FMOD_SPEAKERMODE_DEFAULT.
+ * Для числа каналов без своей раскладки перезапуск дал бы ту же раскладку, поэтому сравнивается только частота.
+ */
+inline bool mixer_matches_source_(FMOD::System *system, source_format const &format) {
+	int rate = 0;
+	FMOD_SPEAKERMODE mode = FMOD_SPEAKERMODE_DEFAULT;
+	if (system->getSoftwareFormat(&rate, &mode, nullptr) != FMOD_OK) {
+		return false;
+	}
+	FMOD_SPEAKERMODE wanted = passthrough_speaker_mode_(format.channels);
+	return rate == format.rate && (wanted == FMOD_SPEAKERMODE_DEFAULT || mode == wanted);
+}
+
+/**
+ * \brief ставит формат микшера равным формату трека; вызывать до System::init
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT apply_passthrough_format_(FMOD::System *system, source_format const &format) {
+	return system->setSoftwareFormat(format.rate, passthrough_speaker_mode_(format.channels), 0);
+}
+
+/**
+ * \brief настраивает канал так, чтобы сэмплы не менялись: громкость 1 без рамп
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT passthrough_channel_(FMOD::Channel *channel) {
+	FMOD_RESULT result = channel->setVolumeRamp(false);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	result = channel->setVolume(1.0f);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	return channel->setPitch(1.0f);
+}
+
+#endif //SOUND_PASSTHROUGH_HPP
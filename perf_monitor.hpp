@@ -0,0 +1,343 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_PERF_MONITOR_HPP
+#define SOUND_PERF_MONITOR_HPP
+
+#include "fmod.hpp"
+#include "fmod_functions.hpp"
+#include "thread_config.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief гистограмма по последним window значениям
+ * Корзины обновляются при добавлении и вытеснении, поэтому add стоит O(1).
+ */
+class rolling_histogram {
+	std::vector<float> ring;
+	std::vector<unsigned> bins;
+	std::size_t next = 0;
+	std::size_t filled = 0;
+	float lo, hi;
+	double sum = 0;
+
+	std::size_t bin_of(float v) const {
+		float t = (v - lo) / (hi - lo);
+		auto b = static_cast<long>(t * bins.size());
+		return static_cast<std::size_t>(std::min<long>(std::max<long>(b, 0), bins.size() - 1));
+	}
+
+public:
+	rolling_histogram(std::size_t window, float lo, float hi, std::size_t num_bins)
+			: ring(window), bins(num_bins), lo(lo), hi(hi) {}
+
+	void add(float v) {
+		if (filled == ring.size()) {
+			--bins[bin_of(ring[next])];
+			sum -= ring[next];
+		} else {
+			++filled;
+		}
+		ring[next] = v;
+		++bins[bin_of(v)];
+		sum += v;
+		next = (next + 1) % ring.size();
+	}
+
+	/// верхняя граница корзины, в которую попадает перцентиль p (0..1)
+	float percentile(float p) const {
+		if (filled == 0) {
+			return 0;
+		}
+		auto need = static_cast<std::size_t>(p * (filled - 1)) + 1;
+		std::size_t seen = 0;
+		for (std::size_t b = 0; b < bins.size(); ++b) {
+			seen += bins[b];
+			if (seen >= need) {
+				return lo + (hi - lo) * (b + 1) / bins.size();
+			}
+		}
+		return hi;
+	}
+
+	float mean() const { return filled ? static_cast<float>(sum / filled) : 0; }
+
+	std::vector<unsigned> const &counts() const { return bins; }
+};
+
+/**
+ * \brief стоимость одного DSP мастер-группы за последний блок, мкс
+ */
+struct dsp_cost {
+	std::string name;
+	unsigned exclusive_us = 0;
+	unsigned inclusive_us = 0;
+};
+
+/**
+ * \brief один замер производительности
+ */
+struct perf_sample {
+	double time = 0;                  ///< секунды от старта мониторинга
+	FMOD_CPU_USAGE cpu = {};          ///< загрузка потоков FMOD, %
+	FMOD_OPENSTATE open_state = FMOD_OPENSTATE_READY;
+	unsigned buffered = 0;            ///< заполнение буфера стрима, %
+	bool starving = false;
+	unsigned stream_starves = 0;
+	unsigned mixer_stalls = 0;
+	unsigned errors = 0;              ///< ошибки, прошедшие через ERROR_CHECK
+	std::vector<dsp_cost> dsps;
+};
+
+/**
+ * \brief фоновый сбор метрик FMOD: загрузка микшера и стримов, стоимость DSP, буфер стрима, срывы
+ * Поток просыпается раз в interval, поэтому накладные расходы - несколько вызовов FMOD за период.
+ * Стоимость отдельных DSP FMOD считает только с FMOD_INIT_PROFILE_ENABLE | FMOD_INIT_PROFILE_METER_ALL.
+ * Замеры можно выгружать в CSV или JSON Lines (по расширению файла .json).
+ */
+class perf_monitor {
+	FMOD::System *system;
+	FMOD::ChannelGroup *group;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = false;
+	bool stress_only = false; ///< только признаки нагрузки для report_stress, без DSP, гистограмм и выгрузки
+	std::chrono::milliseconds interval{250};
+	std::chrono::steady_clock::time_point start_time;
+
+	FMOD::Sound *sound = nullptr;
+	underrun_detector underruns;
+	perf_sample last;
+	rolling_histogram dsp_hist{1200, 0, 100, 50};
+	rolling_histogram stream_hist{1200, 0, 100, 50};
+	rolling_histogram buffer_hist{1200, 0, 100, 20};
+
+	std::ofstream out;
+	bool json = false;
+
+	std::atomic<bool> *stress_flag = nullptr;
+	std::chrono::steady_clock::time_point calm_after;
+	unsigned seen_starves = 0, seen_stalls = 0;
+
+	perf_sample take_sample() {
+		perf_sample s;
+		s.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		system->getCPUUsage(&s.cpu);
+		if (sound) {
+			sound->getOpenState(&s.open_state, &s.buffered, &s.starving, nullptr);
+		}
+		underruns.poll(sound);
+		s.stream_starves = underruns.result().stream_starves;
+		s.mixer_stalls = underruns.result().mixer_stalls;
+		s.errors = fmod_error_count.load(std::memory_order_relaxed);
+		if (stress_only) {
+			return s;
+		}
+
+		int num = 0;
+		group->getNumDSPs(&num);
+		for (int i = 0; i < num; ++i) {
+			FMOD::DSP *dsp = nullptr;
+			if (group->getDSP(i, &dsp) != FMOD_OK) {
+				continue;
+			}
+			dsp_cost cost;
+			char name[32] = {};
+			dsp->getInfo(name, nullptr, nullptr, nullptr, nullptr);
+			cost.name = name;
+			dsp->getCPUUsage(&cost.exclusive_us, &cost.inclusive_us);
+			s.dsps.push_back(cost);
+		}
+		return s;
+	}
+
+	void write_export(perf_sample const &s) {
+		if (!out.is_open()) {
+			return;
+		}
+		if (json) {
+			out << "{\"time\":" << s.time << ",\"cpu_dsp\":" << s.cpu.dsp << ",\"cpu_stream\":" << s.cpu.stream
+				<< ",\"cpu_update\":" << s.cpu.update << ",\"open_state\":" << s.open_state
+				<< ",\"buffered\":" << s.buffered << ",\"starving\":" << (s.starving ? "true" : "false")
+				<< ",\"stream_starves\":" << s.stream_starves << ",\"mixer_stalls\":" << s.mixer_stalls
+				<< ",\"errors\":" << s.errors << ",\"dsps\":[";
+			for (std::size_t i = 0; i < s.dsps.size(); ++i) {
+				out << (i ? "," : "") << "{\"name\":\"" << s.dsps[i].name << "\",\"exclusive_us\":"
+					<< s.dsps[i].exclusive_us << ",\"inclusive_us\":" << s.dsps[i].inclusive_us << "}";
+			}
+			out << "]}\n";
+		} else {
+			out << s.time << ',' << s.cpu.dsp << ',' << s.cpu.stream << ',' << s.cpu.update << ','
+				<< s.open_state << ',' << s.buffered << ',' << s.starving << ',' << s.stream_starves << ','
+				<< s.mixer_stalls << ',' << s.errors << ",\"";
+			for (std::size_t i = 0; i < s.dsps.size(); ++i) {
+				out << (i ? ";" : "") << s.dsps[i].name << '=' << s.dsps[i].exclusive_us << '/'
+					<< s.dsps[i].inclusive_us;
+			}
+			out << "\"\n";
+		}
+		out.flush();
+	}
+
+	/// воспроизведению тяжело: микшер или стрим загружены, стрим голодает или были новые срывы;
+	/// состояние держится ещё 3 с после последнего признака, чтобы фоновая работа не дёргалась
+	void update_stress(perf_sample const &s) {
+		auto now = std::chrono::steady_clock::now();
+		if (s.cpu.dsp > 60 || s.cpu.stream > 40 || s.starving || s.stream_starves != seen_starves ||
+			s.mixer_stalls != seen_stalls) {
+			calm_after = now + std::chrono::seconds(3);
+		}
+		seen_starves = s.stream_starves;
+		seen_stalls = s.mixer_stalls;
+		if (stress_flag) {
+			stress_flag->store(now < calm_after, std::memory_order_relaxed);
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			perf_sample s = take_sample();
+			update_stress(s);
+			if (stress_only) {
+				wake.wait_for(guard, interval, [this] { return !running; });
+				continue;
+			}
+			dsp_hist.add(s.cpu.dsp);
+			stream_hist.add(s.cpu.stream);
+			buffer_hist.add(static_cast<float>(s.buffered));
+			write_export(s);
+			last = std::move(s);
+			wake.wait_for(guard, interval, [this] { return !running; });
+		}
+	}
+
+public:
+	perf_monitor(FMOD::System *system, FMOD::ChannelGroup *group) : system(system), group(group) {}
+
+	perf_monitor(perf_monitor const &) = delete;
+
+	perf_monitor &operator=(perf_monitor const &) = delete;
+
+	~perf_monitor() { stop(); }
+
+	/**
+	 * \brief запускает фоновый сбор
+	 * @param period - период замеров
+	 * @param export_path - файл выгрузки (.json - JSON Lines, иначе CSV), пустая строка - без выгрузки
+	 */
+	void start(std::chrono::milliseconds period, std::string const &export_path = {}) {
+		stop();
+		std::lock_guard<std::mutex> guard(lock);
+		stress_only = false;
+		interval = period;
+		start_time = std::chrono::steady_clock::now();
+		underruns.begin(system, group);
+		if (!export_path.empty()) {
+			json = export_path.size() >= 5 && export_path.compare(export_path.size() - 5, 5, ".json") == 0;
+			bool fresh = !std::ifstream(export_path).good();
+			out.open(export_path, std::ios::app);
+			if (fresh && !json) {
+				out << "time,cpu_dsp,cpu_stream,cpu_update,open_state,buffered,starving,stream_starves,"
+					   "mixer_stalls,errors,dsp_us\n";
+			}
+		}
+		running = true;
+		worker = std::thread(&perf_monitor::run, this);
+	}
+
+	/**
+	 * \brief запускает дешёвый сбор только для report_stress: загрузка FMOD, голодание стрима и срывы
+	 * Нужен, пока фоновой работе надо знать о нагрузке, а полные замеры никто не смотрит.
+	 * @param period - период замеров
+	 */
+	void start_stress_only(std::chrono::milliseconds period) {
+		stop();
+		std::lock_guard<std::mutex> guard(lock);
+		stress_only = true;
+		interval = period;
+		start_time = std::chrono::steady_clock::now();
+		underruns.begin(system, group);
+		running = true;
+		worker = std::thread(&perf_monitor::run, this);
+	}
+
+	/// идёт ли сбор: монитор создаётся вместе с системой, а поток запускается, только когда замеры кому-то нужны
+	bool active() const { return worker.joinable(); }
+
+	/// идёт ли только сбор признаков нагрузки (start_stress_only)
+	bool stress_only_active() const { return worker.joinable() && stress_only; }
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_all();
+		if (worker.joinable()) {
+			worker.join();
+		}
+		out.close();
+		if (stress_flag) {
+			stress_flag->store(false);
+		}
+	}
+
+	/**
+	 * \brief флаг, в который после каждого замера пишется, тяжело ли сейчас воспроизведению
+	 * Фоновые задачи (анализ библиотеки) читают его и ждут, пока он не сбросится.
+	 */
+	void report_stress(std::atomic<bool> *flag) {
+		std::lock_guard<std::mutex> guard(lock);
+		stress_flag = flag;
+	}
+
+	/**
+	 * \brief стрим, за буфером которого надо следить; вызывать при смене трека и перед его освобождением
+	 */
+	void watch(FMOD::Sound *stream) {
+		std::lock_guard<std::mutex> guard(lock);
+		sound = stream;
+	}
+
+	perf_sample latest() {
+		std::lock_guard<std::mutex> guard(lock);
+		return last;
+	}
+
+	/**
+	 * \brief короткая сводка для оверлея в окне
+	 */
+	std::string overlay_text() {
+		std::lock_guard<std::mutex> guard(lock);
+		static char const *states[] = {"ready", "loading", "error", "connecting", "buffering", "seeking",
+									   "playing", "setposition"};
+		std::ostringstream text;
+		text.precision(3);
+		text << "mixer " << last.cpu.dsp << "% (p50 " << dsp_hist.percentile(0.5f) << ", p99 "
+			 << dsp_hist.percentile(0.99f) << ")  stream " << last.cpu.stream << "% (p99 "
+			 << stream_hist.percentile(0.99f) << ")\n";
+		text << "buffer " << last.buffered << "% (min p1 " << buffer_hist.percentile(0.01f) << ")  "
+			 << (last.open_state < FMOD_OPENSTATE_MAX ? states[last.open_state] : "?")
+			 << (last.starving ? " STARVING" : "") << "  starves " << last.stream_starves << "  stalls "
+			 << last.mixer_stalls << "  errors " << last.errors << "\n";
+		for (auto const &d : last.dsps) {
+			text << d.name << ' ' << d.exclusive_us << "us  ";
+		}
+		return text.str();
+	}
+};
+
+#endif //SOUND_PERF_MONITOR_HPP
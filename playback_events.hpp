@@ -0,0 +1,418 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_PLAYBACK_EVENTS_HPP
+#define SOUND_PLAYBACK_EVENTS_HPP
+
+#include "fmod.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/// состояние основного плеера
+enum class playback_state {
+	stopped, ///< канала нет: ничего не выбрано, трек доиграл или не открылся
+	opening, ///< звук открывается с FMOD_NONBLOCKING, канал появится, когда он будет готов
+	playing,
+	paused
+};
+
+/// виды событий для UI; это биты, чтобы одинаковые события сливались в одно
+enum playback_event : unsigned {
+	playback_state_changed = 1u << 0,
+	playback_ended = 1u << 1,       ///< трек доиграл сам, а не был остановлен или заменён
+	playback_open_failed = 1u << 2, ///< звук, которого ждали, не открылся
+};
+
+/**
+ * \brief очередь событий плеера для UI
+ * События одного вида, пришедшие до того, как UI их забрал, сливаются в одно: UI важно, что что-то случилось,
+ * а не сколько раз. Поэтому очередь - одно слово с битами, и её размер не растёт, пока UI не смотрит
+ * (окно свёрнуто и таймеры стоят).
+ */
+class playback_queue {
+	std::mutex lock;
+	unsigned pending = 0;
+	std::uint64_t posted = 0, taken = 0;
+
+public:
+	void post(unsigned events) {
+		std::lock_guard<std::mutex> guard(lock);
+		pending |= events;
+		++posted;
+	}
+
+	/**
+	 * \brief забирает всё накопленное разом
+	 * @return биты playback_event, 0 - ничего не было
+	 */
+	unsigned take() {
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned events = pending;
+		pending = 0;
+		if (events) {
+			++taken;
+		}
+		return events;
+	}
+
+	/**
+	 * \brief сколько раз события добавлялись и сколько раз UI их забрал; разница - сколько слилось
+	 */
+	void counts(std::uint64_t &posts, std::uint64_t &takes) {
+		std::lock_guard<std::mutex> guard(lock);
+		posts = posted;
+		takes = taken;
+	}
+};
+
+/**
+ * \brief отдаёт окну события из других потоков (сокет управления, наблюдение за папками)
+ * post никого не ждёт: биты сливаются, как в playback_queue, а обработчик зовёт свой поток. Поэтому обработчик может
+ * брать замок окна, а тот, кто вызывает post, - держать любые замки или ждать потока, который его вызвал.
+ * Пока событий нет, поток спит на условной переменной и не просыпается вовсе.
+ */
+class event_pump {
+public:
+	/// получает все биты, накопленные с прошлого вызова
+	using handler = std::function<void(unsigned events)>;
+
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	unsigned pending = 0;
+	bool stopping = false;
+	handler deliver;
+	std::thread worker;
+
+	void run() {
+#ifdef SOUND_TRACE
+		trace_thread_name_("event pump");
+#endif
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake.wait(guard, [this] { return stopping || pending; });
+			if (stopping) {
+				break;
+			}
+			unsigned events = pending;
+			pending = 0;
+			guard.unlock();
+			deliver(events);
+			guard.lock();
+		}
+	}
+
+public:
+	explicit event_pump(handler deliver) : deliver(std::move(deliver)) {
+		worker = std::thread(&event_pump::run, this);
+	}
+
+	/// не недоставленные события пропадают; звать не из обработчика
+	~event_pump() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	event_pump(event_pump const &) = delete;
+	event_pump &operator=(event_pump const &) = delete;
+
+	void post(unsigned events) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			pending |= events;
+		}
+		wake.notify_one();
+	}
+};
+
+/**
+ * \brief конечный автомат основного плеера
+ * stopped -> opening (open) -> playing, когда звук открылся; stopped и playback_open_failed, если нет.
+ * playing <-> paused (pause); playing -> stopped и playback_ended, когда канал доиграл (FMOD_CHANNELCONTROL_CALLBACK_END).
+ * Обратные вызовы FMOD приходят только из System::update, поэтому update вызывает свой поток, и только пока
+ * состояние playing или opening; на паузе и в остановке поток спит на условной переменной и не просыпается вовсе.
+ * Поток держит замок плеера (player) на время update и обработчиков, а обработчики могут сразу включить следующий
+ * трек - так автопереход работает и при свёрнутом окне. Всё, что меняет канал или трек из других потоков, должно
+ * держать тот же замок. Обработчики не должны звать nana: UI берёт свой замок раньше, чем замок плеера.
+ * Останов или замена канала (play с другим каналом, stop) - не конец трека: END старого канала отбрасывается.
+ * Трек, который занимает часть файла (CUE), кончается раньше канала: play получает его конец в сэмплах, поток сам
+ * останавливает канал на этой границе и считает это концом трека. К границе поток просыпается чаще, чем period.
+ */
+class playback_machine {
+public:
+	/// звук, которого ждали, открылся (ok) или нет; вызывается под замком плеера, состояние уже stopped
+	using open_handler = std::function<void(FMOD::Sound *sound, bool ok)>;
+	/// канал доиграл сам; вызывается под замком плеера, состояние уже stopped
+	using end_handler = std::function<void()>;
+
+private:
+	std::recursive_mutex &player;
+	open_handler opened;
+	end_handler ended;
+	std::chrono::milliseconds period;
+	FMOD::System *system = nullptr;
+	std::mutex lock;
+	std::condition_variable wake;
+	playback_state current = playback_state::stopped;
+	FMOD::Channel *watched = nullptr;
+	FMOD::Sound *awaited = nullptr;
+	unsigned int limit = 0; ///< конец трека в сэмплах канала, 0 - до конца звука
+	std::chrono::milliseconds wait;
+	bool end_seen = false;
+	bool stopping = false;
+	std::atomic<std::uint64_t> updates{0};
+	playback_queue queue;
+	std::thread pump;
+
+	static FMOD_RESULT F_CALLBACK on_channel(FMOD_CHANNELCONTROL *control, FMOD_CHANNELCONTROL_TYPE type,
+											 FMOD_CHANNELCONTROL_CALLBACK_TYPE kind, void *, void *) {
+		if (type != FMOD_CHANNELCONTROL_CHANNEL || kind != FMOD_CHANNELCONTROL_CALLBACK_END) {
+			return FMOD_OK;
+		}
+		auto *channel = reinterpret_cast<FMOD::Channel *>(control);
+		void *self = nullptr;
+		if (channel->getUserData(&self) == FMOD_OK && self) {
+			static_cast<playback_machine *>(self)->channel_ended(channel);
+		}
+		return FMOD_OK;
+	}
+
+	void channel_ended(FMOD::Channel *channel) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (channel == watched) {
+			end_seen = true;
+		}
+	}
+
+	/// вызывать под lock
+	void set_state(playback_state state) {
+		if (state == current) {
+			return;
+		}
+		current = state;
+		queue.post(playback_state_changed);
+		wake.notify_all();
+	}
+
+	bool busy() const { return current == playback_state::playing || current == playback_state::opening; }
+
+	/**
+	 * \brief дошёл ли канал до конца своей части файла; заодно - через сколько проснуться, чтобы не проскочить её
+	 * Вызывать под замком плеера.
+	 */
+	bool past_limit() {
+		FMOD::Channel *channel = nullptr;
+		unsigned int end = 0;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			wait = period;
+			channel = watched;
+			end = limit;
+		}
+		unsigned int position = 0;
+		float rate = 0;
+		if (!channel || !end || channel->getPosition(&position, FMOD_TIMEUNIT_PCM) != FMOD_OK ||
+			channel->getFrequency(&rate) != FMOD_OK || rate <= 0) {
+			return false;
+		}
+		if (position >= end) {
+			channel->setCallback(nullptr);
+			channel->stop();
+			return true;
+		}
+		auto left = std::chrono::milliseconds(static_cast<long long>((end - position) * 1000.0 / rate));
+		std::lock_guard<std::mutex> guard(lock);
+		wait = std::max(std::chrono::milliseconds(1), std::min(period, left));
+		return false;
+	}
+
+	/**
+	 * \brief один шаг потока: update, затем переходы по тому, что он принёс
+	 */
+	void step() {
+		std::lock_guard<std::recursive_mutex> hold(player);
+		if (!system) {
+			return;
+		}
+		system->update();
+		++updates;
+		FMOD::Sound *sound = nullptr;
+		bool end = false;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			sound = awaited;
+			end = end_seen;
+			end_seen = false;
+		}
+		if (!sound && !end) {
+			end = past_limit();
+		}
+		if (sound) {
+			FMOD_OPENSTATE state = FMOD_OPENSTATE_ERROR;
+			if (sound->getOpenState(&state, nullptr, nullptr, nullptr) != FMOD_OK) {
+				state = FMOD_OPENSTATE_ERROR;
+			}
+			if (state != FMOD_OPENSTATE_READY && state != FMOD_OPENSTATE_ERROR) {
+				return;
+			}
+			bool ok = state == FMOD_OPENSTATE_READY;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				awaited = nullptr;
+				set_state(playback_state::stopped);
+				if (!ok) {
+					queue.post(playback_open_failed);
+				}
+			}
+			TRACE_SCOPE("playback: opened");
+			opened(sound, ok);
+		} else if (end) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				watched = nullptr;
+				limit = 0;
+				set_state(playback_state::stopped);
+				queue.post(playback_ended);
+			}
+			TRACE_SCOPE("playback: ended");
+			ended();
+		}
+	}
+
+	void run() {
+		trace_thread_name_("playback");
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake.wait(guard, [this] { return stopping || busy(); });
+			if (stopping) {
+				break;
+			}
+			guard.unlock();
+			step();
+			guard.lock();
+			wake.wait_for(guard, wait, [this] { return stopping; });
+		}
+	}
+
+public:
+	/**
+	 * @param player - замок плеера, общий с UI
+	 * @param period - как часто звать update, пока что-то играет или открывается
+	 */
+	playback_machine(std::recursive_mutex &player, open_handler opened, end_handler ended,
+					 std::chrono::milliseconds period = std::chrono::milliseconds(50))
+			: player(player), opened(std::move(opened)), ended(std::move(ended)), period(period), wait(period) {
+		pump = std::thread(&playback_machine::run, this);
+	}
+
+	/// нельзя уничтожать, держа замок плеера: поток может ждать его внутри step
+	~playback_machine() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		pump.join();
+	}
+
+	playback_machine(playback_machine const &) = delete;
+	playback_machine &operator=(playback_machine const &) = delete;
+
+	/**
+	 * \brief система, у которой звать update; nullptr - система закрывается, автомат останавливается
+	 * Вызывать под замком плеера.
+	 */
+	void attach(FMOD::System *sys) {
+		system = sys;
+		if (!sys) {
+			stop();
+		}
+	}
+
+	/**
+	 * \brief ждёт, пока откроется звук, созданный с FMOD_NONBLOCKING; канал запустит обработчик open_handler
+	 */
+	void open(FMOD::Sound *sound) {
+		FMOD::Channel *previous = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			previous = watched;
+			watched = nullptr;
+			awaited = sound;
+			limit = 0;
+			end_seen = false;
+			set_state(sound ? playback_state::opening : playback_state::stopped);
+		}
+		if (previous) {
+			previous->setCallback(nullptr);
+		}
+	}
+
+	/**
+	 * \brief следит за новым каналом плеера; nullptr - канала больше нет
+	 * Вызывать после каждой замены канала: конец старого канала после этого концом трека не считается.
+	 * @param end - где в звуке кончается трек, в сэмплах; 0 - трек играет звук до конца
+	 */
+	void play(FMOD::Channel *channel, unsigned int end = 0) {
+		bool paused = false;
+		if (channel) {
+			channel->setUserData(this);
+			channel->setCallback(&playback_machine::on_channel);
+			channel->getPaused(&paused);
+		}
+		FMOD::Channel *previous = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			previous = watched;
+			watched = channel;
+			awaited = nullptr;
+			limit = channel ? end : 0;
+			end_seen = false;
+			set_state(!channel ? playback_state::stopped : paused ? playback_state::paused : playback_state::playing);
+		}
+		if (previous && previous != channel) {
+			previous->setCallback(nullptr); // у остановленного канала вернёт ошибку хэндла - это нормально
+		}
+	}
+
+	/// канал поставлен на паузу или снят с неё
+	void pause(bool on) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (watched) {
+			set_state(on ? playback_state::paused : playback_state::playing);
+		}
+	}
+
+	void stop() { play(nullptr); }
+
+	playback_state state() {
+		std::lock_guard<std::mutex> guard(lock);
+		return current;
+	}
+
+	/// звук, открытия которого ждёт автомат, или nullptr; освобождать его можно только после open(nullptr)
+	FMOD::Sound *awaiting() {
+		std::lock_guard<std::mutex> guard(lock);
+		return awaited;
+	}
+
+	playback_queue &events() { return queue; }
+
+	/// сколько раз поток позвал update; в паузе и остановке число не растёт
+	std::uint64_t update_count() const { return updates; }
+};
+
+#endif //SOUND_PLAYBACK_EVENTS_HPP
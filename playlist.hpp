@@ -0,0 +1,321 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_PLAYLIST_HPP
+#define SOUND_PLAYLIST_HPP
+
+#include "library.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <vector>
+
+/**
+ * \brief режим повтора
+ */
+enum class repeat_mode {
+	off, ///< после последнего трека - тишина
+	all, ///< после последнего трека - снова первый (при перемешивании - новый порядок)
+	one  ///< по окончании трек начинается заново
+};
+
+/**
+ * \brief псевдослучайная перестановка [0, n) без таблицы
+ * Сеть Фейстеля на 4 раунда над ближайшей степенью двойки с чётным числом бит и cycle walking
+ * для значений за пределами n: и прямое, и обратное отображение стоят O(1) в среднем и не требуют памяти,
+ * поэтому перемешать список из миллиона треков - это сменить ключ.
+ */
+class lazy_permutation {
+	std::uint64_t n = 0;
+	unsigned half_bits = 1;
+	std::uint64_t half_mask = 1;
+	std::uint64_t key = 0;
+
+	static std::uint64_t mix(std::uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		return x ^ (x >> 33);
+	}
+
+	std::uint64_t round(std::uint64_t half, unsigned r) const {
+		return mix(half ^ key ^ (0x9e3779b97f4a7c15ULL * (r + 1))) & half_mask;
+	}
+
+	std::uint64_t encrypt(std::uint64_t x) const {
+		std::uint64_t left = x >> half_bits, right = x & half_mask;
+		for (unsigned r = 0; r < 4; ++r) {
+			std::uint64_t next = left ^ round(right, r);
+			left = right;
+			right = next;
+		}
+		return (left << half_bits) | right;
+	}
+
+	std::uint64_t decrypt(std::uint64_t x) const {
+		std::uint64_t left = x >> half_bits, right = x & half_mask;
+		for (unsigned r = 4; r-- > 0;) {
+			std::uint64_t prev = right ^ round(left, r);
+			right = left;
+			left = prev;
+		}
+		return (left << half_bits) | right;
+	}
+
+public:
+	/**
+	 * \brief задаёт размер и ключ перестановки
+	 */
+	void reset(std::uint64_t size, std::uint64_t seed) {
+		n = size;
+		key = seed;
+		unsigned bits = 2;
+		while ((std::uint64_t(1) << bits) < n) {
+			bits += 2;
+		}
+		half_bits = bits / 2;
+		half_mask = (std::uint64_t(1) << half_bits) - 1;
+	}
+
+	std::uint64_t size() const { return n; }
+
+	/// i-й элемент перестановки, i < size()
+	std::uint64_t operator()(std::uint64_t i) const {
+		std::uint64_t x = encrypt(i);
+		while (x >= n) { // область не больше 4n, так что в среднем меньше четырёх шагов
+			x = encrypt(x);
+		}
+		return x;
+	}
+
+	/// позиция, на которой стоит value
+	std::uint64_t inverse(std::uint64_t value) const {
+		std::uint64_t x = decrypt(value);
+		while (x >= n) {
+			x = decrypt(x);
+		}
+		return x;
+	}
+};
+
+/**
+ * \brief список воспроизведения: треки по порядку, очередь "играть следующим", повтор, перемешивание и история
+ * Порядок при перемешивании не хранится, а вычисляется lazy_permutation, история - кольцо шагов,
+ * поэтому все операции O(1). Перестановка покрывает треки, которые были в списке, когда круг начался; добавленные
+ * посреди круга играют в его конце по порядку, так что сыгранное не возвращается, а позиции в истории не устаревают.
+ * Следующий круг перемешивает всех. peek_next всегда совпадает с тем, что вернёт следующий next,
+ * на этом держится предварительное открытие следующего трека.
+ */
+class playlist {
+public:
+	static constexpr std::size_t npos = ~std::size_t(0);
+
+private:
+	struct step {
+		track_id track = no_track;
+		std::size_t pos = npos; ///< позиция в порядке воспроизведения, npos - трек из очереди
+	};
+
+	static constexpr std::size_t history_limit = 1024;
+
+	std::vector<track_id> entries;
+	std::deque<track_id> queue;
+	std::deque<step> history;
+	lazy_permutation order;
+	bool shuffled = false;
+	repeat_mode repeat = repeat_mode::off;
+	std::uint64_t seed;
+	std::size_t pos = npos; ///< позиция последнего сыгранного трека из entries
+	track_id playing = no_track;
+
+	static std::uint64_t next_seed(std::uint64_t s) {
+		s += 0x9e3779b97f4a7c15ULL;
+		s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		s = (s ^ (s >> 27)) * 0x94d049bb133111ebULL;
+		return s ^ (s >> 31);
+	}
+
+	std::size_t entry_at(std::size_t p) const {
+		return shuffled && p < order.size() ? static_cast<std::size_t>(order(p)) : p;
+	}
+
+	/// позиция трека номер index в порядке воспроизведения
+	std::size_t position_of(std::size_t index) const {
+		return shuffled && index < order.size() ? static_cast<std::size_t>(order.inverse(index)) : index;
+	}
+
+	/// что будет следующим; wrap - начинается новый круг
+	step plan(bool ended, bool &wrap) const {
+		wrap = false;
+		if (ended && repeat == repeat_mode::one && playing != no_track) {
+			return history.empty() ? step{playing, pos} : history.back();
+		}
+		if (!queue.empty()) {
+			return {queue.front(), npos};
+		}
+		if (entries.empty()) {
+			return {};
+		}
+		std::size_t p = pos == npos ? 0 : pos + 1;
+		if (p < entries.size()) {
+			return {entries[entry_at(p)], p};
+		}
+		if (repeat == repeat_mode::off) {
+			return {};
+		}
+		wrap = true;
+		if (!shuffled) {
+			return {entries[0], 0};
+		}
+		lazy_permutation fresh;
+		fresh.reset(entries.size(), next_seed(seed));
+		return {entries[static_cast<std::size_t>(fresh(0))], 0};
+	}
+
+	track_id enter(step const &s) {
+		playing = s.track;
+		if (s.pos != npos) {
+			pos = s.pos;
+		}
+		if (s.track != no_track) {
+			history.push_back(s);
+			if (history.size() > history_limit) {
+				history.pop_front();
+			}
+		}
+		return s.track;
+	}
+
+public:
+	explicit playlist(std::uint64_t seed = std::random_device{}()) : seed(seed) {}
+
+	/// добавляет трек в конец списка; если круг уже начат и идёт перемешивание, трек сыграет в его конце
+	void add(track_id id) {
+		entries.push_back(id);
+		if (pos == npos) {
+			order.reset(entries.size(), seed); // круг не начат, сохранять нечего
+		}
+	}
+
+	/// ставит трек в очередь: он сыграет раньше следующего по списку
+	void enqueue(track_id id) { queue.push_back(id); }
+
+	void clear() {
+		entries.clear();
+		queue.clear();
+		history.clear();
+		order.reset(0, seed);
+		pos = npos;
+		playing = no_track;
+	}
+
+	/**
+	 * \brief следующий трек
+	 * @param ended - трек доиграл сам (тогда работает repeat_mode::one), иначе пользователь нажал "далее"
+	 * @return no_track, если играть больше нечего
+	 */
+	track_id next(bool ended = false) {
+		bool wrap = false;
+		step s = plan(ended, wrap);
+		if (s.track == no_track) {
+			return no_track;
+		}
+		if (s.pos == npos && !(ended && repeat == repeat_mode::one)) {
+			queue.pop_front();
+		}
+		if (wrap && shuffled) {
+			seed = next_seed(seed);
+			order.reset(entries.size(), seed);
+		}
+		if (ended && repeat == repeat_mode::one) {
+			playing = s.track; // повтор не засоряет историю
+			return s.track;
+		}
+		return enter(s);
+	}
+
+	/// то, что вернёт next(ended), без изменения состояния
+	track_id peek_next(bool ended = false) const {
+		bool wrap = false;
+		return plan(ended, wrap).track;
+	}
+
+	/**
+	 * \brief предыдущий трек: сначала по истории, а когда она кончилась - предыдущий по порядку
+	 */
+	track_id previous() {
+		if (history.size() >= 2) {
+			history.pop_back();
+			step s = history.back();
+			playing = s.track;
+			if (s.pos != npos) {
+				pos = s.pos;
+			}
+			return playing;
+		}
+		if (entries.empty()) {
+			return no_track;
+		}
+		std::size_t p;
+		if (pos != npos && pos > 0) {
+			p = pos - 1;
+		} else if (repeat == repeat_mode::all) {
+			p = entries.size() - 1;
+		} else {
+			return playing;
+		}
+		history.clear();
+		return enter({entries[entry_at(p)], p});
+	}
+
+	/**
+	 * \brief начинает играть трек номер index в списке (щелчок по строке)
+	 */
+	track_id jump(std::size_t index) {
+		if (index >= entries.size()) {
+			return no_track;
+		}
+		return enter({entries[index], position_of(index)});
+	}
+
+	/**
+	 * \brief включает/выключает перемешивание; текущий трек остаётся текущим
+	 */
+	void set_shuffle(bool enable) {
+		if (enable == shuffled) {
+			return;
+		}
+		std::size_t current = pos == npos ? npos : entry_at(pos);
+		shuffled = enable;
+		if (enable) {
+			seed = next_seed(seed);
+			order.reset(entries.size(), seed);
+		}
+		if (current != npos) {
+			pos = position_of(current);
+		}
+	}
+
+	bool shuffle() const { return shuffled; }
+
+	void set_repeat(repeat_mode mode) { repeat = mode; }
+
+	repeat_mode repeat_state() const { return repeat; }
+
+	track_id current() const { return playing; }
+
+	std::size_t size() const { return entries.size(); }
+
+	std::size_t queued() const { return queue.size(); }
+
+	/// очередь "играть следующим" по порядку
+	std::deque<track_id> const &queued_tracks() const { return queue; }
+
+	track_id operator[](std::size_t index) const { return entries[index]; }
+};
+
+#endif //SOUND_PLAYLIST_HPP
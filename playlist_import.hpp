@@ -0,0 +1,497 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_PLAYLIST_IMPORT_HPP
+#define SOUND_PLAYLIST_IMPORT_HPP
+
+#include "library.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/// форматы списков, которые умеет читать импорт
+enum class playlist_format {
+	unknown,
+	m3u,  ///< .m3u/.m3u8: путь на строке, #EXTINF:<секунды>,<название> перед ним
+	pls,  ///< .pls: FileN=, TitleN=
+	xspf, ///< .xspf: <track><location>file:///...</location><title>...</title></track>
+	cue   ///< .cue: образ альбома одним файлом, треки - части этого файла
+};
+
+/**
+ * \brief одна запись списка
+ * Все строки указывают в разбираемый текст и живут, пока жив он; разбор ничего не копирует и не выделяет.
+ */
+struct playlist_entry {
+	std::string_view location;  ///< как записано: путь, путь от папки списка или URI
+	std::string_view title;     ///< может быть пустым
+	std::string_view performer; ///< только у CUE
+	track_range range;          ///< только у CUE; у остальных - весь файл
+	bool escaped = false;       ///< location - из XML: в нём сущности &amp; и %XX, их раскрывает resolve_location_
+};
+
+/**
+ * \brief следующая строка текста без перевода строки и пробелов по краям
+ * @param at - с какого места читать; сдвигается за строку
+ * @return false, если текст кончился
+ */
+inline bool next_line_(std::string_view text, std::size_t &at, std::string_view &line) {
+	if (at >= text.size()) {
+		return false;
+	}
+	char const *begin = text.data() + at;
+	auto const *end = static_cast<char const *>(std::memchr(begin, '\n', text.size() - at));
+	std::size_t length = end ? static_cast<std::size_t>(end - begin) : text.size() - at;
+	at += length + 1;
+	line = std::string_view(begin, length);
+	while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+		line.remove_suffix(1);
+	}
+	while (!line.empty() && std::isspace(static_cast<unsigned char>(line.front()))) {
+		line.remove_prefix(1);
+	}
+	return true;
+}
+
+/// отрезает UTF-8 BOM, с которого начинаются списки из Windows
+inline std::string_view skip_bom_(std::string_view text) {
+	return text.compare(0, 3, "\xEF\xBB\xBF") == 0 ? text.substr(3) : text;
+}
+
+/// сравнение без учёта регистра ASCII
+inline bool starts_with_nocase_(std::string_view text, std::string_view prefix) {
+	if (text.size() < prefix.size()) {
+		return false;
+	}
+	for (std::size_t i = 0; i < prefix.size(); ++i) {
+		if (std::tolower(static_cast<unsigned char>(text[i])) != std::tolower(static_cast<unsigned char>(prefix[i]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * \brief M3U и M3U8
+ * @param sink - вызывается для каждой записи: sink(playlist_entry const &)
+ * @return число записей
+ */
+template <class Sink>
+std::size_t parse_m3u_(std::string_view text, Sink &&sink) {
+	text = skip_bom_(text);
+	std::size_t at = 0, count = 0;
+	std::string_view line, title;
+	while (next_line_(text, at, line)) {
+		if (line.empty()) {
+			continue;
+		}
+		if (line[0] == '#') {
+			if (line.compare(0, 8, "#EXTINF:") == 0) {
+				std::size_t comma = line.find(',');
+				title = comma == std::string_view::npos ? std::string_view() : line.substr(comma + 1);
+			}
+			continue;
+		}
+		playlist_entry entry;
+		entry.location = line;
+		entry.title = title;
+		sink(static_cast<playlist_entry const &>(entry));
+		title = {};
+		++count;
+	}
+	return count;
+}
+
+/**
+ * \brief PLS; TitleN может идти и до, и после FileN, поэтому запись уходит, когда началась следующая
+ * @return число записей
+ */
+template <class Sink>
+std::size_t parse_pls_(std::string_view text, Sink &&sink) {
+	text = skip_bom_(text);
+	std::size_t at = 0, count = 0;
+	std::string_view line;
+	playlist_entry pending;
+	std::string_view number; // N записи в pending
+	auto flush = [&] {
+		if (!pending.location.empty()) {
+			sink(static_cast<playlist_entry const &>(pending));
+			++count;
+		}
+		pending = {};
+	};
+	while (next_line_(text, at, line)) {
+		bool file = starts_with_nocase_(line, "file"), title = starts_with_nocase_(line, "title");
+		if (!file && !title) {
+			continue;
+		}
+		std::size_t eq = line.find('=');
+		if (eq == std::string_view::npos) {
+			continue;
+		}
+		std::string_view n = line.substr(file ? 4 : 5, eq - (file ? 4 : 5));
+		std::string_view value = line.substr(eq + 1);
+		if (n != number) {
+			flush();
+			number = n;
+		}
+		(file ? pending.location : pending.title) = value;
+	}
+	flush();
+	return count;
+}
+
+/**
+ * \brief содержимое первого <tag>...</tag> в text; пусто, если его нет
+ */
+inline std::string_view xml_element_(std::string_view text, std::string_view tag) {
+	std::size_t open = text.find(tag);
+	while (open != std::string_view::npos) {
+		// <tag> или <tag attr=...>, но не <tagother>
+		char after = open + tag.size() < text.size() ? text[open + tag.size()] : '\0';
+		if (after == '>' || after == ' ') {
+			break;
+		}
+		open = text.find(tag, open + 1);
+	}
+	if (open == std::string_view::npos) {
+		return {};
+	}
+	std::size_t begin = text.find('>', open);
+	if (begin == std::string_view::npos) {
+		return {};
+	}
+	++begin;
+	std::size_t end = text.find("</", begin);
+	return end == std::string_view::npos ? std::string_view() : text.substr(begin, end - begin);
+}
+
+/**
+ * \brief XSPF: по записи на каждый <track> с <location>
+ * Это не разбор XML, а поиск нужных тегов: XSPF из плееров плоский, и так его можно читать прямо из отображения.
+ * @return число записей
+ */
+template <class Sink>
+std::size_t parse_xspf_(std::string_view text, Sink &&sink) {
+	std::size_t at = 0, count = 0;
+	while (true) {
+		std::size_t open = text.find("<track", at);
+		if (open == std::string_view::npos) {
+			break;
+		}
+		char after = open + 6 < text.size() ? text[open + 6] : '\0';
+		if (after != '>' && !std::isspace(static_cast<unsigned char>(after))) {
+			at = open + 6; // <trackList>
+			continue;
+		}
+		std::size_t close = text.find("</track>", open);
+		if (close == std::string_view::npos) {
+			break;
+		}
+		at = close + 8;
+		std::string_view track = text.substr(open + 6, close - open - 6);
+		playlist_entry entry;
+		entry.location = xml_element_(track, "<location");
+		entry.title = xml_element_(track, "<title");
+		entry.escaped = true;
+		if (!entry.location.empty()) {
+			sink(static_cast<playlist_entry const &>(entry));
+			++count;
+		}
+	}
+	return count;
+}
+
+/// первое слово строки CUE; line сдвигается за него
+inline std::string_view cue_word_(std::string_view &line) {
+	std::size_t end = line.find_first_of(" \t");
+	std::string_view word = line.substr(0, end);
+	line = end == std::string_view::npos ? std::string_view() : line.substr(end + 1);
+	while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+		line.remove_prefix(1);
+	}
+	return word;
+}
+
+/// значение в кавычках или до пробела: FILE "a b.flac" WAVE, TITLE "x"
+inline std::string_view cue_value_(std::string_view line) {
+	if (!line.empty() && line[0] == '"') {
+		std::size_t end = line.find('"', 1);
+		return line.substr(1, end == std::string_view::npos ? std::string_view::npos : end - 1);
+	}
+	return line.substr(0, line.find(' '));
+}
+
+/**
+ * \brief mm:ss:ff в кадрах CUE
+ * @return false, если это не время
+ */
+inline bool cue_time_(std::string_view text, std::uint32_t &frames) {
+	std::uint32_t parts[3] = {};
+	int part = 0;
+	for (char c : text) {
+		if (c == ':') {
+			if (++part > 2) {
+				return false;
+			}
+		} else if (c >= '0' && c <= '9') {
+			parts[part] = parts[part] * 10 + static_cast<std::uint32_t>(c - '0');
+		} else {
+			return false;
+		}
+	}
+	if (part != 2 || parts[1] >= 60 || parts[2] >= cue_frames_per_second) {
+		return false;
+	}
+	frames = (parts[0] * 60 + parts[1]) * cue_frames_per_second + parts[2];
+	return true;
+}
+
+/**
+ * \brief CUE: каждый TRACK становится записью с частью файла FILE
+ * Трек начинается с INDEX 01 и кончается на INDEX 01 следующего трека того же файла; последний трек файла
+ * идёт до конца. Пауза перед треком (INDEX 00) остаётся в конце предыдущего, как при проигрывании диска.
+ * PERFORMER и TITLE до первого TRACK относятся к альбому: у трека без своего исполнителя он альбомный.
+ * @return число записей
+ */
+template <class Sink>
+std::size_t parse_cue_(std::string_view text, Sink &&sink) {
+	text = skip_bom_(text);
+	std::size_t at = 0, count = 0;
+	std::string_view line, file, album_performer;
+	playlist_entry ready, current; // ready ждёт своего конца - INDEX 01 следующего трека; current - читается
+	bool have_ready = false, have_current = false, current_started = false;
+	auto emit = [&](playlist_entry &entry, std::uint32_t end) {
+		entry.range.end = end;
+		if (entry.performer.empty()) {
+			entry.performer = album_performer;
+		}
+		if (!entry.location.empty()) {
+			sink(static_cast<playlist_entry const &>(entry));
+			++count;
+		}
+	};
+	auto finish_file = [&] { // последний трек файла - до конца
+		if (have_ready) {
+			emit(ready, 0);
+		}
+		if (have_current && current_started) {
+			emit(current, 0);
+		}
+		have_ready = have_current = current_started = false;
+	};
+	while (next_line_(text, at, line)) {
+		std::string_view command = cue_word_(line);
+		if (command == "FILE") {
+			finish_file();
+			file = cue_value_(line);
+		} else if (command == "TRACK") {
+			if (have_current && current_started) {
+				ready = current; // у ready уже был конец: его отдал INDEX 01 этого current
+				have_ready = true;
+			}
+			current = {};
+			current.location = file;
+			have_current = true;
+			current_started = false; // трек без INDEX 01 пропускается
+		} else if (command == "TITLE") {
+			if (have_current) {
+				current.title = cue_value_(line);
+			}
+		} else if (command == "PERFORMER") {
+			(have_current ? current.performer : album_performer) = cue_value_(line);
+		} else if (command == "INDEX" && have_current && !current_started) {
+			std::uint32_t frames = 0;
+			if (cue_word_(line) == "01" && cue_time_(cue_word_(line), frames)) {
+				current.range.start = frames;
+				current_started = true;
+				if (have_ready) {
+					emit(ready, frames);
+					have_ready = false;
+				}
+			}
+		}
+	}
+	finish_file();
+	return count;
+}
+
+/**
+ * \brief формат списка по расширению, а если оно незнакомо - по началу текста
+ */
+inline playlist_format playlist_format_of_(std::string_view path, std::string_view text) {
+	std::size_t dot = path.find_last_of("./\\");
+	std::string_view ext = dot == std::string_view::npos || path[dot] != '.' ? std::string_view() : path.substr(dot);
+	if (starts_with_nocase_(ext, ".m3u")) {
+		return playlist_format::m3u;
+	}
+	if (starts_with_nocase_(ext, ".pls")) {
+		return playlist_format::pls;
+	}
+	if (starts_with_nocase_(ext, ".xspf")) {
+		return playlist_format::xspf;
+	}
+	if (starts_with_nocase_(ext, ".cue")) {
+		return playlist_format::cue;
+	}
+	text = skip_bom_(text.substr(0, 4096));
+	while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+		text.remove_prefix(1);
+	}
+	if (text.compare(0, 7, "#EXTM3U") == 0) {
+		return playlist_format::m3u;
+	}
+	if (starts_with_nocase_(text, "[playlist]")) {
+		return playlist_format::pls;
+	}
+	if (text.find("<playlist") != std::string_view::npos && text.find("xspf") != std::string_view::npos) {
+		return playlist_format::xspf;
+	}
+	if (text.find("FILE ") != std::string_view::npos && text.find("TRACK ") != std::string_view::npos) {
+		return playlist_format::cue;
+	}
+	return playlist_format::unknown;
+}
+
+/**
+ * \brief разбирает text как список формата format
+ * @return число записей
+ */
+template <class Sink>
+std::size_t parse_playlist_(playlist_format format, std::string_view text, Sink &&sink) {
+	switch (format) {
+		case playlist_format::m3u:
+			return parse_m3u_(text, sink);
+		case playlist_format::pls:
+			return parse_pls_(text, sink);
+		case playlist_format::xspf:
+			return parse_xspf_(text, sink);
+		case playlist_format::cue:
+			return parse_cue_(text, sink);
+		default:
+			return 0;
+	}
+}
+
+/// путь уже от корня: /x, \\server\x, C:\x, C:/x
+inline bool is_absolute_path_(std::string_view path) {
+	return (!path.empty() && (path[0] == '/' || path[0] == '\\')) ||
+		   (path.size() > 2 && std::isalpha(static_cast<unsigned char>(path[0])) && path[1] == ':' &&
+			(path[2] == '/' || path[2] == '\\'));
+}
+
+/**
+ * \brief путь из записи списка, по которому его откроет FMOD
+ * file:// превращается в путь, %XX и сущности XML раскрываются, путь от папки списка дописывается к ней.
+ * Адреса http(s) остаются как есть. Запись в out, а не новая строка: импорт зовёт это на каждую запись
+ * с одним и тем же буфером.
+ * @param folder - папка списка с разделителем на конце, может быть пустой
+ */
+inline void resolve_location_(playlist_entry const &entry, std::string_view folder, std::string &out) {
+	std::string_view location = entry.location;
+	out.clear();
+	bool uri = false;
+	if (location.compare(0, 7, "file://") == 0) {
+		location.remove_prefix(7);
+		if (location.size() > 2 && location[0] == '/' && location[2] == ':') {
+			location.remove_prefix(1); // file:///C:/x
+		}
+		uri = true;
+	} else if (location.find("://") != std::string_view::npos) {
+		out.assign(location.data(), location.size());
+		return;
+	}
+	if (!uri && !entry.escaped) {
+		if (!is_absolute_path_(location)) {
+			out.assign(folder.data(), folder.size());
+		}
+		out.append(location.data(), location.size());
+		return;
+	}
+	auto hex = [](char c) {
+		return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+	};
+	static constexpr std::pair<char const *, char> entities[] = {{"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'},
+																{"&quot;", '"'}, {"&apos;", '\''}};
+	// путь от папки списка узнаётся по раскрытому тексту, поэтому папка вставляется потом
+	for (std::size_t i = 0; i < location.size(); ++i) {
+		char c = location[i];
+		if (c == '%' && i + 2 < location.size() && hex(location[i + 1]) >= 0 && hex(location[i + 2]) >= 0) {
+			out += static_cast<char>(hex(location[i + 1]) * 16 + hex(location[i + 2]));
+			i += 2;
+			continue;
+		}
+		if (c == '&' && entry.escaped) {
+			bool replaced = false;
+			for (auto const &e : entities) {
+				std::size_t n = std::strlen(e.first);
+				if (location.compare(i, n, e.first) == 0) {
+					out += e.second;
+					i += n - 1;
+					replaced = true;
+					break;
+				}
+			}
+			if (replaced) {
+				continue;
+			}
+		}
+		out += c;
+	}
+	if (!uri && !is_absolute_path_(out)) {
+		out.insert(0, folder.data(), folder.size());
+	}
+}
+
+/**
+ * \brief читает список или CUE с диска прямо из отображения файла
+ * Разбор не выделяет память на строку: записи указывают в отображение, а путь собирается в один буфер,
+ * который переиспользуется. Копируется только то, что заберёт sink.
+ * @param sink - вызывается на каждую запись: sink(std::string const &path, playlist_entry const &entry);
+ *               path - уже готовый к открытию; path и строки entry действительны только во время вызова
+ * @param expect - вызывается один раз до разбора: expect(записей не больше, байт в файле) - чтобы
+ *                 получатель заранее взял место
+ * @return число записей; 0 - файла нет, он пустой или формат не узнан
+ */
+template <class Sink, class Expect>
+std::size_t import_playlist_(std::string const &path, Sink &&sink, Expect &&expect) {
+	TRACE_SCOPE("import_playlist_");
+	mapped_file file;
+	if (!file.open(path) || !file.data()) {
+		return 0;
+	}
+	std::string_view text(file.data(), file.size());
+	playlist_format format = playlist_format_of_(path, text);
+	if (format == playlist_format::unknown) {
+		return 0;
+	}
+	std::size_t lines = 1;
+	for (char const *p = text.data(), *end = p + text.size();
+		 (p = static_cast<char const *>(std::memchr(p, '\n', static_cast<std::size_t>(end - p)))) != nullptr; ++p) {
+		++lines;
+	}
+	expect(lines, text.size());
+	std::size_t slash = path.find_last_of("/\\");
+	std::string_view folder = slash == std::string::npos ? std::string_view() : std::string_view(path).substr(0, slash + 1);
+	std::string resolved;
+	resolved.reserve(260);
+	return parse_playlist_(format, text, [&](playlist_entry const &entry) {
+		resolve_location_(entry, folder, resolved);
+		sink(static_cast<std::string const &>(resolved), entry);
+	});
+}
+
+template <class Sink>
+std::size_t import_playlist_(std::string const &path, Sink &&sink) {
+	return import_playlist_(path, sink, [](std::size_t, std::size_t) {});
+}
+
+#endif //SOUND_PLAYLIST_IMPORT_HPP
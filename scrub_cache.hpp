@@ -0,0 +1,447 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_SCRUB_CACHE_HPP
+#define SOUND_SCRUB_CACHE_HPP
+
+#include "fmod.hpp"
+#include "latency_profile.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief настройки кэша перемотки
+ */
+struct scrub_cache_options {
+	double back_seconds = 5;       ///< сколько сыгранного звука держать за точкой воспроизведения
+	double ahead_seconds = 5;      ///< сколько декодировать впрок
+	std::size_t chunk_frames = 4096; ///< сколько кадров декодер выдаёт за раз
+};
+
+/**
+ * \brief сводка перемоток: сколько обошлось без сброса декодера и сколько ждали звука
+ */
+struct scrub_report {
+	std::size_t seeks = 0;
+	std::size_t hits = 0; ///< перемотки без сброса декодера
+	double hit_rate = 0;  ///< hits / seeks, 0..1
+	latency_report latency; ///< от перемотки до звука в кэше, мс
+};
+
+/**
+ * \brief счётчики перемоток; один на все треки, чтобы сводка не обнулялась при смене трека
+ * Пишут потоки кэшей, читает интерфейс.
+ */
+class scrub_counters {
+	static constexpr std::size_t capacity = 1024;
+
+	std::mutex lock;
+	std::size_t seeks = 0, hits = 0;
+	std::vector<double> samples_ms;
+	std::size_t next = 0;
+
+public:
+	/**
+	 * \brief одна перемотка
+	 * @param hit - декодер не сбрасывался
+	 * @param ms - сколько прошло до звука в кэше
+	 */
+	void record(bool hit, double ms) {
+		std::lock_guard<std::mutex> guard(lock);
+		++seeks;
+		hits += hit;
+		if (samples_ms.size() < capacity) {
+			samples_ms.push_back(ms);
+		} else {
+			samples_ms[next] = ms;
+		}
+		next = (next + 1) % capacity;
+	}
+
+	/**
+	 * \brief доля попаданий и p50/p99 задержки по последним (до 1024) перемоткам
+	 */
+	scrub_report report() {
+		scrub_report r;
+		std::vector<double> v;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			r.seeks = seeks;
+			r.hits = hits;
+			v = samples_ms;
+		}
+		if (r.seeks == 0) {
+			return r;
+		}
+		r.hit_rate = double(r.hits) / r.seeks;
+		std::sort(v.begin(), v.end());
+		r.latency.count = v.size();
+		r.latency.p50 = v[(v.size() - 1) * 50 / 100];
+		r.latency.p99 = v[(v.size() - 1) * 99 / 100];
+		r.latency.max = v.back();
+		return r;
+	}
+};
+
+/**
+ * \brief кольцо декодированного PCM вокруг точки воспроизведения
+ * Свой поток декодирует впрок до ahead_seconds за точкой чтения; сыгранное не выбрасывается, пока не старше
+ * back_seconds. Перемотка внутри окна - это сдвиг точки чтения, декодер её не замечает. Перемотка чуть вперёд за
+ * окно (не дальше ahead_seconds) тоже обходится без сброса: поток просто декодирует до неё. Только перемотка дальше
+ * сбрасывает декодер на новое место, и окно начинается заново. Позиции - в кадрах от начала файла.
+ * Потокобезопасно: читает стрим FMOD, перематывает любой поток.
+ */
+class pcm_scrub_cache {
+	using clock = std::chrono::steady_clock;
+
+	std::function<std::size_t(char *, std::size_t)> decode;
+	std::function<bool(std::uint64_t)> restart;
+	std::size_t frame_bytes;
+	std::uint64_t total;          ///< длина файла в кадрах
+	std::uint64_t ahead;          ///< кадров впрок
+	std::size_t chunk;
+	std::uint64_t capacity;       ///< кадров в кольце: окно назад, впрок и один кусок декодера
+	scrub_counters *counters;
+
+	std::mutex lock;
+	std::condition_variable wake_reader, wake_filler;
+	std::vector<char> ring;
+	std::uint64_t first = 0;      ///< самый старый кадр в кольце
+	std::uint64_t last = 0;       ///< конец декодированного
+	std::uint64_t play = 0;       ///< следующий кадр для стрима
+	unsigned generation = 0;      ///< растёт при каждом сбросе декодера: кусок старого поколения выбрасывается
+	bool restart_pending = false; ///< декодер надо поставить на last
+	bool ended = false;           ///< декодер кончился раньше total или не смог перемотаться
+	bool stopping = false;
+	bool seek_waiting = false;    ///< перемотка ждёт звука, её задержка ещё не записана
+	bool seek_hit = false;
+	clock::time_point seek_started;
+	std::thread worker;
+
+	bool covered() const { return play >= first && play < last; }
+
+	void finish_seek() {
+		if (seek_waiting && (covered() || ended)) {
+			seek_waiting = false;
+			if (counters) {
+				counters->record(seek_hit, std::chrono::duration<double, std::milli>(clock::now() - seek_started).count());
+			}
+		}
+	}
+
+	/// сбрасывает окно на play и просит поток поставить туда декодер; под lock
+	void reset_window() {
+		++generation;
+		restart_pending = true;
+		ended = false;
+		first = last = play;
+	}
+
+	void run() {
+#ifdef SOUND_TRACE
+		trace_thread_name_("scrub cache");
+#endif
+		std::vector<char> buffer(chunk * frame_bytes);
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake_filler.wait(guard, [this] {
+				return stopping || restart_pending || (!ended && last < total && last < play + ahead);
+			});
+			if (stopping) {
+				return;
+			}
+			if (restart_pending) {
+				restart_pending = false;
+				unsigned g = generation;
+				std::uint64_t to = last;
+				guard.unlock();
+				bool ok;
+				{
+					TRACE_SCOPE("scrub cache: restart decoder");
+					ok = restart(to);
+				}
+				guard.lock();
+				if (!ok && g == generation) {
+					ended = true;
+					finish_seek();
+					wake_reader.notify_all();
+				}
+				continue;
+			}
+			unsigned g = generation;
+			std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(chunk, total - last));
+			guard.unlock();
+			std::size_t frames = decode(buffer.data(), want * frame_bytes) / frame_bytes;
+			guard.lock();
+			if (g != generation) {
+				continue; // перемотали, пока декодер читал: кусок не оттуда
+			}
+			if (frames == 0) {
+				ended = true;
+				finish_seek();
+				wake_reader.notify_all();
+				continue;
+			}
+			std::uint64_t end = last + frames;
+			if (end > capacity && play < end - capacity) {
+				// перемотка попала в то, что этот кусок вытеснит: ставим декодер туда
+				reset_window();
+				continue;
+			}
+			std::size_t at = static_cast<std::size_t>(last % capacity);
+			std::size_t head = std::min<std::size_t>(frames, static_cast<std::size_t>(capacity) - at);
+			std::memcpy(&ring[at * frame_bytes], buffer.data(), head * frame_bytes);
+			std::memcpy(&ring[0], buffer.data() + head * frame_bytes, (frames - head) * frame_bytes);
+			last = end;
+			if (last - first > capacity) {
+				first = last - capacity;
+			}
+			finish_seek();
+			wake_reader.notify_all();
+		}
+	}
+
+public:
+	/**
+	 * @param decode - читает следующие байты PCM подряд; 0 - конец
+	 * @param restart - ставит декодер на кадр; false - не смог
+	 * @param frame_bytes - байт в кадре (все каналы)
+	 * @param rate - кадров в секунде
+	 * @param total_frames - длина файла в кадрах
+	 * @param counters - куда писать перемотки, nullptr - никуда
+	 */
+	pcm_scrub_cache(std::function<std::size_t(char *, std::size_t)> decode, std::function<bool(std::uint64_t)> restart,
+					std::size_t frame_bytes, double rate, std::uint64_t total_frames, scrub_cache_options const &options = {},
+					scrub_counters *counters = nullptr)
+			: decode(std::move(decode)), restart(std::move(restart)), frame_bytes(frame_bytes), total(total_frames),
+			  ahead(static_cast<std::uint64_t>(options.ahead_seconds * rate)), chunk(std::max<std::size_t>(options.chunk_frames, 1)),
+			  counters(counters) {
+		capacity = static_cast<std::uint64_t>(options.back_seconds * rate) + ahead + chunk;
+		ring.resize(static_cast<std::size_t>(capacity) * frame_bytes);
+		worker = std::thread(&pcm_scrub_cache::run, this);
+	}
+
+	~pcm_scrub_cache() {
+		stop();
+		worker.join();
+	}
+
+	pcm_scrub_cache(pcm_scrub_cache const &) = delete;
+	pcm_scrub_cache &operator=(pcm_scrub_cache const &) = delete;
+
+	/// будит все ожидания: чтение вернёт конец; вызывать перед Sound::release
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake_reader.notify_all();
+		wake_filler.notify_all();
+	}
+
+	/**
+	 * \brief читает с точки воспроизведения; ждёт, пока поток декодирует нужное
+	 * @return байт прочитано; меньше size - конец файла или кэш остановлен
+	 */
+	std::size_t read(char *out, std::size_t size) {
+		std::unique_lock<std::mutex> guard(lock);
+		std::size_t done = 0;
+		while (size - done >= frame_bytes && play < total) {
+			wake_reader.wait(guard, [this] { return stopping || ended || covered(); });
+			if (stopping || !covered()) {
+				break;
+			}
+			std::size_t frames = static_cast<std::size_t>(std::min<std::uint64_t>((size - done) / frame_bytes, last - play));
+			std::size_t at = static_cast<std::size_t>(play % capacity);
+			std::size_t head = std::min<std::size_t>(frames, static_cast<std::size_t>(capacity) - at);
+			std::memcpy(out + done, &ring[at * frame_bytes], head * frame_bytes);
+			std::memcpy(out + done + head * frame_bytes, &ring[0], (frames - head) * frame_bytes);
+			play += frames;
+			done += frames * frame_bytes;
+			wake_filler.notify_one();
+		}
+		return done;
+	}
+
+	/**
+	 * \brief переставляет точку воспроизведения; внутри окна и чуть впереди декодер не трогается
+	 * @return true, если декодер не сбрасывался
+	 */
+	bool seek(std::uint64_t frame) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (seek_waiting && counters) { // прошлая перемотка не дождалась звука: пишется то, что она прождала
+			counters->record(seek_hit, std::chrono::duration<double, std::milli>(clock::now() - seek_started).count());
+		}
+		seek_started = clock::now();
+		seek_waiting = true;
+		play = std::min(frame, total);
+		seek_hit = play >= first && play <= last + ahead && !(ended && play > last);
+		if (!seek_hit) {
+			reset_window();
+		}
+		finish_seek();
+		wake_filler.notify_one();
+		wake_reader.notify_all();
+		return seek_hit;
+	}
+
+	/// кадры [from, to), которые лежат в кольце
+	void window(std::uint64_t &from, std::uint64_t &to) {
+		std::lock_guard<std::mutex> guard(lock);
+		from = first;
+		to = last;
+	}
+
+	std::uint64_t length() const { return total; }
+};
+
+/**
+ * \brief трек, который FMOD играет через pcm_scrub_cache
+ * Декодер - звук, открытый с FMOD_OPENONLY: его читает поток кэша через readData и перематывает seekData.
+ * Играет пользовательский стрим (FMOD_OPENUSER) того же формата, его pcmread берёт звук из кольца, а pcmsetpos -
+ * это seek кэша. Поэтому Channel::setPosition внутри окна не сбрасывает декодер, а getPosition, getLength и
+ * конец трека работают как у обычного стрима.
+ */
+class scrub_stream {
+	FMOD::Sound *decoder = nullptr;
+	FMOD::Sound *stream = nullptr;
+	std::unique_ptr<pcm_scrub_cache> cache;
+	std::size_t frame_bytes = 0;
+	float rate = 0;
+
+	static scrub_stream *of(FMOD_SOUND *sound) {
+		void *userdata = nullptr;
+		reinterpret_cast<FMOD::Sound *>(sound)->getUserData(&userdata);
+		return static_cast<scrub_stream *>(userdata);
+	}
+
+	static FMOD_RESULT F_CALLBACK pcm_read(FMOD_SOUND *sound, void *data, unsigned int datalen) {
+		scrub_stream *self = of(sound);
+		std::size_t got = self && self->cache ? self->cache->read(static_cast<char *>(data), datalen) : 0;
+		std::memset(static_cast<char *>(data) + got, 0, datalen - got); // за концом - тишина, длину знает FMOD
+		return FMOD_OK;
+	}
+
+	static FMOD_RESULT F_CALLBACK pcm_setpos(FMOD_SOUND *sound, int, unsigned int position, FMOD_TIMEUNIT postype) {
+		scrub_stream *self = of(sound);
+		if (!self || !self->cache) {
+			return FMOD_ERR_INVALID_HANDLE;
+		}
+		std::uint64_t frame = position;
+		if (postype == FMOD_TIMEUNIT_MS) {
+			frame = static_cast<std::uint64_t>(position * double(self->rate) / 1000);
+		} else if (postype == FMOD_TIMEUNIT_PCMBYTES) {
+			frame = position / self->frame_bytes;
+		}
+		self->cache->seek(frame);
+		return FMOD_OK;
+	}
+
+public:
+	scrub_stream() = default;
+	scrub_stream(scrub_stream const &) = delete;
+	scrub_stream &operator=(scrub_stream const &) = delete;
+
+	/// сначала будит стрим FMOD, который мог ждать кэш, потом отпускает его, кэш и декодер
+	~scrub_stream() {
+		if (cache) {
+			cache->stop();
+		}
+		if (stream) {
+			stream->release();
+		}
+		cache.reset();
+		if (decoder) {
+			decoder->release();
+		}
+	}
+
+	/**
+	 * \brief создаёт кэш и стрим поверх открытого декодера
+	 * @param opened - звук с FMOD_OPENONLY, уже готовый; переходит во владение, даже если открыть не удалось
+	 * @return FMOD_RESULT; FMOD_ERR_FORMAT - сжатый или слишком длинный звук, его стоит играть обычным стримом
+	 */
+	FMOD_RESULT open(FMOD::System *system, FMOD::Sound *opened, scrub_cache_options const &options = {},
+					 scrub_counters *counters = nullptr) {
+		TRACE_SCOPE("scrub_stream::open");
+		decoder = opened;
+		FMOD_SOUND_TYPE type;
+		FMOD_SOUND_FORMAT format = FMOD_SOUND_FORMAT_NONE;
+		int channels = 0, bits = 0;
+		unsigned int frames = 0;
+		FMOD_RESULT result = decoder->getFormat(&type, &format, &channels, &bits);
+		if (result == FMOD_OK) {
+			result = decoder->getDefaults(&rate, nullptr);
+		}
+		if (result == FMOD_OK) {
+			result = decoder->getLength(&frames, FMOD_TIMEUNIT_PCM);
+		}
+		if (result != FMOD_OK) {
+			return result;
+		}
+		frame_bytes = std::size_t(channels) * bits / 8;
+		if (format < FMOD_SOUND_FORMAT_PCM8 || format > FMOD_SOUND_FORMAT_PCMFLOAT || frame_bytes == 0 || frames == 0 ||
+			std::uint64_t(frames) * frame_bytes > 0xffffffffu) {
+			return FMOD_ERR_FORMAT;
+		}
+		FMOD::Sound *source = decoder;
+		cache.reset(new pcm_scrub_cache(
+				[source](char *out, std::size_t size) {
+					unsigned int read = 0;
+					FMOD_RESULT r = source->readData(out, static_cast<unsigned int>(size), &read);
+					return r == FMOD_OK || r == FMOD_ERR_FILE_EOF ? std::size_t(read) : std::size_t(0);
+				},
+				[source](std::uint64_t frame) { return source->seekData(static_cast<unsigned int>(frame)) == FMOD_OK; },
+				frame_bytes, rate, frames, options, counters));
+		FMOD_CREATESOUNDEXINFO info;
+		std::memset(&info, 0, sizeof(info));
+		info.cbsize = sizeof(info);
+		info.length = static_cast<unsigned int>(frames * frame_bytes);
+		info.numchannels = channels;
+		info.defaultfrequency = static_cast<int>(rate);
+		info.format = format;
+		info.decodebuffersize = static_cast<unsigned int>(options.chunk_frames); // кольцо и так впрок
+		info.pcmreadcallback = pcm_read;
+		info.pcmsetposcallback = pcm_setpos;
+		info.userdata = this;
+		return system->createSound(nullptr, FMOD_OPENUSER | FMOD_CREATESTREAM | FMOD_LOOP_OFF, &info, &stream);
+	}
+
+	/// то, что играется; принадлежит scrub_stream, не отпускать
+	FMOD::Sound *sound() const { return stream; }
+
+	pcm_scrub_cache *ring() const { return cache.get(); }
+};
+
+/**
+ * \brief открывает файл с кэшем перемотки
+ * @return FMOD_RESULT; при ошибке out пуст, и файл стоит открыть обычным стримом
+ */
+inline FMOD_RESULT open_scrub_stream_(FMOD::System *system, char const *path, std::unique_ptr<scrub_stream> &out,
+									  scrub_cache_options const &options = {}, scrub_counters *counters = nullptr) {
+	out.reset();
+	FMOD::Sound *decoder = nullptr;
+	FMOD_RESULT result = system->createSound(path, FMOD_OPENONLY, 0, &decoder);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	std::unique_ptr<scrub_stream> stream(new scrub_stream);
+	result = stream->open(system, decoder, options, counters);
+	if (result == FMOD_OK) {
+		out = std::move(stream);
+	}
+	return result;
+}
+
+#endif //SOUND_SCRUB_CACHE_HPP
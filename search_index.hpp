@@ -0,0 +1,431 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_SEARCH_INDEX_HPP
+#define SOUND_SEARCH_INDEX_HPP
+
+#include "library.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief приводит текст к виду для поиска: нижний регистр (латиница и кириллица), разделители - одиночные пробелы
+ * В начало добавляется пробел, чтобы у первого слова тоже было начало слова.
+ */
+inline std::string normalize_for_search_(std::string_view text) {
+	std::string out(1, ' ');
+	for (std::size_t i = 0; i < text.size(); ++i) {
+		auto c = static_cast<unsigned char>(text[i]);
+		if (c >= 'A' && c <= 'Z') {
+			out += static_cast<char>(c - 'A' + 'a');
+		} else if (c == 0xd0 && i + 1 < text.size()) { // А-Я, Ё в UTF-8
+			auto d = static_cast<unsigned char>(text[++i]);
+			if (d >= 0x90 && d <= 0x9f) {
+				out += '\xd0';
+				out += static_cast<char>(d + 0x20);
+			} else if (d >= 0xa0 && d <= 0xaf) {
+				out += '\xd1';
+				out += static_cast<char>(d - 0x20);
+			} else if (d == 0x81) {
+				out += "\xd1\x91";
+			} else {
+				out += '\xd0';
+				out += static_cast<char>(d);
+			}
+		} else if (c < 0x80 && !((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) {
+			if (out.back() != ' ') {
+				out += ' ';
+			}
+		} else {
+			out += static_cast<char>(c);
+		}
+	}
+	if (out.size() > 1 && out.back() == ' ') {
+		out.pop_back();
+	}
+	return out;
+}
+
+/**
+ * \brief найденный трек; чем больше score, тем выше в выдаче
+ */
+struct search_hit {
+	track_id id = no_track;
+	int score = 0;
+};
+
+/**
+ * \brief флаг отмены поиска: запрос устарел, если пришёл более новый
+ */
+struct search_cancel {
+	std::atomic<unsigned> const *latest = nullptr;
+	unsigned mine = 0;
+
+	bool stale() const { return latest && latest->load(std::memory_order_relaxed) != mine; }
+};
+
+/**
+ * \brief триграммный индекс по названию, исполнителю, альбому и пути
+ * Каждое слово запроса ищется как подстрока: кандидаты - пересечение списков триграмм, затем проверка текста.
+ * Совпадение с начала слова ценится выше, чем в середине. Однобуквенные и двухбуквенные слова ищутся
+ * по началу слова. Если точных совпадений мало, добираются нечёткие: треки, у которых есть заметная доля
+ * триграмм запроса (опечатки, пропущенные буквы).
+ */
+class search_index {
+	std::unordered_map<std::uint32_t, std::vector<track_id>> postings; ///< списки отсортированы по возрастанию
+	std::vector<char> text;
+	std::vector<std::pair<std::uint32_t, std::uint32_t>> docs; ///< нормализованный текст трека в text
+	std::vector<std::uint16_t> counts; ///< рабочий массив нечёткого поиска
+	std::vector<track_id> touched;
+
+	static std::uint32_t gram(char a, char b, char c) {
+		return static_cast<unsigned char>(a) | static_cast<unsigned char>(b) << 8 |
+			   static_cast<unsigned char>(c) << 16 | 3u << 24;
+	}
+
+	/// "слово начинается с буквы a"
+	static std::uint32_t start_gram(char a) {
+		return static_cast<unsigned char>(a) | 1u << 24;
+	}
+
+	void post(std::uint32_t key, track_id id) {
+		auto &list = postings[key];
+		if (list.empty() || list.back() < id) {
+			list.push_back(id);
+			return;
+		}
+		auto it = std::lower_bound(list.begin(), list.end(), id); // переиндексация старого трека
+		if (*it != id) {
+			list.insert(it, id);
+		}
+	}
+
+	std::vector<track_id> const *find(std::uint32_t key) const {
+		auto it = postings.find(key);
+		return it == postings.end() ? nullptr : &it->second;
+	}
+
+	/// ключи, которые обязательно есть у документа со словом word
+	static void word_keys(std::string_view word, std::vector<std::uint32_t> &keys) {
+		if (word.size() == 1) {
+			keys.push_back(start_gram(word[0]));
+		} else if (word.size() == 2) {
+			keys.push_back(gram(' ', word[0], word[1]));
+		} else {
+			for (std::size_t i = 0; i + 2 < word.size(); ++i) {
+				keys.push_back(gram(word[i], word[i + 1], word[i + 2]));
+			}
+		}
+	}
+
+	static std::vector<std::string_view> split(std::string const &normalized) {
+		std::vector<std::string_view> words;
+		std::size_t i = 0;
+		while (i < normalized.size()) {
+			while (i < normalized.size() && normalized[i] == ' ') {
+				++i;
+			}
+			std::size_t begin = i;
+			while (i < normalized.size() && normalized[i] != ' ') {
+				++i;
+			}
+			if (i > begin) {
+				words.emplace_back(normalized.data() + begin, i - begin);
+			}
+		}
+		return words;
+	}
+
+	/// оценка точного совпадения: 0 - какого-то слова нет
+	int exact_score(track_id id, std::vector<std::string_view> const &words) const {
+		std::string_view doc(text.data() + docs[id].first, docs[id].second - docs[id].first);
+		int score = 0;
+		for (auto word : words) {
+			std::size_t at = doc.find(word);
+			if (at == std::string_view::npos) {
+				return 0;
+			}
+			bool word_start = false;
+			for (; at != std::string_view::npos && !word_start; at = doc.find(word, at + 1)) {
+				word_start = doc[at - 1] == ' '; // doc начинается с пробела, поэтому at > 0
+			}
+			if (word.size() <= 2 && !word_start) {
+				return 0;
+			}
+			score += word_start ? 3 : 2;
+		}
+		return score;
+	}
+
+public:
+	/**
+	 * \brief добавляет трек или обновляет его текст (например, когда прочитались теги)
+	 */
+	void set(track_id id, track_tags const &tags, std::string_view path) {
+		std::string doc = normalize_for_search_(tags.title + ' ' + tags.artist + ' ' + tags.album + ' ' +
+												std::string(path));
+		if (docs.size() <= id) {
+			docs.resize(id + 1, {0, 0});
+			counts.resize(id + 1, 0);
+		}
+		docs[id] = {static_cast<std::uint32_t>(text.size()), static_cast<std::uint32_t>(text.size() + doc.size())};
+		text.insert(text.end(), doc.begin(), doc.end()); // старый текст остаётся мусором: обновления редки
+		for (std::size_t i = 0; i + 2 < doc.size(); ++i) {
+			if (doc[i + 1] != ' ' && doc[i + 2] != ' ') {
+				post(gram(doc[i], doc[i + 1], doc[i + 2]), id);
+			}
+			if (doc[i] == ' ') {
+				post(start_gram(doc[i + 1]), id);
+			}
+		}
+	}
+
+	std::size_t size() const { return docs.size(); }
+
+	/**
+	 * \brief ищет треки по запросу
+	 * @param limit - сколько результатов вернуть
+	 * @param cancel - при устаревании запроса поиск бросается и возвращает пустой список
+	 */
+	std::vector<search_hit> query(std::string_view request, std::size_t limit, search_cancel cancel = {}) {
+		std::string normalized = normalize_for_search_(request);
+		std::vector<std::string_view> words = split(normalized);
+		std::vector<search_hit> hits;
+		if (words.empty() || limit == 0 || cancel.stale()) { // пока запрос ждал поток, его могли сменить
+			return hits;
+		}
+		std::vector<std::uint32_t> keys;
+		for (auto word : words) {
+			word_keys(word, keys);
+		}
+
+		// точные совпадения: пересечение, начиная с самого короткого списка
+		std::vector<std::vector<track_id> const *> lists;
+		bool all_found = true;
+		for (std::uint32_t key : keys) {
+			auto const *list = find(key);
+			all_found = all_found && list;
+			if (list) {
+				lists.push_back(list);
+			}
+		}
+		std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+		std::vector<char> exact(docs.size(), 0);
+		std::size_t checked = 0;
+		if (all_found && !lists.empty()) {
+			for (track_id id : *lists[0]) {
+				if ((++checked & 4095) == 0 && cancel.stale()) {
+					return {};
+				}
+				bool everywhere = true;
+				for (std::size_t l = 1; l < lists.size() && everywhere; ++l) {
+					everywhere = std::binary_search(lists[l]->begin(), lists[l]->end(), id);
+				}
+				int score = everywhere ? exact_score(id, words) : 0;
+				if (score > 0) {
+					hits.push_back({id, score * 100});
+					exact[id] = 1;
+					if (hits.size() >= limit * 4) { // для подсказки при наборе хватит
+						break;
+					}
+				}
+			}
+		}
+
+		// нечёткие: доля общих триграмм; слишком частые триграммы почти ничего не говорят и пропускаются
+		std::size_t grams = 0;
+		for (auto word : words) {
+			grams += word.size() >= 3 ? word.size() - 2 : 0;
+		}
+		if (hits.size() < limit && grams >= 2) {
+			std::size_t common = docs.size() / 4 + 1;
+			touched.clear();
+			for (auto word : words) {
+				for (std::size_t i = 0; i + 2 < word.size(); ++i) {
+					auto const *list = find(gram(word[i], word[i + 1], word[i + 2]));
+					if (!list || list->size() > common) {
+						continue;
+					}
+					for (track_id id : *list) {
+						if ((++checked & 4095) == 0 && cancel.stale()) {
+							for (track_id t : touched) {
+								counts[t] = 0;
+							}
+							return {};
+						}
+						if (counts[id]++ == 0) {
+							touched.push_back(id);
+						}
+					}
+				}
+			}
+			std::size_t need = std::max<std::size_t>(2, (grams + 2) / 3);
+			for (track_id id : touched) {
+				if (counts[id] >= need && !exact[id]) {
+					hits.push_back({id, static_cast<int>(100 * counts[id] / grams)});
+				}
+				counts[id] = 0;
+			}
+		}
+
+		std::size_t keep = std::min(limit, hits.size());
+		std::partial_sort(hits.begin(), hits.begin() + keep, hits.end(), [](search_hit const &a, search_hit const &b) {
+			return a.score != b.score ? a.score > b.score : a.id < b.id;
+		});
+		hits.resize(keep);
+		return hits;
+	}
+};
+
+/**
+ * \brief поиск в фоновом потоке
+ * Поток держит индекс, дочитывает теги добавленных треков и выполняет запросы. Новый запрос отменяет
+ * выполняющийся, а окно забирает результаты опросом take_results, поэтому UI-поток никогда не ждёт индекс.
+ */
+class search_worker {
+	search_index index;
+	std::function<track_tags(std::string const &)> read_tags;
+	std::size_t limit;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+	std::deque<std::pair<track_id, std::string>> jobs;
+	std::string request;
+	bool request_pending = false;
+	std::atomic<unsigned> generation{0};
+	std::vector<search_hit> results;
+	unsigned results_generation = 0;
+	bool results_ready = false;
+	double last_ms = 0;
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			if (request_pending) {
+				request_pending = false;
+				std::string text = request;
+				search_cancel cancel{&generation, generation.load()};
+				guard.unlock();
+				auto begin = std::chrono::steady_clock::now();
+				std::vector<search_hit> found = index.query(text, limit, cancel);
+				double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+				guard.lock();
+				if (!cancel.stale()) {
+					results = std::move(found);
+					results_generation = cancel.mine;
+					results_ready = true;
+					last_ms = ms;
+				}
+			} else if (!jobs.empty()) {
+				auto job = std::move(jobs.front());
+				jobs.pop_front();
+				guard.unlock();
+				index.set(job.first, {}, job.second); // путь ищется сразу, теги - как только прочитаются
+				if (read_tags) {
+					index.set(job.first, read_tags(job.second), job.second);
+				}
+				guard.lock();
+				if (jobs.empty() && !request.empty()) {
+					request_pending = true; // в индексе появились новые треки - обновляем выдачу
+					generation.fetch_add(1);
+				}
+			} else {
+				wake.wait(guard);
+			}
+		}
+	}
+
+public:
+	/**
+	 * @param reader - чтение тегов по пути (вызывается в потоке поиска), может быть пустым
+	 * @param limit - сколько результатов отдавать
+	 */
+	explicit search_worker(std::function<track_tags(std::string const &)> reader = {}, std::size_t limit = 500)
+			: read_tags(std::move(reader)), limit(limit) {
+		worker = std::thread(&search_worker::run, this);
+	}
+
+	search_worker(search_worker const &) = delete;
+
+	search_worker &operator=(search_worker const &) = delete;
+
+	~search_worker() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+			generation.fetch_add(1);
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	/// ставит трек в очередь на индексацию
+	void add(track_id id, std::string path) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.emplace_back(id, std::move(path));
+		}
+		wake.notify_one();
+	}
+
+	/**
+	 * \brief запускает поиск, отменяя предыдущий
+	 * @return номер запроса
+	 */
+	unsigned search(std::string text) {
+		unsigned mine;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			request = std::move(text);
+			request_pending = !request.empty();
+			mine = generation.fetch_add(1) + 1;
+		}
+		wake.notify_one();
+		return mine;
+	}
+
+	/**
+	 * \brief забирает результаты, если они пришли после прошлого вызова
+	 * @param generation_out - номер запроса, к которому относятся результаты
+	 */
+	bool take_results(std::vector<search_hit> &out, unsigned &generation_out) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!results_ready) {
+			return false;
+		}
+		out = std::move(results);
+		generation_out = results_generation;
+		results_ready = false;
+		return true;
+	}
+
+	/// сколько занял последний завершённый запрос, мс
+	double last_query_ms() {
+		std::lock_guard<std::mutex> guard(lock);
+		return last_ms;
+	}
+
+	/// сколько треков ещё ждут индексации
+	std::size_t pending() {
+		std::lock_guard<std::mutex> guard(lock);
+		return jobs.size();
+	}
+};
+
+#endif //SOUND_SEARCH_INDEX_HPP
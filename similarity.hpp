@@ -0,0 +1,631 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_SIMILARITY_HPP
+#define SOUND_SIMILARITY_HPP
+
+#include "analysis_cache.hpp"
+#include "library.hpp"
+#include "spectrum.hpp"
+#include "time_stretch.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// длина вектора похожести: кратна 4, чтобы расстояние считалось SSE без хвоста
+constexpr std::size_t similarity_dims = 32;
+/// из них тембр и громкость - артефакт анализа; темп и тональность дописываются из track_analysis
+constexpr std::size_t timbre_dims = 28;
+/// полосы, из которых считаются MFCC, и сколько коэффициентов берётся (без нулевого - это громкость)
+constexpr std::size_t timbre_bands = 24;
+constexpr std::size_t timbre_coefficients = 12;
+constexpr std::size_t timbre_frame = 2048;
+
+/**
+ * \brief тембр и громкость трека
+ * [0, 12) - средние MFCC 1..12, [12, 24) - их разброс, 24 - средняя громкость, 25 - её разброс,
+ * 26 - средний спектральный центроид, 27 - доля тихих кадров.
+ */
+struct track_timbre {
+	float values[timbre_dims] = {};
+};
+
+/**
+ * \brief квадрат евклидова расстояния (SSE, если доступно)
+ */
+inline float l2_squared_(float const *a, float const *b, std::size_t n) {
+	std::size_t i = 0;
+	float sum = 0;
+#ifdef SOUND_HAVE_SSE
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+		__m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; i < n; ++i) {
+		float d = a[i] - b[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+/**
+ * \brief тембр моно-сигнала с частотой analysis_rate
+ * MFCC - косинусное преобразование логарифмов энергии в полосах, равномерных по логарифму частоты от 60 до 5000 Гц
+ * (выше 1 кГц это почти шкала мел, а ниже такие полосы шире, чем бины кадра). Тихие кадры в тембр не идут.
+ * Один объект на поток: буферы переиспользуются между треками.
+ */
+class timbre_extractor {
+	spectrum_analyzer spectrum{timbre_frame, analysis_rate};
+	std::vector<std::size_t> edges;
+	std::vector<float> power, bands;
+	float dct[timbre_coefficients][timbre_bands];
+
+public:
+	timbre_extractor() : edges(spectrum.log_bands(60, 5000, timbre_bands)), power(spectrum.bins()), bands(timbre_bands) {
+		for (std::size_t c = 0; c < timbre_coefficients; ++c) {
+			for (std::size_t b = 0; b < timbre_bands; ++b) {
+				dct[c][b] = static_cast<float>(std::sqrt(2.0 / timbre_bands) *
+											   std::cos(3.14159265358979323846 * (c + 1) * (b + 0.5) / timbre_bands));
+			}
+		}
+	}
+
+	/**
+	 * @return false, если громких кадров слишком мало, чтобы говорить о тембре
+	 */
+	bool compute(float const *mono, std::size_t n, track_timbre &out) {
+		TRACE_SCOPE("timbre_extractor::compute");
+		double sum[timbre_coefficients] = {}, square[timbre_coefficients] = {};
+		double loud_sum = 0, loud_square = 0, centroid_sum = 0;
+		std::size_t frames = 0, quiet = 0;
+		for (std::size_t start = 0; start + timbre_frame <= n; start += timbre_frame) {
+			float energy = dot_product_(mono + start, mono + start, timbre_frame) / timbre_frame;
+			double db = 10 * std::log10(energy + 1e-10);
+			if (db < -60) {
+				++quiet;
+				continue;
+			}
+			spectrum.power(mono + start, power.data());
+			spectrum_analyzer::band_energies(power.data(), edges, bands.data());
+			for (float &b : bands) {
+				b = std::log(b + 1e-9f);
+			}
+			for (std::size_t c = 0; c < timbre_coefficients; ++c) {
+				double v = dot_product_(dct[c], bands.data(), timbre_bands);
+				sum[c] += v;
+				square[c] += v * v;
+			}
+			double weighted = 0, total = 0;
+			for (std::size_t k = 1; k < power.size(); ++k) {
+				weighted += double(power[k]) * spectrum.bin_hz(k);
+				total += power[k];
+			}
+			centroid_sum += std::log2(std::max(weighted / std::max(total, 1e-20), 20.0) / 1000);
+			loud_sum += db;
+			loud_square += db * db;
+			++frames;
+		}
+		if (frames < 8) {
+			return false;
+		}
+		// веса подобраны так, чтобы у групп был сравнимый разброс по библиотеке: ни одна не заглушает остальные
+		for (std::size_t c = 0; c < timbre_coefficients; ++c) {
+			double mean = sum[c] / frames;
+			out.values[c] = static_cast<float>(mean / 4);
+			out.values[timbre_coefficients + c] =
+					static_cast<float>(std::sqrt(std::max(0.0, square[c] / frames - mean * mean)) / 2);
+		}
+		double loud = loud_sum / frames;
+		out.values[24] = static_cast<float>(loud / 10);
+		out.values[25] = static_cast<float>(std::sqrt(std::max(0.0, loud_square / frames - loud * loud)) / 5);
+		out.values[26] = static_cast<float>(centroid_sum / frames);
+		out.values[27] = static_cast<float>(double(quiet) / (quiet + frames));
+		return true;
+	}
+};
+
+constexpr std::uint32_t timbre_artifact = artifact_type_("TMBR");
+
+/**
+ * \brief проход общего декодирования, который считает тембр; артефакт - track_timbre
+ */
+inline analysis_pass timbre_pass_(double seconds) {
+	static_assert(std::is_trivially_copyable<track_timbre>::value, "track_timbre is stored as raw bytes");
+	auto extractor = std::make_shared<timbre_extractor>();
+	return {timbre_artifact, 1, seconds, [extractor, seconds](decoded_track const &track, std::vector<char> &out) {
+		track_timbre timbre;
+		if (!extractor->compute(track.mono.data(), track.mono_length(seconds), timbre)) {
+			return false;
+		}
+		out.resize(sizeof(timbre));
+		std::memcpy(out.data(), &timbre, sizeof(timbre));
+		return true;
+	}};
+}
+
+/**
+ * \brief вектор похожести: тембр, громкость, темп и тональность
+ * Темп - log2(bpm / 120): 60 и 240 BPM равно далеки от 120. Тональность - точка на круге Camelot, поэтому
+ * параллельные мажор и минор совпадают, а соседние по кругу сводятся ближе, чем далёкие.
+ * Неизвестные темп и тональность - нули: трек не притягивается ни к какому темпу.
+ */
+inline void similarity_vector_(track_timbre const &timbre, track_analysis const &analysis, float *out) {
+	std::copy(timbre.values, timbre.values + timbre_dims, out);
+	std::fill(out + timbre_dims, out + similarity_dims, 0.0f);
+	if (analysis.bpm > 0) {
+		out[28] = static_cast<float>(2 * std::log2(analysis.bpm / 120.0));
+	}
+	if (analysis.key >= 0) {
+		int major = analysis.minor ? (analysis.key + 3) % 12 : analysis.key;
+		double angle = 2 * 3.14159265358979323846 * ((major * 7) % 12) / 12;
+		out[29] = static_cast<float>(std::cos(angle));
+		out[30] = static_cast<float>(std::sin(angle));
+	}
+}
+
+/**
+ * \brief индекс приближённых ближайших соседей (HNSW) по векторам похожести
+ * Граф из слоёв: на нулевом все треки с до 2M соседей, каждый следующий - примерно в M раз реже, с до M соседей.
+ * Поиск спускается жадно по верхним слоям и широким перебором (ef) по нулевому; соседи выбираются эвристикой
+ * HNSW - кандидат берётся, только если он ближе к вставляемому, чем к уже выбранным, чтобы граф не слипался в
+ * кластерах. Треки добавляются по одному, без перестройки. Номера треков живут до выхода, поэтому в файл идут пути:
+ * после load все узлы - сироты, пока adopt не свяжет путь с номером в библиотеке; сирот поиск не возвращает.
+ * Потокобезопасно.
+ */
+class similarity_index {
+public:
+	static constexpr std::size_t M = 16;
+	static constexpr std::size_t M0 = 2 * M;
+
+private:
+	static constexpr std::uint32_t none = ~std::uint32_t(0);
+	static constexpr std::uint32_t file_magic = 0x4d495353; // "SSIM"
+	static constexpr std::uint32_t file_version = 1;
+	static constexpr int max_level = 15;
+
+	using scored = std::pair<float, std::uint32_t>; ///< расстояние, узел
+
+	std::mutex lock;
+	std::size_t ef_construction;
+	std::vector<float> vectors;               ///< similarity_dims на узел
+	std::vector<track_id> labels;             ///< трек узла, no_track - сирота
+	std::vector<std::uint8_t> levels;
+	std::vector<std::uint32_t> base;          ///< нулевой слой: на узел [число соседей, M0 соседей]
+	std::vector<std::vector<std::uint32_t>> upper; ///< слои 1..level: на слой [число, M соседей]
+	std::unordered_map<track_id, std::uint32_t> nodes;
+	std::unordered_map<std::string, std::uint32_t> orphans; ///< путь -> узел, ещё не найденный в библиотеке
+	std::uint32_t entry = none;
+	int top = -1;
+	std::vector<std::uint32_t> visited;
+	std::uint32_t epoch = 0;
+	std::mt19937_64 random;
+	std::vector<scored> found, candidates, chosen; ///< буферы поиска, чтобы не выделять память на каждый запрос
+
+	std::size_t node_count() const { return labels.size(); }
+
+	float const *vector_of(std::uint32_t node) const { return vectors.data() + std::size_t(node) * similarity_dims; }
+
+	std::uint32_t *links(std::uint32_t node, int level) {
+		return level == 0 ? base.data() + std::size_t(node) * (M0 + 1) : upper[node].data() + (level - 1) * (M + 1);
+	}
+
+	float distance(float const *query, std::uint32_t node) const {
+		return l2_squared_(query, vector_of(node), similarity_dims);
+	}
+
+	void next_epoch() {
+		if (visited.size() < node_count()) {
+			visited.resize(node_count(), 0);
+		}
+		if (++epoch == 0) {
+			std::fill(visited.begin(), visited.end(), 0);
+			epoch = 1;
+		}
+	}
+
+	/// жадный спуск по слою level от узла from
+	std::uint32_t greedy(float const *query, std::uint32_t from, int level) {
+		float best = distance(query, from);
+		for (bool moved = true; moved;) {
+			moved = false;
+			std::uint32_t const *l = links(from, level);
+			for (std::uint32_t i = 1; i <= l[0]; ++i) {
+				float d = distance(query, l[i]);
+				if (d < best) {
+					best = d;
+					from = l[i];
+					moved = true;
+				}
+			}
+		}
+		return from;
+	}
+
+	/**
+	 * \brief ef ближайших к query на слое level, начиная с from; результат в found по возрастанию расстояния
+	 */
+	void search_layer(float const *query, std::uint32_t from, int level, std::size_t ef) {
+		next_epoch();
+		found.clear();
+		candidates.clear();
+		float d = distance(query, from);
+		visited[from] = epoch;
+		candidates.emplace_back(-d, from); // куча по максимуму минус расстояния - ближайший сверху
+		found.emplace_back(d, from);       // куча по максимуму расстояния - дальнейший сверху
+		while (!candidates.empty()) {
+			scored c = candidates.front();
+			if (-c.first > found.front().first && found.size() >= ef) {
+				break;
+			}
+			std::pop_heap(candidates.begin(), candidates.end());
+			candidates.pop_back();
+			std::uint32_t const *l = links(c.second, level);
+			for (std::uint32_t i = 1; i <= l[0]; ++i) {
+				std::uint32_t n = l[i];
+				if (visited[n] == epoch) {
+					continue;
+				}
+				visited[n] = epoch;
+				float dn = distance(query, n);
+				if (found.size() < ef || dn < found.front().first) {
+					candidates.emplace_back(-dn, n);
+					std::push_heap(candidates.begin(), candidates.end());
+					found.emplace_back(dn, n);
+					std::push_heap(found.begin(), found.end());
+					if (found.size() > ef) {
+						std::pop_heap(found.begin(), found.end());
+						found.pop_back();
+					}
+				}
+			}
+		}
+		std::sort_heap(found.begin(), found.end());
+	}
+
+	/// эвристика HNSW: из pool по возрастанию расстояния оставляет до m разнонаправленных соседей
+	void select(std::vector<scored> const &pool, std::size_t m, std::vector<scored> &out) const {
+		out.clear();
+		for (auto const &c : pool) {
+			if (out.size() >= m) {
+				break;
+			}
+			bool keep = true;
+			for (auto const &s : out) {
+				if (l2_squared_(vector_of(c.second), vector_of(s.second), similarity_dims) < c.first) {
+					keep = false;
+					break;
+				}
+			}
+			if (keep) {
+				out.push_back(c);
+			}
+		}
+	}
+
+	/// добавляет node в список соседей n на слое level; переполненный список выбирается заново
+	void link_back(std::uint32_t n, std::uint32_t node, int level) {
+		std::size_t limit = level == 0 ? M0 : M;
+		std::uint32_t *l = links(n, level);
+		if (l[0] < limit) {
+			l[++l[0]] = node;
+			return;
+		}
+		std::vector<scored> pool, kept;
+		float const *v = vector_of(n);
+		pool.emplace_back(l2_squared_(v, vector_of(node), similarity_dims), node);
+		for (std::uint32_t i = 1; i <= l[0]; ++i) {
+			pool.emplace_back(l2_squared_(v, vector_of(l[i]), similarity_dims), l[i]);
+		}
+		std::sort(pool.begin(), pool.end());
+		select(pool, limit, kept);
+		l[0] = static_cast<std::uint32_t>(kept.size());
+		for (std::size_t i = 0; i < kept.size(); ++i) {
+			l[i + 1] = kept[i].second;
+		}
+	}
+
+	std::uint32_t add_node(track_id id, float const *vector, int level) {
+		auto node = static_cast<std::uint32_t>(node_count());
+		vectors.insert(vectors.end(), vector, vector + similarity_dims);
+		labels.push_back(id);
+		levels.push_back(static_cast<std::uint8_t>(level));
+		base.resize(base.size() + M0 + 1, 0);
+		upper.emplace_back(std::size_t(level) * (M + 1), 0);
+		return node;
+	}
+
+	void connect(std::uint32_t node) {
+		int level = levels[node];
+		float const *query = vector_of(node);
+		if (entry == none) {
+			entry = node;
+			top = level;
+			return;
+		}
+		std::uint32_t from = entry;
+		for (int l = top; l > level; --l) {
+			from = greedy(query, from, l);
+		}
+		for (int l = std::min(level, top); l >= 0; --l) {
+			search_layer(query, from, l, ef_construction);
+			from = found.front().second;
+			select(found, l == 0 ? M0 : M, chosen);
+			std::uint32_t *own = links(node, l);
+			own[0] = static_cast<std::uint32_t>(chosen.size());
+			for (std::size_t i = 0; i < chosen.size(); ++i) {
+				own[i + 1] = chosen[i].second;
+			}
+			for (auto const &n : chosen) {
+				link_back(n.second, node, l);
+			}
+		}
+		if (level > top) {
+			entry = node;
+			top = level;
+		}
+	}
+
+	void search_locked(float const *query, std::size_t k, std::size_t ef, track_id exclude,
+					   std::vector<std::pair<float, track_id>> &out) {
+		out.clear();
+		if (entry == none || k == 0) {
+			return;
+		}
+		std::uint32_t from = entry;
+		for (int l = top; l > 0; --l) {
+			from = greedy(query, from, l);
+		}
+		search_layer(query, from, 0, std::max(ef, k + 1));
+		for (auto const &f : found) {
+			track_id id = labels[f.second];
+			if (id != no_track && id != exclude) {
+				out.emplace_back(f.first, id);
+				if (out.size() == k) {
+					break;
+				}
+			}
+		}
+	}
+
+public:
+	/**
+	 * @param ef_construction - ширина перебора при вставке: больше - точнее граф, дольше вставка
+	 */
+	explicit similarity_index(std::size_t ef_construction = 100, std::uint64_t seed = 42)
+			: ef_construction(ef_construction), random(seed) {}
+
+	similarity_index(similarity_index const &) = delete;
+	similarity_index &operator=(similarity_index const &) = delete;
+
+	/**
+	 * \brief добавляет трек; трек, который уже есть, не меняется - граф не перестраивается из-за одного вектора
+	 * @param vector - similarity_dims чисел
+	 * @return false, если трек уже в индексе
+	 */
+	bool insert(track_id id, float const *vector) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (nodes.count(id)) {
+			return false;
+		}
+		double r = std::uniform_real_distribution<double>(std::nextafter(0.0, 1.0), 1.0)(random);
+		int level = std::min(max_level, static_cast<int>(-std::log(r) / std::log(double(M))));
+		std::uint32_t node = add_node(id, vector, level);
+		nodes.emplace(id, node);
+		connect(node);
+		return true;
+	}
+
+	/**
+	 * \brief k ближайших к вектору
+	 * @param ef - ширина перебора: больше - точнее и медленнее
+	 * @param out - (квадрат расстояния, трек) по возрастанию расстояния
+	 */
+	void search(float const *query, std::size_t k, std::vector<std::pair<float, track_id>> &out, std::size_t ef = 64) {
+		std::lock_guard<std::mutex> guard(lock);
+		search_locked(query, k, ef, no_track, out);
+	}
+
+	/**
+	 * \brief k треков, похожих на трек id, без него самого
+	 * @return false, если трека нет в индексе
+	 */
+	bool nearest(track_id id, std::size_t k, std::vector<std::pair<float, track_id>> &out, std::size_t ef = 64) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = nodes.find(id);
+		if (it == nodes.end()) {
+			out.clear();
+			return false;
+		}
+		float query[similarity_dims];
+		std::copy(vector_of(it->second), vector_of(it->second) + similarity_dims, query);
+		search_locked(query, k, ef, id, out);
+		return true;
+	}
+
+	bool contains(track_id id) {
+		std::lock_guard<std::mutex> guard(lock);
+		return nodes.count(id) != 0;
+	}
+
+	/**
+	 * \brief связывает узел из файла с треком библиотеки
+	 * @return false, если в файле такого пути не было или трек уже в индексе
+	 */
+	bool adopt(std::string_view path, track_id id) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = orphans.find(std::string(path));
+		if (it == orphans.end() || nodes.count(id)) {
+			return false;
+		}
+		labels[it->second] = id;
+		nodes.emplace(id, it->second);
+		orphans.erase(it);
+		return true;
+	}
+
+	/// сколько узлов, вместе с сиротами
+	std::size_t size() {
+		std::lock_guard<std::mutex> guard(lock);
+		return node_count();
+	}
+
+	std::size_t orphan_count() {
+		std::lock_guard<std::mutex> guard(lock);
+		return orphans.size();
+	}
+
+	/**
+	 * \brief пишет индекс: сначала во временный файл, потом переименовывает
+	 * Формат: magic, версия, размерность, M, число узлов, вход, верхний слой; уровни, пути, векторы, нулевой слой,
+	 * верхние слои; в конце XXH64 всего перечисленного. Числа - в порядке байт машины.
+	 * @param path_of - путь к треку библиотеки
+	 */
+	bool save(std::string const &file, std::function<std::string_view(track_id)> const &path_of) {
+		TRACE_SCOPE("similarity_index::save");
+		std::lock_guard<std::mutex> guard(lock);
+		std::vector<std::string_view> paths(node_count());
+		for (auto const &o : orphans) {
+			paths[o.second] = o.first;
+		}
+		std::string temp = file + ".tmp";
+		std::uint64_t check = 0;
+		{
+			std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+			auto put = [&out, &check](void const *p, std::size_t n) {
+				out.write(static_cast<char const *>(p), static_cast<std::streamsize>(n));
+				check = hash64_(p, n, check);
+			};
+			std::uint32_t head[7] = {file_magic, file_version, static_cast<std::uint32_t>(similarity_dims),
+									 static_cast<std::uint32_t>(M), static_cast<std::uint32_t>(node_count()), entry,
+									 static_cast<std::uint32_t>(top)};
+			put(head, sizeof(head));
+			put(levels.data(), levels.size());
+			std::string names;
+			for (std::uint32_t node = 0; node < node_count(); ++node) {
+				std::string_view p = labels[node] == no_track ? paths[node] : path_of(labels[node]);
+				auto n = static_cast<std::uint32_t>(p.size());
+				names.append(reinterpret_cast<char const *>(&n), sizeof(n));
+				names.append(p.data(), p.size());
+			}
+			std::uint64_t length = names.size();
+			put(&length, sizeof(length));
+			put(names.data(), names.size());
+			put(vectors.data(), vectors.size() * sizeof(float));
+			put(base.data(), base.size() * sizeof(std::uint32_t));
+			for (auto const &u : upper) {
+				put(u.data(), u.size() * sizeof(std::uint32_t));
+			}
+			out.write(reinterpret_cast<char const *>(&check), sizeof(check));
+			if (!out) {
+				return false;
+			}
+		}
+		std::error_code error;
+		std::filesystem::rename(temp, file, error);
+		return !error;
+	}
+
+	/**
+	 * \brief читает индекс; все узлы становятся сиротами до adopt. Повреждённый или чужой файл не читается вовсе
+	 * @return false, если файла нет или он не подходит - тогда индекс не меняется
+	 */
+	bool load(std::string const &file) {
+		TRACE_SCOPE("similarity_index::load");
+		std::ifstream in(file, std::ios::binary);
+		std::uint64_t check = 0;
+		bool ok = true;
+		auto get = [&](void *p, std::size_t n) {
+			if (ok && !in.read(static_cast<char *>(p), static_cast<std::streamsize>(n))) {
+				ok = false;
+			}
+			if (ok) {
+				check = hash64_(p, n, check);
+			}
+		};
+		std::uint32_t head[7] = {};
+		get(head, sizeof(head));
+		if (!ok || head[0] != file_magic || head[1] != file_version || head[2] != similarity_dims || head[3] != M ||
+			(head[4] == 0) != (head[5] == none) || (head[4] && head[5] >= head[4])) {
+			return false;
+		}
+		std::size_t count = head[4];
+		std::vector<std::uint8_t> l(count);
+		get(l.data(), count);
+		std::uint64_t length = 0;
+		get(&length, sizeof(length));
+		if (!ok || length > (std::uint64_t(1) << 32)) {
+			return false;
+		}
+		std::string names(static_cast<std::size_t>(length), '\0');
+		get(&names[0], names.size());
+		std::vector<float> v(count * similarity_dims);
+		get(v.data(), v.size() * sizeof(float));
+		std::vector<std::uint32_t> b(count * (M0 + 1));
+		get(b.data(), b.size() * sizeof(std::uint32_t));
+		std::vector<std::vector<std::uint32_t>> u(count);
+		for (std::size_t i = 0; i < count && ok; ++i) {
+			if (l[i] > max_level) {
+				return false;
+			}
+			u[i].resize(std::size_t(l[i]) * (M + 1));
+			get(u[i].data(), u[i].size() * sizeof(std::uint32_t));
+		}
+		std::uint64_t stored = 0;
+		if (!ok || !in.read(reinterpret_cast<char *>(&stored), sizeof(stored)) || stored != check) {
+			return false;
+		}
+		std::unordered_map<std::string, std::uint32_t> o;
+		o.reserve(count);
+		std::size_t at = 0;
+		for (std::uint32_t node = 0; node < count; ++node) {
+			std::uint32_t n = 0;
+			if (names.size() - at < sizeof(n)) {
+				return false;
+			}
+			std::memcpy(&n, names.data() + at, sizeof(n));
+			at += sizeof(n);
+			if (names.size() - at < n) {
+				return false;
+			}
+			o.emplace(names.substr(at, n), node);
+			at += n;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		levels = std::move(l);
+		vectors = std::move(v);
+		base = std::move(b);
+		upper = std::move(u);
+		labels.assign(count, no_track);
+		nodes.clear();
+		orphans = std::move(o);
+		entry = head[5];
+		top = count ? static_cast<int>(head[6]) : -1;
+		visited.clear();
+		return true;
+	}
+};
+
+#endif //SOUND_SIMILARITY_HPP
@@ -0,0 +1,287 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ * Сокеты TCP и локальные (AF_UNIX) для Windows и POSIX; на Windows AF_UNIX есть с Windows 10 1803. На Windows этот
+ * заголовок должен подключаться раньше windows.h (то есть раньше common.h), иначе winsock.h из windows.h конфликтует
+ * с winsock2.h.
+ */
+
+#ifndef SOUND_SOCKET_COMPAT_HPP
+#define SOUND_SOCKET_COMPAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+
+using socket_handle = SOCKET;
+constexpr socket_handle no_socket = INVALID_SOCKET;
+using socket_poll = WSAPOLLFD;
+constexpr short socket_readable = POLLRDNORM;
+constexpr short socket_writable = POLLWRNORM;
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using socket_handle = int;
+constexpr socket_handle no_socket = -1;
+using socket_poll = pollfd;
+constexpr short socket_readable = POLLIN;
+constexpr short socket_writable = POLLOUT;
+#endif
+
+/**
+ * \brief инициализирует сокеты (WSAStartup) один раз на процесс
+ */
+inline bool socket_startup_() {
+#ifdef _WIN32
+	static bool ready = [] {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return ready;
+#else
+	return true;
+#endif
+}
+
+inline void close_socket_(socket_handle s) {
+	if (s == no_socket) {
+		return;
+	}
+#ifdef _WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+/**
+ * \brief ждёт, пока из сокета можно читать (или писать)
+ * @return false по тайм-ауту или ошибке
+ */
+inline bool wait_socket_(socket_handle s, int timeout_ms, bool for_write = false) {
+#ifdef _WIN32
+	WSAPOLLFD fd{s, static_cast<SHORT>(for_write ? POLLWRNORM : POLLRDNORM), 0};
+	return WSAPoll(&fd, 1, timeout_ms) > 0;
+#else
+	pollfd fd{s, static_cast<short>(for_write ? POLLOUT : POLLIN), 0};
+	return poll(&fd, 1, timeout_ms) > 0;
+#endif
+}
+
+inline void set_socket_blocking_(socket_handle s, bool blocking) {
+#ifdef _WIN32
+	u_long mode = blocking ? 0 : 1;
+	ioctlsocket(s, FIONBIO, &mode);
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	fcntl(s, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+/**
+ * \brief соединение TCP с тайм-аутом; адреса из DNS пробуются по очереди
+ * @return no_socket, если не удалось
+ */
+inline socket_handle connect_tcp_(std::string const &host, std::uint16_t port, int timeout_ms) {
+	if (!socket_startup_()) {
+		return no_socket;
+	}
+	addrinfo hints{}, *found = nullptr;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) {
+		return no_socket;
+	}
+	socket_handle s = no_socket;
+	for (addrinfo *a = found; a && s == no_socket; a = a->ai_next) {
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s == no_socket) {
+			continue;
+		}
+		set_socket_blocking_(s, false);
+		bool connected = connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0;
+		if (!connected && wait_socket_(s, timeout_ms, true)) {
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length);
+			connected = error == 0;
+		}
+		if (!connected) {
+			close_socket_(s);
+			s = no_socket;
+			continue;
+		}
+		set_socket_blocking_(s, true);
+		int on = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const *>(&on), sizeof(on));
+	}
+	freeaddrinfo(found);
+	return s;
+}
+
+/**
+ * \brief отправляет всё; на закрытом соединении возвращает false, а не роняет процесс сигналом
+ */
+inline bool send_all_(socket_handle s, char const *data, std::size_t size) {
+	while (size > 0) {
+#ifdef _WIN32
+		int sent = send(s, data, static_cast<int>(size), 0);
+#else
+		auto sent = send(s, data, size, MSG_NOSIGNAL);
+#endif
+		if (sent <= 0) {
+			return false;
+		}
+		data += sent;
+		size -= static_cast<std::size_t>(sent);
+	}
+	return true;
+}
+
+/**
+ * \brief читает что есть, ждёт не дольше timeout_ms
+ * @return число байт; 0 - соединение закрыто или оборвано, -1 - тайм-аут
+ */
+inline long receive_some_(socket_handle s, char *data, std::size_t size, int timeout_ms) {
+	if (!wait_socket_(s, timeout_ms)) {
+		return -1;
+	}
+	auto got = recv(s, data, static_cast<int>(size), 0);
+	return got < 0 ? 0 : static_cast<long>(got);
+}
+
+/**
+ * \brief ждёт сразу несколько сокетов; revents заполняются, как у poll
+ * @return сколько сокетов готово, 0 - тайм-аут, -1 - ошибка
+ */
+inline int poll_sockets_(socket_poll *fds, std::size_t count, int timeout_ms) {
+#ifdef _WIN32
+	return WSAPoll(fds, static_cast<ULONG>(count), timeout_ms);
+#else
+	return poll(fds, static_cast<nfds_t>(count), timeout_ms);
+#endif
+}
+
+/**
+ * \brief отправляет сколько влезет в неблокирующий сокет
+ * @return число байт; 0 - буфер сокета полон, -1 - соединение оборвано
+ */
+inline long send_some_(socket_handle s, char const *data, std::size_t size) {
+#ifdef _WIN32
+	int sent = send(s, data, static_cast<int>(size), 0);
+	if (sent < 0) {
+		return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+	}
+#else
+	auto sent = send(s, data, size, MSG_NOSIGNAL);
+	if (sent < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+#endif
+	return static_cast<long>(sent);
+}
+
+/**
+ * \brief адрес локального сокета; false, если путь не влезает в sun_path
+ */
+inline bool unix_address_(std::string const &path, sockaddr_un &address) {
+	address = sockaddr_un{};
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+/**
+ * \brief соединение с локальным сокетом
+ * @return no_socket, если там никто не слушает
+ */
+inline socket_handle connect_unix_(std::string const &path) {
+	sockaddr_un address;
+	if (!socket_startup_() || !unix_address_(path, address)) {
+		return no_socket;
+	}
+	socket_handle s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s != no_socket && connect(s, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+		close_socket_(s);
+		s = no_socket;
+	}
+	return s;
+}
+
+/**
+ * \brief слушающий локальный сокет; файл, оставшийся от упавшего процесса, заменяется, а живой - нет
+ * На POSIX файл доступен только владельцу (0600): управлять плеером может только тот, кто его запустил.
+ * @return no_socket, если путь занят работающим процессом или создать сокет не удалось
+ */
+inline socket_handle listen_unix_(std::string const &path) {
+	sockaddr_un address;
+	if (!socket_startup_() || !unix_address_(path, address)) {
+		return no_socket;
+	}
+	socket_handle alive = connect_unix_(path);
+	if (alive != no_socket) {
+		close_socket_(alive);
+		return no_socket;
+	}
+	std::remove(path.c_str());
+	socket_handle s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == no_socket) {
+		return no_socket;
+	}
+	if (bind(s, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(s, 16) != 0) {
+		close_socket_(s);
+		return no_socket;
+	}
+#ifndef _WIN32
+	chmod(path.c_str(), S_IRUSR | S_IWUSR);
+#endif
+	return s;
+}
+
+/**
+ * \brief слушающий сокет на 127.0.0.1
+ * @param port - 0 - выбрать свободный; сюда пишется выбранный
+ */
+inline socket_handle listen_local_(std::uint16_t &port) {
+	if (!socket_startup_()) {
+		return no_socket;
+	}
+	socket_handle s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == no_socket) {
+		return no_socket;
+	}
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	socklen_t length = sizeof(address);
+	if (bind(s, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(s, 4) != 0 ||
+		getsockname(s, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+		close_socket_(s);
+		return no_socket;
+	}
+	port = ntohs(address.sin_port);
+	return s;
+}
+
+#endif //SOUND_SOCKET_COMPAT_HPP
@@ -0,0 +1,242 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_SPECTRUM_HPP
+#define SOUND_SPECTRUM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SOUND_HAVE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+/**
+ * \brief БПФ по основанию 2 над раздельными массивами действительных и мнимых частей
+ * Раздельный формат нужен для SSE: бабочка считает четыре соседних пары за раз, а поворачивающие
+ * множители каждого этапа лежат подряд, поэтому все загрузки - последовательные.
+ */
+class fft_plan {
+	std::size_t n = 0;
+	std::vector<std::uint32_t> bitrev;
+	std::vector<float> tw_re, tw_im; ///< множители этапа с половиной h лежат в [h - 1, 2h - 1)
+
+public:
+	/// size - степень двойки
+	explicit fft_plan(std::size_t size) : n(size), bitrev(size), tw_re(size > 1 ? size - 1 : 0),
+										  tw_im(size > 1 ? size - 1 : 0) {
+		unsigned bits = 0;
+		while ((std::size_t(1) << bits) < n) {
+			++bits;
+		}
+		for (std::size_t i = 0; i < n; ++i) {
+			std::uint32_t r = 0;
+			for (unsigned b = 0; b < bits; ++b) {
+				r |= ((i >> b) & 1u) << (bits - 1 - b);
+			}
+			bitrev[i] = r;
+		}
+		for (std::size_t half = 1; half < n; half *= 2) {
+			for (std::size_t j = 0; j < half; ++j) {
+				double angle = -3.14159265358979323846 * double(j) / double(half);
+				tw_re[half - 1 + j] = static_cast<float>(std::cos(angle));
+				tw_im[half - 1 + j] = static_cast<float>(std::sin(angle));
+			}
+		}
+	}
+
+	std::size_t size() const { return n; }
+
+	/**
+	 * \brief прямое преобразование на месте, без нормировки
+	 */
+	void forward(float *re, float *im) const {
+		for (std::size_t i = 0; i < n; ++i) {
+			std::size_t j = bitrev[i];
+			if (i < j) {
+				std::swap(re[i], re[j]);
+				std::swap(im[i], im[j]);
+			}
+		}
+		for (std::size_t half = 1; half < n; half *= 2) {
+			float const *wr = tw_re.data() + half - 1;
+			float const *wi = tw_im.data() + half - 1;
+			for (std::size_t start = 0; start < n; start += 2 * half) {
+				float *ar = re + start, *ai = im + start;
+				float *br = ar + half, *bi = ai + half;
+				std::size_t j = 0;
+#ifdef SOUND_HAVE_SSE
+				for (; j + 4 <= half; j += 4) {
+					__m128 xr = _mm_loadu_ps(br + j), xi = _mm_loadu_ps(bi + j);
+					__m128 cr = _mm_loadu_ps(wr + j), ci = _mm_loadu_ps(wi + j);
+					__m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+					__m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+					__m128 ur = _mm_loadu_ps(ar + j), ui = _mm_loadu_ps(ai + j);
+					_mm_storeu_ps(ar + j, _mm_add_ps(ur, tr));
+					_mm_storeu_ps(ai + j, _mm_add_ps(ui, ti));
+					_mm_storeu_ps(br + j, _mm_sub_ps(ur, tr));
+					_mm_storeu_ps(bi + j, _mm_sub_ps(ui, ti));
+				}
+#endif
+				for (; j < half; ++j) {
+					float tr = br[j] * wr[j] - bi[j] * wi[j];
+					float ti = br[j] * wi[j] + bi[j] * wr[j];
+					br[j] = ar[j] - tr;
+					bi[j] = ai[j] - ti;
+					ar[j] += tr;
+					ai[j] += ti;
+				}
+			}
+		}
+	}
+};
+
+/**
+ * \brief спектр мощности кадра с окном Ханна и свёртки спектра в хрому и полосы
+ * Один объект на поток: буферы внутри, вызовы не выделяют память.
+ */
+class spectrum_analyzer {
+	fft_plan plan;
+	int rate;
+	std::vector<float> window, re, im;
+	std::vector<int> pitch_class; ///< класс высоты (0 = C) для каждого бина, -1 - бин вне диапазона хромы
+
+public:
+	/**
+	 * @param frame - длина кадра, степень двойки
+	 * @param rate - частота дискретизации кадров
+	 */
+	spectrum_analyzer(std::size_t frame, int rate) : plan(frame), rate(rate), window(frame), re(frame), im(frame),
+													 pitch_class(frame / 2 + 1, -1) {
+		for (std::size_t i = 0; i < frame; ++i) {
+			window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2 * 3.14159265358979323846 * i / frame));
+		}
+		for (std::size_t k = 1; k < pitch_class.size(); ++k) {
+			double hz = bin_hz(k);
+			if (hz >= 55 && hz <= 5000) { // от A1: ниже бины шире полутона
+				long note = std::lround(12 * std::log2(hz / 440.0)) + 69;
+				pitch_class[k] = static_cast<int>(((note % 12) + 12) % 12);
+			}
+		}
+	}
+
+	std::size_t frame() const { return plan.size(); }
+
+	std::size_t bins() const { return plan.size() / 2 + 1; }
+
+	double bin_hz(std::size_t k) const { return double(k) * rate / double(plan.size()); }
+
+	/**
+	 * \brief спектр мощности кадра
+	 * @param samples - frame() моно-сэмплов
+	 * @param power - сюда пишутся bins() значений
+	 */
+	void power(float const *samples, float *power) {
+		std::size_t n = plan.size(), i = 0;
+#ifdef SOUND_HAVE_SSE
+		for (; i + 4 <= n; i += 4) {
+			_mm_storeu_ps(&re[i], _mm_mul_ps(_mm_loadu_ps(samples + i), _mm_loadu_ps(&window[i])));
+			_mm_storeu_ps(&im[i], _mm_setzero_ps());
+		}
+#endif
+		for (; i < n; ++i) {
+			re[i] = samples[i] * window[i];
+			im[i] = 0;
+		}
+		plan.forward(re.data(), im.data());
+		std::size_t k = 0, half = n / 2 + 1;
+#ifdef SOUND_HAVE_SSE
+		for (; k + 4 <= half; k += 4) {
+			__m128 r = _mm_loadu_ps(&re[k]), m = _mm_loadu_ps(&im[k]);
+			_mm_storeu_ps(power + k, _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(m, m)));
+		}
+#endif
+		for (; k < half; ++k) {
+			power[k] = re[k] * re[k] + im[k] * im[k];
+		}
+	}
+
+	/**
+	 * \brief хрома: энергия спектра, сложенная по 12 классам высоты
+	 */
+	void chroma(float const *power, float *out) const {
+		for (int c = 0; c < 12; ++c) {
+			out[c] = 0;
+		}
+		for (std::size_t k = 0; k < pitch_class.size(); ++k) {
+			if (pitch_class[k] >= 0) {
+				out[pitch_class[k]] += power[k];
+			}
+		}
+	}
+
+	/**
+	 * \brief границы count полос, равномерных по логарифму частоты от lo до hi Гц
+	 * @return count + 1 номер бина
+	 */
+	std::vector<std::size_t> log_bands(double lo, double hi, std::size_t count) const {
+		std::vector<std::size_t> edges(count + 1);
+		for (std::size_t b = 0; b <= count; ++b) {
+			double hz = lo * std::pow(hi / lo, double(b) / count);
+			edges[b] = static_cast<std::size_t>(std::lround(hz * plan.size() / rate));
+		}
+		return edges;
+	}
+
+	/**
+	 * \brief энергия в полосах, заданных log_bands
+	 */
+	static void band_energies(float const *power, std::vector<std::size_t> const &edges, float *out) {
+		for (std::size_t b = 0; b + 1 < edges.size(); ++b) {
+			float sum = 0;
+			for (std::size_t k = edges[b]; k < edges[b + 1]; ++k) {
+				sum += power[k];
+			}
+			out[b] = sum;
+		}
+	}
+};
+
+/**
+ * \brief сводит interleaved-сигнал в моно и понижает частоту усреднением по интервалу выходного сэмпла
+ * Усреднение - это грубый ФНЧ, но анализу хватает: отпечаток и темп смотрят на соотношения энергий, а не на форму волны.
+ */
+inline void downmix_resample_(std::vector<float> const &in, int channels, int in_rate, int out_rate,
+							  std::vector<float> &out) {
+	out.clear();
+	if (channels <= 0 || in_rate <= 0 || out_rate <= 0) {
+		return;
+	}
+	std::size_t frames = in.size() / channels;
+	double step = double(in_rate) / out_rate;
+	out.reserve(static_cast<std::size_t>(frames / step) + 1);
+	float scale = 1.0f / channels;
+	auto mono = [&](std::size_t i) {
+		float sum = 0;
+		for (int c = 0; c < channels; ++c) {
+			sum += in[i * channels + c];
+		}
+		return sum * scale;
+	};
+	for (std::size_t k = 0;; ++k) {
+		auto begin = static_cast<std::size_t>(k * step), end = static_cast<std::size_t>((k + 1) * step);
+		if (begin >= frames) {
+			break;
+		}
+		end = std::min(std::max(end, begin + 1), frames);
+		float sum = 0;
+		for (std::size_t i = begin; i < end; ++i) {
+			sum += mono(i);
+		}
+		out.push_back(sum / float(end - begin));
+	}
+}
+
+#endif //SOUND_SPECTRUM_HPP
@@ -0,0 +1,252 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_STARTUP_HPP
+#define SOUND_STARTUP_HPP
+
+#include "analysis_cache.hpp"
+#include "dsp_graph.hpp"
+#include "library.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// сколько может пройти от запуска до окна, в котором уже можно щёлкать
+constexpr double interactive_budget_ms = 150.0;
+
+/**
+ * \brief замеры фаз запуска
+ * Отметка - конец фазы, в миллисекундах от создания объекта. Фазы фонового запуска отмечаются из своего потока
+ * и перемежаются с фазами окна, поэтому отчёт сортирует их по времени. Каждая отметка попадает и в трассу.
+ */
+class startup_phases {
+	using clock = std::chrono::steady_clock;
+	clock::time_point begin = clock::now();
+	std::mutex lock;
+	std::vector<std::pair<char const *, double>> marks;
+
+public:
+	/// отмечает конец фазы; name - строковый литерал, его указатель хранится
+	void mark(char const *name) {
+		double ms = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+		TRACE_INSTANT(name);
+		std::lock_guard<std::mutex> guard(lock);
+		marks.emplace_back(name, ms);
+	}
+
+	/// время отметки, -1 - такой ещё не было
+	double at(char const *name) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto const &m : marks) {
+			if (std::strcmp(m.first, name) == 0) {
+				return m.second;
+			}
+		}
+		return -1;
+	}
+
+	/**
+	 * \brief фазы по времени: сколько длилась каждая и когда кончилась
+	 */
+	std::string report() {
+		std::vector<std::pair<char const *, double>> sorted;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			sorted = marks;
+		}
+		std::stable_sort(sorted.begin(), sorted.end(),
+						 [](auto const &a, auto const &b) { return a.second < b.second; });
+		std::string out;
+		double previous = 0;
+		char line[160];
+		for (auto const &m : sorted) {
+			std::snprintf(line, sizeof(line), "%-20s +%7.1f ms  at %7.1f ms\n", m.first, m.second - previous, m.second);
+			out += line;
+			previous = m.second;
+		}
+		return out;
+	}
+};
+
+/**
+ * \brief то, что нужно, чтобы продолжить с того места, где закрыли плеер
+ * Треки хранятся путями, а не номерами: номера в библиотеке живут только до выхода.
+ */
+struct session_snapshot {
+	std::vector<std::string> tracks; ///< список по порядку
+	std::vector<track_range> ranges; ///< части файлов у треков CUE, по номерам tracks; пустой - все треки целые
+	std::vector<std::uint32_t> queue; ///< очередь "играть следующим", номера в tracks
+	std::int32_t current = -1;       ///< номер в tracks, -1 - ничего не выбрано
+	std::uint32_t position_ms = 0;
+	float speed = 1.0f;
+	std::uint8_t repeat = 0;         ///< repeat_mode
+	bool shuffle = false;
+	effect_chain effects;
+};
+
+/// "SSN1" и версия формата; во второй версии у треков есть части файлов (CUE), первая читается без них
+constexpr std::uint32_t session_magic = 0x314e5353;
+constexpr std::uint32_t session_version = 2;
+
+/**
+ * \brief пишет снимок: сначала во временный файл, потом переименовывает, чтобы падение не оставило половину
+ * Формат: magic, версия, длина тела, тело, XXH64 тела. Числа - в порядке байт машины: файл не переносится.
+ * @return false, если записать не удалось
+ */
+inline bool save_session_(std::string const &path, session_snapshot const &s) {
+	std::string body;
+	auto put = [&body](void const *p, std::size_t n) { body.append(static_cast<char const *>(p), n); };
+	auto put32 = [&put](std::uint32_t v) { put(&v, sizeof(v)); };
+	put32(static_cast<std::uint32_t>(s.tracks.size()));
+	for (auto const &t : s.tracks) {
+		put32(static_cast<std::uint32_t>(t.size()));
+		put(t.data(), t.size());
+	}
+	for (std::size_t i = 0; i < s.tracks.size(); ++i) {
+		track_range r = i < s.ranges.size() ? s.ranges[i] : track_range();
+		put32(r.start);
+		put32(r.end);
+	}
+	put32(static_cast<std::uint32_t>(s.queue.size()));
+	put(s.queue.data(), s.queue.size() * sizeof(std::uint32_t));
+	put(&s.current, sizeof(s.current));
+	put32(s.position_ms);
+	put(&s.speed, sizeof(s.speed));
+	put(&s.repeat, 1);
+	std::uint8_t shuffle = s.shuffle;
+	put(&shuffle, 1);
+	put32(static_cast<std::uint32_t>(s.effects.size()));
+	for (auto const &e : s.effects) {
+		put32(static_cast<std::uint32_t>(e.type));
+		std::uint8_t enabled = e.enabled;
+		put(&enabled, 1);
+		put32(static_cast<std::uint32_t>(e.params.size()));
+		for (auto const &p : e.params) {
+			put32(static_cast<std::uint32_t>(p.first));
+			put(&p.second, sizeof(p.second));
+		}
+	}
+	std::uint32_t head[3] = {session_magic, session_version, static_cast<std::uint32_t>(body.size())};
+	std::uint64_t check = hash64_(body.data(), body.size());
+	std::string temp = path + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<char const *>(head), sizeof(head));
+		out.write(body.data(), static_cast<std::streamsize>(body.size()));
+		out.write(reinterpret_cast<char const *>(&check), sizeof(check));
+		if (!out) {
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temp, path, error);
+	return !error;
+}
+
+/**
+ * \brief читает снимок; повреждённый или чужой файл не читается вовсе, а не наполовину
+ * @return false, если файла нет или он не подходит - тогда s не меняется
+ */
+inline bool load_session_(std::string const &path, session_snapshot &s) {
+	std::ifstream in(path, std::ios::binary);
+	std::uint32_t head[3] = {};
+	if (!in.read(reinterpret_cast<char *>(head), sizeof(head)) || head[0] != session_magic || head[1] < 1 ||
+		head[1] > session_version) {
+		return false;
+	}
+	// длине из заголовка верим, только если в файле действительно есть столько данных и 8 байт хеша
+	std::streamoff at_body = in.tellg();
+	in.seekg(0, std::ios::end);
+	std::streamoff end = in.tellg();
+	if (at_body < 0 || end - at_body < static_cast<std::streamoff>(head[2]) + 8) {
+		return false;
+	}
+	in.seekg(at_body);
+	std::string body(head[2], '\0');
+	std::uint64_t check = 0;
+	if (!in.read(&body[0], static_cast<std::streamsize>(body.size())) ||
+		!in.read(reinterpret_cast<char *>(&check), sizeof(check)) || check != hash64_(body.data(), body.size())) {
+		return false;
+	}
+	std::size_t at = 0;
+	bool ok = true;
+	auto get = [&](void *p, std::size_t n) {
+		if (!ok || body.size() - at < n) {
+			ok = false;
+			return;
+		}
+		std::memcpy(p, body.data() + at, n);
+		at += n;
+	};
+	auto get32 = [&get]() {
+		std::uint32_t v = 0;
+		get(&v, sizeof(v));
+		return v;
+	};
+	session_snapshot r;
+	std::uint32_t count = get32();
+	for (std::uint32_t i = 0; i < count && ok; ++i) {
+		std::uint32_t n = get32();
+		if (body.size() - at < n) {
+			ok = false;
+			break;
+		}
+		r.tracks.emplace_back(body.data() + at, n);
+		at += n;
+	}
+	if (head[1] >= 2) {
+		r.ranges.resize(r.tracks.size());
+		for (auto &range : r.ranges) {
+			range.start = get32();
+			range.end = get32();
+		}
+	}
+	count = get32();
+	if (ok && body.size() - at >= std::size_t(count) * sizeof(std::uint32_t)) {
+		r.queue.resize(count);
+		get(r.queue.data(), count * sizeof(std::uint32_t));
+	} else {
+		ok = false;
+	}
+	get(&r.current, sizeof(r.current));
+	r.position_ms = get32();
+	get(&r.speed, sizeof(r.speed));
+	get(&r.repeat, 1);
+	std::uint8_t shuffle = 0;
+	get(&shuffle, 1);
+	r.shuffle = shuffle != 0;
+	count = get32();
+	for (std::uint32_t i = 0; i < count && ok; ++i) {
+		effect_desc e;
+		e.type = static_cast<FMOD_DSP_TYPE>(get32());
+		std::uint8_t enabled = 0;
+		get(&enabled, 1);
+		e.enabled = enabled != 0;
+		std::uint32_t params = get32();
+		for (std::uint32_t j = 0; j < params && ok; ++j) {
+			int index = static_cast<int>(get32());
+			float value = 0;
+			get(&value, sizeof(value));
+			e.params.emplace_back(index, value);
+		}
+		r.effects.push_back(std::move(e));
+	}
+	if (!ok || at != body.size()) {
+		return false;
+	}
+	s = std::move(r);
+	return true;
+}
+
+#endif //SOUND_STARTUP_HPP
@@ -0,0 +1,367 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_THREAD_CONFIG_HPP
+#define SOUND_THREAD_CONFIG_HPP
+
+#include "fmod.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/**
+ * \brief атрибуты одного потока FMOD (см. FMOD::Thread_SetAttributes)
+ */
+struct thread_attributes {
+	FMOD_THREAD_AFFINITY affinity = FMOD_THREAD_AFFINITY_GROUP_DEFAULT;
+	FMOD_THREAD_PRIORITY priority = FMOD_THREAD_PRIORITY_DEFAULT;
+	FMOD_THREAD_STACK_SIZE stack_size = FMOD_THREAD_STACK_SIZE_DEFAULT;
+};
+
+/**
+ * \brief настройки потоков микшера, стримов, неблокирующей загрузки и файлового потока
+ * По умолчанию всё оставлено на усмотрение FMOD.
+ */
+struct thread_config {
+	thread_attributes mixer;
+	thread_attributes stream;
+	thread_attributes nonblocking;
+	thread_attributes file;
+};
+
+/**
+ * \brief разбирает приоритет: low, medium, high, very_high, extreme, critical, default или число платформы
+ * @return false, если строка не распознана
+ */
+inline bool parse_thread_priority_(char const *str, FMOD_THREAD_PRIORITY &priority) {
+	static const struct {
+		char const *name;
+		FMOD_THREAD_PRIORITY value;
+	} names[] = {
+			{"default",   FMOD_THREAD_PRIORITY_DEFAULT},
+			{"low",       FMOD_THREAD_PRIORITY_LOW},
+			{"medium",    FMOD_THREAD_PRIORITY_MEDIUM},
+			{"high",      FMOD_THREAD_PRIORITY_HIGH},
+			{"very_high", FMOD_THREAD_PRIORITY_VERY_HIGH},
+			{"extreme",   FMOD_THREAD_PRIORITY_EXTREME},
+			{"critical",  FMOD_THREAD_PRIORITY_CRITICAL},
+	};
+	for (auto const &n : names) {
+		if (std::strcmp(str, n.name) == 0) {
+			priority = n.value;
+			return true;
+		}
+	}
+	char *end = nullptr;
+	long value = std::strtol(str, &end, 10);
+	if (end == str || *end != '\0' || value < FMOD_THREAD_PRIORITY_PLATFORM_MIN ||
+		value > FMOD_THREAD_PRIORITY_PLATFORM_MAX) {
+		return false;
+	}
+	priority = static_cast<FMOD_THREAD_PRIORITY>(value);
+	return true;
+}
+
+/**
+ * \brief разбирает список ядер "0,2,3" в маску FMOD_THREAD_AFFINITY_CORE_*
+ * "all" снимает привязку, "default" возвращает группу по умолчанию
+ */
+inline bool parse_thread_affinity_(char const *str, FMOD_THREAD_AFFINITY &affinity) {
+	if (std::strcmp(str, "all") == 0) {
+		affinity = FMOD_THREAD_AFFINITY_CORE_ALL;
+		return true;
+	}
+	if (std::strcmp(str, "default") == 0) {
+		affinity = FMOD_THREAD_AFFINITY_GROUP_DEFAULT;
+		return true;
+	}
+	FMOD_THREAD_AFFINITY mask = 0;
+	char const *p = str;
+	while (*p) {
+		char *end = nullptr;
+		long core = std::strtol(p, &end, 10);
+		if (end == p || core < 0 || core > 61) { // старшие биты заняты группами FMOD
+			return false;
+		}
+		mask |= FMOD_THREAD_AFFINITY(1) << core;
+		p = end;
+		if (*p == ',') {
+			if (*++p == '\0') { // "1," - пустой последний элемент
+				return false;
+			}
+		} else if (*p != '\0') {
+			return false;
+		}
+	}
+	if (mask == 0) {
+		return false;
+	}
+	affinity = mask;
+	return true;
+}
+
+/**
+ * \brief разбирает размер стека в байтах, допускаются суффиксы k и m
+ * @return false и для размера, который не помещается в FMOD_THREAD_STACK_SIZE
+ */
+inline bool parse_thread_stack_size_(char const *str, FMOD_THREAD_STACK_SIZE &stack_size) {
+	if (*str < '0' || *str > '9') { // strtoul молча принимает минус и пробелы
+		return false;
+	}
+	errno = 0;
+	char *end = nullptr;
+	unsigned long long value = std::strtoull(str, &end, 10);
+	if (end == str || errno == ERANGE) {
+		return false;
+	}
+	unsigned long long scale = 1;
+	if (*end == 'k' || *end == 'K') {
+		scale = 1024;
+		++end;
+	} else if (*end == 'm' || *end == 'M') {
+		scale = 1024 * 1024;
+		++end;
+	}
+	unsigned long long const limit = std::numeric_limits<FMOD_THREAD_STACK_SIZE>::max();
+	if (*end != '\0' || value > limit / scale) {
+		return false;
+	}
+	value *= scale;
+	stack_size = static_cast<FMOD_THREAD_STACK_SIZE>(value);
+	return true;
+}
+
+/**
+ * \brief разбирает одну опцию командной строки вида --<поток>-<поле>=<значение>
+ * поток: mixer, stream, nonblocking, file; поле: cores, priority, stack
+ * Пример: --mixer-cores=2 --mixer-priority=critical --stream-stack=128k
+ * @return false, если опция не относится к потокам или значение некорректно
+ */
+inline bool parse_thread_option_(char const *arg, thread_config &config) {
+	if (std::strncmp(arg, "--", 2) != 0) {
+		return false;
+	}
+	arg += 2;
+	static const struct {
+		char const *name;
+		thread_attributes thread_config::*member;
+	} threads[] = {
+			{"mixer-",       &thread_config::mixer},
+			{"stream-",      &thread_config::stream},
+			{"nonblocking-", &thread_config::nonblocking},
+			{"file-",        &thread_config::file},
+	};
+	for (auto const &t : threads) {
+		std::size_t len = std::strlen(t.name);
+		if (std::strncmp(arg, t.name, len) != 0) {
+			continue;
+		}
+		thread_attributes &attr = config.*(t.member);
+		char const *field = arg + len;
+		char const *value = std::strchr(field, '=');
+		if (!value) {
+			return false;
+		}
+		std::string key(field, value - field);
+		++value;
+		if (key == "cores") {
+			return parse_thread_affinity_(value, attr.affinity);
+		}
+		if (key == "priority") {
+			return parse_thread_priority_(value, attr.priority);
+		}
+		if (key == "stack") {
+			return parse_thread_stack_size_(value, attr.stack_size);
+		}
+		return false;
+	}
+	return false;
+}
+
+/**
+ * \brief применяет настройки потоков; вызывать до FMOD::System_Create
+ * @return первый ненулевой FMOD_RESULT или FMOD_OK
+ */
+inline FMOD_RESULT apply_thread_config_(thread_config const &config) {
+	static const struct {
+		FMOD_THREAD_TYPE type;
+		thread_attributes thread_config::*member;
+	} threads[] = {
+			{FMOD_THREAD_TYPE_MIXER,       &thread_config::mixer},
+			{FMOD_THREAD_TYPE_STREAM,      &thread_config::stream},
+			{FMOD_THREAD_TYPE_NONBLOCKING, &thread_config::nonblocking},
+			{FMOD_THREAD_TYPE_FILE,        &thread_config::file},
+	};
+	FMOD_RESULT first_error = FMOD_OK;
+	for (auto const &t : threads) {
+		thread_attributes const &attr = config.*(t.member);
+		FMOD_RESULT result = FMOD::Thread_SetAttributes(t.type, attr.affinity, attr.priority, attr.stack_size);
+		if (result != FMOD_OK && first_error == FMOD_OK) {
+			first_error = result;
+		}
+	}
+	return first_error;
+}
+
+/**
+ * \brief переводит вызывающий поток в фоновый режим: он получает процессор и диск, только когда они никому не нужны
+ * Для потоков фонового анализа, которые не должны отнимать время у микшера и стримов FMOD.
+ * @return false, если система не позволила
+ */
+inline bool lower_current_thread_priority_() {
+#ifdef _WIN32
+	return SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0; // заодно понижает приоритет ввода-вывода
+#else
+	return setpriority(PRIO_PROCESS, 0, 19) == 0; // в Linux nice действует на поток, а не на процесс
+#endif
+}
+
+/**
+ * \brief синтетическая нагрузка на процессор
+ * Каждый поток крутится duty долю от периода в 10 мс и спит остальное время.
+ */
+class cpu_load_generator {
+	std::vector<std::thread> workers;
+	std::atomic<bool> running{false};
+
+public:
+	~cpu_load_generator() { stop(); }
+
+	void start(unsigned threads, float duty) {
+		stop();
+		running = true;
+		auto const period = std::chrono::microseconds(10000);
+		auto const busy = std::chrono::microseconds(static_cast<long long>(10000 * duty));
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back([this, period, busy] {
+				volatile unsigned long long sink = 0;
+				while (running) {
+					auto begin = std::chrono::steady_clock::now();
+					while (std::chrono::steady_clock::now() - begin < busy) {
+						sink = sink + 1;
+					}
+					std::this_thread::sleep_until(begin + period);
+				}
+			});
+		}
+	}
+
+	void stop() {
+		running = false;
+		for (auto &w : workers) {
+			w.join();
+		}
+		workers.clear();
+	}
+};
+
+/**
+ * \brief результат замера срывов воспроизведения
+ */
+struct underrun_stats {
+	unsigned stream_starves = 0; ///< сколько раз буфер стрима опустел
+	unsigned mixer_stalls = 0;   ///< сколько раз DSP-часы отстали от реального времени больше чем на буфер
+	double seconds = 0;
+};
+
+/**
+ * \brief детектор срывов воспроизведения
+ * Стрим проверяется через флаг starving у Sound::getOpenState, микшер - по отставанию DSP-часов группы
+ * от настенных часов. Отставание меньше одного кольца DSP-буферов считается нормальным дрожанием.
+ */
+class underrun_detector {
+	FMOD::ChannelGroup *group = nullptr;
+	int rate = 0;
+	double ring = 1;
+	unsigned long long start_clock = 0;
+	std::chrono::steady_clock::time_point start;
+	bool was_starving = false;
+	long long stalled_rings = 0;
+	underrun_stats stats;
+
+public:
+	/**
+	 * \brief начинает отсчёт с текущего момента
+	 */
+	void begin(FMOD::System *system, FMOD::ChannelGroup *channel_group) {
+		group = channel_group;
+		unsigned int buffer_length = 0;
+		int num_buffers = 0;
+		system->getSoftwareFormat(&rate, nullptr, nullptr);
+		system->getDSPBufferSize(&buffer_length, &num_buffers);
+		ring = static_cast<double>(buffer_length) * (num_buffers > 0 ? num_buffers : 1);
+		group->getDSPClock(&start_clock, nullptr);
+		start = std::chrono::steady_clock::now();
+		was_starving = false;
+		stalled_rings = 0;
+		stats = underrun_stats();
+	}
+
+	/**
+	 * \brief проверяет стрим и часы микшера; вызывать периодически
+	 * @param sound - текущий стрим или nullptr
+	 */
+	void poll(FMOD::Sound *sound) {
+		if (!group || rate <= 0) {
+			return;
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats.seconds = elapsed;
+
+		bool starving = false;
+		if (sound && sound->getOpenState(nullptr, nullptr, &starving, nullptr) == FMOD_OK) {
+			if (starving && !was_starving) {
+				++stats.stream_starves;
+			}
+			was_starving = starving;
+		}
+
+		unsigned long long clock = 0;
+		if (group->getDSPClock(&clock, nullptr) == FMOD_OK) {
+			double lag = elapsed * rate - static_cast<double>(clock - start_clock);
+			long long rings = static_cast<long long>(lag / ring);
+			if (rings > stalled_rings) {
+				stats.mixer_stalls += static_cast<unsigned>(rings - stalled_rings);
+				stalled_rings = rings;
+			}
+		}
+	}
+
+	underrun_stats const &result() const { return stats; }
+};
+
+/**
+ * \brief считает срывы во время воспроизведения канала (см. underrun_detector)
+ * @param seconds - длительность замера
+ */
+inline underrun_stats measure_underruns_(FMOD::System *system, FMOD::Sound *sound, FMOD::ChannelGroup *group,
+										 double seconds) {
+	underrun_detector detector;
+	detector.begin(system, group);
+	while (detector.result().seconds < seconds) {
+		double before = detector.result().seconds;
+		system->update();
+		detector.poll(sound);
+		if (detector.result().seconds <= before) {
+			break; // poll не двигает время без группы или без частоты микшера - ждать нечего
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return detector.result();
+}
+
+#endif //SOUND_THREAD_CONFIG_HPP
@@ -0,0 +1,439 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_TIME_STRETCH_HPP
+#define SOUND_TIME_STRETCH_HPP
+
+#include "fmod.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SOUND_HAVE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+/**
+ * \brief скалярное произведение двух массивов (SSE, если доступно)
+ */
+inline float dot_product_(float const *a, float const *b, std::size_t n) {
+	std::size_t i = 0;
+	float sum = 0;
+#ifdef SOUND_HAVE_SSE
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; i < n; ++i) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+/**
+ * \brief коррекция высоты тона для ускоренного/замедленного воспроизведения (WSOLA + ресемплинг)
+ * Канал играет с частотой, умноженной на speed: позиция идёт в исходном времени, но тон смещён.
+ * Этот класс возвращает тон обратно, не меняя количество сэмплов: сначала WSOLA сжимает сигнал по
+ * времени в speed раз (кадры по ~20 мс с перекрытием 50%, окно Ханна, сдвиг подбирается по максимуму
+ * нормированной взаимной корреляции), потом линейный ресемплер растягивает его обратно, понижая тон.
+ * Вся память выделяется в configure: очереди имеют постоянную ёмкость, а блок длиннее max_block
+ * обрабатывается по частям, поэтому process в потоке микшера не выделяет память.
+ * Скорость задаётся из потока интерфейса (set_speed) и читается микшером раз за блок. Сброс из чужого потока
+ * (request_reset) тоже только ставит флаг, а историю очищает сам микшер в начале следующего блока.
+ */
+class wsola_stretcher {
+	/// очередь постоянной ёмкости: дописывается в конец, отбрасывается с начала
+	struct fixed_queue {
+		std::vector<float> data;
+		std::size_t used = 0;
+
+		void allocate(std::size_t capacity) {
+			data.assign(capacity, 0.0f);
+			used = 0;
+		}
+
+		/// ёмкость рассчитана в configure с запасом; то, что всё же не поместилось, отбрасывается
+		void append(float const *src, std::size_t n) {
+			n = std::min(n, data.size() - used);
+			std::copy(src, src + n, data.begin() + used);
+			used += n;
+		}
+
+		void append_zeros(std::size_t n) {
+			n = std::min(n, data.size() - used);
+			std::fill(data.begin() + used, data.begin() + used + n, 0.0f);
+			used += n;
+		}
+
+		void drop_front(std::size_t n) {
+			n = std::min(n, used);
+			std::copy(data.begin() + n, data.begin() + used, data.begin());
+			used -= n;
+		}
+
+		float *begin() { return data.data(); }
+	};
+
+	int channels = 0;
+	std::size_t frame = 0;     ///< длина кадра N
+	std::size_t hop = 0;       ///< шаг синтеза N/2
+	std::size_t search = 0;    ///< допуск поиска сдвига в обе стороны
+	std::size_t max_block = 0; ///< самый длинный кусок, который process обрабатывает за раз
+	std::atomic<float> ratio{1};
+	std::atomic<bool> reset_pending{false}; ///< request_reset ждёт следующего process
+
+	std::vector<float> window;
+	fixed_queue input;          ///< interleaved вход
+	fixed_queue mono;           ///< моно-микс входа для поиска сдвига
+	std::vector<float> overlap; ///< interleaved накопитель перекрытия длиной N
+	fixed_queue middle;         ///< interleaved выход WSOLA перед ресемплером
+	std::vector<double> energy; ///< префиксные суммы квадратов mono
+	double analysis = 0;        ///< номинальная позиция следующего кадра во входе
+	std::size_t previous = 0;   ///< фактическая позиция предыдущего кадра
+	bool first_frame = true;
+	double resample_pos = 0;
+	bool primed = false;
+
+	std::size_t input_frames() const { return channels ? input.used / channels : 0; }
+
+	std::size_t middle_frames() const { return channels ? middle.used / channels : 0; }
+
+	std::size_t find_best_offset(std::size_t nominal) {
+		if (first_frame) {
+			return nominal;
+		}
+		float const *target = mono.begin() + previous + hop; // естественное продолжение предыдущего кадра
+		std::size_t begin = nominal - search, end = nominal + search;
+		energy.resize(end + hop - begin + 1);
+		energy[0] = 0;
+		for (std::size_t i = begin; i < end + hop; ++i) {
+			energy[i - begin + 1] = energy[i - begin] + double(mono.data[i]) * mono.data[i];
+		}
+		std::size_t best = nominal;
+		double best_score = -1e300;
+		for (std::size_t c = begin; c <= end; ++c) {
+			double e = energy[c - begin + hop] - energy[c - begin];
+			double score = dot_product_(target, mono.begin() + c, hop) / std::sqrt(e + 1e-9);
+			if (score > best_score) {
+				best_score = score;
+				best = c;
+			}
+		}
+		return best;
+	}
+
+	void synthesize(float speed) {
+		for (;;) {
+			std::size_t nominal = static_cast<std::size_t>(analysis);
+			if (nominal + search + frame > input_frames() || previous + 2 * hop > input_frames()) {
+				break;
+			}
+			std::size_t chosen = find_best_offset(nominal);
+			float const *src = input.begin() + chosen * channels;
+			for (std::size_t i = 0; i < frame; ++i) {
+				for (int ch = 0; ch < channels; ++ch) {
+					overlap[i * channels + ch] += window[i] * src[i * channels + ch];
+				}
+			}
+			middle.append(overlap.data(), hop * channels);
+			std::memmove(overlap.data(), overlap.data() + hop * channels, (frame - hop) * channels * sizeof(float));
+			std::fill(overlap.end() - hop * channels, overlap.end(), 0.0f);
+			previous = chosen;
+			first_frame = false;
+			analysis += hop * speed;
+		}
+
+		// выбрасываем вход, который больше не понадобится
+		std::size_t keep_from = std::min(previous, static_cast<std::size_t>(analysis) - search);
+		if (keep_from > frame) {
+			input.drop_front(keep_from * channels);
+			mono.drop_front(keep_from);
+			analysis -= keep_from;
+			previous -= keep_from;
+		}
+	}
+
+public:
+	/**
+	 * \brief задаёт формат и выделяет буферы
+	 * @param max_block - максимальный размер блока process
+	 */
+	void configure(int num_channels, int sample_rate, unsigned block = 4096) {
+		channels = num_channels;
+		max_block = block;
+		frame = 256;
+		while (frame < static_cast<std::size_t>(sample_rate / 50)) {
+			frame *= 2;
+		}
+		hop = frame / 2;
+		search = frame / 4;
+		window.resize(frame);
+		for (std::size_t i = 0; i < frame; ++i) {
+			window[i] = 0.5f - 0.5f * std::cos(2 * 3.14159265358979 * i / frame);
+		}
+		std::size_t history = (frame + 2 * search) * 4 + max_block * 3 + 2 * frame;
+		input.allocate(history * channels);
+		mono.allocate(history);
+		// до заполнения запаса (2 шага + блок на скорости 0.5) в очередь успевает прийти ещё по 2 блока и шагу
+		middle.allocate((max_block * 5 + 4 * frame) * channels);
+		energy.reserve(2 * search + hop + 1);
+		overlap.assign(frame * channels, 0.0f);
+		reset();
+	}
+
+	/**
+	 * \brief сбрасывает историю; вызывать после перемотки
+	 */
+	void reset() {
+		input.used = mono.used = middle.used = 0;
+		std::fill(overlap.begin(), overlap.end(), 0.0f);
+		// начинаем с тишины длиной допуска, чтобы поиску было куда сдвигаться назад
+		input.append_zeros(search * channels);
+		mono.append_zeros(search);
+		analysis = static_cast<double>(search);
+		previous = 0;
+		first_frame = true;
+		resample_pos = 0;
+		primed = false;
+	}
+
+	/**
+	 * \brief просит сбросить историю перед следующим блоком; можно звать из любого потока
+	 */
+	void request_reset() { reset_pending.store(true, std::memory_order_release); }
+
+	/**
+	 * \brief коэффициент скорости канала, 0.5 .. 3
+	 */
+	void set_speed(float speed) { ratio.store(std::min(3.0f, std::max(0.5f, speed)), std::memory_order_relaxed); }
+
+	float speed() const { return ratio.load(std::memory_order_relaxed); }
+
+	int num_channels() const { return channels; }
+
+	/// задержка, которую вносит обработка, в сэмплах
+	std::size_t latency() const { return frame + search; }
+
+	/**
+	 * \brief обрабатывает frames interleaved кадров; in и out могут совпадать
+	 */
+	void process(float const *in, float *out, unsigned frames) {
+		if (reset_pending.exchange(false, std::memory_order_acquire)) {
+			reset();
+		}
+		while (frames > max_block) {
+			process_block(in, out, static_cast<unsigned>(max_block));
+			in += max_block * channels;
+			out += max_block * channels;
+			frames -= static_cast<unsigned>(max_block);
+		}
+		process_block(in, out, frames);
+	}
+
+private:
+	void process_block(float const *in, float *out, unsigned frames) {
+		float const speed = ratio.load(std::memory_order_relaxed); // один и тот же на весь блок
+		input.append(in, frames * channels);
+		for (unsigned i = 0; i < frames; ++i) {
+			float sum = 0;
+			for (int ch = 0; ch < channels; ++ch) {
+				sum += in[i * channels + ch];
+			}
+			sum /= channels;
+			mono.append(&sum, 1);
+		}
+		synthesize(speed);
+
+		double const step = 1.0 / speed;
+		if (!primed && middle_frames() >= 2 * hop + static_cast<std::size_t>(frames * step)) {
+			primed = true; // запас на весь блок плюс кадр, иначе блок может опустеть посередине
+		}
+		for (unsigned i = 0; i < frames; ++i) {
+			std::size_t pos = static_cast<std::size_t>(resample_pos);
+			if (!primed || pos + 1 >= middle_frames()) {
+				primed = false; // опустели - ждём, пока WSOLA снова накопит запас
+				std::fill(out + i * channels, out + (i + 1) * channels, 0.0f);
+				continue;
+			}
+			float frac = static_cast<float>(resample_pos - pos);
+			float const *a = middle.begin() + pos * channels;
+			for (int ch = 0; ch < channels; ++ch) {
+				out[i * channels + ch] = a[ch] + (a[ch + channels] - a[ch]) * frac;
+			}
+			resample_pos += step;
+		}
+		std::size_t consumed = static_cast<std::size_t>(resample_pos);
+		middle.drop_front(consumed * channels);
+		resample_pos -= consumed;
+	}
+};
+
+/**
+ * \brief имя DSP коррекции тона, по нему он находится в цепочке канала
+ */
+static char const time_stretch_dsp_name[] = "time stretch";
+
+inline FMOD_RESULT F_CALLBACK time_stretch_create_(FMOD_DSP_STATE *dsp_state) {
+	dsp_state->plugindata = new wsola_stretcher;
+	return FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK time_stretch_release_(FMOD_DSP_STATE *dsp_state) {
+	delete static_cast<wsola_stretcher *>(dsp_state->plugindata);
+	return FMOD_OK;
+}
+
+/// DSP::reset зовут из потока интерфейса или сокета, пока микшер может быть внутри read, поэтому только флаг
+inline FMOD_RESULT F_CALLBACK time_stretch_reset_(FMOD_DSP_STATE *dsp_state) {
+	static_cast<wsola_stretcher *>(dsp_state->plugindata)->request_reset();
+	return FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK time_stretch_read_(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer,
+												 unsigned int length, int inchannels, int *outchannels) {
+	auto *stretcher = static_cast<wsola_stretcher *>(dsp_state->plugindata);
+	*outchannels = inchannels;
+	if (stretcher->num_channels() != inchannels) {
+		int rate = 48000;
+		unsigned int block = 1024;
+		FMOD_DSP_GETSAMPLERATE(dsp_state, &rate);
+		FMOD_DSP_GETBLOCKSIZE(dsp_state, &block);
+		float speed = stretcher->speed();
+		stretcher->configure(inchannels, rate, std::max(block, length));
+		stretcher->set_speed(speed);
+	}
+	stretcher->process(inbuffer, outbuffer, length);
+	return FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK time_stretch_set_float_(FMOD_DSP_STATE *dsp_state, int index, float value) {
+	if (index != 0) {
+		return FMOD_ERR_INVALID_PARAM;
+	}
+	static_cast<wsola_stretcher *>(dsp_state->plugindata)->set_speed(value);
+	return FMOD_OK;
+}
+
+inline FMOD_RESULT F_CALLBACK time_stretch_get_float_(FMOD_DSP_STATE *dsp_state, int index, float *value,
+													  char *valuestr) {
+	if (index != 0) {
+		return FMOD_ERR_INVALID_PARAM;
+	}
+	*value = static_cast<wsola_stretcher *>(dsp_state->plugindata)->speed();
+	if (valuestr) {
+		std::snprintf(valuestr, 32, "%.2fx", *value);
+	}
+	return FMOD_OK;
+}
+
+/**
+ * \brief создаёт DSP коррекции тона; параметр 0 - скорость канала
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT create_time_stretch_dsp_(FMOD::System *system, FMOD::DSP *&dsp) {
+	static FMOD_DSP_PARAMETER_DESC speed_desc;
+	static FMOD_DSP_PARAMETER_DESC *params[1] = {&speed_desc};
+	FMOD_DSP_INIT_PARAMDESC_FLOAT(speed_desc, "Speed", "x", "Playback speed of the channel", 0.5f, 3.0f, 1.0f);
+
+	FMOD_DSP_DESCRIPTION desc;
+	std::memset(&desc, 0, sizeof(desc));
+	desc.pluginsdkversion = FMOD_PLUGIN_SDK_VERSION;
+	std::strncpy(desc.name, time_stretch_dsp_name, sizeof(desc.name) - 1);
+	desc.version = 0x00010000;
+	desc.numinputbuffers = 1;
+	desc.numoutputbuffers = 1;
+	desc.create = time_stretch_create_;
+	desc.release = time_stretch_release_;
+	desc.reset = time_stretch_reset_;
+	desc.read = time_stretch_read_;
+	desc.numparameters = 1;
+	desc.paramdesc = params;
+	desc.setparameterfloat = time_stretch_set_float_;
+	desc.getparameterfloat = time_stretch_get_float_;
+	return system->createDSP(&desc, &dsp);
+}
+
+/**
+ * \brief ищет DSP коррекции тона в цепочке канала
+ * @return найденный DSP или nullptr
+ */
+inline FMOD::DSP *find_time_stretch_(FMOD::Channel *channel) {
+	int num = 0;
+	if (!channel || channel->getNumDSPs(&num) != FMOD_OK) {
+		return nullptr;
+	}
+	for (int i = 0; i < num; ++i) {
+		FMOD::DSP *dsp = nullptr;
+		char name[32] = {};
+		if (channel->getDSP(i, &dsp) == FMOD_OK &&
+			dsp->getInfo(name, nullptr, nullptr, nullptr, nullptr) == FMOD_OK &&
+			std::strcmp(name, time_stretch_dsp_name) == 0) {
+			return dsp;
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * \brief сбрасывает историю коррекции тона после перемотки, чтобы не склеивать старый и новый фрагменты
+ */
+inline void reset_time_stretch_(FMOD::Channel *channel) {
+	if (FMOD::DSP *dsp = find_time_stretch_(channel)) {
+		dsp->reset();
+	}
+}
+
+/**
+ * \brief задаёт скорость воспроизведения без изменения тона
+ * Частота канала умножается на speed (позиция остаётся в исходном времени трека, поэтому перемотка
+ * и getPosition работают как раньше), а DSP на канале возвращает тон. При speed == 1 DSP обходится.
+ * @param stretch - DSP из create_time_stretch_dsp_, ставится на канал, если ещё не стоит
+ * @param speed - 0.5 .. 3
+ * @return FMOD_RESULT
+ */
+inline FMOD_RESULT set_playback_speed_(FMOD::Channel *channel, FMOD::DSP *stretch, float speed) {
+	speed = std::min(3.0f, std::max(0.5f, speed));
+	FMOD::Sound *sound = nullptr;
+	float frequency = 0;
+	FMOD_RESULT result = channel->getCurrentSound(&sound);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	result = sound->getDefaults(&frequency, nullptr);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	if (find_time_stretch_(channel) != stretch) {
+		result = channel->addDSP(0, stretch);
+		if (result != FMOD_OK) {
+			return result;
+		}
+	}
+	bool bypassed = false;
+	stretch->getBypass(&bypassed);
+	if (bypassed && speed != 1.0f) {
+		stretch->reset(); // пока DSP обходился, его история устарела
+	}
+	result = stretch->setParameterFloat(0, speed);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	result = stretch->setBypass(speed == 1.0f);
+	if (result != FMOD_OK) {
+		return result;
+	}
+	return channel->setFrequency(frequency * speed);
+}
+
+#endif //SOUND_TIME_STRETCH_HPP
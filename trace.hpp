@@ -0,0 +1,288 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_TRACE_HPP
+#define SOUND_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * \brief одно событие трассы: интервал (end > 0) или мгновенное событие (end == 0)
+ * Имя - только строковый литерал, чтобы запись не копировала строк.
+ */
+struct trace_event {
+	char const *name = nullptr;
+	std::uint64_t begin_ns = 0;
+	std::uint64_t end_ns = 0;
+};
+
+/**
+ * \brief кольцо событий одного потока
+ * Пишет только поток-владелец, читает дамп: head публикуется с release после записи события,
+ * а события, которые могли перезаписаться во время чтения, дамп отбрасывает.
+ * Кольцо завершившегося потока достаётся следующему новому потоку; события прошлого владельца
+ * (до first) дамп уже не показывает.
+ */
+struct trace_ring {
+	static constexpr std::size_t capacity = 8192;
+	trace_event events[capacity];
+	std::atomic<std::uint64_t> head{0};
+	std::atomic<std::uint64_t> first{0};
+	unsigned tid = 0;         ///< под замком реестра
+	std::string thread_name;  ///< под замком реестра
+
+	void push(trace_event const &e) {
+		std::uint64_t h = head.load(std::memory_order_relaxed);
+		events[h % capacity] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+/// включена ли запись; отдельная переменная, чтобы проверка не шла через инициализацию static
+inline std::atomic<bool> trace_enabled{false};
+
+/**
+ * \brief список колец всех потоков
+ * Кольцо завершившегося потока остаётся в списке, чтобы дамп показывал и его, пока оно не понадобится
+ * новому потоку. Поэтому колец не больше, чем потоков, писавших трассу одновременно, а не сколько их было за сессию.
+ */
+struct trace_registry {
+	std::mutex lock;
+	std::vector<std::shared_ptr<trace_ring>> rings;
+	std::vector<trace_ring *> spare; ///< кольца завершившихся потоков
+	unsigned next_tid = 0;
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::string crash_path;
+};
+
+inline trace_registry &trace_registry_() {
+	static trace_registry registry;
+	return registry;
+}
+
+/**
+ * \brief кольцо и имя текущего потока; при выходе потока кольцо возвращается в запас реестра
+ */
+struct trace_thread_slot {
+	trace_ring *ring = nullptr;
+	std::string name;
+
+	~trace_thread_slot() {
+		if (ring) {
+			trace_registry &registry = trace_registry_();
+			std::lock_guard<std::mutex> guard(registry.lock);
+			registry.spare.push_back(ring);
+		}
+	}
+};
+
+inline trace_thread_slot &trace_thread_slot_() {
+	thread_local trace_thread_slot slot;
+	return slot;
+}
+
+/// единственная проверка на горячем пути
+inline bool trace_enabled_() {
+	return trace_enabled.load(std::memory_order_relaxed);
+}
+
+inline void set_trace_enabled_(bool enable) {
+	trace_registry_(); // эпоха отсчитывается не позже включения
+	trace_enabled.store(enable, std::memory_order_relaxed);
+}
+
+inline std::uint64_t trace_now_ns_() {
+	return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - trace_registry_().epoch).count());
+}
+
+/// кольцо текущего потока; берётся из запаса или создаётся при первом событии, т.е. только при включённой записи
+inline trace_ring &trace_thread_ring_() {
+	trace_thread_slot &slot = trace_thread_slot_();
+	if (!slot.ring) {
+		trace_registry &registry = trace_registry_();
+		std::lock_guard<std::mutex> guard(registry.lock);
+		if (!registry.spare.empty()) {
+			slot.ring = registry.spare.back();
+			registry.spare.pop_back();
+			slot.ring->first.store(slot.ring->head.load(std::memory_order_relaxed), std::memory_order_release);
+		} else {
+			registry.rings.push_back(std::make_shared<trace_ring>());
+			slot.ring = registry.rings.back().get();
+		}
+		slot.ring->tid = ++registry.next_tid; // новый поток - новая строка в просмотрщике
+		slot.ring->thread_name = slot.name;
+	}
+	return *slot.ring;
+}
+
+/**
+ * \brief даёт потоку имя, которое покажет просмотрщик трассы
+ * Кольцо не создаётся: имя запоминается и достанется кольцу, если поток что-нибудь запишет.
+ */
+inline void trace_thread_name_(char const *name) {
+	trace_thread_slot &slot = trace_thread_slot_();
+	slot.name = name;
+	if (slot.ring) {
+		std::lock_guard<std::mutex> guard(trace_registry_().lock);
+		slot.ring->thread_name = name;
+	}
+}
+
+/**
+ * \brief записывает мгновенное событие, например завершение загрузки
+ */
+inline void trace_instant_(char const *name) {
+	if (trace_enabled_()) {
+		trace_thread_ring_().push({name, trace_now_ns_(), 0});
+	}
+}
+
+/**
+ * \brief интервал от конструктора до деструктора; при выключенной трассировке - одна проверка флага
+ */
+class trace_scope {
+	char const *name;
+	std::uint64_t begin = 0;
+
+public:
+	explicit trace_scope(char const *name) : name(name) {
+		if (trace_enabled_()) {
+			begin = trace_now_ns_() | 1; // 0 означает "не пишем"
+		}
+	}
+
+	trace_scope(trace_scope const &) = delete;
+
+	trace_scope &operator=(trace_scope const &) = delete;
+
+	~trace_scope() {
+		if (begin) {
+			trace_thread_ring_().push({name, begin, trace_now_ns_() | 1});
+		}
+	}
+};
+
+inline void trace_write_string_(std::FILE *out, char const *str) {
+	std::fputc('"', out);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') {
+			std::fputc('\\', out);
+		}
+		std::fputc(static_cast<unsigned char>(*str) < 0x20 ? ' ' : *str, out);
+	}
+	std::fputc('"', out);
+}
+
+/**
+ * \brief сохраняет содержимое всех колец в формате Chrome trace event (chrome://tracing, Perfetto)
+ * Запись не останавливается: события, которые потоки успели перезаписать за время дампа, пропускаются.
+ * @param path - файл .json
+ * @return false, если файл не открылся
+ */
+inline bool dump_trace_(char const *path) {
+	std::FILE *out = std::fopen(path, "w");
+	if (!out) {
+		return false;
+	}
+	trace_registry &registry = trace_registry_();
+	struct ring_view {
+		std::shared_ptr<trace_ring> ring;
+		unsigned tid;
+		std::string name;
+	};
+	std::vector<ring_view> rings;
+	{
+		std::lock_guard<std::mutex> guard(registry.lock);
+		for (auto const &ring : registry.rings) {
+			rings.push_back({ring, ring->tid, ring->thread_name});
+		}
+	}
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+	bool first = true;
+	std::vector<trace_event> copy;
+	for (auto const &view : rings) {
+		trace_ring const *ring = view.ring.get();
+		std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+					 first ? "" : ",\n", view.tid);
+		trace_write_string_(out, view.name.empty() ? "thread" : view.name.c_str());
+		std::fputs("}}", out);
+		first = false;
+
+		std::uint64_t end = ring->head.load(std::memory_order_acquire);
+		std::uint64_t begin = end > trace_ring::capacity ? end - trace_ring::capacity : 0;
+		begin = std::max(begin, std::min(end, ring->first.load(std::memory_order_acquire)));
+		copy.clear();
+		for (std::uint64_t i = begin; i < end; ++i) {
+			copy.push_back(ring->events[i % trace_ring::capacity]);
+		}
+		// всё, что писатель мог успеть затереть за время копирования, ненадёжно; ячейка after пишется прямо сейчас
+		std::uint64_t after = ring->head.load(std::memory_order_acquire);
+		std::uint64_t safe = after + 1 > trace_ring::capacity ? after + 1 - trace_ring::capacity : 0;
+		for (std::uint64_t i = std::max(begin, safe); i < end; ++i) {
+			trace_event const &e = copy[i - begin];
+			if (!e.name) {
+				continue;
+			}
+			std::fputs(",\n{\"name\":", out);
+			trace_write_string_(out, e.name);
+			if (e.end_ns) {
+				std::fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", view.tid,
+							 e.begin_ns / 1000.0, (e.end_ns - e.begin_ns) / 1000.0);
+			} else {
+				std::fprintf(out, ",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}", view.tid,
+							 e.begin_ns / 1000.0);
+			}
+		}
+	}
+	std::fputs("\n]}\n", out);
+	return std::fclose(out) == 0;
+}
+
+inline void trace_crash_signal_(int sig) {
+	// не async-signal-safe, но процесс всё равно падает, а трасса - то, ради чего всё затевалось
+	dump_trace_(trace_registry_().crash_path.c_str());
+	std::signal(sig, SIG_DFL);
+	std::raise(sig);
+}
+
+/**
+ * \brief сохраняет трассу в path при падении процесса (сигналы и std::terminate)
+ */
+inline void install_trace_crash_handler_(std::string const &path) {
+	trace_registry_().crash_path = path;
+	for (int sig : {SIGSEGV, SIGABRT, SIGFPE, SIGILL}) {
+		std::signal(sig, trace_crash_signal_);
+	}
+	std::set_terminate([] {
+		dump_trace_(trace_registry_().crash_path.c_str());
+		std::abort();
+	});
+}
+
+#define SOUND_TRACE_CONCAT2(a, b) a##b
+#define SOUND_TRACE_CONCAT(a, b) SOUND_TRACE_CONCAT2(a, b)
+
+#ifdef SOUND_TRACE
+/// интервал до конца текущей области видимости; name - строковый литерал
+#define TRACE_SCOPE(name) trace_scope SOUND_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+/// мгновенное событие
+#define TRACE_INSTANT(name) trace_instant_(name)
+#else
+#define TRACE_SCOPE(name) ((void) 0)
+#define TRACE_INSTANT(name) ((void) 0)
+#endif
+
+#endif //SOUND_TRACE_HPP
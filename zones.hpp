@@ -0,0 +1,388 @@
+/**
+ * \file
+ * \author Lukashov Sergey
+ */
+
+#ifndef SOUND_ZONES_HPP
+#define SOUND_ZONES_HPP
+
+#include "fmod.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief общие часы всех зон, секунды
+ */
+inline double zone_clock_() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * \brief подстройка скорости стрима под часы выхода
+ * У каждого устройства свой кварц: 48000 Гц одной карты - это 48000 * (1 + ошибка) настоящих.
+ * Корректор проводит МНК-прямую по точкам (время, DSP-часы) за последнее окно. Наклон - настоящая скорость выхода,
+ * а время блока берётся с прямой, а не с часов: так дрожание момента update не попадает в фазу.
+ * Множитель частоты канала подбирается так, чтобы содержимое шло ровно source_rate кадров в секунду общих часов,
+ * а накопившееся расхождение фазы убиралось за tau секунд. Поправка ограничена max_adjust - это сотые доли
+ * процента, на слух не заметно. В реальном времени зоны расходятся на единицы миллисекунд (дрожание блоков выхода),
+ * при рендере без реального времени - меньше кадра.
+ */
+class drift_corrector {
+	double source_rate, output_rate, tau, window, max_adjust;
+	double started = -1;
+	double origin = 0; ///< позиция содержимого в момент started
+	std::deque<std::pair<double, double>> history; ///< (время, DSP-часы) раз в window / 600
+	double rate;
+	double fit_time = 0, fit_clock = 0; ///< точка на прямой (средние по окну)
+	bool fitted = false;
+	double error = 0;
+	double factor = 1;
+
+	void fit() {
+		fitted = history.size() >= 2 && history.back().first - history.front().first >= 1.0;
+		if (!fitted) {
+			rate = output_rate;
+			return;
+		}
+		double t0 = history.front().first, d0 = history.front().second;
+		double sum_t = 0, sum_d = 0, sum_tt = 0, sum_td = 0;
+		for (auto const &h : history) {
+			double t = h.first - t0, d = h.second - d0;
+			sum_t += t;
+			sum_d += d;
+			sum_tt += t * t;
+			sum_td += t * d;
+		}
+		double n = static_cast<double>(history.size());
+		rate = (n * sum_td - sum_t * sum_d) / (n * sum_tt - sum_t * sum_t);
+		fit_time = t0 + sum_t / n;
+		fit_clock = d0 + sum_d / n;
+	}
+
+public:
+	/**
+	 * @param source_rate - частота содержимого, кадров в секунду
+	 * @param output_rate - номинальная частота выхода
+	 * @param tau - за сколько секунд убирается расхождение фазы
+	 * @param window - по скольким последним секундам оценивается скорость выхода
+	 */
+	drift_corrector(double source_rate, double output_rate, double tau = 4, double window = 60,
+					double max_adjust = 0.002)
+			: source_rate(source_rate), output_rate(output_rate), tau(tau), window(window), max_adjust(max_adjust),
+			  rate(output_rate) {}
+
+	/**
+	 * \brief момент по общим часам, в который содержимое было (или будет) в позиции content
+	 */
+	void start(double at, double content = 0) {
+		started = at;
+		origin = content;
+		error = 0;
+	}
+
+	/**
+	 * \brief новое наблюдение; вызывать после каждого update системы
+	 * @param now - общие часы
+	 * @param device - DSP-часы выхода, кадров
+	 * @param content - позиция содержимого в канале, кадров
+	 * @return множитель для частоты канала
+	 */
+	double observe(double now, double device, double content) {
+		if (history.empty() || now - history.back().first >= window / 600) {
+			history.emplace_back(now, device);
+			while (history.size() > 2 && now - history[1].first >= window) {
+				history.pop_front();
+			}
+			fit();
+		}
+		if (fitted) {
+			now = fit_time + (device - fit_clock) / rate;
+		}
+		if (started < 0 || now < started) {
+			return factor;
+		}
+		error = content - origin - (now - started) * source_rate;
+		double wanted = output_rate / rate * (1 - error / (source_rate * tau));
+		factor = std::min(std::max(wanted, 1 - max_adjust), 1 + max_adjust);
+		return factor;
+	}
+
+	/// оценка ухода часов выхода, миллионных долей
+	double skew_ppm() const { return (rate / output_rate - 1) * 1e6; }
+
+	/// насколько содержимое впереди (+) или позади (-) общих часов при последнем наблюдении, кадров
+	double error_frames() const { return error; }
+
+	double adjustment() const { return factor; }
+};
+
+/**
+ * \brief куда выводит зона
+ */
+struct zone_options {
+	std::string name;
+	FMOD_OUTPUTTYPE output = FMOD_OUTPUTTYPE_AUTODETECT;
+	int driver = 0;       ///< номер устройства вывода
+	std::string wav_file; ///< файл для FMOD_OUTPUTTYPE_WAVWRITER(_NRT)
+	int rate = 48000;
+};
+
+/**
+ * \brief зона: своя система FMOD на своём выходе, своя очередь треков и свой поток обновления
+ * Зона играет либо свою очередь (enqueue), либо общий для нескольких зон стрим (play_synced_), который
+ * drift_corrector держит вровень с общими часами.
+ */
+class zone {
+	zone_options options;
+	FMOD::System *system = nullptr;
+	std::mutex lock; ///< очередь, канал, звук и корректор: их трогают и окно, и поток зоны
+	FMOD::Sound *sound = nullptr;
+	FMOD::Channel *channel = nullptr;
+	std::deque<std::string> queue;
+	std::unique_ptr<drift_corrector> sync;
+	float base_frequency = 0;
+	std::atomic<bool> stopping{false};
+	std::thread worker;
+
+	void drop_sound() {
+		if (channel) {
+			channel->stop();
+			channel = nullptr;
+		}
+		if (sound) {
+			sound->release();
+			sound = nullptr;
+		}
+		sync.reset();
+	}
+
+	FMOD_RESULT play_next() {
+		drop_sound();
+		if (queue.empty()) {
+			return FMOD_OK;
+		}
+		std::string path = std::move(queue.front());
+		queue.pop_front();
+		FMOD_RESULT result = system->createSound(path.c_str(), FMOD_CREATESTREAM | FMOD_LOOP_OFF, 0, &sound);
+		if (result != FMOD_OK) {
+			sound = nullptr;
+			return result;
+		}
+		return system->playSound(sound, 0, false, &channel);
+	}
+
+public:
+	explicit zone(zone_options opts) : options(std::move(opts)) {}
+
+	~zone() { close(); }
+
+	zone(zone const &) = delete;
+	zone &operator=(zone const &) = delete;
+
+	/**
+	 * \brief создаёт систему зоны
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT open() {
+		TRACE_SCOPE("zone::open");
+		FMOD_RESULT result = FMOD::System_Create(&system);
+		if (result != FMOD_OK) {
+			return result;
+		}
+		result = system->setOutput(options.output);
+		if (result == FMOD_OK && options.driver > 0) {
+			result = system->setDriver(options.driver);
+		}
+		if (result == FMOD_OK) {
+			result = system->setSoftwareFormat(options.rate, FMOD_SPEAKERMODE_STEREO, 0);
+		}
+		if (result == FMOD_OK) {
+			// для вывода в WAV имя файла передаётся через extradriverdata
+			void *extra = options.wav_file.empty() ? nullptr : const_cast<char *>(options.wav_file.c_str());
+			bool offline = options.output == FMOD_OUTPUTTYPE_NOSOUND_NRT || options.output == FMOD_OUTPUTTYPE_WAVWRITER_NRT;
+			// без часов реального времени поток чтения стримов не успевал бы за update: стримы читаются в update
+			result = system->init(32, offline ? FMOD_INIT_STREAM_FROM_UPDATE : FMOD_INIT_NORMAL, extra);
+		}
+		return result;
+	}
+
+	std::string const &name() const { return options.name; }
+
+	FMOD::System *fmod_system() const { return system; }
+
+	int rate() const { return options.rate; }
+
+	/**
+	 * \brief DSP-часы выхода зоны, кадров
+	 */
+	unsigned long long dsp_clock() {
+		FMOD::ChannelGroup *master = nullptr;
+		unsigned long long clock = 0;
+		if (system->getMasterChannelGroup(&master) == FMOD_OK) {
+			master->getDSPClock(&clock, nullptr);
+		}
+		return clock;
+	}
+
+	/**
+	 * \brief своя очередь зоны: трек заиграет после текущего (или сразу, если зона молчит)
+	 */
+	void enqueue(std::string path) {
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(std::move(path));
+		bool playing = false;
+		if (!channel || channel->isPlaying(&playing) != FMOD_OK || !playing) {
+			play_next();
+		}
+	}
+
+	/**
+	 * \brief включает трек сразу, очередь сохраняется
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT play(std::string path) {
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_front(std::move(path));
+		return play_next();
+	}
+
+	/**
+	 * \brief ставит звук так, чтобы он начался в момент at по общим часам, и включает подстройку
+	 * Момент переводится в DSP-часы зоны по номинальной частоте; остаток добирает drift_corrector.
+	 * @param owned - звук этой системы, зона отпустит его сама
+	 * @param now - общие часы сейчас
+	 * @return FMOD_RESULT
+	 */
+	FMOD_RESULT play_synced(FMOD::Sound *owned, double at, double now) {
+		std::lock_guard<std::mutex> guard(lock);
+		queue.clear();
+		drop_sound();
+		sound = owned;
+		FMOD_RESULT result = system->playSound(sound, 0, true, &channel);
+		if (result != FMOD_OK) {
+			return result;
+		}
+		channel->getFrequency(&base_frequency);
+		unsigned long long start = dsp_clock() + static_cast<unsigned long long>(std::max(at - now, 0.0) * options.rate);
+		channel->setDelay(start, 0, false);
+		sync.reset(new drift_corrector(base_frequency, options.rate));
+		sync->start(std::max(at, now));
+		return channel->setPaused(false);
+	}
+
+	/**
+	 * \brief одно обновление системы: очередь, подстройка общего стрима
+	 * @param now - общие часы в момент, когда вышел этот блок
+	 */
+	void step(double now) {
+		system->update();
+		std::lock_guard<std::mutex> guard(lock);
+		bool playing = false;
+		if (channel && (channel->isPlaying(&playing) != FMOD_OK || !playing)) {
+			channel = nullptr;
+			play_next();
+		}
+		if (sync && channel) {
+			unsigned int position = 0;
+			channel->getPosition(&position, FMOD_TIMEUNIT_PCM);
+			double factor = sync->observe(now, static_cast<double>(dsp_clock()), position);
+			channel->setFrequency(static_cast<float>(base_frequency * factor));
+		}
+	}
+
+	/// корректор общего стрима или nullptr
+	drift_corrector const *corrector() const { return sync.get(); }
+
+	/// позиция канала, кадров содержимого
+	unsigned int position() {
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned int pcm = 0;
+		if (channel) {
+			channel->getPosition(&pcm, FMOD_TIMEUNIT_PCM);
+		}
+		return pcm;
+	}
+
+	/**
+	 * \brief запускает поток зоны: update раз в period и подстройка по zone_clock_
+	 * Зоны с выводом NRT так не гоняют: их блоки считает тот, кто задаёт время (см. тест).
+	 */
+	void run(std::chrono::milliseconds period = std::chrono::milliseconds(10)) {
+		stopping = false;
+		worker = std::thread([this, period] {
+#ifdef SOUND_TRACE
+			trace_thread_name_(("zone " + options.name).c_str());
+#endif
+			auto next = std::chrono::steady_clock::now();
+			while (!stopping) {
+				step(zone_clock_());
+				next += period;
+				std::this_thread::sleep_until(next);
+			}
+		});
+	}
+
+	/**
+	 * \brief останавливает поток и отпускает систему
+	 */
+	void close() {
+		stopping = true;
+		if (worker.joinable()) {
+			worker.join();
+		}
+		if (!system) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			drop_sound();
+			queue.clear();
+		}
+		system->close();
+		system->release();
+		system = nullptr;
+	}
+};
+
+/**
+ * \brief один трек во всех зонах сразу, начало через lead секунд по общим часам
+ * Каждая зона открывает трек в своей системе: звук FMOD принадлежит системе.
+ * @param lead - запас на открытие стримов во всех зонах
+ * @return первый ненулевой FMOD_RESULT или FMOD_OK
+ */
+inline FMOD_RESULT play_synced_(std::vector<zone *> const &zones, std::string const &path, double lead = 0.3) {
+	TRACE_SCOPE("play_synced_");
+	std::vector<FMOD::Sound *> sounds(zones.size(), nullptr);
+	FMOD_RESULT first = FMOD_OK;
+	for (std::size_t i = 0; i < zones.size() && first == FMOD_OK; ++i) {
+		first = zones[i]->fmod_system()->createSound(path.c_str(), FMOD_CREATESTREAM | FMOD_LOOP_OFF, 0, &sounds[i]);
+	}
+	if (first != FMOD_OK) {
+		for (FMOD::Sound *s : sounds) {
+			if (s) {
+				s->release();
+			}
+		}
+		return first;
+	}
+	double at = zone_clock_() + lead; // открытие уже позади, запас - на то, чтобы все зоны успели поставить задержку
+	for (std::size_t i = 0; i < zones.size(); ++i) {
+		FMOD_RESULT result = zones[i]->play_synced(sounds[i], at, zone_clock_());
+		if (first == FMOD_OK) {
+			first = result;
+		}
+	}
+	return first;
+}
+
+#endif //SOUND_ZONES_HPP